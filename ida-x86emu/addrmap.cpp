@@ -0,0 +1,112 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: addrmap.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "addrmap.h"
+
+#define AS_PAGE_SIZE (1 << PAGEMAP_PAGE_SHIFT)
+#define AS_PAGE_MASK (AS_PAGE_SIZE - 1)
+
+AddressMap addressSpace;
+
+AddressMap::~AddressMap() {
+   for (unsigned int i = 0; i < PAGEMAP_DIR_SIZE; i++) {
+      PageInfo *leaf = pages.leaf(i);
+      if (leaf) {
+         for (unsigned int j = 0; j < PAGEMAP_LEAF_SIZE; j++) {
+            free(leaf[j].tags);
+         }
+      }
+   }
+}
+
+void AddressMap::add(unsigned int base, unsigned int len, int kind, int perms, void *owner) {
+   while (len) {
+      unsigned int n = AS_PAGE_SIZE - (base & AS_PAGE_MASK);
+      if (n > len) n = len;
+      PageInfo *p = pages.get(base);
+      if (p == NULL) {
+         //out of memory, nothing we can do
+      }
+      else if (n != AS_PAGE_SIZE || p->kind == AS_SHARED) {
+         //partial page, let the regions sort it out
+         p->kind = AS_SHARED;
+         p->perms |= perms;
+         p->owner = NULL;
+      }
+      else if (p->kind == AS_UNMAPPED || p->owner == owner) {
+         p->kind = kind;
+         p->perms = perms;
+         p->owner = owner;
+      }
+      else {
+         //two regions cover the whole page, keep the one with precedence
+         p->overlap = 1;
+         if (kind < p->kind) {
+            p->kind = kind;
+            p->perms = perms;
+            p->owner = owner;
+         }
+      }
+      base += n;
+      len -= n;
+   }
+}
+
+void AddressMap::remove(unsigned int base, unsigned int len, void *owner) {
+   while (len) {
+      unsigned int n = AS_PAGE_SIZE - (base & AS_PAGE_MASK);
+      if (n > len) n = len;
+      PageInfo *p = pages.find(base);
+      if (p && p->kind != AS_SHARED && p->owner == owner) {
+         if (p->overlap) {
+            //whatever was underneath is still there
+            p->kind = AS_SHARED;
+            p->owner = NULL;
+         }
+         else {
+            p->kind = AS_UNMAPPED;
+            p->perms = 0;
+            p->owner = NULL;
+         }
+      }
+      //shared pages are left alone, the slow path is still right for them
+      base += n;
+      len -= n;
+   }
+}
+
+void AddressMap::setTag(unsigned int base, unsigned int len, void *tag) {
+   if (len == 0) return;
+   unsigned int last = (base + len - 1) >> AS_TAG_SHIFT;
+   for (unsigned int g = base >> AS_TAG_SHIFT; ; g++) {
+      unsigned int addr = g << AS_TAG_SHIFT;
+      PageInfo *p = tag ? pages.get(addr) : pages.find(addr);
+      if (p && p->tags == NULL && tag) {
+         p->tags = (void**)calloc(AS_PAGE_SIZE >> AS_TAG_SHIFT, sizeof(void*));
+      }
+      if (p && p->tags) {
+         p->tags[(addr & AS_PAGE_MASK) >> AS_TAG_SHIFT] = tag;
+      }
+      if (g == last) break;
+   }
+}
@@ -0,0 +1,93 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: addrmap.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __ADDRMAP_H
+#define __ADDRMAP_H
+
+#include "pagemap.h"
+
+//region kinds, in order of precedence when regions overlap
+#define AS_UNMAPPED 0
+#define AS_MAPPED   1   //owner is the MappedFile
+#define AS_PROGRAM  2
+#define AS_STACK    3   //owner is the EmuStack
+#define AS_HEAP     4   //owner is the EmuHeap
+#define AS_MODULE   5   //owner is the module's HandleList
+#define AS_SHARED   6   //page split between regions, ask the owners
+
+//page permissions as the emulator enforces them
+#define AS_READ  1
+#define AS_WRITE 2
+#define AS_EXEC  4
+#define AS_RWX   (AS_READ | AS_WRITE | AS_EXEC)
+
+#define AS_TAG_SHIFT 2  //tags are kept per dword
+
+typedef struct _PageInfo {
+   unsigned char kind;
+   unsigned char perms;
+   unsigned char overlap;  //another region is hidden under this one
+   void *owner;
+   void **tags;         //per dword client tags, NULL until one is set
+} PageInfo;
+
+/*
+ * One map of the whole guest address space.  Every region (program,
+ * stack, heaps, mapped files and loaded modules) registers its pages
+ * here so that classifying an address is a page table lookup rather
+ * than a walk over each region list.  Where two regions cover a whole
+ * page the one with precedence wins.  A page that is only partly
+ * covered, or whose hidden region we can no longer vouch for, is
+ * marked AS_SHARED and callers fall back to asking the regions.
+ */
+class AddressMap {
+public:
+   AddressMap() {};
+   ~AddressMap();
+
+   void add(unsigned int base, unsigned int len, int kind, int perms, void *owner);
+   //only pages still owned by owner are released
+   void remove(unsigned int base, unsigned int len, void *owner);
+
+   PageInfo *find(unsigned int addr) {return pages.find(addr);};
+   int kind(unsigned int addr) {
+      PageInfo *p = pages.find(addr);
+      return p ? p->kind : AS_UNMAPPED;
+   };
+   int perms(unsigned int addr) {
+      PageInfo *p = pages.find(addr);
+      return p ? p->perms : 0;
+   };
+
+   //attach a client pointer (idastruct uses its trace record) to
+   //every dword in [base, base + len)
+   void setTag(unsigned int base, unsigned int len, void *tag);
+   void *getTag(unsigned int addr) {
+      PageInfo *p = pages.find(addr);
+      return (p && p->tags) ? p->tags[(addr & 0xFFF) >> AS_TAG_SHIFT] : NULL;
+   };
+
+private:
+   PageMap<PageInfo> pages;
+};
+
+extern AddressMap addressSpace;
+
+#endif
@@ -0,0 +1,142 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: bench.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "bench.h"
+
+double benchTime() {
+#ifdef WIN32
+   LARGE_INTEGER count, freq;
+   QueryPerformanceCounter(&count);
+   QueryPerformanceFrequency(&freq);
+   return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+BenchSamples::BenchSamples() {
+   vals = NULL;
+   count = max = 0;
+   total = 0;
+   sorted = true;
+}
+
+BenchSamples::~BenchSamples() {
+   ::free(vals);
+}
+
+void BenchSamples::add(double val) {
+   if (count == max) {
+      unsigned int n = max ? max * 2 : 1024;
+      double *p = (double*)::realloc(vals, n * sizeof(double));
+      if (p == NULL) return;
+      vals = p;
+      max = n;
+   }
+   vals[count++] = val;
+   total += val;
+   sorted = false;
+}
+
+static int compareSamples(const void *a, const void *b) {
+   double x = *(const double*)a;
+   double y = *(const double*)b;
+   return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//nearest rank
+double BenchSamples::percentile(double p) {
+   if (count == 0) return 0;
+   if (!sorted) {
+      qsort(vals, count, sizeof(double), compareSamples);
+      sorted = true;
+   }
+   double rank = p / 100.0 * count;
+   unsigned int i = (unsigned int)rank;
+   if (i < rank) i++;
+   if (i > 0) i--;
+   if (i >= count) i = count - 1;
+   return vals[i];
+}
+
+BenchJson::BenchJson(const char *fileName, const char *suite) {
+   f = fileName ? fopen(fileName, "w") : NULL;
+   cases = 0;
+   if (fileName && f == NULL) {
+      fprintf(stderr, "unable to write %s\n", fileName);
+   }
+   if (f) {
+      fprintf(f, "{\"suite\": \"%s\", \"cases\": [", suite);
+   }
+}
+
+BenchJson::~BenchJson() {
+   if (f) {
+      fprintf(f, "\n]}\n");
+      fclose(f);
+   }
+}
+
+void BenchJson::begin(const char *name) {
+   if (f == NULL) return;
+   fprintf(f, "%s\n  {\"name\": \"%s\"", cases++ ? "," : "", name);
+}
+
+void BenchJson::key(const char *key) {
+   fprintf(f, ", \"%s\": ", key);
+}
+
+void BenchJson::field(const char *name, double val) {
+   if (f == NULL) return;
+   key(name);
+   fprintf(f, "%.6g", val);
+}
+
+void BenchJson::field(const char *name, unsigned long long val) {
+   if (f == NULL) return;
+   key(name);
+   fprintf(f, "%llu", val);
+}
+
+void BenchJson::field(const char *name, const char *val) {
+   if (f == NULL) return;
+   key(name);
+   fprintf(f, "\"%s\"", val);
+}
+
+void BenchJson::field(const char *name, bool val) {
+   if (f == NULL) return;
+   key(name);
+   fprintf(f, val ? "true" : "false");
+}
+
+void BenchJson::end() {
+   if (f == NULL) return;
+   fprintf(f, "}");
+}
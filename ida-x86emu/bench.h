@@ -0,0 +1,79 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: bench.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdio.h>
+
+//monotonic wall clock in seconds
+double benchTime();
+
+/*
+ * Latency samples in seconds, for percentiles over a run of operations.
+ * Each sample includes the cost of one benchTime call.
+ */
+class BenchSamples {
+public:
+   BenchSamples();
+   ~BenchSamples();
+
+   void add(double val);
+   void clear() {count = 0; total = 0; sorted = true;};
+   unsigned int size() {return count;};
+   double mean() {return count ? total / count : 0;};
+   //p in [0, 100]
+   double percentile(double p);
+
+private:
+   double *vals;
+   unsigned int count;
+   unsigned int max;
+   double total;
+   bool sorted;
+};
+
+/*
+ * Results file for the benchmarks, one JSON object per suite holding
+ * an array of cases so runs can be diffed and tracked over time.
+ *
+ *    {"suite": "cpu", "cases": [{"name": "crc32", ...}, ...]}
+ */
+class BenchJson {
+public:
+   //fileName may be NULL for no output
+   BenchJson(const char *fileName, const char *suite);
+   ~BenchJson();
+
+   void begin(const char *name);
+   void field(const char *key, double val);
+   void field(const char *key, unsigned long long val);
+   void field(const char *key, const char *val);
+   void field(const char *key, bool val);
+   void end();
+
+private:
+   void key(const char *key);
+
+   FILE *f;
+   int cases;
+};
+
+#endif
@@ -0,0 +1,544 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: bench_cpu.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * CPU throughput benchmarks for the headless core.  Each kernel is a
+ * small hand assembled 32 bit routine run through executeInstruction
+ * as a cdecl call, with its result checked against a C version so a
+ * faster engine that gets the wrong answer does not pass.
+ *
+ *    bench_cpu [-o results.json] [-s scale] [-r repeats]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "seh.h"
+#include "bench.h"
+
+//the image holds the kernel code followed by its data
+#define CODE_BASE  0x400000
+#define IMAGE_SIZE 0x10000
+#define SRC   0x404000     //4K of source data
+#define DST   0x405000     //4K copy destination
+#define SBOX  0x406000     //RC4 state
+#define KEY   0x406100     //RC4 key
+#define OUT   0x407000     //RC4 keystream
+#define TMPL  0x408000     //unsorted array, 128 dwords
+#define WORK  0x408200     //array being sorted
+#define LIST  0x40A000     //1024 list nodes of {next, value}
+#define TEB   0x40C000     //fs:[0] for the SEH kernel
+#define COUNT 0x40C200     //exceptions handled
+
+#define BLOCK_DWORDS 1024
+#define SORT_DWORDS  128
+#define LIST_NODES   1024
+#define RC4_BYTES    1024
+
+#define SEH_HANDLER 0x1A   //offset of seh_handler in sehRaiseCode
+#define SEH_REGISTRATION (TEB + 0x100)
+
+//return address for the kernel, the run ends when we get here
+#define RUN_EXIT 0xFFFFFFF0
+
+#define IMG(addr) (image + ((addr) - CODE_BASE))
+
+//memcpy_loop
+static const unsigned char memcpyLoopCode[] = {
+   0x56,                                   //   push esi
+   0x57,                                   //   push edi
+   0x53,                                   //   push ebx
+   0x8B, 0x5C, 0x24, 0x10,                 //   mov ebx, [esp+16]
+   0xBE, 0x00, 0x40, 0x40, 0x00,           //1: mov esi, SRC
+   0xBF, 0x00, 0x50, 0x40, 0x00,           //   mov edi, DST
+   0xB9, 0x00, 0x04, 0x00, 0x00,           //   mov ecx, 1024
+   0x8B, 0x06,                             //2: mov eax, [esi]
+   0x89, 0x07,                             //   mov [edi], eax
+   0x83, 0xC6, 0x04,                       //   add esi, 4
+   0x83, 0xC7, 0x04,                       //   add edi, 4
+   0x49,                                   //   dec ecx
+   0x75, 0xF3,                             //   jnz 2b
+   0x4B,                                   //   dec ebx
+   0x75, 0xE1,                             //   jnz 1b
+   0xA1, 0xFC, 0x5F, 0x40, 0x00,           //   mov eax, [DST+4092]
+   0x5B,                                   //   pop ebx
+   0x5F,                                   //   pop edi
+   0x5E,                                   //   pop esi
+   0xC3,                                   //   ret
+};
+
+//rep_movsd
+static const unsigned char repMovsdCode[] = {
+   0x56,                                   //   push esi
+   0x57,                                   //   push edi
+   0x53,                                   //   push ebx
+   0x8B, 0x5C, 0x24, 0x10,                 //   mov ebx, [esp+16]
+   0xFC,                                   //   cld
+   0xBE, 0x00, 0x40, 0x40, 0x00,           //1: mov esi, SRC
+   0xBF, 0x00, 0x50, 0x40, 0x00,           //   mov edi, DST
+   0xB9, 0x00, 0x04, 0x00, 0x00,           //   mov ecx, 1024
+   0xF3, 0xA5,                             //   rep movsd
+   0x4B,                                   //   dec ebx
+   0x75, 0xEC,                             //   jnz 1b
+   0xA1, 0xFC, 0x5F, 0x40, 0x00,           //   mov eax, [DST+4092]
+   0x5B,                                   //   pop ebx
+   0x5F,                                   //   pop edi
+   0x5E,                                   //   pop esi
+   0xC3,                                   //   ret
+};
+
+//crc32
+static const unsigned char crc32Code[] = {
+   0x56,                                   //   push esi
+   0x53,                                   //   push ebx
+   0x8B, 0x5C, 0x24, 0x0C,                 //   mov ebx, [esp+12]
+   0xBE, 0x00, 0x40, 0x40, 0x00,           //1: mov esi, SRC
+   0xB9, 0x00, 0x04, 0x00, 0x00,           //   mov ecx, 1024
+   0xB8, 0xFF, 0xFF, 0xFF, 0xFF,           //   mov eax, 0xFFFFFFFF
+   0x0F, 0xB6, 0x16,                       //2: movzx edx, byte ptr [esi]
+   0x31, 0xD0,                             //   xor eax, edx
+   0xBA, 0x08, 0x00, 0x00, 0x00,           //   mov edx, 8
+   0xD1, 0xE8,                             //3: shr eax, 1
+   0x73, 0x05,                             //   jnc 4f
+   0x35, 0x20, 0x83, 0xB8, 0xED,           //   xor eax, 0xEDB88320
+   0x4A,                                   //4: dec edx
+   0x75, 0xF4,                             //   jnz 3b
+   0x46,                                   //   inc esi
+   0x49,                                   //   dec ecx
+   0x75, 0xE6,                             //   jnz 2b
+   0xF7, 0xD0,                             //   not eax
+   0x4B,                                   //   dec ebx
+   0x75, 0xD2,                             //   jnz 1b
+   0x5B,                                   //   pop ebx
+   0x5E,                                   //   pop esi
+   0xC3,                                   //   ret
+};
+
+//rc4
+static const unsigned char rc4Code[] = {
+   0x56,                                   //   push esi
+   0x57,                                   //   push edi
+   0x53,                                   //   push ebx
+   0x55,                                   //   push ebp
+   0x8B, 0x6C, 0x24, 0x14,                 //   mov ebp, [esp+20]
+   0xBE, 0x00, 0x60, 0x40, 0x00,           //1: mov esi, SBOX
+   0x31, 0xC9,                             //   xor ecx, ecx
+   0x88, 0x0C, 0x0E,                       //2: mov [esi+ecx], cl
+   0xFE, 0xC1,                             //   inc cl
+   0x75, 0xF9,                             //   jnz 2b
+   0x31, 0xC0,                             //   xor eax, eax
+   0x31, 0xDB,                             //   xor ebx, ebx
+   0x8A, 0x14, 0x06,                       //3: mov dl, [esi+eax]
+   0x00, 0xD3,                             //   add bl, dl
+   0x89, 0xC1,                             //   mov ecx, eax
+   0x83, 0xE1, 0x03,                       //   and ecx, 3
+   0x02, 0x99, 0x00, 0x61, 0x40, 0x00,     //   add bl, [KEY+ecx]
+   0x8A, 0x34, 0x1E,                       //   mov dh, [esi+ebx]
+   0x88, 0x34, 0x06,                       //   mov [esi+eax], dh
+   0x88, 0x14, 0x1E,                       //   mov [esi+ebx], dl
+   0xFE, 0xC0,                             //   inc al
+   0x75, 0xE3,                             //   jnz 3b
+   0x31, 0xC0,                             //   xor eax, eax
+   0x31, 0xDB,                             //   xor ebx, ebx
+   0xBF, 0x00, 0x70, 0x40, 0x00,           //   mov edi, OUT
+   0xB9, 0x00, 0x04, 0x00, 0x00,           //   mov ecx, 1024
+   0xFE, 0xC0,                             //4: inc al
+   0x8A, 0x14, 0x06,                       //   mov dl, [esi+eax]
+   0x00, 0xD3,                             //   add bl, dl
+   0x8A, 0x34, 0x1E,                       //   mov dh, [esi+ebx]
+   0x88, 0x34, 0x06,                       //   mov [esi+eax], dh
+   0x88, 0x14, 0x1E,                       //   mov [esi+ebx], dl
+   0x00, 0xF2,                             //   add dl, dh
+   0x0F, 0xB6, 0xD2,                       //   movzx edx, dl
+   0x8A, 0x14, 0x16,                       //   mov dl, [esi+edx]
+   0x88, 0x17,                             //   mov [edi], dl
+   0x47,                                   //   inc edi
+   0x49,                                   //   dec ecx
+   0x75, 0xE2,                             //   jnz 4b
+   0x4D,                                   //   dec ebp
+   0x75, 0xA2,                             //   jnz 1b
+   0x0F, 0xB6, 0x05, 0xFF, 0x73, 0x40, 0x00,//   movzx eax, byte ptr [OUT+1023]
+   0x5D,                                   //   pop ebp
+   0x5B,                                   //   pop ebx
+   0x5F,                                   //   pop edi
+   0x5E,                                   //   pop esi
+   0xC3,                                   //   ret
+};
+
+//bubble_sort
+static const unsigned char bubbleSortCode[] = {
+   0x56,                                   //   push esi
+   0x57,                                   //   push edi
+   0x53,                                   //   push ebx
+   0x55,                                   //   push ebp
+   0x8B, 0x6C, 0x24, 0x14,                 //   mov ebp, [esp+20]
+   0xBE, 0x00, 0x80, 0x40, 0x00,           //1: mov esi, TMPL
+   0xBF, 0x00, 0x82, 0x40, 0x00,           //   mov edi, WORK
+   0xB9, 0x80, 0x00, 0x00, 0x00,           //   mov ecx, 128
+   0xFC,                                   //   cld
+   0xF3, 0xA5,                             //   rep movsd
+   0xB9, 0x7F, 0x00, 0x00, 0x00,           //   mov ecx, 127
+   0xBE, 0x00, 0x82, 0x40, 0x00,           //2: mov esi, WORK
+   0x89, 0xCA,                             //   mov edx, ecx
+   0x31, 0xFF,                             //   xor edi, edi
+   0x8B, 0x06,                             //3: mov eax, [esi]
+   0x8B, 0x5E, 0x04,                       //   mov ebx, [esi+4]
+   0x39, 0xD8,                             //   cmp eax, ebx
+   0x76, 0x06,                             //   jbe 4f
+   0x89, 0x1E,                             //   mov [esi], ebx
+   0x89, 0x46, 0x04,                       //   mov [esi+4], eax
+   0x47,                                   //   inc edi
+   0x83, 0xC6, 0x04,                       //4: add esi, 4
+   0x4A,                                   //   dec edx
+   0x75, 0xEB,                             //   jnz 3b
+   0x85, 0xFF,                             //   test edi, edi
+   0x74, 0x03,                             //   jz 5f
+   0x49,                                   //   dec ecx
+   0x75, 0xDB,                             //   jnz 2b
+   0x4D,                                   //5: dec ebp
+   0x75, 0xC1,                             //   jnz 1b
+   0xA1, 0x00, 0x82, 0x40, 0x00,           //   mov eax, [WORK]
+   0x5D,                                   //   pop ebp
+   0x5B,                                   //   pop ebx
+   0x5F,                                   //   pop edi
+   0x5E,                                   //   pop esi
+   0xC3,                                   //   ret
+};
+
+//list_walk
+static const unsigned char listWalkCode[] = {
+   0x53,                                   //   push ebx
+   0x8B, 0x5C, 0x24, 0x08,                 //   mov ebx, [esp+8]
+   0x31, 0xC0,                             //   xor eax, eax
+   0xBA, 0x00, 0xA0, 0x40, 0x00,           //1: mov edx, LIST
+   0x03, 0x42, 0x04,                       //2: add eax, [edx+4]
+   0x8B, 0x12,                             //   mov edx, [edx]
+   0x85, 0xD2,                             //   test edx, edx
+   0x75, 0xF7,                             //   jnz 2b
+   0x4B,                                   //   dec ebx
+   0x75, 0xEF,                             //   jnz 1b
+   0x5B,                                   //   pop ebx
+   0xC3,                                   //   ret
+};
+
+//fib
+static const unsigned char fibCode[] = {
+   0x8B, 0x4C, 0x24, 0x04,                 //   mov ecx, [esp+4]
+   0x83, 0xF9, 0x02,                       //   cmp ecx, 2
+   0x73, 0x03,                             //   jae 1f
+   0x89, 0xC8,                             //   mov eax, ecx
+   0xC3,                                   //   ret
+   0x53,                                   //1: push ebx
+   0x49,                                   //   dec ecx
+   0x51,                                   //   push ecx
+   0xE8, 0xEC, 0xFF, 0xFF, 0xFF,           //   call fib
+   0x89, 0xC3,                             //   mov ebx, eax
+   0x8B, 0x0C, 0x24,                       //   mov ecx, [esp]
+   0x49,                                   //   dec ecx
+   0x89, 0x0C, 0x24,                       //   mov [esp], ecx
+   0xE8, 0xDE, 0xFF, 0xFF, 0xFF,           //   call fib
+   0x83, 0xC4, 0x04,                       //   add esp, 4
+   0x01, 0xD8,                             //   add eax, ebx
+   0x5B,                                   //   pop ebx
+   0xC3,                                   //   ret
+};
+
+//seh_raise
+static const unsigned char sehRaiseCode[] = {
+   0x53,                                   //   push ebx
+   0x8B, 0x5C, 0x24, 0x08,                 //   mov ebx, [esp+8]
+   0xC7, 0x05, 0x00, 0xC2, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00,//   mov dword ptr [COUNT], 0
+   0xCC,                                   //1: int3
+   0x4B,                                   //   dec ebx
+   0x75, 0xFC,                             //   jnz 1b
+   0xA1, 0x00, 0xC2, 0x40, 0x00,           //   mov eax, [COUNT]
+   0x5B,                                   //   pop ebx
+   0xC3,                                   //   ret
+   //seh_handler:
+   0x8B, 0x44, 0x24, 0x0C,                 //   mov eax, [esp+12]
+   0xFF, 0x80, 0xB8, 0x00, 0x00, 0x00,     //   inc dword ptr [eax+0xB8]
+   0xFF, 0x05, 0x00, 0xC2, 0x40, 0x00,     //   inc dword ptr [COUNT]
+   0x31, 0xC0,                             //   xor eax, eax
+   0xC3,                                   //   ret
+};
+
+static unsigned int random32(unsigned int *seed) {
+   *seed = *seed * 1103515245 + 12345;
+   return (*seed >> 8) ^ (*seed << 20);
+}
+
+static unsigned int getDword(unsigned char *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void putDword(unsigned char *p, unsigned int v) {
+   p[0] = (unsigned char)v;
+   p[1] = (unsigned char)(v >> 8);
+   p[2] = (unsigned char)(v >> 16);
+   p[3] = (unsigned char)(v >> 24);
+}
+
+static void fillSource(unsigned char *image) {
+   unsigned int seed = 1;
+   for (unsigned int i = 0; i < BLOCK_DWORDS; i++) {
+      putDword(IMG(SRC + i * 4), random32(&seed));
+   }
+}
+
+static bool checkCopy(unsigned char *image, unsigned int arg) {
+   return memcmp(IMG(SRC), IMG(DST), BLOCK_DWORDS * 4) == 0 &&
+          eax == getDword(IMG(SRC + (BLOCK_DWORDS - 1) * 4));
+}
+
+static bool checkCrc32(unsigned char *image, unsigned int arg) {
+   unsigned int crc = 0xFFFFFFFF;
+   for (unsigned int i = 0; i < BLOCK_DWORDS; i++) {
+      crc ^= *IMG(SRC + i);
+      for (int b = 0; b < 8; b++) {
+         crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+      }
+   }
+   return eax == ~crc;
+}
+
+static const unsigned char rc4Key[4] = {0x01, 0x23, 0x45, 0x67};
+
+static void setupRc4(unsigned char *image) {
+   memcpy(IMG(KEY), rc4Key, sizeof(rc4Key));
+}
+
+static bool checkRc4(unsigned char *image, unsigned int arg) {
+   unsigned char s[256];
+   unsigned int i, j = 0;
+   for (i = 0; i < 256; i++) s[i] = (unsigned char)i;
+   for (i = 0; i < 256; i++) {
+      j = (j + s[i] + rc4Key[i & 3]) & 0xFF;
+      unsigned char t = s[i];
+      s[i] = s[j];
+      s[j] = t;
+   }
+   i = j = 0;
+   for (unsigned int n = 0; n < RC4_BYTES; n++) {
+      i = (i + 1) & 0xFF;
+      j = (j + s[i]) & 0xFF;
+      unsigned char t = s[i];
+      s[i] = s[j];
+      s[j] = t;
+      if (*IMG(OUT + n) != s[(s[i] + s[j]) & 0xFF]) return false;
+   }
+   return eax == *IMG(OUT + RC4_BYTES - 1);
+}
+
+static void setupSort(unsigned char *image) {
+   unsigned int seed = 7;
+   for (unsigned int i = 0; i < SORT_DWORDS; i++) {
+      putDword(IMG(TMPL + i * 4), random32(&seed));
+   }
+}
+
+static int compareDwords(const void *a, const void *b) {
+   unsigned int x = *(const unsigned int*)a;
+   unsigned int y = *(const unsigned int*)b;
+   return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static bool checkSort(unsigned char *image, unsigned int arg) {
+   unsigned int sorted[SORT_DWORDS];
+   for (unsigned int i = 0; i < SORT_DWORDS; i++) {
+      sorted[i] = getDword(IMG(TMPL + i * 4));
+   }
+   qsort(sorted, SORT_DWORDS, sizeof(unsigned int), compareDwords);
+   for (unsigned int i = 0; i < SORT_DWORDS; i++) {
+      if (getDword(IMG(WORK + i * 4)) != sorted[i]) return false;
+   }
+   return eax == sorted[0];
+}
+
+//nodes are chained in a shuffled order so the walk jumps around
+static void setupList(unsigned char *image) {
+   unsigned int order[LIST_NODES];
+   unsigned int seed = 3;
+   unsigned int i;
+   for (i = 0; i < LIST_NODES; i++) order[i] = i;
+   for (i = LIST_NODES - 1; i > 1; i--) {
+      unsigned int r = 1 + random32(&seed) % i;   //node 0 stays the head
+      unsigned int t = order[i];
+      order[i] = order[r];
+      order[r] = t;
+   }
+   for (i = 0; i < LIST_NODES; i++) {
+      unsigned int node = LIST + order[i] * 8;
+      unsigned int next = i + 1 < LIST_NODES ? LIST + order[i + 1] * 8 : 0;
+      putDword(IMG(node), next);
+      putDword(IMG(node + 4), order[i]);
+   }
+}
+
+static bool checkList(unsigned char *image, unsigned int arg) {
+   return eax == arg * (LIST_NODES * (LIST_NODES - 1) / 2);
+}
+
+static bool checkFib(unsigned char *image, unsigned int arg) {
+   unsigned int a = 0, b = 1;
+   for (unsigned int i = 0; i < arg; i++) {
+      unsigned int t = a + b;
+      a = b;
+      b = t;
+   }
+   return eax == a;
+}
+
+static void setupSeh(unsigned char *image) {
+   putDword(IMG(TEB), SEH_REGISTRATION);
+   putDword(IMG(SEH_REGISTRATION), 0xFFFFFFFF);
+   putDword(IMG(SEH_REGISTRATION + 4), CODE_BASE + SEH_HANDLER);
+}
+
+static bool checkSeh(unsigned char *image, unsigned int arg) {
+   return eax == arg && getDword(IMG(COUNT)) == arg;
+}
+
+typedef struct _Kernel {
+   const char *name;
+   const unsigned char *code;
+   unsigned int codeSize;
+   unsigned int arg;          //passes, n for fib
+   bool scaled;               //arg grows with -s
+   bool windows;              //needs SEH and fs
+   void (*setup)(unsigned char *image);
+   bool (*check)(unsigned char *image, unsigned int arg);
+} Kernel;
+
+static Kernel kernels[] = {
+   {"memcpy_loop", memcpyLoopCode, sizeof(memcpyLoopCode), 100, true, false, fillSource, checkCopy},
+   {"rep_movsd", repMovsdCode, sizeof(repMovsdCode), 200, true, false, fillSource, checkCopy},
+   {"crc32", crc32Code, sizeof(crc32Code), 4, true, false, fillSource, checkCrc32},
+   {"rc4", rc4Code, sizeof(rc4Code), 20, true, false, setupRc4, checkRc4},
+   {"bubble_sort", bubbleSortCode, sizeof(bubbleSortCode), 8, true, false, setupSort, checkSort},
+   {"list_walk", listWalkCode, sizeof(listWalkCode), 100, true, false, setupList, checkList},
+   {"fib_recursion", fibCode, sizeof(fibCode), 22, false, false, NULL, checkFib},
+   {"seh_raise", sehRaiseCode, sizeof(sehRaiseCode), 2000, true, true, setupSeh, checkSeh},
+};
+
+typedef struct _Result {
+   uquad instructions;
+   uquad memoryOps;
+   double seconds;
+   bool passed;
+} Result;
+
+static void runKernel(Kernel *k, unsigned int arg, Result *r) {
+   unsigned char *image = (unsigned char*)calloc(IMAGE_SIZE, 1);
+   memcpy(image, k->code, k->codeSize);
+   if (k->setup) (*k->setup)(image);
+
+   //same layouts the plugin and x86emu-run use
+   resetCpu();
+   MemoryManager *mgr = new MemoryManager(image, CODE_BASE, CODE_BASE + IMAGE_SIZE);
+   if (k->windows) {
+      mgr->initStack(0x01300000, 0x01300000);
+      enableSEH();
+      es = ss = ds = 0x23;
+      cs = 0x1b;
+      fs = 0x38;
+      fsBase = TEB;
+   }
+   else {
+      mgr->initStack(0xC0000000, 0x01000000);
+   }
+   mgr->initHeap(0xA0000000, 0x01000000);
+   initProgram(CODE_BASE, mgr);
+   push(arg, SIZE_DWORD);
+   push(RUN_EXIT, SIZE_DWORD);
+
+   uquad count = 0;
+   memoryOps = 0;
+   double start = benchTime();
+   while (eip != RUN_EXIT) {
+      executeInstruction();
+      count++;
+   }
+   r->seconds = benchTime() - start;
+   r->instructions = count;
+   r->memoryOps = memoryOps;
+   r->passed = (*k->check)(image, arg);
+
+   delete mgr;
+   mm = NULL;
+   free(image);
+}
+
+int main(int argc, char **argv) {
+   const char *output = NULL;
+   unsigned int scale = 1;
+   unsigned int repeats = 3;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) scale = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) repeats = strtoul(argv[++i], NULL, 10);
+      else {
+         fprintf(stderr, "usage: bench_cpu [-o results.json] [-s scale] [-r repeats]\n");
+         return 1;
+      }
+   }
+   if (scale == 0) scale = 1;
+   if (repeats == 0) repeats = 1;
+   msgQuiet = true;   //the SEH kernel would report every exception
+
+   BenchJson json(output, "cpu");
+   int failures = 0;
+   printf("%-14s %12s %12s %14s %10s %14s\n", "kernel", "insns", "mem ops",
+          "insns/sec", "ns/insn", "mem ops/sec");
+   for (unsigned int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+      Kernel *k = kernels + i;
+      unsigned int arg = k->scaled ? k->arg * scale : k->arg;
+      //best of the repeats, every run has to get the right answer
+      Result best, r;
+      bool passed = true;
+      for (unsigned int n = 0; n < repeats; n++) {
+         runKernel(k, arg, &r);
+         passed = passed && r.passed;
+         if (n == 0 || r.seconds < best.seconds) best = r;
+      }
+      if (best.seconds <= 0) best.seconds = 1e-9;
+      double ips = best.instructions / best.seconds;
+      double ns = best.seconds * 1e9 / (best.instructions ? best.instructions : 1);
+      double mops = best.memoryOps / best.seconds;
+      printf("%-14s %12llu %12llu %14.0f %10.2f %14.0f%s\n", k->name,
+             (unsigned long long)best.instructions, (unsigned long long)best.memoryOps,
+             ips, ns, mops, passed ? "" : "  FAILED");
+      if (!passed) failures++;
+
+      json.begin(k->name);
+      json.field("arg", (unsigned long long)arg);
+      json.field("instructions", (unsigned long long)best.instructions);
+      json.field("memory_ops", (unsigned long long)best.memoryOps);
+      json.field("seconds", best.seconds);
+      json.field("instructions_per_sec", ips);
+      json.field("ns_per_instruction", ns);
+      json.field("memory_ops_per_sec", mops);
+      json.field("passed", passed);
+      json.end();
+   }
+   return failures ? 1 : 0;
+}
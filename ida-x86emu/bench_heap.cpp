@@ -0,0 +1,344 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: bench_heap.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * EmuHeap benchmarks.  Synthetic allocation patterns are driven straight
+ * through the heap (no CPU) and every operation is timed on its own so
+ * we can report latency percentiles, and how they move as the number of
+ * live blocks grows.
+ *
+ *    bench_heap [-o results.json] [-s scale] [-n max list nodes] [-t seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memmgr.h"
+#include "emuheap.h"
+#include "bench.h"
+
+#define HEAP_BASE 0x10000000
+
+//time one heap operation into a sample set
+#define TIMED(samples, op) do { \
+      double t0 = benchTime(); \
+      op; \
+      (samples).add(benchTime() - t0); \
+   } while (0)
+
+static BenchJson *json;
+static int failures;
+
+static unsigned int random32(unsigned int *seed) {
+   *seed = *seed * 1103515245 + 12345;
+   return (*seed >> 8) ^ (*seed << 20);
+}
+
+static void report(const char *name, unsigned int live, BenchSamples &s) {
+   printf("%-16s %8u %8u %10.0f %10.0f %10.0f %10.0f %12.0f\n", name, live, s.size(),
+          s.mean() * 1e9, s.percentile(50) * 1e9, s.percentile(90) * 1e9,
+          s.percentile(99) * 1e9, s.percentile(100) * 1e9);
+   json->begin(name);
+   json->field("live_blocks", (unsigned long long)live);
+   json->field("ops", (unsigned long long)s.size());
+   json->field("mean_ns", s.mean() * 1e9);
+   json->field("p50_ns", s.percentile(50) * 1e9);
+   json->field("p90_ns", s.percentile(90) * 1e9);
+   json->field("p99_ns", s.percentile(99) * 1e9);
+   json->field("max_ns", s.percentile(100) * 1e9);
+   json->end();
+   s.clear();
+}
+
+static bool failed(const char *name, const char *why) {
+   fprintf(stderr, "%s: %s\n", name, why);
+   failures++;
+   return false;
+}
+
+//free and reallocate random blocks with the live count held steady
+static void churn(unsigned int live, unsigned int ops) {
+   EmuHeap heap(HEAP_BASE, 0x10000000);
+   BenchSamples mallocs, frees, writes, reads;
+   unsigned int *blocks = (unsigned int*)calloc(live, sizeof(unsigned int));
+   unsigned int seed = live;
+   unsigned int i;
+   for (i = 0; i < live; i++) {
+      blocks[i] = heap.malloc(16 + random32(&seed) % 497);
+      heap.writeByte(blocks[i], (unsigned char)i);
+   }
+   for (unsigned int n = 0; n < ops; n++) {
+      unsigned int slot = random32(&seed) % live;
+      unsigned int size = 16 + random32(&seed) % 497;
+      TIMED(frees, heap.free(blocks[slot]));
+      TIMED(mallocs, blocks[slot] = heap.malloc(size));
+      if (blocks[slot] == HEAP_ERROR) {
+         failed("churn", "out of heap");
+         break;
+      }
+      TIMED(writes, heap.writeByte(blocks[slot], (unsigned char)slot));
+      unsigned int other = random32(&seed) % live;
+      unsigned char val;
+      TIMED(reads, val = heap.readByte(blocks[other]));
+      if (val != (unsigned char)other) {
+         failed("churn", "read back the wrong value");
+         break;
+      }
+   }
+   report("churn_malloc", live, mallocs);
+   report("churn_free", live, frees);
+   report("churn_write", live, writes);
+   report("churn_read", live, reads);
+   free(blocks);
+}
+
+/*
+ * Build a linked list one calloc'ed node at a time, the way a guest
+ * filling a list does, linking each node into the one before it.  The
+ * scaling curve is the per operation cost at each checkpoint.  Growth
+ * stops early, with a final point where it stopped, once it runs past
+ * the time budget.
+ */
+static void listGrowth(unsigned int maxNodes, double budget) {
+   static const unsigned int checkpoints[] = {1000, 2000, 5000, 10000, 20000, 50000, 100000,
+                                              200000, 500000, 1000000};
+   EmuHeap heap(HEAP_BASE, 0x40000000);
+   BenchSamples callocs, writes, reads;
+   unsigned int *nodes = (unsigned int*)malloc(maxNodes * sizeof(unsigned int));
+   unsigned int seed = 11;
+   unsigned int count = 0;
+   unsigned int c = 0;
+   double start = benchTime();
+   while (count < maxNodes) {
+      unsigned int node;
+      TIMED(callocs, node = heap.calloc(1, 12));
+      if (node == HEAP_ERROR) {
+         failed("list", "out of heap");
+         break;
+      }
+      if (count) {
+         //next pointer of the previous node
+         unsigned int prev = nodes[count - 1];
+         for (int b = 0; b < 4; b++) {
+            TIMED(writes, heap.writeByte(prev + b, (unsigned char)(node >> (b * 8))));
+         }
+      }
+      nodes[count++] = node;
+      unsigned int mark = c < sizeof(checkpoints) / sizeof(checkpoints[0]) ? checkpoints[c] : maxNodes;
+      bool over = (count & 0xFF) == 0 && benchTime() - start > budget;
+      if (count == mark || count == maxNodes || over) {
+         //follow links from random nodes to check them and time the reads
+         for (unsigned int n = 0; n < 1000 && count > 1; n++) {
+            unsigned int i = random32(&seed) % (count - 1);
+            unsigned int next = 0;
+            for (int b = 0; b < 4; b++) {
+               unsigned char val;
+               TIMED(reads, val = heap.readByte(nodes[i] + b));
+               next |= val << (b * 8);
+            }
+            if (next != nodes[i + 1]) {
+               failed("list", "broken link");
+               break;
+            }
+         }
+         report("list_calloc", count, callocs);
+         report("list_write", count, writes);
+         report("list_read", count, reads);
+         c++;
+         if (over && count < maxNodes) {
+            fprintf(stderr, "list growth stopped at %u nodes, over the %.0f second budget\n",
+                    count, budget);
+            break;
+         }
+      }
+   }
+   free(nodes);
+}
+
+//every other block freed, then requests that fit the holes and that don't
+static void fragmentation(unsigned int blocks, unsigned int ops) {
+   EmuHeap heap(HEAP_BASE, 0x10000000);
+   BenchSamples fits, misses;
+   unsigned int *addrs = (unsigned int*)malloc(blocks * sizeof(unsigned int));
+   unsigned int i;
+   for (i = 0; i < blocks; i++) {
+      addrs[i] = heap.malloc(32);
+   }
+   for (i = 0; i < blocks; i += 2) {
+      heap.free(addrs[i]);
+   }
+   unsigned int live = blocks - blocks / 2;
+   for (i = 0; i < ops; i++) {
+      //no hole is big enough, walks the whole list
+      unsigned int addr;
+      TIMED(misses, addr = heap.malloc(256));
+      if (addr == HEAP_ERROR || addr < addrs[blocks - 1]) {
+         failed("fragmentation", "large block landed in a hole");
+         break;
+      }
+      live++;
+      //fits the first hole left
+      TIMED(fits, addr = heap.malloc(24));
+      if (addr == HEAP_ERROR) {
+         failed("fragmentation", "out of heap");
+         break;
+      }
+      live++;
+   }
+   report("frag_no_fit", live, misses);
+   report("frag_fit", live, fits);
+   free(addrs);
+}
+
+//VirtualAlloc sized blocks, 64K to 1M
+static void largeBlocks(unsigned int ops) {
+   EmuHeap heap(HEAP_BASE, 0x40000000);
+   BenchSamples mallocs, callocs, touches, frees;
+   unsigned int ring[16];
+   unsigned int seed = 5;
+   unsigned int i;
+   memset(ring, 0, sizeof(ring));
+   for (i = 0; i < ops; i++) {
+      unsigned int slot = i % 16;
+      unsigned int size = 0x10000 << (random32(&seed) % 5);
+      if (ring[slot]) {
+         TIMED(frees, heap.free(ring[slot]));
+      }
+      if (i & 1) {
+         TIMED(callocs, ring[slot] = heap.calloc(1, size));
+      }
+      else {
+         TIMED(mallocs, ring[slot] = heap.malloc(size));
+      }
+      if (ring[slot] == HEAP_ERROR) {
+         failed("large", "out of heap");
+         ring[slot] = 0;
+         break;
+      }
+      TIMED(touches, heap.writeByte(ring[slot] + size - 1, 1));
+   }
+   report("large_malloc", 16, mallocs);
+   report("large_calloc", 16, callocs);
+   report("large_write", 16, touches);
+   report("large_free", 16, frees);
+}
+
+//a buffer grown and shrunk in small steps, pinned in place by other allocations
+static void reallocGrowth(unsigned int rounds) {
+   EmuHeap heap(HEAP_BASE, 0x10000000);
+   BenchSamples grows, shrinks;
+   unsigned int live = 0;
+   for (unsigned int r = 0; r < rounds; r++) {
+      unsigned int buf = heap.malloc(64);
+      heap.writeByte(buf, 0x5A);
+      unsigned int size;
+      for (size = 128; size <= 0x10000 && buf != HEAP_ERROR; size += 64) {
+         heap.malloc(16);
+         live++;
+         TIMED(grows, buf = heap.realloc(buf, size));
+      }
+      if (buf == HEAP_ERROR || heap.readByte(buf) != 0x5A) {
+         failed("realloc", "contents lost");
+         break;
+      }
+      for (size -= 128; size >= 64; size -= 64) {
+         TIMED(shrinks, buf = heap.realloc(buf, size));
+      }
+      live++;
+   }
+   report("realloc_grow", live, grows);
+   report("realloc_shrink", live, shrinks);
+}
+
+//HeapCreate style heaps chained off the manager, reached by handle
+static void multiHeap(unsigned int heaps, unsigned int ops) {
+   MemoryManager mgr(0x400000, 0x401000);
+   BenchSamples adds, finds, mallocs, writes, reads;
+   unsigned int *handles = (unsigned int*)malloc(heaps * sizeof(unsigned int));
+   unsigned int seed = 9;
+   unsigned int i;
+   mgr.initHeap(0xA0000000, 0x100000);
+   handles[0] = 0xA0000000;
+   for (i = 1; i < heaps; i++) {
+      TIMED(adds, handles[i] = mgr.addHeap(0x100000));
+   }
+   unsigned int live = 0;
+   for (i = 0; i < ops; i++) {
+      unsigned int handle = handles[random32(&seed) % heaps];
+      EmuHeap *h;
+      TIMED(finds, h = mgr.findHeap(handle));
+      if (h == NULL) {
+         failed("multi_heap", "handle not found");
+         break;
+      }
+      unsigned int addr;
+      TIMED(mallocs, addr = h->malloc(32));
+      if (addr == HEAP_ERROR) continue;
+      live++;
+      //through the manager, as the CPU sees the heaps
+      TIMED(writes, mgr.writeByte(addr, (unsigned char)i));
+      unsigned char val;
+      TIMED(reads, val = mgr.readByte(addr));
+      if (val != (unsigned char)i) {
+         failed("multi_heap", "read back the wrong value");
+         break;
+      }
+   }
+   report("heap_add", heaps, adds);
+   report("heap_find", heaps, finds);
+   report("heap_malloc", live, mallocs);
+   report("heap_write", live, writes);
+   report("heap_read", live, reads);
+   free(handles);
+}
+
+int main(int argc, char **argv) {
+   const char *output = NULL;
+   unsigned int scale = 1;
+   unsigned int maxNodes = 100000;
+   double budget = 30;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) scale = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) maxNodes = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) budget = atof(argv[++i]);
+      else {
+         fprintf(stderr, "usage: bench_heap [-o results.json] [-s scale] [-n max list nodes] [-t seconds]\n");
+         return 1;
+      }
+   }
+   if (scale == 0) scale = 1;
+   if (maxNodes < 2) maxNodes = 2;
+
+   BenchJson results(output, "heap");
+   json = &results;
+   printf("%-16s %8s %8s %10s %10s %10s %10s %12s\n", "case", "live", "ops",
+          "mean ns", "p50 ns", "p90 ns", "p99 ns", "max ns");
+   churn(100, 20000 * scale);
+   churn(1000, 20000 * scale);
+   churn(10000, 20000 * scale);
+   listGrowth(maxNodes, budget);
+   fragmentation(20000, 2000 * scale);
+   largeBlocks(500 * scale);
+   reallocGrowth(4 * scale);
+   multiHeap(64, 20000 * scale);
+   return failures ? 1 : 0;
+}
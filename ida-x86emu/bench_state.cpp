@@ -0,0 +1,496 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: bench_state.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * saveState/loadState benchmarks.  Emulator states of growing size are
+ * saved through Buffer into an in-memory stand-in for the IDA netnode,
+ * loaded back and saved again to check the round trip.  Reports the
+ * blob size of each section and where the time goes, then how long an
+ * incremental save takes after a few writes, and what a run of
+ * checkpoints costs in a PageStore.
+ *
+ *    bench_state [-o results.json] [-l levels] [-r repeats] [-u]
+ *
+ * -u saves without packing the sections.  The last level, a 256MB
+ * heap, only runs when asked for with -l 5.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "pagestore.h"
+#include "bench.h"
+
+/*
+ * Stands in for the netnode the plugin saves into.  IDA stores a blob
+ * as a run of MAXSPECSIZE supvals, so we copy it in and out in chunks
+ * of the same size.
+ */
+#define BLOB_CHUNK 1024
+
+class BlobNode {
+public:
+   BlobNode() {chunks = NULL; count = 0; size = 0;};
+   ~BlobNode() {delblob();};
+
+   void setblob(const unsigned char *buf, unsigned int sz);
+   //malloc'ed copy of the blob, NULL if there is none
+   unsigned char *getblob(unsigned int *sz);
+   void delblob();
+
+private:
+   unsigned char **chunks;
+   unsigned int count;
+   unsigned int size;
+};
+
+void BlobNode::setblob(const unsigned char *buf, unsigned int sz) {
+   delblob();
+   count = (sz + BLOB_CHUNK - 1) / BLOB_CHUNK;
+   chunks = (unsigned char**)malloc(count * sizeof(unsigned char*));
+   for (unsigned int i = 0; i < count; i++) {
+      unsigned int len = sz - i * BLOB_CHUNK;
+      if (len > BLOB_CHUNK) len = BLOB_CHUNK;
+      chunks[i] = (unsigned char*)malloc(len);
+      memcpy(chunks[i], buf + i * BLOB_CHUNK, len);
+   }
+   size = sz;
+}
+
+unsigned char *BlobNode::getblob(unsigned int *sz) {
+   if (chunks == NULL) return NULL;
+   unsigned char *buf = (unsigned char*)malloc(size);
+   for (unsigned int i = 0; i < count; i++) {
+      unsigned int len = size - i * BLOB_CHUNK;
+      if (len > BLOB_CHUNK) len = BLOB_CHUNK;
+      memcpy(buf + i * BLOB_CHUNK, chunks[i], len);
+   }
+   *sz = size;
+   return buf;
+}
+
+void BlobNode::delblob() {
+   for (unsigned int i = 0; i < count; i++) {
+      free(chunks[i]);
+   }
+   free(chunks);
+   chunks = NULL;
+   count = size = 0;
+}
+
+typedef struct _StateSize {
+   const char *name;
+   unsigned int stackDwords;
+   unsigned int heapBlocks;
+   unsigned int blockSize;
+   unsigned int hooks;
+   unsigned int modules;
+} StateSize;
+
+static StateSize levels[] = {
+   {"tiny", 256, 16, 64, 8, 2},
+   {"small", 4096, 256, 256, 64, 8},
+   {"medium", 16384, 2048, 1024, 256, 32},
+   {"large", 65536, 8192, 4096, 1024, 64},
+   {"huge", 262144, 16384, 16384, 4096, 128},
+};
+
+static const char *sectionNames[] = {"cpu", "memory", "hooks", "modules", "seh"};
+
+static BenchJson *json;
+static int failures;
+
+static void noHook(MemoryManager *mgr, dword addr) {
+}
+
+static void freeState() {
+   delete mm;
+   mm = NULL;
+   freeHookList();
+   freeModuleList();
+}
+
+static void buildState(StateSize *s) {
+   unsigned int i;
+   char name[32];
+   freeModuleList();
+   resetCpu();
+   MemoryManager *mgr = new MemoryManager(0x400000, 0x500000);
+   mgr->initStack(0xC0000000, 0x01000000);
+   mgr->initHeap(0xA0000000, 0x20000000);
+   initProgram(0x401000, mgr);
+   for (i = 0; i < s->stackDwords; i++) {
+      push(i * 0x9E3779B9, SIZE_DWORD);
+   }
+   unsigned char *fill = (unsigned char*)malloc(s->blockSize);
+   for (i = 0; i < s->blockSize; i++) fill[i] = (unsigned char)(i * 7);
+   for (i = 0; i < s->heapBlocks; i++) {
+      dword addr = mm->heap->malloc(s->blockSize);
+      fill[0] = (unsigned char)i;
+      mm->writeBlock(addr, fill, s->blockSize);
+   }
+   free(fill);
+   for (i = 0; i < s->hooks; i++) {
+      sprintf(name, "Function%u", i);
+      addHook(name, 0x70000000 + i * 16, noHook, 0);
+   }
+   for (i = 0; i < s->modules; i++) {
+      sprintf(name, "module%u.dll", i);
+      addHeadlessModule(name, i + 1, 0x10000000 + i * 0x100000);
+   }
+}
+
+//true if two saved states match outside the hook list, see roundTrip
+static bool sameState(Buffer &a, unsigned int *as, Buffer &b, unsigned int *bs) {
+   unsigned char *p = a.get_buf(), *q = b.get_buf();
+   return as[STATE_HOOKS] == bs[STATE_HOOKS] &&
+          memcmp(p, q, as[STATE_HOOKS]) == 0 &&
+          as[STATE_END] - as[STATE_MODULES] == bs[STATE_END] - bs[STATE_MODULES] &&
+          memcmp(p + as[STATE_MODULES], q + bs[STATE_MODULES],
+                 as[STATE_END] - as[STATE_MODULES]) == 0;
+}
+
+/*
+ * Time one save and load of the current state.  The blob saved after
+ * loading has to match the original outside the hook list, headless
+ * hooks have no emulation to bind to and are dropped on load.
+ */
+static void roundTrip(StateSize *s, unsigned int repeats) {
+   double serialize = 0, store = 0, fetch = 0, deserialize = 0;
+   unsigned int sections[STATE_SECTIONS];
+   unsigned int stackBytes = 0, heapBytes = 0, rawBytes = 0;
+   bool passed = true;
+   BlobNode node;
+
+   for (unsigned int r = 0; r < repeats; r++) {
+      buildState(s);
+      {
+         Buffer sb;
+         mm->stack->save(sb, esp);
+         stackBytes = sb.get_wlen();
+         Buffer hb;
+         mm->heap->save(hb);
+         heapBytes = hb.get_wlen();
+         //size before packing, rates are quoted against this
+         bool packing = compressState;
+         compressState = false;
+         Buffer rb(CPU_VERSION);
+         saveState(rb);
+         rawBytes = rb.get_wlen();
+         compressState = packing;
+      }
+
+      double t0 = benchTime();
+      Buffer *b = new Buffer(CPU_VERSION);
+      if (saveState(*b, sections) != X86EMUSAVE_OK) passed = false;
+      double t1 = benchTime();
+      node.setblob(b->get_buf(), b->get_wlen());
+      double t2 = benchTime();
+      freeState();
+
+      double t3 = benchTime();
+      unsigned int sz;
+      unsigned char *buf = node.getblob(&sz);
+      double t4 = benchTime();
+      Buffer *l = new Buffer(buf, sz, false);
+      if (loadState(*l) != X86EMULOAD_OK) passed = false;
+      delete l;
+      free(buf);
+      double t5 = benchTime();
+
+      Buffer again(CPU_VERSION);
+      unsigned int after[STATE_SECTIONS];
+      saveState(again, after);
+      if (!sameState(*b, sections, again, after)) {
+         passed = false;
+      }
+      delete b;
+      freeState();
+
+      if (r == 0 || t1 - t0 < serialize) serialize = t1 - t0;
+      if (r == 0 || t2 - t1 < store) store = t2 - t1;
+      if (r == 0 || t4 - t3 < fetch) fetch = t4 - t3;
+      if (r == 0 || t5 - t4 < deserialize) deserialize = t5 - t4;
+   }
+
+   unsigned int total = sections[STATE_END];
+   double mb = rawBytes / 1048576.0;
+   printf("%-8s %10u %10u %9.3f %9.3f %9.3f %9.3f %9.1f %9.1f%s\n", s->name, rawBytes, total,
+          serialize * 1e3, store * 1e3, fetch * 1e3, deserialize * 1e3,
+          mb / (serialize + store), mb / (fetch + deserialize), passed ? "" : "  FAILED");
+   printf("         ");
+   for (int i = 0; i < STATE_END; i++) {
+      printf(" %s %u", sectionNames[i], sections[i + 1] - sections[i]);
+      if (i == STATE_MEMORY) printf(" (stack %u heap %u)", stackBytes, heapBytes);
+   }
+   printf("\n");
+   if (!passed) failures++;
+
+   json->begin(s->name);
+   json->field("stack_dwords", (unsigned long long)s->stackDwords);
+   json->field("heap_blocks", (unsigned long long)s->heapBlocks);
+   json->field("block_size", (unsigned long long)s->blockSize);
+   json->field("hooks", (unsigned long long)s->hooks);
+   json->field("modules", (unsigned long long)s->modules);
+   json->field("raw_bytes", (unsigned long long)rawBytes);
+   json->field("blob_bytes", (unsigned long long)total);
+   for (int i = 0; i < STATE_END; i++) {
+      char key[32];
+      sprintf(key, "%s_bytes", sectionNames[i]);
+      json->field(key, (unsigned long long)(sections[i + 1] - sections[i]));
+   }
+   json->field("stack_bytes", (unsigned long long)stackBytes);
+   json->field("heap_bytes", (unsigned long long)heapBytes);
+   json->field("serialize_ms", serialize * 1e3);
+   json->field("store_ms", store * 1e3);
+   json->field("fetch_ms", fetch * 1e3);
+   json->field("deserialize_ms", deserialize * 1e3);
+   json->field("packed", compressState);
+   json->field("passed", passed);
+   json->end();
+}
+
+/*
+ * Save the state in full, write a few heap blocks and push a little,
+ * then save only what changed.  The delta applied over the full save
+ * has to give back the state as it was at the second save.
+ */
+static void incremental(StateSize *s) {
+   unsigned int sections[STATE_SECTIONS], after[STATE_SECTIONS];
+   unsigned int i, touched = 0;
+   buildState(s);
+   Buffer base(CPU_VERSION);
+   double t0 = benchTime();
+   saveState(base);
+   double t1 = benchTime();
+
+   //one block in every sixteenth of the heap
+   unsigned int heapBase = mm->heap->getHeapBase();
+   unsigned int span = s->heapBlocks * (s->blockSize + HEAP_GAP);
+   for (i = 0; i < 16; i++) {
+      unsigned int addr, size, site;
+      if (mm->heap->nearestBlock(heapBase + i * (span / 16), &addr, &size, &site)) {
+         writeMem(addr, i, SIZE_DWORD);
+         touched++;
+      }
+   }
+   for (i = 0; i < 64; i++) {
+      push(i, SIZE_DWORD);
+   }
+
+   Buffer delta(CPU_VERSION);
+   double t2 = benchTime();
+   saveStateDelta(delta);
+   double t3 = benchTime();
+   Buffer want(CPU_VERSION);
+   saveState(want, sections);
+   freeState();
+
+   Buffer l(base.get_buf(), base.get_wlen(), false);
+   bool passed = loadState(l) == X86EMULOAD_OK;
+   Buffer d(delta.get_buf(), delta.get_wlen(), false);
+   double t4 = benchTime();
+   passed = loadStateDelta(d) == X86EMULOAD_OK && passed;
+   double t5 = benchTime();
+   Buffer got(CPU_VERSION);
+   saveState(got, after);
+   passed = passed && sameState(want, sections, got, after);
+   freeState();
+
+   printf("%-8s %10u %10u %9.3f %9.3f %9.3f   %u blocks written%s\n", s->name, base.get_wlen(),
+          delta.get_wlen(), (t1 - t0) * 1e3, (t3 - t2) * 1e3, (t5 - t4) * 1e3, touched,
+          passed ? "" : "  FAILED");
+   if (!passed) failures++;
+
+   char name[32];
+   sprintf(name, "%s_delta", s->name);
+   json->begin(name);
+   json->field("blocks_written", (unsigned long long)touched);
+   json->field("base_bytes", (unsigned long long)base.get_wlen());
+   json->field("delta_bytes", (unsigned long long)delta.get_wlen());
+   json->field("base_save_ms", (t1 - t0) * 1e3);
+   json->field("delta_save_ms", (t3 - t2) * 1e3);
+   json->field("delta_load_ms", (t5 - t4) * 1e3);
+   json->field("passed", passed);
+   json->end();
+}
+
+#define CHECKPOINTS 100
+
+/*
+ * Take CHECKPOINTS states a few writes apart into one PageStore.  The
+ * last two are compared, which has to find every heap write between
+ * them and esp, and then the first is restored and taken again, which
+ * has to give no differences at all.
+ */
+static void checkpoints(StateSize *s) {
+   PagedState *states[CHECKPOINTS];
+   dword written[16];
+   unsigned int i, k, touched = 0;
+   double capture = 0;
+   bool passed = true;
+   PageStore store;
+   buildState(s);
+   Buffer full(CPU_VERSION);
+   saveState(full);
+
+   unsigned int heapBase = mm->heap->getHeapBase();
+   unsigned int span = s->heapBlocks * (s->blockSize + HEAP_GAP);
+   for (k = 0; k < CHECKPOINTS; k++) {
+      touched = 0;
+      for (i = 0; k && i < 16; i++) {
+         unsigned int addr, size, site;
+         if (mm->heap->nearestBlock(heapBase + ((k * 16 + i) % 256) * (span / 256), &addr, &size, &site)) {
+            written[touched++] = addr + (k % (size / 4)) * 4;
+            writeMem(written[touched - 1], 0xC0DE0000 + k, SIZE_DWORD);
+         }
+      }
+      if (k) push(k, SIZE_DWORD);
+      double t0 = benchTime();
+      states[k] = new PagedState(&store);
+      double t1 = benchTime();
+      if (k == 0 || t1 - t0 < capture) capture = t1 - t0;
+   }
+
+   StateRange *ranges;
+   int which[STATE_REGS];
+   PagedState *a = states[CHECKPOINTS - 2], *b = states[CHECKPOINTS - 1];
+   double t2 = benchTime();
+   unsigned int n = a->diffMemory(b, &ranges);
+   unsigned int regs = a->diffRegisters(b, which);
+   double t3 = benchTime();
+   //the writes made between the last two, each in some range
+   for (i = 0; i < touched; i++) {
+      bool found = false;
+      for (k = 0; k < n && !found; k++) {
+         found = written[i] - ranges[k].addr < ranges[k].len;
+      }
+      passed = passed && found;
+   }
+   passed = passed && regs == 1 && which[0] == ESP;
+   free(ranges);
+
+   double t4 = benchTime();
+   passed = states[0]->restore() && passed;
+   double t5 = benchTime();
+   PagedState again(&store);
+   n = states[0]->diffMemory(&again, &ranges);
+   free(ranges);
+   passed = passed && n == 0 && states[0]->diffRegisters(&again, which) == 0;
+
+   double stored = store.getPageCount() * (double)STORE_PAGE_SIZE;
+   double flat = (double)states[0]->getPageCount() * STORE_PAGE_SIZE * CHECKPOINTS;
+   printf("%-8s %10u %10u %10.1f %10.1f %9.3f %9.3f %9.3f%s\n", s->name,
+          states[0]->getPageCount(), store.getPageCount(), flat / 1048576.0, stored / 1048576.0,
+          capture * 1e3, (t3 - t2) * 1e3, (t5 - t4) * 1e3, passed ? "" : "  FAILED");
+   if (!passed) failures++;
+
+   char name[32];
+   sprintf(name, "%s_checkpoints", s->name);
+   json->begin(name);
+   json->field("checkpoints", (unsigned long long)CHECKPOINTS);
+   json->field("state_pages", (unsigned long long)states[0]->getPageCount());
+   json->field("stored_pages", (unsigned long long)store.getPageCount());
+   json->field("saved_state_bytes", (unsigned long long)full.get_wlen());
+   json->field("capture_ms", capture * 1e3);
+   json->field("diff_ms", (t3 - t2) * 1e3);
+   json->field("restore_ms", (t5 - t4) * 1e3);
+   json->field("passed", passed);
+   json->end();
+
+   for (k = 0; k < CHECKPOINTS; k++) {
+      delete states[k];
+   }
+   freeState();
+}
+
+//Buffer grows BLOCK_SIZE bytes at a time, time filling one against a flat copy
+static void bufferGrowth(unsigned int total) {
+   unsigned char chunk[4096];
+   memset(chunk, 0x5A, sizeof(chunk));
+   double t0 = benchTime();
+   Buffer b;
+   for (unsigned int n = 0; n < total; n += sizeof(chunk)) {
+      b.write(chunk, sizeof(chunk));
+   }
+   double t1 = benchTime();
+   unsigned char *flat = (unsigned char*)malloc(total);
+   for (unsigned int n = 0; n < total; n += sizeof(chunk)) {
+      memcpy(flat + n, chunk, sizeof(chunk));
+   }
+   double t2 = benchTime();
+   free(flat);
+   double mb = total / 1048576.0;
+   printf("buffer %10u   append %9.1f MB/s   flat copy %9.1f MB/s\n", total,
+          mb / (t1 - t0), mb / (t2 - t1));
+   char name[32];
+   sprintf(name, "buffer_%u", total);
+   json->begin(name);
+   json->field("bytes", (unsigned long long)total);
+   json->field("append_ms", (t1 - t0) * 1e3);
+   json->field("flat_copy_ms", (t2 - t1) * 1e3);
+   json->end();
+}
+
+int main(int argc, char **argv) {
+   const char *output = NULL;
+   unsigned int count = sizeof(levels) / sizeof(levels[0]) - 1;
+   unsigned int repeats = 3;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+      else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) count = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) repeats = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "-u") == 0) compressState = false;
+      else {
+         fprintf(stderr, "usage: bench_state [-o results.json] [-l levels] [-r repeats] [-u]\n");
+         return 1;
+      }
+   }
+   if (count == 0 || count > sizeof(levels) / sizeof(levels[0])) {
+      count = sizeof(levels) / sizeof(levels[0]);
+   }
+   if (repeats == 0) repeats = 1;
+   msgQuiet = true;
+
+   BenchJson results(output, "state");
+   json = &results;
+   printf("%-8s %10s %10s %9s %9s %9s %9s %9s %9s\n", "state", "raw", "blob", "save ms", "store ms",
+          "fetch ms", "load ms", "save MB/s", "load MB/s");
+   for (unsigned int i = 0; i < count; i++) {
+      roundTrip(levels + i, repeats);
+   }
+   printf("%-8s %10s %10s %9s %9s %9s\n", "state", "base", "delta", "base ms", "delta ms",
+          "apply ms");
+   for (unsigned int i = 0; i < count; i++) {
+      incremental(levels + i);
+   }
+   printf("%-8s %10s %10s %10s %10s %9s %9s %9s\n", "state", "pages", "stored", "flat MB",
+          "stored MB", "take ms", "diff ms", "restore ms");
+   for (unsigned int i = 0; i < count; i++) {
+      checkpoints(levels + i);
+   }
+   for (unsigned int total = 0x10000; total <= 0x4000000; total <<= 2) {
+      bufferGrowth(total);
+   }
+   return failures ? 1 : 0;
+}
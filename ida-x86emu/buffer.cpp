@@ -34,36 +34,50 @@ Buffer::Buffer(unsigned int magic) {
    write(&magic, sizeof(magic));
 }
 
-Buffer::Buffer(unsigned char *buf, unsigned int len) {
-   init(len);
-   if (!error) {
-      if (len >= 4) {  //check for presence of BUFFER_MAGIC
-         unsigned int m = *(unsigned int*)buf;
-         if ((m & BUFFER_MAGIC_MASK) == BUFFER_MAGIC) {
-            magic = m;
-            len -= 4;  //adjust length
-            buf += 4;  //adjust buffer start
-         }
+Buffer::Buffer(unsigned char *buf, unsigned int len, bool copy) {
+   unsigned int m = 0;
+   if (len >= 4) {  //check for presence of BUFFER_MAGIC
+      memcpy(&m, buf, sizeof(m));
+      if ((m & BUFFER_MAGIC_MASK) == BUFFER_MAGIC) {
+         len -= 4;  //adjust length
+         buf += 4;  //adjust buffer start
       }
-      memcpy(bptr, buf, len);
+      else {
+         m = 0;
+      }
+   }
+   if (copy) {
+      init(len);
+      if (!error) {
+         memcpy(bptr, buf, len);
+      }
+   }
+   else {
+      bptr = buf;
+      sz = len;
+      rptr = 0;
+      error = false;
+      owner = false;
    }
+   magic = m;
    wptr = sz;
 }
 
 void Buffer::init(unsigned int size) {
-   bptr = (unsigned char *)malloc(size);
+   bptr = (unsigned char *)malloc(size ? size : 1);
    sz = bptr ? size : 0;
    rptr = wptr = 0;
    error = sz != size;
    magic = 0;
+   owner = true;
 }
 
 Buffer::~Buffer() {
-   free(bptr);
+   if (owner) free(bptr);
 }
 
 int Buffer::read(void *data, unsigned int len) {
-   if ((rptr + len) <= sz) {
+   if (len <= wptr - rptr) {
       memcpy(data, bptr + rptr, len);
       rptr += len;
       return 0;
@@ -81,15 +95,40 @@ bool Buffer::rewind(unsigned int amt) {
 }
 
 int Buffer::write(void *data, unsigned int len) {
-   if (!check_size(wptr + len)) {
-      memcpy(bptr + wptr, data, len);
-      wptr += len;
+   unsigned char *p = write_view(len);
+   if (p) {
+      memcpy(p, data, len);
       return 0;
 	}
-   error = true;
    return 1;
 }
 
+unsigned char *Buffer::detach() {
+   if (!owner) return NULL;
+   owner = false;
+   return bptr;
+}
+
+const unsigned char *Buffer::read_view(unsigned int len) {
+   if (len <= wptr - rptr) {
+      const unsigned char *p = bptr + rptr;
+      rptr += len;
+      return p;
+   }
+   error = true;
+   return NULL;
+}
+
+unsigned char *Buffer::write_view(unsigned int len) {
+   if (wptr + len >= wptr && !check_size(wptr + len)) {
+      unsigned char *p = bptr + wptr;
+      wptr += len;
+      return p;
+   }
+   error = true;
+   return NULL;
+}
+
 unsigned char *Buffer::get_buf() {
    return bptr;
 }
@@ -102,17 +141,30 @@ unsigned int Buffer::get_rlen() {
    return rptr;
 }
 
+//grow by at least half again so a long run of writes costs linear time
 int Buffer::check_size(unsigned int max) {
-	if (max <= sz) return 0;
-	max = (max + BLOCK_SIZE) & ~(BLOCK_SIZE - 1);   //round up to next BLOCK_SIZE
-	unsigned char *tmp = (unsigned char *)realloc(bptr, max);
-	if (tmp) {
-	   bptr = tmp;
-   	sz = max;
-   	return 0;
-	}
+   if (max <= sz && owner) return 0;
+   unsigned int grow = sz + (sz >> 1);
+   if (grow > max && grow > sz) max = grow;
+   if (max <= 0xFFFFFFFF - BLOCK_SIZE) {
+      max = (max + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);   //round up to next BLOCK_SIZE
+   }
+   unsigned char *tmp;
+   if (owner) {
+      tmp = (unsigned char *)realloc(bptr, max);
+   }
+   else if ((tmp = (unsigned char *)malloc(max)) != NULL) {
+      //first write to a view, take our own copy of the blob
+      memcpy(tmp, bptr, wptr);
+      owner = true;
+   }
+   if (tmp) {
+      bptr = tmp;
+      sz = max;
+      return 0;
+   }
    error = true;
-	return 1;
+   return 1;
 }
 
 unsigned int Buffer::getVersion() {
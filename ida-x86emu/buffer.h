@@ -25,16 +25,31 @@
 #define BUFFER_MAGIC_MASK 0xFFFFF000
 #define VERSION(n) (BUFFER_MAGIC | n)
 
+/*
+ * Serialization buffer for the saved state.  Writes append, growing the
+ * buffer geometrically so saving a large heap stays linear.  Reads walk
+ * the contents from the front.  A Buffer built over a blob with
+ * copy == false is a view that parses the blob in place, the blob must
+ * outlive it.  Writing to a view gives it a private copy first.
+ */
 class Buffer {
 public:
    Buffer();
    Buffer(unsigned int magic);
-   Buffer(unsigned char *buf, unsigned int len);
+   Buffer(unsigned char *buf, unsigned int len, bool copy = true);
    ~Buffer();
    
    int read(void *data, unsigned int len);
    bool rewind(unsigned int amt);
    int write(void *data, unsigned int len);
+
+   //the next len bytes in place, NULL and an error if there are not that many
+   const unsigned char *read_view(unsigned int len);
+   //len bytes at the end for the caller to fill, NULL if we can't grow
+   unsigned char *write_view(unsigned int len);
+   //hand the contents over to the caller, who frees them once done with
+   //them and this Buffer, which becomes a view.  NULL for a view.
+   unsigned char *detach();
    
    unsigned char *get_buf();
    unsigned int get_wlen();
@@ -42,6 +57,8 @@ public:
    bool has_error() {return error;};
    void reset_error() {error = false;};
    unsigned int getMagic() {return magic;};
+   //parse as this version, for a section taken out of a larger blob
+   void setMagic(unsigned int m) {magic = m;};
    unsigned int getVersion();
 
 private:
@@ -55,6 +72,7 @@ private:
    unsigned int wptr;
    unsigned int sz;
    bool error;
+   bool owner;    //false for a view over someone else's blob
 };
 
 #endif
@@ -19,14 +19,17 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <malloc.h>
 
+#include "host.h"
 #include "cpu.h"
 #include "hooklist.h"
 #include "emufuncs.h"
 #include "seh.h"
-
-#include "../idastruct/idastruct.h"
+#include "pack.h"
+#include "events.h"
+#include "memo.h"
 
 //masks to clear out bytes appropriate to the sizes above
 dword SIZE_MASKS[] = {0, 0x000000FF, 0x0000FFFF, 0, 0xFFFFFFFF};
@@ -75,6 +78,10 @@ DescriptorTableReg gdtr;
 DescriptorTableReg idtr;
 static uquad tsc; //timestamp counter
 
+//data reads and writes made through readMem/writeMem and the block
+//versions, instruction fetches are not counted
+uquad memoryOps;
+
 static uint segmentBase;   //base address for next memory operation
 
 dword seg3_map[] = {3, 0, 1, 2, 4, 5, 0, 0};
@@ -90,7 +97,6 @@ static dword prefix;  //any prefix flags
 static byte opcode;   //opcode, first or second byte (if first == 0x0F)
 
 dword gpaSavePoint = 0xFFFFFFFF;
-static bool makeImport = false;
 
 IntrRecord *intrList = NULL;
 
@@ -116,15 +122,136 @@ void initIDTR() {
    }
 }
 
-#ifdef __IDP__
+/*
+ * From VERSION(4) each part of the state after the registers is kept
+ * as a section: a method byte, the unpacked length, the stored length
+ * and then the stored bytes.  Sections are packed (see pack.h) unless
+ * compressState is off or packing doesn't make them any smaller.
+ */
+#define SECTION_RAW    0
+#define SECTION_PACKED 1
+
+bool compressState = true;
+
+static bool writeSection(Buffer &b, Buffer &s) {
+   unsigned char method = SECTION_RAW;
+   unsigned int raw = s.get_wlen();
+   unsigned int stored = raw;
+   unsigned char *data = s.get_buf();
+   unsigned char *packed = NULL;
+   if (compressState && raw) {
+      packed = (unsigned char*)malloc(packBound(raw));
+      if (packed) {
+         unsigned int len = pack(data, raw, packed);
+         if (len < raw) {
+            method = SECTION_PACKED;
+            stored = len;
+            data = packed;
+         }
+      }
+   }
+   b.write(&method, sizeof(method));
+   b.write(&raw, sizeof(raw));
+   b.write(&stored, sizeof(stored));
+   b.write(data, stored);
+   free(packed);
+   return !s.has_error();
+}
+
+//the next section unpacked into a Buffer that parses as b's version,
+//NULL if it is damaged
+static Buffer *readSection(Buffer &b) {
+   unsigned char method = 0xFF;
+   unsigned int raw = 0, stored = 0;
+   b.read(&method, sizeof(method));
+   b.read(&raw, sizeof(raw));
+   b.read(&stored, sizeof(stored));
+   const unsigned char *data = b.read_view(stored);
+   if (data == NULL) return NULL;
+   Buffer *s = new Buffer();
+   unsigned char *dest = s->write_view(raw);
+   bool ok = false;
+   if (dest && method == SECTION_RAW && stored == raw) {
+      memcpy(dest, data, raw);
+      ok = true;
+   }
+   else if (dest && method == SECTION_PACKED) {
+      ok = unpack(data, stored, dest, raw);
+   }
+   if (!ok) {
+      delete s;
+      return NULL;
+   }
+   s->setMagic(b.getMagic());
+   return s;
+}
+
+//bumped by every save and load, tells saveState(netnode&) whether the
+//changes being tracked are relative to what is in the database
+static unsigned int stateSerial;
+
+static void saveSection(Buffer &b, int section, bool delta) {
+   switch (section) {
+      case STATE_MEMORY:
+         if (delta) {
+            mm->saveDelta(b, esp);
+         }
+         else {
+            mm->save(b, esp);
+         }
+         break;
+/* VERSION(0)   
+   saveHookList(b);
+   saveModuleList(b);
+*/
+      //>= VERSION(1)
+      case STATE_HOOKS:
+         saveHookList(b);
+         break;
+      case STATE_MODULES:
+         saveModuleList(b);
+         break;
+      case STATE_SEH:
+         saveSEHState(b);
+         break;
+   }
+}
 
-int saveState(netnode &f) {
-   unsigned char *buf = NULL;
-   dword sz;
-//   Buffer b(CPU_VERSION);
-   Buffer b;
+static bool loadSection(Buffer &b, int section, bool delta, HeapImage *image) {
+   switch (section) {
+      case STATE_MEMORY:
+         if (delta) {
+            return mm != NULL && mm->loadDelta(b);
+         }
+         mm = new MemoryManager(b, image);
+         break;
+      case STATE_HOOKS:
+         loadHookList(b);
+         break;
+/*
+   if (b.getVersion() == 0) {
+      Buffer *r = getHookListBlob(b);
+//      loadHookList(b);           //this needs to happen after modules have been loaded in new scheme
+      loadModuleList(b);
+      loadHookList(*r);
+      delete r;
+   }
+   else {
+      loadModuleList(b);
+      loadHookList(b);
+   }
+*/
+      case STATE_MODULES:
+         loadModuleList(b);
+         break;
+      case STATE_SEH:
+         loadSEHState(b);
+         break;
+   }
+   return true;
+}
 
-   //need to start writing version magic as first 4 bytes
+void saveRegisters(Buffer &b) {
    b.write((char*)debug_regs, sizeof(debug_regs));
    b.write((char*)general, sizeof(general));
    b.write((char*)&initial_eip, sizeof(initial_eip));
@@ -137,19 +264,154 @@ int saveState(netnode &f) {
    b.write((char*)&idtr, sizeof(idtr));
    b.write((char*)&tsc, sizeof(tsc));
    b.write((char*)&gpaSavePoint, sizeof(gpaSavePoint));
-   mm->save(b, esp);
+}
 
-/* VERSION(0)   
-   saveHookList(b);
-   saveModuleList(b);
-*/
-   //>= VERSION(1)
-   saveHookList(b);
-   saveModuleList(b);
+void loadRegisters(Buffer &b) {
+   b.read((char*)debug_regs, sizeof(debug_regs));
+   b.read((char*)general, sizeof(general));
+   b.read((char*)&initial_eip, sizeof(initial_eip));
+   b.read((char*)&eip, sizeof(eip));
+   b.read((char*)&eflags, sizeof(eflags));
+   b.read((char*)&control, sizeof(control));
+   b.read((char*)segBase, sizeof(segBase));
+   b.read((char*)segReg, sizeof(segReg));
+   b.read((char*)&gdtr, sizeof(gdtr));
+   b.read((char*)&idtr, sizeof(idtr));
+   b.read((char*)&tsc, sizeof(tsc));
+   b.read((char*)&gpaSavePoint, sizeof(gpaSavePoint));
+}
 
-   saveSEHState(b);
-   
-   if (!b.has_error()) {
+void stateLoaded() {
+   if (idtr.base == 0) {
+      initIDTR();
+   }
+   mm->markClean(esp);
+   stateSerial++;
+   clearCallMemo();
+}
+
+static int saveStateParts(Buffer &b, unsigned int *sections, bool delta) {
+   bool ok = true;
+   if (sections) sections[STATE_CPU] = b.get_wlen();
+   saveRegisters(b);
+   for (int i = STATE_MEMORY; i < STATE_END; i++) {
+      if (sections) sections[i] = b.get_wlen();
+      if (b.getVersion() >= 4) {
+         Buffer s;
+         saveSection(s, i, delta);
+         ok = writeSection(b, s) && ok;
+      }
+      else {
+         saveSection(b, i, delta);
+      }
+   }
+   if (sections) sections[STATE_END] = b.get_wlen();
+
+   if (ok && !b.has_error()) {
+      mm->markClean(esp);
+      stateSerial++;
+      return X86EMUSAVE_OK;
+   }
+   return X86EMUSAVE_FAILED;
+}
+
+static int loadStateParts(Buffer &b, bool delta) {
+   //Buffer consumes any version magic, stages depend on b.getVersion()
+   loadRegisters(b);
+   bool ok = true;
+   for (int i = STATE_MEMORY; i < STATE_END; i++) {
+      if (b.getVersion() >= 4) {
+         Buffer *s = readSection(b);
+         if (s == NULL) {
+            //nothing sensible can be built from a damaged section
+            ok = false;
+            break;
+         }
+         //heap blocks are read from the section until they are written,
+         //so only the blocks the program writes to are ever copied
+         unsigned char *data = (i == STATE_MEMORY && !delta) ? s->detach() : NULL;
+         HeapImage *image = data ? new HeapImage(data) : NULL;
+         ok = loadSection(*s, i, delta, image) && !s->has_error();
+         delete s;
+         if (image) image->release();
+         if (!ok) break;
+      }
+      else if (!loadSection(b, i, delta, NULL)) {
+         ok = false;
+         break;
+      }
+   }
+
+   if (ok && !b.has_error()) {
+      stateLoaded();
+      return X86EMULOAD_OK;
+   }
+   return X86EMULOAD_CORRUPT;
+}
+
+int saveState(Buffer &b, unsigned int *sections) {
+   return saveStateParts(b, sections, false);
+}
+
+int loadState(Buffer &b) {
+   return loadStateParts(b, false);
+}
+
+int saveStateDelta(Buffer &b, unsigned int *sections) {
+   return saveStateParts(b, sections, true);
+}
+
+int loadStateDelta(Buffer &b) {
+   return loadStateParts(b, true);
+}
+
+#ifdef __IDP__
+
+/*
+ * The node holds a full state in the 'B' blob followed by up to
+ * MAX_STATE_DELTAS deltas, delta i starting at supval i * DELTA_STRIDE
+ * of the 'D' blobs.  Loading applies them in order.  A save only adds
+ * a delta if memory still matches what the node holds, otherwise, or
+ * once the deltas get long or add up to half the base, the whole state
+ * is written as a new base.
+ */
+#define DELTA_TAG 'D'
+#define DELTA_STRIDE 0x100000
+#define MAX_STATE_DELTAS 16
+
+//altvals of the state node
+#define ALT_DELTAS     0
+#define ALT_BASE_SIZE  1
+#define ALT_DELTA_SIZE 2   //all of the deltas together
+
+static unsigned int nodeSerial;   //stateSerial when memory matched the node
+
+int saveState(netnode &f) {
+   unsigned char *buf = NULL;
+   dword sz;
+   dword deltas = f.altval(ALT_DELTAS);
+   dword baseSize = f.altval(ALT_BASE_SIZE);
+   dword deltaSize = f.altval(ALT_DELTA_SIZE);
+   Buffer b(CPU_VERSION);
+
+   if (nodeSerial == stateSerial && baseSize && deltas < MAX_STATE_DELTAS &&
+       deltaSize < baseSize / 2) {
+      if (saveStateDelta(b) != X86EMUSAVE_OK) return X86EMUSAVE_FAILED;
+      deltas++;
+      f.delblob(deltas * DELTA_STRIDE, DELTA_TAG);
+      f.setblob(b.get_buf(), b.get_wlen(), deltas * DELTA_STRIDE, DELTA_TAG);
+      f.altset(ALT_DELTA_SIZE, deltaSize + b.get_wlen());
+      f.altset(ALT_DELTAS, deltas);
+      nodeSerial = stateSerial;
+      return X86EMUSAVE_OK;
+   }
+
+   if (saveState(b) == X86EMUSAVE_OK) {
+      //drop the deltas first, they can't be applied to the new base
+      f.altset(ALT_DELTAS, 0);
+      for (dword i = 1; i <= deltas; i++) {
+         f.delblob(i * DELTA_STRIDE, DELTA_TAG);
+      }
    //
       // Delete any previous blob data in the IDA database node.
       //
@@ -171,6 +433,9 @@ int saveState(netnode &f) {
       }
 */
       f.setblob(buf, sz, 0, 'B');
+      f.altset(ALT_BASE_SIZE, sz);
+      f.altset(ALT_DELTA_SIZE, 0);
+      nodeSerial = stateSerial;
       return X86EMUSAVE_OK;
    }
    else {
@@ -193,48 +458,22 @@ int loadState(netnode &f) {
       msg("\n");
    }
 */
-   Buffer b(buf, sz);
-   //need to read version magic as first 4 bytes and skip stages depending on version
-   b.read((char*)debug_regs, sizeof(debug_regs));
-   b.read((char*)general, sizeof(general));
-   b.read((char*)&initial_eip, sizeof(initial_eip));
-   b.read((char*)&eip, sizeof(eip));
-   b.read((char*)&eflags, sizeof(eflags));
-   b.read((char*)&control, sizeof(control));
-   b.read((char*)segBase, sizeof(segBase));
-   b.read((char*)segReg, sizeof(segReg));
-   b.read((char*)&gdtr, sizeof(gdtr));
-   b.read((char*)&idtr, sizeof(idtr));
-   b.read((char*)&tsc, sizeof(tsc));
-   b.read((char*)&gpaSavePoint, sizeof(gpaSavePoint));
-   mm = new MemoryManager(b);
-
-   loadHookList(b);
-   loadModuleList(b);
-
-/*
-   if (b.getVersion() == 0) {
-      Buffer *r = getHookListBlob(b);
-//      loadHookList(b);           //this needs to happen after modules have been loaded in new scheme
-      loadModuleList(b);
-      loadHookList(*r);
-      delete r;
+   //parse the blob where it is rather than copying it first
+   Buffer b(buf, sz, false);
+   int result = loadState(b);
+   qfree(buf);
+   dword deltas = f.altval(ALT_DELTAS);
+   for (dword i = 1; result == X86EMULOAD_OK && i <= deltas; i++) {
+      buf = (unsigned char *)f.getblob(NULL, &sz, i * DELTA_STRIDE, DELTA_TAG);
+      if (buf == NULL) return X86EMULOAD_CORRUPT;
+      Buffer d(buf, sz, false);
+      result = loadStateDelta(d);
+      qfree(buf);
    }
-   else {
-      loadModuleList(b);
-      loadHookList(b);
+   if (result == X86EMULOAD_OK) {
+      nodeSerial = stateSerial;
    }
-*/
-
-   loadSEHState(b);
-
-   qfree(buf);
-   
-   if (!b.has_error() && idtr.base == 0) {
-      initIDTR();
-   }   
-
-   return b.has_error() ? X86EMULOAD_CORRUPT : X86EMULOAD_OK;
+   return result;
 }
 
 #endif
@@ -248,6 +487,8 @@ void resetCpu() {
    cs = 0xF000;  //base = 0xFFFF0000, limit = 0xFFFF
    cr0 = 0x60000010;
    tsc = 0;
+   memoryOps = 0;
+   clearCallMemo();
    //need to clear the heap in here as well then allocate a new idt
 }
 
@@ -302,8 +543,8 @@ dword readDword(dword addr) {
    return result | readWord(addr);
 }
 
-//all reads from memory should be through this function
-dword readMem(dword addr, byte size) {
+//readMem without the count, for instruction fetches
+static dword readUncounted(dword addr, byte size) {
    int result = 0;
    addr += segmentBase;
    switch (size) {
@@ -320,6 +561,17 @@ dword readMem(dword addr, byte size) {
    return result;
 }
 
+//all reads from memory should be through this function
+dword readMem(dword addr, byte size) {
+   memoryOps++;
+   dword result = readUncounted(addr, size);
+   if (eventMask & EVENT_BIT(EV_MEM_READ)) {
+      raiseMemEvent(EV_MEM_READ, addr + segmentBase, size, result);
+   }
+   if (memoRecording) memoRead(addr + segmentBase, &result, size);
+   return result;
+}
+
 //store a byte
 void writeByte(dword addr, byte val) {
    mm->writeByte(addr, val);
@@ -333,14 +585,18 @@ void writeWord(dword addr, word val) {
 }
 
 void writeDword(dword addr, dword val) {
-   if (makeImport) makeImportLabel(addr);
    writeWord(addr, (word)val);
    writeWord(addr + 2, (word)(val >> 16));
 }
 
 //all writes to memory should be through this function
 void writeMem(dword addr, dword val, byte size) {
+   memoryOps++;
    addr += segmentBase;
+   if (eventMask & EVENT_BIT(EV_MEM_WRITE)) {
+      raiseMemEvent(EV_MEM_WRITE, addr, size, val & SIZE_MASKS[size]);
+   }
+   if (memoRecording) memoWrite(addr, &val, size);
    switch (size) {
       case SIZE_BYTE:
          writeByte(addr, (byte)val);
@@ -354,6 +610,19 @@ void writeMem(dword addr, dword val, byte size) {
    }
 }
 
+//bulk versions of readMem/writeMem
+void readBlock(dword addr, void *buf, dword len) {
+   memoryOps++;
+   mm->readBlock(addr + segmentBase, buf, len);
+   if (memoRecording) memoRead(addr + segmentBase, buf, len);
+}
+
+void writeBlock(dword addr, const void *buf, dword len) {
+   memoryOps++;
+   mm->writeBlock(addr + segmentBase, buf, len);
+   if (memoRecording) memoWrite(addr + segmentBase, buf, len);
+}
+
 void push(dword val, byte size) {
    segmentBase = ssBase;
    esp -= size;
@@ -378,6 +647,7 @@ void doInterruptReturn() {
       IntrRecord *temp = intrList;
       intrList = intrList->next;
       free(temp);
+      if (eventMask & EVENT_BIT(EV_RETURN)) raiseEvent(EV_RETURN, eip);
    }  //else no interrupts to return from!
 }
 
@@ -386,6 +656,7 @@ void initiateInterrupt(dword interrupt_number, dword saved_eip) {
    //need to pick segment reg value out of table as well
    dword handler = readMem(table, SIZE_WORD);
    handler |= (readMem(table + 6, SIZE_WORD) << 16);
+   if (memoRecording) memoAbort();
    msg("Initiating INT %d processing w/ handler %x\n", interrupt_number, handler);
    push(eflags, SIZE_DWORD);
    push(cs, SIZE_DWORD);
@@ -394,6 +665,9 @@ void initiateInterrupt(dword interrupt_number, dword saved_eip) {
    //need to keep track of nested interrupts so that we know whether to 
    //pop off the error code during the associated iret
    eip = handler;
+   if (eventMask & EVENT_BIT(EV_INTERRUPT)) {
+      raiseEvent(EV_INTERRUPT, handler, interrupt_number);
+   }
    IntrRecord *temp = (IntrRecord*) calloc(1, sizeof(IntrRecord));
    temp->next = intrList;
    intrList = temp;
@@ -405,7 +679,7 @@ void initiateInterrupt(dword interrupt_number, dword saved_eip) {
 //read according to specified n from eip location 
 dword fetch(byte n) {
 //   segmentBase = csBase;
-   dword result = readMem(eip, n);
+   dword result = readUncounted(eip, n);
    eip += n;
    return result;
 }
@@ -897,13 +1171,16 @@ void dShift() {
 }
 
 void doCall(dword addr) {
+   if (eventMask & EVENT_BIT(EV_CALL)) raiseEvent(EV_CALL, addr, 0, eip);
    hookfunc hook = findHook(addr);
 //   hookfunc hook = findHook(instStart);
    if (hook) {
+      if (memoRecording) memoAbort();
       (*hook)(mm, addr);
    }
    else if (isModuleAddress(addr)) {
       //this function is in a loaded module
+      if (memoRecording) memoAbort();
       char *name = reverseLookupExport(addr);
       if (name) {
          (*checkForHook(name, addr, 0))(mm, addr);
@@ -914,7 +1191,9 @@ void doCall(dword addr) {
    }
    else {
       push(eip, SIZE_DWORD);
+      dword retAddr = eip;
       eip = addr;
+      if (memoOn) tsc += memoCall(retAddr);
    }
 }
                                
@@ -1327,8 +1606,13 @@ int doSeven() {
          branch = G;
          break;
    }
+   dword next = eip;
+   dword target = eip + ((opsize == SIZE_BYTE) ? sebd(imm) : imm);
    if (branch) {
-      eip += (opsize == SIZE_BYTE) ? sebd(imm) : imm;
+      eip = target;
+   }
+   if (eventMask & EVENT_BIT(EV_BRANCH)) {
+      raiseEvent(EV_BRANCH, eip, branch ? 1 : 0, branch ? next : target);
    }
    return 1;
 }
@@ -1673,9 +1957,13 @@ int doTwelve() {
          delta = fetchu(SIZE_WORD);
          eip = pop(SIZE_DWORD);
          esp += delta;
+         if (memoRecording) memoReturn();
+         if (eventMask & EVENT_BIT(EV_RETURN)) raiseEvent(EV_RETURN, eip);
          break;
       case 3: //RETN
          eip = pop(SIZE_DWORD);
+         if (memoRecording) memoReturn();
+         if (eventMask & EVENT_BIT(EV_RETURN)) raiseEvent(EV_RETURN, eip);
          if (eip == SEH_MAGIC) {
             sehReturn();
          }
@@ -2094,6 +2382,7 @@ int doEscape() {
          break;
       case 0x30: //
          if (opcode == 0x31) { //RDTSC
+            if (memoRecording) memoAbort();
             edx = (dword) (tsc >> 32);
             eax = (dword) tsc;
          }
@@ -2165,6 +2454,7 @@ int executeInstruction() {
    segmentBase = csBase;
    instStart = csBase + eip;
    initial_eip = eip;
+   if (memoRecording) memoStep();
    //test breakpoint conditions here
    if (dr7 & 0x155) {  //minimal Dr enabled
       if (((dr7 & 1) && (eip == dr0)) ||
@@ -2178,11 +2468,7 @@ int executeInstruction() {
       }
    }
 
-   if(strace)
-
-	   struct_trace(eip);
-
-   makeImport = eip == gpaSavePoint;
+   if (eventMask & EVENT_BIT(EV_INSTRUCTION)) raiseEvent(EV_INSTRUCTION, eip);
 //msg("begin instruction, eip: 0x%x\n", eip);
    while (!done) {
       opcode = fetchu(SIZE_BYTE);
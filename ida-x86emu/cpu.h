@@ -23,7 +23,10 @@
 #include "x86defs.h"
 #include "memmgr.h"
 
-#define CPU_VERSION VERSION(1)
+//2 adds the mapped file list after the heaps
+//3 adds the base of each module we loaded ourselves
+//4 keeps everything after the registers in sections that may be packed
+#define CPU_VERSION VERSION(4)
 
 typedef struct _DescriptorTableReg_t {
    dword base;
@@ -54,6 +57,11 @@ extern byte BITS[5];
 
 extern dword gpaSavePoint;
 
+extern uquad memoryOps;
+
+//pack the sections of saved state, on by default
+extern bool compressState;
+
 extern MemoryManager *mm;
 
 typedef struct _IntrRecord_t {
@@ -96,10 +104,36 @@ dword pop(byte size);
 dword readDword(dword addr);
 void writeMem(dword addr, dword val, byte size);
 dword readMem(dword addr, byte size);
+void readBlock(dword addr, void *buf, dword len);
+void writeBlock(dword addr, const void *buf, dword len);
 
 int executeInstruction();
 void doInterruptReturn();
 
+//parts of the saved state, saveState can record where each one starts
+#define STATE_CPU      0
+#define STATE_MEMORY   1   //stack, heaps and mapped files
+#define STATE_HOOKS    2
+#define STATE_MODULES  3
+#define STATE_SEH      4
+#define STATE_END      5   //total length
+#define STATE_SECTIONS 6
+
+//the whole emulator state to or from a blob, b should start out as
+//Buffer(CPU_VERSION) for saving.  loadState replaces mm.
+int saveState(Buffer &b, unsigned int *sections = NULL);
+int loadState(Buffer &b);
+//only what changed since the last save or load of either kind, applied
+//over the state in memory, which has to be that same state
+int saveStateDelta(Buffer &b, unsigned int *sections = NULL);
+int loadStateDelta(Buffer &b);
+
+//the registers alone, the STATE_CPU part of a saved state
+void saveRegisters(Buffer &b);
+void loadRegisters(Buffer &b);
+//finish off a state that was put together by hand, mm must be in place
+void stateLoaded();
+
 #ifdef __IDP__
 
 int saveState(netnode &f);
@@ -29,18 +29,27 @@
 #include "emufuncs.h"
 #include "memmgr.h"
 #include "hooklist.h"
+#include "hookargs.h"
+#include "peloader.h"
+#include "events.h"
+#include "stubs.h"
 
 #include <kernwin.hpp>
 #include <bytes.hpp>
 #include <name.hpp>
-
-#include "../idastruct/idastruct.h"
+#include <typinf.hpp>
 
 
 #define FAKE_HANDLE_BASE 0x80000000
 
 extern ea_t loaded_base;
-extern HWND x86Dlg;
+
+//one named export, kept sorted by address for reverse lookups
+struct ExportEntry {
+   dword addr;
+   dword ord;   //index into the EAT, lowest wins for aliased functions
+   char *name;
+};
 
 struct HandleList {
    char *handleName;
@@ -52,11 +61,19 @@ struct HandleList {
    dword *eat; // AddressOfFunctions  export address table
    dword *ent; // AddressOfNames      export name table
    word *eot;  // AddressOfNameOrdinals  export ordinal table
+   ExportEntry *exports;  //named exports sorted by address
+   dword numExports;
+   PEImage *image;   //loaded into emulated memory by us, NULL for host modules
    HandleList *next;
 };
 
 static HandleList *moduleHead = NULL;
 
+//loaded modules sorted by base address, for address to module lookups
+static HandleList **moduleIndex = NULL;
+static dword moduleCount = 0;
+static dword moduleIndexSize = 0;
+
 //stick dummy values up in kernel space to distinguish them from
 //actual library handles
 static dword moduleHandle = FAKE_HANDLE_BASE;    
@@ -64,6 +81,9 @@ static dword moduleHandle = FAKE_HANDLE_BASE;
 //persistant module identifier
 static dword moduleId = 1;
 
+//';' separated directories to load DLLs from, NULL to use the host loader
+char *emu_dllPath = NULL;
+
 typedef enum {R_FAKE = -1, R_NO = 0, R_YES = 1} Reply;
 
 int emu_alwaysLoadLibrary = ASK;
@@ -72,21 +92,48 @@ int emu_alwaysGetModuleHandle = ASK;
 HookEntry hookTable[] = {
    {"VirtualAlloc", emu_VirtualAlloc},
    {"VirtualFree", emu_VirtualFree},
-   {"LocalAlloc", emu_LocalAlloc},
-   {"LocalFree", emu_LocalFree},
+   {"LocalAlloc", hook2<HOOK_STDCALL, dword, dword, native_LocalAlloc>},
+   {"LocalFree", hook1<HOOK_STDCALL, dword, native_LocalFree>},
    {"GetProcAddress", emu_GetProcAddress},
    {"GetModuleHandle", emu_GetModuleHandle},
    {"LoadLibrary", emu_LoadLibrary},
    {"LoadLibraryA", emu_LoadLibrary},
-   {"HeapCreate", emu_HeapCreate},
-   {"HeapDestroy", emu_HeapDestroy},
-   {"HeapAlloc", emu_HeapAlloc},
-   {"HeapFree", emu_HeapFree},
-   {"GetProcessHeap", emu_GetProcessHeap},
+   {"HeapCreate", hook3<HOOK_STDCALL, dword, dword, dword, native_HeapCreate>},
+   {"HeapDestroy", hook1<HOOK_STDCALL, dword, native_HeapDestroy>},
+   {"HeapAlloc", hook3<HOOK_STDCALL, dword, dword, dword, native_HeapAlloc>},
+   {"HeapFree", hook3<HOOK_STDCALL, dword, dword, dword, native_HeapFree>},
+   {"GetProcessHeap", hook0<HOOK_STDCALL, native_GetProcessHeap>},
    {"malloc", emu_malloc},
    {"calloc", emu_calloc},
    {"realloc", emu_realloc},
    {"free", emu_free},
+   {"memcpy", hook3<HOOK_CDECL, dword, dword, dword, native_memmove>},
+   {"memmove", hook3<HOOK_CDECL, dword, dword, dword, native_memmove>},
+   {"memset", hook3<HOOK_CDECL, dword, unsigned char, dword, native_memset>},
+   {"memcmp", hook3<HOOK_CDECL, dword, dword, dword, native_memcmp>},
+   {"memchr", hook3<HOOK_CDECL, dword, unsigned char, dword, native_memchr>},
+   {"strlen", hook1<HOOK_CDECL, dword, native_strlen>},
+   {"strcpy", hook2<HOOK_CDECL, dword, dword, native_strcpy>},
+   {"strncpy", hook3<HOOK_CDECL, dword, dword, dword, native_strncpy>},
+   {"strcat", hook2<HOOK_CDECL, dword, dword, native_strcat>},
+   {"strcmp", hook2<HOOK_CDECL, dword, dword, native_strcmp>},
+   {"strncmp", hook3<HOOK_CDECL, dword, dword, dword, native_strncmp>},
+   {"strchr", hook2<HOOK_CDECL, dword, unsigned char, native_strchr>},
+   {"wcslen", hook1<HOOK_CDECL, dword, native_wcslen>},
+   {"wcscpy", hook2<HOOK_CDECL, dword, dword, native_wcscpy>},
+   {"wcscat", hook2<HOOK_CDECL, dword, dword, native_wcscat>},
+   {"lstrlen", hook1<HOOK_STDCALL, dword, native_strlen>},
+   {"lstrlenA", hook1<HOOK_STDCALL, dword, native_strlen>},
+   {"lstrlenW", hook1<HOOK_STDCALL, dword, native_wcslen>},
+   {"lstrcpy", hook2<HOOK_STDCALL, dword, dword, native_strcpy>},
+   {"lstrcpyA", hook2<HOOK_STDCALL, dword, dword, native_strcpy>},
+   {"lstrcpyW", hook2<HOOK_STDCALL, dword, dword, native_wcscpy>},
+   {"lstrcat", hook2<HOOK_STDCALL, dword, dword, native_strcat>},
+   {"lstrcatA", hook2<HOOK_STDCALL, dword, dword, native_strcat>},
+   {"lstrcatW", hook2<HOOK_STDCALL, dword, dword, native_wcscat>},
+   {"RtlMoveMemory", hook3<HOOK_STDCALL, dword, dword, dword, native_RtlMoveMemory>},
+   {"RtlZeroMemory", hook2<HOOK_STDCALL, dword, dword, native_RtlZeroMemory>},
+   {"RtlFillMemory", hook3<HOOK_STDCALL, dword, dword, unsigned char, native_RtlFillMemory>},
    {NULL, NULL}
 };
 
@@ -125,8 +172,55 @@ IMAGE_NT_HEADERS *getPEHeader(HMODULE mod) {
    return pe;
 }
 
+static int compareExports(const void *a, const void *b) {
+   const ExportEntry *ea = (const ExportEntry*)a;
+   const ExportEntry *eb = (const ExportEntry*)b;
+   if (ea->addr != eb->addr) return ea->addr < eb->addr ? -1 : 1;
+   if (ea->ord != eb->ord) return ea->ord < eb->ord ? -1 : 1;
+   return ea->name < eb->name ? -1 : (ea->name > eb->name ? 1 : 0);
+}
+
+//build the address sorted export index for a module
+static void indexExports(HandleList *m) {
+   m->exports = (ExportEntry*) malloc(m->NoN * sizeof(ExportEntry));
+   if (m->exports == NULL) return;
+   for (dword i = 0; i < m->NoN; i++) {
+      if (m->eot[i] >= m->NoF) continue;
+      ExportEntry *e = m->exports + m->numExports++;
+      e->ord = m->eot[i];
+      e->addr = m->eat[e->ord] + m->handle;
+      e->name = (char*)(m->ent[i] + m->handle);
+   }
+   qsort(m->exports, m->numExports, sizeof(ExportEntry), compareExports);
+}
+
+static void indexModule(HandleList *m) {
+   if (moduleCount == moduleIndexSize) {
+      dword size = moduleIndexSize ? moduleIndexSize * 2 : 16;
+      HandleList **p = (HandleList**) realloc(moduleIndex, size * sizeof(HandleList*));
+      if (p == NULL) return;
+      moduleIndex = p;
+      moduleIndexSize = size;
+   }
+   dword i = moduleCount++;
+   for (; i > 0 && moduleIndex[i - 1]->handle > m->handle; i--) {
+      moduleIndex[i] = moduleIndex[i - 1];
+   }
+   moduleIndex[i] = m;
+}
+
+static HandleList *addImage(char *mod, int id, dword base);
+
 HandleList *addModule(char *mod, int id) {
    HMODULE h;
+   if (id == 0 && emu_dllPath) {
+      //new modules come from the DLL directory when there is one, the
+      //host's own copies are never mixed in with them
+      HandleList *m = addImage(mod, 0, 0);
+      if (m) return m;
+      msg("x86emu: %s is not in the DLL path, faking it\n", mod);
+      id = FAKE_HANDLE_BASE | moduleId++;
+   }
    if ((id & FAKE_HANDLE_BASE) != 0) {
       h = (HMODULE)id;
    }
@@ -149,28 +243,26 @@ HandleList *addModule(char *mod, int id) {
       m->handleName = _strdup(mod);
       m->handle = (dword) h;
       m->id = id ? (id & ~FAKE_HANDLE_BASE) : moduleId++;
-      if ((id & FAKE_HANDLE_BASE) == 0) {
-#ifdef CYGWIN         
-         MODULEINFO mi;
-         if (GetModuleInformation(GetCurrentProcess(), h, &mi, sizeof(mi))) {
-            m->maxAddr = mi.SizeOfImage + (dword) h;
-         }
-#else
-         //Microsoft does not see fit to include psapi.h and psapi.lib with Visual Studio
-         //You will need the Platform SDK to get access to it, so here is a kludge fix
-         m->maxAddr = FAKE_HANDLE_BASE;
-#endif
+      if ((m->handle & FAKE_HANDLE_BASE) == 0) {
          IMAGE_NT_HEADERS *pe = getPEHeader(h);
          if (pe) {
-            DWORD export_dir = pe->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress + m->handle;
-  
-            IMAGE_EXPORT_DIRECTORY *ed = (IMAGE_EXPORT_DIRECTORY*) export_dir;
-            m->NoF = ed->NumberOfFunctions;
-            m->NoN = ed->NumberOfNames;
+            //the image size in the PE header is what psapi would report
+            m->maxAddr = pe->OptionalHeader.SizeOfImage + m->handle;
+            DWORD export_rva = pe->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress;
+            if (export_rva) {
+               IMAGE_EXPORT_DIRECTORY *ed = (IMAGE_EXPORT_DIRECTORY*) (export_rva + m->handle);
+               m->NoF = ed->NumberOfFunctions;
+               m->NoN = ed->NumberOfNames;
    
-            m->eat = (dword*)(ed->AddressOfFunctions + m->handle);
-            m->ent = (dword*)(ed->AddressOfNames + m->handle);
-            m->eot = (word*)(ed->AddressOfNameOrdinals + m->handle);
+               m->eat = (dword*)(ed->AddressOfFunctions + m->handle);
+               m->ent = (dword*)(ed->AddressOfNames + m->handle);
+               m->eot = (word*)(ed->AddressOfNameOrdinals + m->handle);
+               indexExports(m);
+            }
+         }
+         if (m->maxAddr > m->handle) {
+            addressSpace.add(m->handle, m->maxAddr - m->handle, AS_MODULE, AS_READ | AS_EXEC, m);
+            indexModule(m);
          }
       }
    }
@@ -180,9 +272,15 @@ HandleList *addModule(char *mod, int id) {
 void freeModuleList() {
    for (HandleList *p = moduleHead; p; moduleHead = p) {
       p = p->next;
+      if (moduleHead->maxAddr > moduleHead->handle) {
+         addressSpace.remove(moduleHead->handle, moduleHead->maxAddr - moduleHead->handle, moduleHead);
+      }
       free(moduleHead->handleName);
+      free(moduleHead->exports);
+      delete moduleHead->image;
       free(moduleHead);
    }
+   moduleCount = 0;
    moduleHandle = FAKE_HANDLE_BASE;
 }
 
@@ -201,7 +299,7 @@ void loadModuleList(Buffer &b) {
       m->handleName = (char*) malloc(len);
       b.read((char*)m->handleName, len);
 */
-      dword id, tempid;
+      dword id, tempid, base = 0;
       char *name;
       b.read((char*)&id, sizeof(id));
       tempid = id & ~FAKE_HANDLE_BASE;
@@ -209,7 +307,11 @@ void loadModuleList(Buffer &b) {
       b.read((char*)&len, sizeof(len));
       name = (char*) malloc(len);
       b.read((char*)name, len);
-      HandleList *m = addModule(name, id);
+      if (b.getVersion() >= 3) {
+         b.read((char*)&base, sizeof(base));
+      }
+      //images came back with the mapped files, just pick them up again
+      HandleList *m = base ? addImage(name, id, base) : addModule(name, id);
       free(name);
    }
 }
@@ -224,6 +326,8 @@ void saveModuleList(Buffer &b) {
       len = strlen(m->handleName) + 1; //save terminating null
       b.write((char*)&len, sizeof(len));
       b.write((char*)m->handleName, len);
+      dword base = m->image ? m->handle : 0;
+      b.write((char*)&base, sizeof(base));
    }
 }
 
@@ -234,40 +338,24 @@ void saveModuleList(Buffer &b) {
  */
 
 char *getString(MemoryManager *mgr, dword addr) {
-   int size = 16;
-   int i = 0;
-   byte *str = NULL, ch;
-   str = (byte*) malloc(size);
+   dword len = 0;
+   char *str;
    if (addr) {
-      while (ch = mgr->readByte(addr++)) {
-         if (i == size) {
-            str = (byte*)realloc(str, size + 16);
-            size += 16;
-         }
-         str[i++] = ch;
-      }
-      if (i == size) {
-         str = (byte*)realloc(str, size + 1);
-      }
+      //unmapped memory reads as zero, so the string ends there at the latest
+      len = mgr->findByte(addr, 0, 0xFFFFFFFF - addr);
    }
-   str[i] = 0;
-   return (char*)str;
+   str = (char*) malloc(len + 1);
+   mgr->readBlock(addr, str, len);
+   str[len] = 0;
+   return str;
 }
 
 /*
- * This function is used for all unemulated API functions
+ * This function is used for all unemulated API functions, see stubs.h
  */
 void unemulated(MemoryManager *mgr, dword addr) {
    HookNode *n = find(addr);
-   static char format[] = "%s called without an emulation. Check your stack layout!\n";
-   if (n) {
-      int len = sizeof(format) + strlen(n->getName()) + 10;
-      char *mesg = (char*) malloc(len);
-      qsnprintf(mesg, len, format, n->getName());
-      MessageBox(x86Dlg, mesg, "Unemulated", MB_OK);
-      msg(format, n->getName());
-      free(mesg);
-   }
+   stubCall(n ? n->getName() : NULL);
 }
 
 /*
@@ -278,98 +366,213 @@ void unemulated(MemoryManager *mgr, dword addr) {
    with a result in eax.  Because these are invoked from the emulator
    no return address gets pushed onto the stack and the functions can
    get right at their parameters on top of the stack.
+
+   Most are written as native_ functions with the API's own signature
+   and bound with the hookN templates from hookargs.h, which do the
+   argument fetch, eax and stack cleanup.
 */
 
-void emu_HeapCreate(MemoryManager *mgr, dword addr) {
-   /* DWORD flOptions =*/ pop(SIZE_DWORD); 
-   /* SIZE_T dwInitialSize =*/ pop(SIZE_DWORD);
-   dword dwMaximumSize = pop(SIZE_DWORD);
+//HANDLE __stdcall HeapCreate(DWORD flOptions, SIZE_T dwInitialSize, SIZE_T dwMaximumSize)
+dword native_HeapCreate(MemoryManager *mgr, dword flOptions, dword dwInitialSize, dword dwMaximumSize) {
    //we are not going to try to do growable heaps here
    if (dwMaximumSize == 0) dwMaximumSize = 0x01000000;
-   eax = mgr->addHeap(dwMaximumSize);
+   return mgr->addHeap(dwMaximumSize);
 }
 
-void emu_HeapDestroy(MemoryManager *mgr, dword addr) {
-   dword hHeap = pop(SIZE_DWORD); 
-   eax = mgr->destroyHeap(hHeap);
+//BOOL __stdcall HeapDestroy(HANDLE hHeap)
+dword native_HeapDestroy(MemoryManager *mgr, dword hHeap) {
+   return mgr->destroyHeap(hHeap);
 }
 
-void emu_GetProcessHeap(MemoryManager *mgr, dword addr) {
-   eax = mgr->heap ? mgr->heap->getHeapBase() : 0;
+//HANDLE __stdcall GetProcessHeap(void)
+dword native_GetProcessHeap(MemoryManager *mgr) {
+   return mgr->heap ? mgr->heap->getHeapBase() : 0;
 }
 
-void emu_HeapAlloc(MemoryManager *mgr, dword addr) {
-   dword hHeap = pop(SIZE_DWORD); 
-   /* DWORD dwFlags =*/ pop(SIZE_DWORD);
-   dword dwBytes = pop(SIZE_DWORD);
+//tell subscribers about blocks handed to and taken back from the program
+static void allocated(dword addr, dword size) {
+   if (addr && (eventMask & EVENT_BIT(EV_ALLOC))) raiseEvent(EV_ALLOC, addr, size);
+}
+
+static void freed(dword addr) {
+   if (addr && (eventMask & EVENT_BIT(EV_FREE))) raiseEvent(EV_FREE, addr);
+}
+
+//LPVOID __stdcall HeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+dword native_HeapAlloc(MemoryManager *mgr, dword hHeap, dword dwFlags, dword dwBytes) {
    EmuHeap *h = mgr->findHeap(hHeap);
    //are HeapAlloc  blocks zero'ed?
-   eax = h ? h->calloc(dwBytes, 1) : 0;
-
-   struct_init(initial_eip, eax, dwBytes);
+   dword result = h ? h->calloc(dwBytes, 1) : 0;
+   allocated(result, dwBytes);
+   return result;
 }
 
-void emu_HeapFree(MemoryManager *mgr, dword addr) {
-   dword hHeap = pop(SIZE_DWORD); 
-   /* DWORD dwFlags =*/ pop(SIZE_DWORD);
-   dword lpMem = pop(SIZE_DWORD);
+//BOOL __stdcall HeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
+dword native_HeapFree(MemoryManager *mgr, dword hHeap, dword dwFlags, dword lpMem) {
    EmuHeap *h = mgr->findHeap(hHeap);
-   eax = h ? h->free(lpMem) : 0;
+   if (h) freed(lpMem);
+   return h ? h->free(lpMem) : 0;
 }
 
-void emu_VirtualAlloc(MemoryManager *mgr, dword addr) {
-   /*dword lpAddress =*/ pop(SIZE_DWORD); 
-   dword dwSize = pop(SIZE_DWORD);
-   /*dword flAllocationType =*/ pop(SIZE_DWORD);
-   /*dword flProtect =*/ pop(SIZE_DWORD);
-   eax = mgr->heap->calloc(dwSize, 1);
+//LPVOID __stdcall VirtualAlloc(LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+dword native_VirtualAlloc(MemoryManager *mgr, dword lpAddress, dword dwSize, dword flAllocationType, dword flProtect) {
+   dword result = mgr->heap->calloc(dwSize, 1);
+   allocated(result, dwSize);
+   return result;
+}
 
-   struct_init(initial_eip, eax, dwSize);
+//BOOL __stdcall VirtualFree(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType)
+dword native_VirtualFree(MemoryManager *mgr, dword lpAddress, dword dwSize, dword dwFreeType) {
+   freed(lpAddress);
+   return mgr->heap->free(lpAddress);
 }
 
-void emu_VirtualFree(MemoryManager *mgr, dword addr) {
-   eax = mgr->heap->free(pop(SIZE_DWORD));
-   /*dword dwSize =*/ pop(SIZE_DWORD);
-   /*dword dwFreeType =*/ pop(SIZE_DWORD);
+//HLOCAL __stdcall LocalAlloc(UINT uFlags, SIZE_T uBytes)
+dword native_LocalAlloc(MemoryManager *mgr, dword uFlags, dword dwSize) {
+   dword result = mgr->heap->malloc(dwSize);
+   allocated(result, dwSize);
+   return result;
 }
 
-void emu_LocalAlloc(MemoryManager *mgr, dword addr) {
-   /*dword uFlags =*/ pop(SIZE_DWORD); 
-   dword dwSize = pop(SIZE_DWORD);
-   eax = mgr->heap->malloc(dwSize);
+//HLOCAL __stdcall LocalFree(HLOCAL hMem)
+dword native_LocalFree(MemoryManager *mgr, dword hMem) {
+   freed(hMem);
+   return mgr->heap->free(hMem);
+}
 
-   struct_init(initial_eip, eax, dwSize);
+void emu_VirtualAlloc(MemoryManager *mgr, dword addr) {
+   hook4<HOOK_STDCALL, dword, dword, dword, dword, native_VirtualAlloc>(mgr, addr);
 }
 
-void emu_LocalFree(MemoryManager *mgr, dword addr) {
-   eax = mgr->heap->free(pop(SIZE_DWORD));
+void emu_VirtualFree(MemoryManager *mgr, dword addr) {
+   hook3<HOOK_STDCALL, dword, dword, dword, native_VirtualFree>(mgr, addr);
 }
 
 static char *lastProcName = NULL;
 
 //funcName should be a library function name, and funcAddr its address
 hookfunc checkForHook(char *funcName, dword funcAddr, dword moduleId) {
-   int i = 0;
-   for (i = 0; hookTable[i].fName; i++) {
-      if (!strcmp(hookTable[i].fName, funcName)) {
-         //if there is an emulation, hook it
-         return addHook(funcName, funcAddr, hookTable[i].func, moduleId);
-      }
+   hookfunc f = findHook(funcName);
+   if (f) {
+      //if there is an emulation, hook it
+      return addHook(funcName, funcAddr, f, moduleId);
    }
    //there is no emulation, pass all calls to the "unemulated" stub
    return addHook(funcName, funcAddr, unemulated, moduleId);
 }
 
+//argument counts and conventions of functions without an emulation,
+//from the type libraries loaded in IDA, see stubs.h
+bool hostSignature(const char *name, int *args, int *conv) {
+   const type_t *type;
+   if (get_named_type(idati, name, NTF_SYMBOL, &type) <= 0 || !is_type_func(type[0])) {
+      return false;
+   }
+   //the byte after the function type holds the calling convention
+   switch (type[1] & CM_CC_MASK) {
+      case CM_CC_VOIDARG:
+         *args = 0;
+         *conv = STUB_CDECL;
+         return true;
+      case CM_CC_ELLIPSIS:
+         *args = -1;
+         *conv = STUB_CDECL;
+         return true;
+      case CM_CC_CDECL:
+         *conv = STUB_CDECL;
+         break;
+      case CM_CC_STDCALL: case CM_CC_PASCAL:
+         *conv = STUB_STDCALL;
+         break;
+      case CM_CC_FASTCALL:
+         *conv = STUB_FASTCALL;
+         break;
+      case CM_CC_THISCALL:
+         *conv = STUB_THISCALL;
+         break;
+      default:
+         //unknown or special conventions say nothing about the stack
+         return false;
+   }
+   *args = calc_func_nargs(type);
+   return *args >= 0;
+}
+
+//PELookup over our module list, binding and forwarders load DLLs as needed
+static PEImage *lookupImage(const char *dll, unsigned int *id, void *user) {
+   HandleList *m = findModule(moduleHead, (char*)dll);
+   if (m == NULL) m = addModule((char*)dll, 0);
+   *id = m ? m->id : 0;
+   return m ? m->image : NULL;
+}
+
+/*
+ * Address a function imported from m resolves to, hooking it as
+ * necessary.  ord is 0 for imports by name, otherwise name is just a
+ * label for the hook.  Images we loaded are left to the core, host
+ * modules are asked for the address.
+ */
+static dword resolveImport(HandleList *m, char *name, dword ord) {
+   if (m && m->image) {
+      return PEImage::resolveImport(m->image, m->id, name, ord, lookupImage, NULL);
+   }
+   dword f = 0;
+   if (m && (m->handle & FAKE_HANDLE_BASE) == 0) {
+      f = (dword)GetProcAddress((HMODULE)m->handle, ord ? (char*)ord : name);
+   }
+   if (f == 0) f = PEImage::unresolved();
+   checkForHook(name, f, m ? m->id : 0);
+   return f;
+}
+
+//module from a PE file in emu_dllPath, or already in memory at base
+static HandleList *addImage(char *mod, int id, dword base) {
+   PEImage *img = NULL;
+   if (base) {
+      img = PEImage::attach(mm, base);
+   }
+   else {
+      char *path = PEImage::find(emu_dllPath, mod);
+      if (path) {
+         img = PEImage::load(mm, path);
+         if (img) {
+            msg("x86emu: loaded %s at 0x%08X\n", path, img->getBase());
+         }
+         free(path);
+      }
+   }
+   if (img == NULL) return NULL;
+   HandleList *m = (HandleList*) calloc(1, sizeof(HandleList));
+   m->next = moduleHead;
+   moduleHead = m;
+   m->handleName = _strdup(mod);
+   m->handle = img->getBase();
+   m->id = id ? id : moduleId++;
+   m->maxAddr = m->handle + img->getSize();
+   m->image = img;
+   indexModule(m);
+   //in the list before binding so circular imports find it, a restored
+   //image already has its IAT filled in
+   if (base == 0) img->bindImports(lookupImage, NULL);
+   return m;
+}
+
+void setDllPath(const char *path) {
+   free(emu_dllPath);
+   emu_dllPath = (path && *path) ? _strdup(path) : NULL;
+}
+
 //FARPROC __stdcall GetProcAddress(HMODULE hModule,LPCSTR lpProcName)
 void emu_GetProcAddress(MemoryManager *mgr, dword addr) {
    static dword address = 0x80000000;
-   static dword bad = 0xFFFFFFFF;
    dword hModule = pop(SIZE_DWORD); 
    dword lpProcName = pop(SIZE_DWORD);
    FARPROC h = NULL;
    HookNode *n;
-   int i;
+   hookfunc f;
    HandleList *m = findModule(hModule);
+   //labels for the last result may still be batched, they need its name
+   flushEvents();
    free(lastProcName);
    if (lpProcName < 0x10000) {
       //getting function by ordinal value
@@ -392,24 +595,24 @@ void emu_GetProcAddress(MemoryManager *mgr, dword addr) {
       }
    }
    msg("GetProcAddress called: %s", lastProcName);
+   if (m && m->image) {
+      eax = resolveImport(m, lastProcName, lpProcName < 0x10000 ? lpProcName : 0);
+   }
    //first see if this function is already hooked
-   if (n = find(lastProcName)) {
+   else if (n = find(lastProcName)) {
       eax = n->getAddr();
    }
    else {  //this is where we need to check if auto hooking is turned on else if (autohook) {
       //if it wasn't hooked, see if there is an emulation for it
       //use h to replace "address" and "bad" below
-      for (i = 0; hookTable[i].fName; i++) {
-         if (!strcmp(hookTable[i].fName, lastProcName)) {
-            //if there is an emulation, hook it
-            eax = h ? (dword)h : address++;
-            addHook(lastProcName, eax, hookTable[i].func, m ? m->id : 0);
-            break;
-         }
+      if (f = findHook(lastProcName)) {
+         //if there is an emulation, hook it
+         eax = h ? (dword)h : address++;
+         addHook(lastProcName, eax, f, m ? m->id : 0);
       }
-      if (hookTable[i].fName == NULL) {
+      else {
          //there is no emulation, pass all calls to the "unemulated" stub
-         eax = h ? (dword)h : bad--;
+         eax = h ? (dword)h : PEImage::unresolved();
          addHook(lastProcName, eax, unemulated, m ? m->id : 0);
       }
    }
@@ -421,7 +624,7 @@ void emu_GetProcAddress(MemoryManager *mgr, dword addr) {
  * GetProcAddress: create a label at addr from lastProcName.
  */
 
-void makeImportLabel(dword addr) {
+static void makeImportLabel(dword addr) {
    for (dword cnt = 0; cnt < 4; cnt++) {
       do_unknown(addr, true); //undefine it
    }
@@ -435,6 +638,17 @@ void makeImportLabel(dword addr) {
    }
 }
 
+//the plugin subscribes this to EV_MEM_WRITE, a dword stored by the
+//instruction at gpaSavePoint is a GetProcAddress result
+void importLabels(const EmuEvent *events, unsigned int count, void *user) {
+   if (gpaSavePoint == 0xFFFFFFFF || lastProcName == NULL) return;
+   for (unsigned int i = 0; i < count; i++) {
+      if (events[i].eip == gpaSavePoint && events[i].size == SIZE_DWORD) {
+         makeImportLabel(events[i].addr);
+      }
+   }
+}
+
 HandleList *moduleCommon(MemoryManager *mgr, dword addr) {
    dword lpModName = pop(SIZE_DWORD);
    char *modName = getString(mgr, lpModName);
@@ -461,37 +675,258 @@ HandleList *moduleCommon(MemoryManager *mgr, dword addr) {
 void emu_GetModuleHandle(MemoryManager *mgr, dword addr) {
    msg("GetModuleHandle");
    HandleList *m = moduleCommon(mgr, addr);
-   eax = m->handle;
+   eax = m ? m->handle : 0;
 }
 
 //HMODULE __stdcall LoadLibraryA(LPCSTR lpLibFileName)
 void emu_LoadLibrary(MemoryManager *mgr, dword addr) {
    msg("LoadLibrary");
    HandleList *m = moduleCommon(mgr, addr);
-   eax = m->handle;
+   eax = m ? m->handle : 0;
 }
 
-void emu_malloc(MemoryManager *mgr, dword addr) {
-   dword dwSize = readDword(esp);
-   eax = mgr->heap->malloc(dwSize);
+//void *malloc(size_t size)
+dword native_malloc(MemoryManager *mgr, dword dwSize) {
+   dword result = mgr->heap->malloc(dwSize);
+   allocated(result, dwSize);
+   return result;
+}
+
+//void *calloc(size_t num, size_t size)
+dword native_calloc(MemoryManager *mgr, dword num, dword dwSize) {
+   dword result = mgr->heap->calloc(num, dwSize);
+   allocated(result, num * dwSize);
+   return result;
+}
+
+//void *realloc(void *memblock, size_t size)
+dword native_realloc(MemoryManager *mgr, dword memblock, dword dwSize) {
+   dword result = mgr->heap->realloc(memblock, dwSize);
+   //a block that moved was freed and allocated again, one that failed
+   //to grow is left where it was
+   if (result != memblock && result != HEAP_ERROR) {
+      freed(memblock);
+      allocated(result, dwSize);
+   }
+   return result;
+}
 
-   struct_init(initial_eip, eax, dwSize);
+//void free(void *memblock)
+dword native_free(MemoryManager *mgr, dword memblock) {
+   freed(memblock);
+   mgr->heap->free(memblock);
+   return eax;
+}
+
+void emu_malloc(MemoryManager *mgr, dword addr) {
+   hook1<HOOK_CDECL, dword, native_malloc>(mgr, addr);
 }
 
 void emu_calloc(MemoryManager *mgr, dword addr) {
-	dword num = readDword(esp);
-	dword dwSize = readDword(esp + 4);
-    eax = mgr->heap->calloc(num, dwSize);
-	
-	struct_init(initial_eip, eax, num * dwSize);
+   hook2<HOOK_CDECL, dword, dword, native_calloc>(mgr, addr);
 }
 
 void emu_realloc(MemoryManager *mgr, dword addr) {
-   eax = mgr->heap->realloc(readDword(esp), readDword(esp + 4));
+   hook2<HOOK_CDECL, dword, dword, native_realloc>(mgr, addr);
 }
 
 void emu_free(MemoryManager *mgr, dword addr) {
-   mgr->heap->free(readDword(esp));
+   hook1<HOOK_CDECL, dword, native_free>(mgr, addr);
+}
+
+/*
+   Memory and string routines.  The guest versions of these are byte
+   at a time loops, so rather than emulate them we move the data in
+   blocks through a host buffer.
+*/
+
+#define EMU_CHUNK 0x1000
+
+//guest to guest copy, safe for overlapping ranges
+static void copyGuest(MemoryManager *mgr, dword dest, dword src, dword len) {
+   unsigned char buf[EMU_CHUNK];
+   if (dest > src && (dest - src) < len) {
+      //dest overlaps the end of src, copy from the top down
+      while (len) {
+         dword n = len < EMU_CHUNK ? len : EMU_CHUNK;
+         len -= n;
+         mgr->readBlock(src + len, buf, n);
+         mgr->writeBlock(dest + len, buf, n);
+      }
+   }
+   else {
+      dword offset = 0;
+      while (offset < len) {
+         dword n = (len - offset) < EMU_CHUNK ? (len - offset) : EMU_CHUNK;
+         mgr->readBlock(src + offset, buf, n);
+         mgr->writeBlock(dest + offset, buf, n);
+         offset += n;
+      }
+   }
+}
+
+static void fillGuest(MemoryManager *mgr, dword dest, unsigned char val, dword len) {
+   unsigned char buf[EMU_CHUNK];
+   memset(buf, val, len < EMU_CHUNK ? len : EMU_CHUNK);
+   while (len) {
+      dword n = len < EMU_CHUNK ? len : EMU_CHUNK;
+      mgr->writeBlock(dest, buf, n);
+      dest += n;
+      len -= n;
+   }
+}
+
+//memcmp semantics, but always -1, 0 or 1 as the MS runtime returns
+static int compareGuest(MemoryManager *mgr, dword a, dword b, dword len) {
+   unsigned char bufa[EMU_CHUNK], bufb[EMU_CHUNK];
+   while (len) {
+      dword n = len < EMU_CHUNK ? len : EMU_CHUNK;
+      mgr->readBlock(a, bufa, n);
+      mgr->readBlock(b, bufb, n);
+      int r = memcmp(bufa, bufb, n);
+      if (r) return r < 0 ? -1 : 1;
+      a += n;
+      b += n;
+      len -= n;
+   }
+   return 0;
+}
+
+static dword stringLen(MemoryManager *mgr, dword addr) {
+   //unmapped memory reads as zero, so the string ends there at the latest
+   return mgr->findByte(addr, 0, 0xFFFFFFFF - addr);
+}
+
+//length in characters of a 16 bit character string
+static dword wideLen(MemoryManager *mgr, dword addr) {
+   dword max = 0xFFFFFFFF - addr;
+   dword len = 0;
+   while (len < max) {
+      len += mgr->findByte(addr + len, 0, max - len);
+      if (len >= max) break;
+      if ((len & 1) == 0 && mgr->readByte(addr + len + 1) == 0) break;
+      len++;
+   }
+   return len / 2;
+}
+
+//void *memcpy(void *dest, const void *src, size_t count)
+//void *memmove(void *dest, const void *src, size_t count)
+dword native_memmove(MemoryManager *mgr, dword dest, dword src, dword count) {
+   copyGuest(mgr, dest, src, count);
+   return dest;
+}
+
+//void *memset(void *dest, int c, size_t count)
+dword native_memset(MemoryManager *mgr, dword dest, unsigned char c, dword count) {
+   fillGuest(mgr, dest, c, count);
+   return dest;
+}
+
+//int memcmp(const void *buf1, const void *buf2, size_t count)
+dword native_memcmp(MemoryManager *mgr, dword buf1, dword buf2, dword count) {
+   return compareGuest(mgr, buf1, buf2, count);
+}
+
+//void *memchr(const void *buf, int c, size_t count)
+dword native_memchr(MemoryManager *mgr, dword buf, unsigned char c, dword count) {
+   dword offset = mgr->findByte(buf, c, count);
+   return offset < count ? buf + offset : 0;
+}
+
+//size_t strlen(const char *str)
+//int __stdcall lstrlenA(LPCSTR lpString)
+dword native_strlen(MemoryManager *mgr, dword str) {
+   return stringLen(mgr, str);
+}
+
+//char *strcpy(char *dest, const char *src)
+//LPSTR __stdcall lstrcpyA(LPSTR lpString1, LPCSTR lpString2)
+dword native_strcpy(MemoryManager *mgr, dword dest, dword src) {
+   copyGuest(mgr, dest, src, stringLen(mgr, src) + 1);
+   return dest;
+}
+
+//char *strncpy(char *dest, const char *src, size_t count)
+dword native_strncpy(MemoryManager *mgr, dword dest, dword src, dword count) {
+   dword len = mgr->findByte(src, 0, count);
+   copyGuest(mgr, dest, src, len);
+   //strncpy pads out to count with nulls
+   fillGuest(mgr, dest + len, 0, count - len);
+   return dest;
+}
+
+//char *strcat(char *dest, const char *src)
+//LPSTR __stdcall lstrcatA(LPSTR lpString1, LPCSTR lpString2)
+dword native_strcat(MemoryManager *mgr, dword dest, dword src) {
+   copyGuest(mgr, dest + stringLen(mgr, dest), src, stringLen(mgr, src) + 1);
+   return dest;
+}
+
+//int strcmp(const char *string1, const char *string2)
+dword native_strcmp(MemoryManager *mgr, dword s1, dword s2) {
+   dword len1 = stringLen(mgr, s1);
+   dword len2 = stringLen(mgr, s2);
+   //include the shorter string's null so that prefixes compare less
+   return compareGuest(mgr, s1, s2, (len1 < len2 ? len1 : len2) + 1);
+}
+
+//int strncmp(const char *string1, const char *string2, size_t count)
+dword native_strncmp(MemoryManager *mgr, dword s1, dword s2, dword count) {
+   dword len = mgr->findByte(s1, 0, count);
+   dword len2 = mgr->findByte(s2, 0, count);
+   if (len2 < len) len = len2;
+   if (len < count) len++;
+   return compareGuest(mgr, s1, s2, len);
+}
+
+//char *strchr(const char *str, int c)
+dword native_strchr(MemoryManager *mgr, dword str, unsigned char c) {
+   dword len = stringLen(mgr, str);
+   if (c == 0) {
+      //the terminating null counts as part of the string
+      return str + len;
+   }
+   dword offset = mgr->findByte(str, c, len);
+   return offset < len ? str + offset : 0;
+}
+
+//size_t wcslen(const wchar_t *str)
+//int __stdcall lstrlenW(LPCWSTR lpString)
+dword native_wcslen(MemoryManager *mgr, dword str) {
+   return wideLen(mgr, str);
+}
+
+//wchar_t *wcscpy(wchar_t *dest, const wchar_t *src)
+//LPWSTR __stdcall lstrcpyW(LPWSTR lpString1, LPCWSTR lpString2)
+dword native_wcscpy(MemoryManager *mgr, dword dest, dword src) {
+   copyGuest(mgr, dest, src, (wideLen(mgr, src) + 1) * 2);
+   return dest;
+}
+
+//wchar_t *wcscat(wchar_t *dest, const wchar_t *src)
+//LPWSTR __stdcall lstrcatW(LPWSTR lpString1, LPCWSTR lpString2)
+dword native_wcscat(MemoryManager *mgr, dword dest, dword src) {
+   copyGuest(mgr, dest + wideLen(mgr, dest) * 2, src, (wideLen(mgr, src) + 1) * 2);
+   return dest;
+}
+
+//VOID __stdcall RtlMoveMemory(PVOID Destination, const VOID *Source, SIZE_T Length)
+dword native_RtlMoveMemory(MemoryManager *mgr, dword dest, dword src, dword len) {
+   copyGuest(mgr, dest, src, len);
+   return eax;
+}
+
+//VOID __stdcall RtlZeroMemory(PVOID Destination, SIZE_T Length)
+dword native_RtlZeroMemory(MemoryManager *mgr, dword dest, dword len) {
+   fillGuest(mgr, dest, 0, len);
+   return eax;
+}
+
+//VOID __stdcall RtlFillMemory(PVOID Destination, SIZE_T Length, BYTE Fill)
+dword native_RtlFillMemory(MemoryManager *mgr, dword dest, dword len, unsigned char fill) {
+   fillGuest(mgr, dest, fill, len);
+   return eax;
 }
 
 void doImports(MemoryManager *mgr, dword import_directory, dword image_base) {
@@ -509,6 +944,10 @@ void doImports(MemoryManager *mgr, dword import_directory, dword image_base) {
       if (m == NULL) m = addModule(dllName, 0);
       
       free(dllName);
+      if (m == NULL) {
+         import_directory += 20;
+         continue;
+      }
 
       dword thunk;
       while ((thunk = get_long(FirstThunk + image_base)) != 0) {
@@ -522,7 +961,10 @@ void doImports(MemoryManager *mgr, dword import_directory, dword image_base) {
                funcName[size] = 0;
 //               msg("netnode(%X) exists, name: %s\n", t, funcName);
                FARPROC f;
-               if (m->handle & FAKE_HANDLE_BASE) {
+               if (m->image) {
+                  f = (FARPROC)resolveImport(m, funcName, 0);
+               }
+               else if (m->handle & FAKE_HANDLE_BASE) {
                   f = (FARPROC)t;
                }
                else {
@@ -530,7 +972,7 @@ void doImports(MemoryManager *mgr, dword import_directory, dword image_base) {
                   reverseLookupExport((dword)f);
                }
                put_long(t, (dword)f);
-               if (f) {
+               if (f && m->image == NULL) {
                   checkForHook(funcName, (dword)f, m->id);
                }
                free(funcName);
@@ -542,60 +984,50 @@ void doImports(MemoryManager *mgr, dword import_directory, dword image_base) {
    }   
 }
 
+//last module based at or below addr that contains it
+static HandleList *moduleAt(dword addr) {
+   dword lo = 0, hi = moduleCount;
+   while (lo < hi) {
+      dword mid = (lo + hi) / 2;
+      if (moduleIndex[mid]->handle <= addr) lo = mid + 1;
+      else hi = mid;
+   }
+   if (lo && addr < moduleIndex[lo - 1]->maxAddr) return moduleIndex[lo - 1];
+   return NULL;
+}
+
 //okay to call for ELF, but module list should be empty
+//only host modules are returned, code in our own images is emulated
 HandleList *moduleFromAddress(dword addr) {
-   HandleList *hl, *result = NULL;
-   dword min = 0;
-   for (hl = moduleHead; hl; hl = hl->next) {
-#ifdef CYGWIN
-      if (addr < hl->maxAddr && addr >= hl->handle) {
-         result = hl;
-         break;
-      }
-#else
-      //Because MS does not include psapi stuff in Visual Studio
-      if (addr > min && addr < hl->maxAddr && addr >= hl->handle) {
-         result = hl;
-         min = hl->handle;
-      }
-#endif
-   }
-   return result;
+   PageInfo *p = addressSpace.find(addr);
+   if (p == NULL) return NULL;
+   if (p->kind == AS_MODULE) return (HandleList*)p->owner;
+   if (p->kind != AS_SHARED && !p->overlap) return NULL;
+   //module shares this page with another region
+   HandleList *m = moduleAt(addr);
+   return (m && m->image == NULL) ? m : NULL;
 }
 
 bool isModuleAddress(dword addr) {
    return moduleFromAddress(addr) != NULL;
 }
 
-int reverseLookupFunc(dword *EAT, dword func, dword max, dword base) {
-   for (unsigned int i = 0; i < max; i++) {
-      if ((EAT[i] + base) == func) return i;
-   }
-   return -1;
-}
-
-int reverseLookupOrd(word *EOT, word ord, dword max) {
-   for (unsigned int i = 0; i < max; i++) {
-      if (EOT[i] == ord) return i;
-   }
-   return -1;
-}
-
 char *reverseLookupExport(dword addr) {
-   HandleList *hl;
-   for (hl = moduleHead; hl; hl = hl->next) {
-      if (addr < hl->maxAddr && addr >= hl->handle) break;
-   }
+   HandleList *hl = moduleAt(addr);
    if (hl == NULL) return NULL;
+   if (hl->image) return (char*)hl->image->exportName(addr);
    if (hl->handle & FAKE_HANDLE_BASE) return NULL;
 
-   int idx = reverseLookupFunc(hl->eat, addr, hl->NoF, hl->handle);
-   if (idx != -1) {
-      idx = reverseLookupOrd(hl->eot, idx, hl->NoN);
-      if (idx != -1) {
-//         msg("reverseLookupExport: %X == %s\n", addr, (char*)(hl->ent[idx] + hl->handle));
-         return (char*) (hl->ent[idx] + hl->handle);
-      }
+   //first entry for addr, the sort puts the lowest ordinal there
+   dword lo = 0, hi = hl->numExports;
+   while (lo < hi) {
+      dword mid = (lo + hi) / 2;
+      if (hl->exports[mid].addr < addr) lo = mid + 1;
+      else hi = mid;
+   }
+   if (lo < hl->numExports && hl->exports[lo].addr == addr) {
+//      msg("reverseLookupExport: %X == %s\n", addr, hl->exports[lo].name);
+      return hl->exports[lo].name;
    }
    return NULL;
 }
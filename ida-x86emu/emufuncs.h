@@ -24,19 +24,13 @@
 #include <stdio.h>
 #include "buffer.h"
 #include "hooklist.h"
+#include "host.h"
+#include "events.h"
 
 class MemoryManager;
 
-void emu_HeapCreate(MemoryManager *mgr, unsigned int addr = 0);
-void emu_HeapDestroy(MemoryManager *mgr, unsigned int addr = 0);
-void emu_HeapAlloc(MemoryManager *mgr, unsigned int addr = 0);
-void emu_HeapFree(MemoryManager *mgr, unsigned int addr = 0);
-void emu_GetProcessHeap(MemoryManager *mgr, unsigned int addr = 0);
-
 void emu_VirtualAlloc(MemoryManager *mgr, unsigned int addr = 0);
 void emu_VirtualFree(MemoryManager *mgr, unsigned int addr = 0);
-void emu_LocalAlloc(MemoryManager *mgr, unsigned int addr = 0);
-void emu_LocalFree(MemoryManager *mgr, unsigned int addr = 0);
 void emu_GetProcAddress(MemoryManager *mgr, unsigned int addr = 0);
 void emu_GetModuleHandle(MemoryManager *mgr, unsigned int addr = 0);
 void emu_LoadLibrary(MemoryManager *mgr, unsigned int addr = 0);
@@ -46,18 +40,51 @@ void emu_calloc(MemoryManager *mgr, unsigned int addr = 0);
 void emu_realloc(MemoryManager *mgr, unsigned int addr = 0);
 void emu_free(MemoryManager *mgr, unsigned int addr = 0);
 
-void makeImportLabel(dword addr);
-void saveModuleList(Buffer &b);
-void loadModuleList(Buffer &b);
+//native emulations, bound to hookfuncs with the templates in hookargs.h
+dword native_HeapCreate(MemoryManager *mgr, dword flOptions, dword dwInitialSize, dword dwMaximumSize);
+dword native_HeapDestroy(MemoryManager *mgr, dword hHeap);
+dword native_GetProcessHeap(MemoryManager *mgr);
+dword native_HeapAlloc(MemoryManager *mgr, dword hHeap, dword dwFlags, dword dwBytes);
+dword native_HeapFree(MemoryManager *mgr, dword hHeap, dword dwFlags, dword lpMem);
+dword native_VirtualAlloc(MemoryManager *mgr, dword lpAddress, dword dwSize, dword flAllocationType, dword flProtect);
+dword native_VirtualFree(MemoryManager *mgr, dword lpAddress, dword dwSize, dword dwFreeType);
+dword native_LocalAlloc(MemoryManager *mgr, dword uFlags, dword dwSize);
+dword native_LocalFree(MemoryManager *mgr, dword hMem);
+
+dword native_malloc(MemoryManager *mgr, dword dwSize);
+dword native_calloc(MemoryManager *mgr, dword num, dword dwSize);
+dword native_realloc(MemoryManager *mgr, dword memblock, dword dwSize);
+dword native_free(MemoryManager *mgr, dword memblock);
+
+dword native_memmove(MemoryManager *mgr, dword dest, dword src, dword count);
+dword native_memset(MemoryManager *mgr, dword dest, unsigned char c, dword count);
+dword native_memcmp(MemoryManager *mgr, dword buf1, dword buf2, dword count);
+dword native_memchr(MemoryManager *mgr, dword buf, unsigned char c, dword count);
+dword native_strlen(MemoryManager *mgr, dword str);
+dword native_strcpy(MemoryManager *mgr, dword dest, dword src);
+dword native_strncpy(MemoryManager *mgr, dword dest, dword src, dword count);
+dword native_strcat(MemoryManager *mgr, dword dest, dword src);
+dword native_strcmp(MemoryManager *mgr, dword s1, dword s2);
+dword native_strncmp(MemoryManager *mgr, dword s1, dword s2, dword count);
+dword native_strchr(MemoryManager *mgr, dword str, unsigned char c);
+dword native_wcslen(MemoryManager *mgr, dword str);
+dword native_wcscpy(MemoryManager *mgr, dword dest, dword src);
+dword native_wcscat(MemoryManager *mgr, dword dest, dword src);
+dword native_RtlMoveMemory(MemoryManager *mgr, dword dest, dword src, dword len);
+dword native_RtlZeroMemory(MemoryManager *mgr, dword dest, dword len);
+dword native_RtlFillMemory(MemoryManager *mgr, dword dest, dword len, unsigned char fill);
+
+void setDllPath(const char *path);
+
+//EV_MEM_WRITE handler that labels GetProcAddress results
+void importLabels(const EmuEvent *events, unsigned int count, void *user);
 
-hookfunc checkForHook(char *funcName, dword funcAddr, dword moduleId);
 void doImports(MemoryManager *mgr, dword import_drectory, dword image_base);
-bool isModuleAddress(dword addr);
-char *reverseLookupExport(dword addr);
 
 typedef enum {NEVER, ASK, ALWAYS} emu_Actions;
 
 extern int emu_alwaysLoadLibrary;
 extern int emu_alwaysGetModuleHandle;
+extern char *emu_dllPath;
 
 #endif
@@ -22,32 +22,62 @@
 #include <string.h>
 
 #include "emuheap.h"
-#include <ida.hpp>
-#include <kernwin.hpp>
 
 //Constructor for malloc'ed node
 MallocNode::MallocNode(unsigned int size, unsigned int base) {
    this->base = base;
    this->size = size;
+   site = 0;
+   changed = true;
    block = (unsigned char*) malloc(size);
+   src = NULL;
+   image = NULL;
 }
 
-MallocNode::MallocNode(Buffer &b) {
+MallocNode::MallocNode(Buffer &b, HeapImage *image) {
    b.read((char*)&base, sizeof(base));
    b.read((char*)&size, sizeof(size));
-   block = (unsigned char*) malloc(size);
-   b.read((char*)block, size);
+   site = 0;
+   changed = false;
+   block = NULL;
+   this->image = NULL;
+   src = b.read_view(size);
+   if (src == NULL) {
+      size = 0;
+   }
+   else if (image) {
+      image->addRef();
+      this->image = image;
+   }
+   else {
+      //nothing to keep the contents alive, take a copy now
+      block = (unsigned char*) malloc(size);
+      memcpy(block, src, size);
+      src = NULL;
+   }
 }
 
 void MallocNode::save(Buffer &b) {
    b.write((char*)&base, sizeof(base));
    b.write((char*)&size, sizeof(size));
-   b.write((char*)block, size);
+   b.write((char*)bytes(), size);
+}
+
+unsigned char *MallocNode::writable() {
+   if (image) {
+      block = (unsigned char*) malloc(size);
+      memcpy(block, src, size);
+      src = NULL;
+      image->release();
+      image = NULL;
+   }
+   return block;
 }
 
 //malloc'ed node destructor
 MallocNode::~MallocNode() {
    free(block);
+   if (image) image->release();
 }
 
 //Does this block contain the indicated virtual address?
@@ -59,7 +89,7 @@ bool MallocNode::contains(unsigned int addr) {
 unsigned char MallocNode::readByte(unsigned int addr) {
    unsigned char val = 0;
    if (contains(addr)) {
-      val = block[addr - base];
+      val = bytes()[addr - base];
    }
    return val;
 }
@@ -67,28 +97,38 @@ unsigned char MallocNode::readByte(unsigned int addr) {
 //write a byte to this block
 void MallocNode::writeByte(unsigned int addr, unsigned char val) {
    if (contains(addr)) {
-      block[addr - base] = val;
+      writable()[addr - base] = val;
+      changed = true;
    }
 }
 
 //Emulation heap constructor, indicate virtual address of base and max size
 EmuHeap::EmuHeap(unsigned int baseAddr, unsigned int maxSize, EmuHeap *next) {
-   head = NULL;
+   head = cursor = NULL;
    base = baseAddr;
    max = base + maxSize;
    nextHeap = next;
+   shadow = NULL;
 }
 
-EmuHeap::EmuHeap(Buffer &b, unsigned int num_blocks) {
+EmuHeap::EmuHeap(Buffer &b, unsigned int num_blocks, HeapImage *image) {
    nextHeap = NULL;
-   readHeap(b, num_blocks);
+   head = cursor = NULL;
+   shadow = NULL;
+   readHeap(b, num_blocks, image);
 }
 
-//Construct new heap from binary buffer data
-EmuHeap::EmuHeap(Buffer &b) {
+/*
+ * Construct new heap from binary buffer data.  Given the image holding
+ * b's bytes, the blocks' contents are left there to be copied out as
+ * they are written, so that loading a large heap only costs building
+ * the block lists.  Without one they are copied as they are read.
+ */
+EmuHeap::EmuHeap(Buffer &b, HeapImage *image) {
    unsigned int n;
    nextHeap = NULL;
-   head = NULL;
+   head = cursor = NULL;
+   shadow = NULL;
    b.read((char*)&n, sizeof(n));
    
    //test for multi-heap
@@ -96,29 +136,39 @@ EmuHeap::EmuHeap(Buffer &b) {
       unsigned int num_heaps;
       EmuHeap *p = NULL;
       b.read((char*)&num_heaps, sizeof(num_heaps));
-      for (unsigned int i = 0; i < num_heaps; i++) {
+      for (unsigned int i = 0; i < num_heaps && !b.has_error(); i++) {
          b.read((char*)&n, sizeof(n));
          if (p) {
-            p->nextHeap = new EmuHeap(b, n);
+            p->nextHeap = new EmuHeap(b, n, image);
             p = p->nextHeap;
          }
          else {
-            readHeap(b, n);
+            readHeap(b, n, image);
             p = this;
          }
       }
    }
    else { //only a single heap, we already have n
-      readHeap(b, n);
+      readHeap(b, n, image);
    }
 }
 
 //read a head consisting of num_blocks allocated blocks from a buffer
-void EmuHeap::readHeap(Buffer &b, unsigned int num_blocks) {
+void EmuHeap::readHeap(Buffer &b, unsigned int num_blocks, HeapImage *image) {
+   MallocNode *tail = NULL;
    b.read((char*)&base, sizeof(base));
    b.read((char*)&max, sizeof(max));
-   for (unsigned int i = 0; i < num_blocks; i++) {
-      insert(new MallocNode(b));
+   for (unsigned int i = 0; i < num_blocks && !b.has_error(); i++) {
+      MallocNode *node = new MallocNode(b, image);
+      //blocks are saved in order, so they normally go on the end
+      if (tail && tail->base < node->base) {
+         node->next = NULL;
+         tail->next = node;
+      }
+      else {
+         insert(node);
+      }
+      if (node->next == NULL) tail = node;
    }
 }
 
@@ -156,6 +206,173 @@ void EmuHeap::save(Buffer &b) {
    }  
 }
 
+/*
+ * Every heap is listed with all of its blocks so that freed blocks and
+ * heaps simply drop out when the delta is applied.  A block carries its
+ * contents only if it was written since the last save or load.
+ */
+void EmuHeap::saveDelta(Buffer &b) {
+   unsigned int num_heaps = 0;
+   EmuHeap *h;
+   MallocNode *m;
+   for (h = this; h; h = h->nextHeap) num_heaps++;
+   b.write((char*)&num_heaps, sizeof(num_heaps));
+   for (h = this; h; h = h->nextHeap) {
+      unsigned int n = 0;
+      for (m = h->head; m; m = m->next) n++;
+      b.write((char*)&n, sizeof(n));
+      b.write((char*)&h->base, sizeof(h->base));
+      b.write((char*)&h->max, sizeof(h->max));
+      for (m = h->head; m; m = m->next) {
+         unsigned char hasData = m->changed;
+         b.write((char*)&m->base, sizeof(m->base));
+         b.write((char*)&m->size, sizeof(m->size));
+         b.write(&hasData, sizeof(hasData));
+         if (hasData) {
+            b.write((char*)m->bytes(), m->size);
+         }
+      }
+   }
+}
+
+//the blocks come in address order, so the old list is walked alongside
+bool EmuHeap::loadDelta(Buffer &b, unsigned int num_blocks) {
+   MallocNode *old = head, *tail = NULL, *t;
+   bool ok = true;
+   head = cursor = NULL;
+   for (unsigned int i = 0; i < num_blocks; i++) {
+      unsigned int addr = 0, size = 0;
+      unsigned char hasData = 0;
+      MallocNode *node;
+      b.read((char*)&addr, sizeof(addr));
+      b.read((char*)&size, sizeof(size));
+      b.read(&hasData, sizeof(hasData));
+      if (b.has_error() || (tail && addr <= tail->base)) {
+         ok = false;
+         break;
+      }
+      //anything before addr has been freed
+      while (old && old->base < addr) {
+         t = old;
+         old = old->next;
+         delete t;
+      }
+      if (hasData) {
+         const unsigned char *data = b.read_view(size);
+         if (data == NULL) {
+            ok = false;
+            break;
+         }
+         node = new MallocNode(size, addr);
+         memcpy(node->block, data, size);
+      }
+      else if (old && old->base == addr && old->size == size) {
+         node = old;
+         old = old->next;
+      }
+      else {
+         //the delta was not taken against this state
+         ok = false;
+         break;
+      }
+      node->changed = false;
+      node->next = NULL;
+      if (tail) {
+         tail->next = node;
+      }
+      else {
+         head = node;
+      }
+      tail = node;
+   }
+   while (old) {
+      t = old;
+      old = old->next;
+      delete t;
+   }
+   return ok;
+}
+
+void EmuHeap::saveLayout(Buffer &b) {
+   unsigned int num_heaps = 0;
+   EmuHeap *h;
+   MallocNode *m;
+   for (h = this; h; h = h->nextHeap) num_heaps++;
+   b.write((char*)&num_heaps, sizeof(num_heaps));
+   for (h = this; h; h = h->nextHeap) {
+      unsigned int n = 0;
+      for (m = h->head; m; m = m->next) n++;
+      b.write((char*)&n, sizeof(n));
+      b.write((char*)&h->base, sizeof(h->base));
+      b.write((char*)&h->max, sizeof(h->max));
+      for (m = h->head; m; m = m->next) {
+         b.write((char*)&m->base, sizeof(m->base));
+         b.write((char*)&m->size, sizeof(m->size));
+         b.write((char*)&m->site, sizeof(m->site));
+      }
+   }
+}
+
+EmuHeap *EmuHeap::loadLayout(Buffer &b) {
+   unsigned int num_heaps = 0;
+   EmuHeap *first = NULL, **last = &first;
+   b.read((char*)&num_heaps, sizeof(num_heaps));
+   for (unsigned int i = 0; i < num_heaps && !b.has_error(); i++) {
+      unsigned int n = 0, base = 0, max = 0;
+      MallocNode *tail = NULL;
+      b.read((char*)&n, sizeof(n));
+      b.read((char*)&base, sizeof(base));
+      b.read((char*)&max, sizeof(max));
+      EmuHeap *h = new EmuHeap(base, max - base);
+      *last = h;
+      last = &h->nextHeap;
+      for (unsigned int j = 0; j < n && !b.has_error(); j++) {
+         unsigned int addr = 0, size = 0, site = 0;
+         b.read((char*)&addr, sizeof(addr));
+         b.read((char*)&size, sizeof(size));
+         b.read((char*)&site, sizeof(site));
+         if (b.has_error() || (tail && addr <= tail->base)) break;
+         MallocNode *node = new MallocNode(size, addr);
+         memset(node->block, 0, size);
+         node->site = site;
+         node->next = NULL;
+         if (tail) {
+            tail->next = node;
+         }
+         else {
+            h->head = node;
+         }
+         tail = node;
+      }
+   }
+   return first;
+}
+
+unsigned int EmuHeap::blockPages(unsigned int shift, unsigned int *pages) {
+   unsigned int n = 0, next = 0;
+   for (MallocNode *m = head; m; m = m->next) {
+      if (m->size == 0) continue;
+      unsigned int first = m->base >> shift;
+      unsigned int last = (m->base + m->size - 1) >> shift;
+      //a page shared with the block before has been counted
+      if (n && first < next) first = next;
+      for (unsigned int p = first; p <= last; p++) {
+         if (pages) pages[n] = p << shift;
+         n++;
+      }
+      if (last + 1 > next) next = last + 1;
+   }
+   return n;
+}
+
+void EmuHeap::markClean() {
+   for (EmuHeap *h = this; h; h = h->nextHeap) {
+      for (MallocNode *m = h->head; m; m = m->next) {
+         m->changed = false;
+      }
+   }
+}
+
 //Destructor for the emulator heap
 EmuHeap::~EmuHeap() {
    if (nextHeap) {
@@ -194,14 +411,101 @@ void EmuHeap::writeByte(unsigned int addr, unsigned char val) {
    }
 }
 
+//where a walk of the blocks for addr can begin, block access is often
+//sequential so the last walk usually ended close by
+MallocNode *EmuHeap::seek(unsigned int addr) {
+   return (cursor && cursor->base <= addr) ? cursor : head;
+}
+
+//Read len bytes starting at addr, unallocated bytes read as zero
+void EmuHeap::readBlock(unsigned int addr, unsigned char *buf, unsigned int len) {
+   MallocNode *p = seek(addr);
+   while (len) {
+      unsigned int n;
+      //skip blocks that lie entirely below addr
+      while (p && (p->base + p->size) <= addr) p = p->next;
+      if (p && p->base <= addr) {
+         n = p->base + p->size - addr;
+         if (n > len) n = len;
+         memcpy(buf, p->bytes() + (addr - p->base), n);
+         cursor = p;
+      }
+      else {
+         n = p ? p->base - addr : len;
+         if (n > len) n = len;
+         memset(buf, 0, n);
+      }
+      addr += n;
+      buf += n;
+      len -= n;
+   }
+}
+
+//Write len bytes starting at addr, writes to unallocated bytes are dropped
+void EmuHeap::writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len) {
+   MallocNode *p = seek(addr);
+   while (len) {
+      unsigned int n;
+      while (p && (p->base + p->size) <= addr) p = p->next;
+      if (p && p->base <= addr) {
+         n = p->base + p->size - addr;
+         if (n > len) n = len;
+         memcpy(p->writable() + (addr - p->base), buf, n);
+         p->changed = true;
+         cursor = p;
+      }
+      else {
+         //oops, writing to unallocated memory!
+         n = p ? p->base - addr : len;
+         if (n > len) n = len;
+      }
+      addr += n;
+      buf += n;
+      len -= n;
+   }
+}
+
+//Offset of the first occurrence of val in [addr, addr + len), or len
+unsigned int EmuHeap::findByte(unsigned int addr, unsigned char val, unsigned int len) {
+   MallocNode *p = seek(addr);
+   unsigned int offset = 0;
+   while (offset < len) {
+      unsigned int n;
+      while (p && (p->base + p->size) <= addr) p = p->next;
+      if (p && p->base <= addr) {
+         n = p->base + p->size - addr;
+         if (n > len - offset) n = len - offset;
+         cursor = p;
+         const unsigned char *start = p->bytes() + (addr - p->base);
+         unsigned char *r = (unsigned char*) memchr(start, val, n);
+         if (r) return offset + (unsigned int)(r - start);
+      }
+      else {
+         //unallocated bytes read as zero
+         if (val == 0) return offset;
+         n = p ? p->base - addr : len - offset;
+         if (n > len - offset) n = len - offset;
+      }
+      addr += n;
+      offset += n;
+   }
+   return len;
+}
+
 //Emulation heap malloc function
 unsigned int EmuHeap::malloc(unsigned int size) {
+   unsigned int req = size;
    size = (size + 3) & 0xFFFFFFFC;  //round up to word boundary
    //find a gap that we can fit in
    unsigned int addr = findBlock(size);
    if (addr != HEAP_ERROR) {
       //create and insert a new malloc node into the allocation list
-      insert(new MallocNode(size, addr));
+      MallocNode *node = new MallocNode(size, addr);
+      insert(node);
+      if (shadow) {
+         node->site = shadow->currentSite();
+         shadow->allocate(addr, req, size, false);
+      }
    }
    return addr;
 }
@@ -214,6 +518,9 @@ unsigned int EmuHeap::calloc(unsigned int nmemb, unsigned int size) {
       //find the newly malloc'ed block and zeroize it
       MallocNode *node = findMallocNode(addr); //this should never fail
       memset(node->block, 0, node->size);
+      if (shadow) {
+         shadow->mark(addr, nmemb * size, SHADOW_VALID);
+      }
    }
    return addr;
 }
@@ -233,6 +540,10 @@ unsigned int EmuHeap::free(unsigned int addr) {
             else {
                head = t->next;
             }
+            if (shadow) {
+               shadow->release(t->base, t->size, t->site);
+            }
+            if (t == cursor) cursor = NULL;
             //free the malloc'ed memory
             delete t;
             break;
@@ -240,7 +551,12 @@ unsigned int EmuHeap::free(unsigned int addr) {
          p = t;
          t = t->next;
       }
-      if (t == NULL) addr = 0;
+      if (t == NULL) {
+         if (shadow) {
+            shadow->badFree(addr);
+         }
+         addr = 0;
+      }
    }
    return addr;
 }
@@ -255,27 +571,34 @@ unsigned int EmuHeap::realloc(unsigned int ptr, unsigned int size) {
    else {
       //find the malloc'ed node
       MallocNode *node = findMallocNode(ptr);
+      unsigned int req = size;
       //round the new size to a word boundary
       size = (size + 3) & 0xFFFFFFFC;
       if (node) {
          if (size == node->size) {
             //no change in size? do nothing
+            if (shadow) shadow->resize(ptr, req, node->size);
             result = ptr;
          }
          else if (size < node->size) {
             //node shrinking, shrink node size and realloc its block
+            if (shadow) shadow->resize(ptr, req, node->size);
             node->size = size;
-            node->block = (unsigned char*) ::realloc(node->block, size);
+            if (node->block) {
+               node->block = (unsigned char*) ::realloc(node->block, size);
+            }
+            node->changed = true;
             result = ptr;
          }
          else {
             //node growing, allocate new block
-            result = this->malloc(size);
+            result = this->malloc(req);
             if (result != HEAP_ERROR) {
                //find the newly allocated node
                MallocNode *newnode = findMallocNode(result);
                //copy the old block into the new larger block
-               memcpy(newnode->block, node->block, node->size);
+               memcpy(newnode->block, node->bytes(), node->size);
+               if (shadow) shadow->copy(result, ptr, node->size);
                //free the old block
                this->free(ptr);
             }
@@ -293,6 +616,50 @@ EmuHeap *EmuHeap::contains(unsigned int addr) {
    return NULL;
 }
 
+bool EmuHeap::nearestBlock(unsigned int addr, unsigned int *base, unsigned int *size, unsigned int *site) {
+   MallocNode *best = NULL;
+   unsigned int dist = 0xFFFFFFFF;
+   for (MallocNode *p = head; p; p = p->next) {
+      unsigned int d;
+      if (p->contains(addr)) d = 0;
+      else if (addr < p->base) d = p->base - addr;
+      else d = addr - (p->base + p->size) + 1;
+      if (d < dist) {
+         dist = d;
+         best = p;
+      }
+      if (p->base > addr) break;   //sorted, nothing closer beyond here
+   }
+   if (best) {
+      *base = best->base;
+      *size = best->size;
+      *site = best->site;
+   }
+   return best != NULL;
+}
+
+bool EmuHeap::blockAt(unsigned int addr, unsigned int *base, unsigned int *size) {
+   MallocNode *p = seek(addr);
+   while (p && (p->base + p->size) <= addr) p = p->next;
+   if (p == NULL || p->base > addr) return false;
+   cursor = p;
+   *base = p->base;
+   *size = p->size;
+   return true;
+}
+
+//existing blocks are assumed to be fully initialized
+void EmuHeap::setShadow(ShadowMemory *s) {
+   for (EmuHeap *h = this; h; h = h->nextHeap) {
+      h->shadow = s;
+      if (s) {
+         for (MallocNode *p = h->head; p; p = p->next) {
+            s->mark(p->base, p->size, SHADOW_VALID);
+         }
+      }
+   }
+}
+
 //insert a newly malloc'ed node into the allocation list
 //the list is sorted by increasing base address
 void EmuHeap::insert(MallocNode *node) {
@@ -335,28 +702,32 @@ MallocNode *EmuHeap::findMallocNode(unsigned int addr) {
 }
 
 //locate a block large enough to satisfy the caller's request
-//keep a 4 byte gap between all blocks in order to detect overflows
+//keep a gap between all blocks in order to detect overflows, the
+//gap grows to the shadow redzone size when heap checking is on
 unsigned int EmuHeap::findBlock(unsigned int size) {
    unsigned int result = HEAP_ERROR;
+   unsigned int spacing = shadow ? shadow->getRedzone() : HEAP_GAP;
    MallocNode *p;
    //first see if we can fit in a gap between exiting blocks
    for (p = head; p && p->next; p = p->next) {
       unsigned int gap = p->next->base - (p->base + p->size);
-      if ((size + 8) <= gap) {
+      if ((size + 2 * spacing) <= gap) {
          break;
       }
    }
    if (p) {
       //compute the start address of the block
-      unsigned int nextBase = p->base + p->size + 4;
+      unsigned int nextBase = p->base + p->size + spacing;
       if ((nextBase + size) < max) {
          //success only if we are not out of memory
          result = nextBase;
       }
    }
    else { //first block goes at the base of the heap
-      if ((base + size) < max) {
-         result = base;
+      //leave room for a leading redzone when checking
+      unsigned int first = shadow ? base + spacing : base;
+      if ((first + size) < max) {
+         result = first;
       }
    }
    return result;
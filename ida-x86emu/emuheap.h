@@ -22,16 +22,38 @@
 #define __EMUHEAP_H
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "buffer.h"
+#include "shadow.h"
 
 #define HEAP_ERROR 0xFFFFFFFF
 #define HEAP_MAGIC 0xDEADBEEF
+#define HEAP_GAP 4      //minimum spacing between blocks
+
+/*
+ * A loaded state's bytes, kept for the blocks that still read their
+ * contents from it.  Each such block holds a reference, as does the
+ * loader while it parses, and the bytes are freed once the last of
+ * them lets go.
+ */
+class HeapImage {
+public:
+   HeapImage(unsigned char *data) {this->data = data; refs = 1;};
+   void addRef() {refs++;};
+   void release() {if (--refs == 0) delete this;};
+
+private:
+   ~HeapImage() {free(data);};
+   unsigned char *data;
+   unsigned int refs;
+};
 
 class MallocNode {
    friend class EmuHeap;
 public:
    MallocNode(unsigned int size, unsigned int base);
-   MallocNode(Buffer &b);
+   //contents are left in image, if there is one, until first written
+   MallocNode(Buffer &b, HeapImage *image);
 
    ~MallocNode();
 
@@ -42,9 +64,18 @@ public:
    void save(Buffer &b);
 
 private:
+   //contents for reading, wherever they are
+   const unsigned char *bytes() {return block ? block : src;};
+   //contents for writing, copied out of the image the first time
+   unsigned char *writable();
+
    unsigned int base;
    unsigned char *block;
+   const unsigned char *src;   //contents in image while block is NULL
+   HeapImage *image;
    unsigned int size;
+   unsigned int site;   //instruction that allocated the block, if known
+   bool changed;        //written since the last save or load
    MallocNode *next;
 };
 
@@ -52,7 +83,7 @@ class EmuHeap {
    friend class MemoryManager;
 public:
    EmuHeap(unsigned int baseAddr, unsigned int maxSize, EmuHeap *next = NULL);
-   EmuHeap(Buffer &b);
+   EmuHeap(Buffer &b, HeapImage *image = NULL);
    ~EmuHeap();
    unsigned int malloc(unsigned int size);
    unsigned int calloc(unsigned int nmemb, unsigned int size);
@@ -62,6 +93,15 @@ public:
    unsigned char readByte(unsigned int addr);
    void writeByte(unsigned int addr, unsigned char val);
    EmuHeap *contains(unsigned int addr);
+   //block containing or nearest to addr, false if the heap is empty
+   bool nearestBlock(unsigned int addr, unsigned int *base, unsigned int *size, unsigned int *site);
+   //allocated block holding addr, false if there is none
+   bool blockAt(unsigned int addr, unsigned int *base, unsigned int *size);
+
+   //block access, [addr, addr + len) must lie within this heap
+   void readBlock(unsigned int addr, unsigned char *buf, unsigned int len);
+   void writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len);
+   unsigned int findByte(unsigned int addr, unsigned char val, unsigned int len);
    
    unsigned int getHeapBase() {return base;};
    unsigned int getHeapSize() {return max - base;};
@@ -70,21 +110,42 @@ public:
    //careful to avoid memory leaks when calling this!
    void setNextHeap(EmuHeap *heap) {nextHeap = heap;};
 
+   //start or stop shadow checking for this heap and all that follow it
+   void setShadow(ShadowMemory *s);
+
    void save(Buffer &b);
+   //every block of this heap and those that follow it, with the contents
+   //of only those written since the last save or load
+   void saveDelta(Buffer &b);
+   //rebuild this heap's blocks from a delta, unchanged ones are kept
+   bool loadDelta(Buffer &b, unsigned int num_blocks);
+   //forget what has been written in this heap and those that follow it
+   void markClean();
+   //where the blocks of this heap and those that follow it lie, without
+   //their contents, and a heap list rebuilt from that with every block
+   //zero filled.  NULL if there are no heaps.
+   void saveLayout(Buffer &b);
+   static EmuHeap *loadLayout(Buffer &b);
+   //address of each page (of 1 << shift bytes) that this heap's blocks
+   //touch, in order, pages may be NULL to count them first
+   unsigned int blockPages(unsigned int shift, unsigned int *pages);
 
 private:
-   EmuHeap(Buffer &b, unsigned int num_blocks);
+   EmuHeap(Buffer &b, unsigned int num_blocks, HeapImage *image);
 
+   MallocNode *seek(unsigned int addr);
    MallocNode *findNode(unsigned int addr);
    MallocNode *findMallocNode(unsigned int addr);
    unsigned int findBlock(unsigned int size);
    void insert(MallocNode *node);
-   void readHeap(Buffer &b, unsigned int num_blocks);
+   void readHeap(Buffer &b, unsigned int num_blocks, HeapImage *image);
    void writeHeap(Buffer &b);
    unsigned int base;
    unsigned int max;
    MallocNode *head;
+   MallocNode *cursor;  //where the last block access was, NULL if freed
    EmuHeap *nextHeap;
+   ShadowMemory *shadow;
 };
 
 #endif
@@ -17,71 +17,248 @@
    this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
    Place, Suite 330, Boston, MA 02111-1307 USA
 */
-
 #include <stdlib.h>
+#include <string.h>
 #include "emustack.h"
 
 #define BLOCK_INCREMENT 0x1000
 
+//granularity of change tracking for incremental saves
+#define STACK_PAGE_SIZE 0x1000
+#define STACK_PAGE_SHIFT 12
+
+/*
+ * The stack is stored in address order.  stack[0] holds the byte at
+ * top - allocated and stack[allocated - 1] the byte at top - 1.  Saved
+ * state blobs hold the stack in the reverse order, starting at top - 1.
+ */
+
+//copy len bytes from src to dest in reverse order
+static void reverseCopy(unsigned char *dest, const unsigned char *src, unsigned int len) {
+   src += len;
+   while (len--) {
+      *dest++ = *--src;
+   }
+}
+
 EmuStack::EmuStack(unsigned int stackTop, unsigned int maxSize) {
    top = stackTop;
    this->maxSize = maxSize;
    bottom = top - maxSize;
    allocated = maxSize < 0x8000 ? maxSize : 0x8000;
-   stack = (unsigned char*) malloc(allocated);
+   stack = (unsigned char*) calloc(allocated, 1);
+   pages = (maxSize + STACK_PAGE_SIZE - 1) >> STACK_PAGE_SHIFT;
+   changed = (unsigned char*) calloc(pages, 1);
+   savedSp = top;    //never saved, the first delta carries everything
 }
 
 EmuStack::EmuStack(Buffer &b) {
-   unsigned int sp;
+   unsigned int sp, len;
    b.read((char*)&sp, sizeof(sp));
    b.read((char*)&top, sizeof(top));
    b.read((char*)&bottom, sizeof(bottom));
    b.read((char*)&maxSize, sizeof(maxSize));
    b.read((char*)&allocated, sizeof(allocated));
-   stack = (unsigned char*) malloc(allocated);
-   b.read((char*)stack, top - sp);
+   len = top - sp;
+   if (len > allocated) allocated = len;
+   stack = (unsigned char*) calloc(allocated, 1);
+   const unsigned char *saved = b.read_view(len);
+   if (stack && saved) {
+      reverseCopy(stack + allocated - len, saved, len);
+   }
+   pages = (maxSize + STACK_PAGE_SIZE - 1) >> STACK_PAGE_SHIFT;
+   changed = (unsigned char*) calloc(pages, 1);
+   savedSp = sp;
 }
 
 void EmuStack::save(Buffer &b, unsigned int sp) {
+   unsigned int len = top - sp;
+   if (len > allocated) {
+      //sp is not within the stack, save everything we have
+      len = allocated;
+      sp = top - len;
+   }
+   b.write((char*)&sp, sizeof(sp));
+   b.write((char*)&top, sizeof(top));
+   b.write((char*)&bottom, sizeof(bottom));
+   b.write((char*)&maxSize, sizeof(maxSize));
+   b.write((char*)&allocated, sizeof(allocated));
+   unsigned char *dest = b.write_view(len);
+   if (dest) {
+      reverseCopy(dest, stack + allocated - len, len);
+   }
+}
+
+//lowest address of page k that is at or above sp
+unsigned int EmuStack::pageLow(unsigned int k, unsigned int sp) {
+   unsigned int offset = (k + 1) << STACK_PAGE_SHIFT;
+   return offset >= top - sp ? sp : top - offset;
+}
+
+/*
+ * Only the pages of [sp, top) written since the last save, plus any that
+ * reach below the sp of that save, each as address, length and bytes.
+ * Everything below sp reads as zero after loading, as it would after
+ * loading a full save.
+ */
+void EmuStack::saveDelta(Buffer &b, unsigned int sp) {
+   unsigned int len = top - sp;
+   unsigned int count = 0;
+   unsigned int k, n;
+   if (len > allocated) {
+      len = allocated;
+      sp = top - len;
+   }
    b.write((char*)&sp, sizeof(sp));
    b.write((char*)&top, sizeof(top));
    b.write((char*)&bottom, sizeof(bottom));
    b.write((char*)&maxSize, sizeof(maxSize));
    b.write((char*)&allocated, sizeof(allocated));
-   b.write((char*)stack, top - sp);
+   n = (len + STACK_PAGE_SIZE - 1) >> STACK_PAGE_SHIFT;
+   for (k = 0; k < n; k++) {
+      if (changed[k] || pageLow(k, sp) < savedSp) count++;
+   }
+   b.write((char*)&count, sizeof(count));
+   for (k = 0; k < n; k++) {
+      unsigned int low = pageLow(k, sp);
+      if (changed[k] || low < savedSp) {
+         unsigned int size = top - (k << STACK_PAGE_SHIFT) - low;
+         b.write((char*)&low, sizeof(low));
+         b.write((char*)&size, sizeof(size));
+         unsigned char *dest = b.write_view(size);
+         if (dest) {
+            readBlock(low, dest, size);
+         }
+      }
+   }
+}
+
+bool EmuStack::loadDelta(Buffer &b) {
+   unsigned int sp, newTop, newBottom, newMax, newAllocated, count;
+   b.read((char*)&sp, sizeof(sp));
+   b.read((char*)&newTop, sizeof(newTop));
+   b.read((char*)&newBottom, sizeof(newBottom));
+   b.read((char*)&newMax, sizeof(newMax));
+   b.read((char*)&newAllocated, sizeof(newAllocated));
+   b.read((char*)&count, sizeof(count));
+   if (b.has_error() || newTop - sp > newMax) return false;
+   if (newTop != top || newMax != maxSize) {
+      rebase(newTop, newMax);
+   }
+   for (unsigned int i = 0; i < count; i++) {
+      unsigned int addr, size;
+      b.read((char*)&addr, sizeof(addr));
+      b.read((char*)&size, sizeof(size));
+      const unsigned char *data = b.read_view(size);
+      //each piece must lie within [sp, top)
+      if (data == NULL || size > top - sp || addr - sp > top - sp - size) return false;
+      writeBlock(addr, data, size);
+   }
+   if (top - sp < allocated) {
+      memset(stack, 0, allocated - (top - sp));
+   }
+   markClean(sp);
+   return true;
+}
+
+void EmuStack::markClean(unsigned int sp) {
+   if (top - sp > allocated) sp = top - allocated;
+   memset(changed, 0, pages);
+   savedSp = sp;
+}
+
+void EmuStack::markChanged(unsigned int addr, unsigned int len) {
+   if (len == 0) return;
+   unsigned int first = (top - addr - len) >> STACK_PAGE_SHIFT;
+   unsigned int last = (top - addr - 1) >> STACK_PAGE_SHIFT;
+   if (last >= pages) last = pages - 1;
+   for (unsigned int k = first; k <= last; k++) {
+      changed[k] = 1;
+   }
 }
 
 EmuStack::~EmuStack() {
    free(stack);
+   free(changed);
 }
 
 void EmuStack::rebase(unsigned int stackTop, unsigned int maxSize) {
    top = stackTop;
    if (maxSize < allocated) {
+      //keep the bytes nearest the top of the stack
+      memmove(stack, stack + allocated - maxSize, maxSize);
       stack = (unsigned char*) realloc(stack, maxSize);
       allocated = maxSize;
    }
    this->maxSize = maxSize;
    bottom = top - maxSize;
+   pages = (maxSize + STACK_PAGE_SIZE - 1) >> STACK_PAGE_SHIFT;
+   changed = (unsigned char*) realloc(changed, pages);
+   memset(changed, 0, pages);
+   savedSp = top;    //every address moved, save it all next time
 }
 
 bool EmuStack::contains(unsigned int addr) {
    return (addr < top) && (addr >= bottom);
 }
 
+//make sure that addr falls within the allocated portion of the stack
+void EmuStack::grow(unsigned int addr) {
+   unsigned int internal = top - addr;
+   if (internal > allocated) {
+      //allocate to next BLOCK_INCREMENT boundary above internal
+      unsigned int newSize = (internal + BLOCK_INCREMENT) & ~(BLOCK_INCREMENT - 1);
+      unsigned int added = newSize - allocated;
+      stack = (unsigned char*) realloc(stack, newSize);
+      memmove(stack + added, stack, allocated);
+      memset(stack, 0, added);
+      allocated = newSize;
+   }
+}
+
 unsigned char EmuStack::readByte(unsigned int addr) {
    unsigned int internal = top - addr;
-   return internal > allocated ? 0 : stack[internal - 1];
+   return internal > allocated ? 0 : stack[allocated - internal];
 }
 
 void EmuStack::writeByte(unsigned int addr, unsigned char val) {
-   unsigned int internal = top - addr;
-   if (internal > allocated) {
-      //allocate to next BLOCK_INCREMENT boundary above internal
-      allocated = (internal + BLOCK_INCREMENT) & ~(BLOCK_INCREMENT - 1);
-      stack = (unsigned char*) realloc(stack, allocated);
+   grow(addr);
+   stack[allocated - (top - addr)] = val;
+   unsigned int k = (top - addr - 1) >> STACK_PAGE_SHIFT;
+   if (k < pages) changed[k] = 1;
+}
+
+void EmuStack::readBlock(unsigned int addr, unsigned char *buf, unsigned int len) {
+   unsigned int low = top - allocated;
+   if (addr < low) {
+      //the unallocated portion reads as zero
+      unsigned int gap = low - addr;
+      if (gap > len) gap = len;
+      memset(buf, 0, gap);
+      addr += gap;
+      buf += gap;
+      len -= gap;
    }
-   stack[internal - 1] = val;
+   memcpy(buf, stack + (addr - low), len);
 }
 
+void EmuStack::writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len) {
+   grow(addr);
+   memcpy(stack + allocated - (top - addr), buf, len);
+   markChanged(addr, len);
+}
 
+//returns the offset of the first occurrence of val, or len if not found
+unsigned int EmuStack::findByte(unsigned int addr, unsigned char val, unsigned int len) {
+   unsigned int low = top - allocated;
+   unsigned int offset = 0;
+   if (addr < low) {
+      unsigned int gap = low - addr;
+      if (gap >= len) return val ? len : 0;
+      if (val == 0) return 0;
+      offset = gap;
+   }
+   unsigned char *p = stack + (addr + offset - low);
+   unsigned char *r = (unsigned char*) memchr(p, val, len - offset);
+   return r ? offset + (unsigned int)(r - p) : len;
+}
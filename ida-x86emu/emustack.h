@@ -38,14 +38,31 @@ public:
    unsigned char readByte(unsigned int addr);
    void writeByte(unsigned int addr, unsigned char val);
 
+   //block access, [addr, addr + len) must lie within the stack
+   void readBlock(unsigned int addr, unsigned char *buf, unsigned int len);
+   void writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len);
+   unsigned int findByte(unsigned int addr, unsigned char val, unsigned int len);
+
    void save(Buffer &b, unsigned int sp);
+   //pages written since the last save or load, applied over that state
+   void saveDelta(Buffer &b, unsigned int sp);
+   bool loadDelta(Buffer &b);
+   //the stack was just saved or loaded with this sp
+   void markClean(unsigned int sp);
 
 private:
+   void grow(unsigned int addr);
+   void markChanged(unsigned int addr, unsigned int len);
+   unsigned int pageLow(unsigned int k, unsigned int sp);
+
    unsigned char *stack;
    unsigned int top;
    unsigned int bottom;
    unsigned int maxSize;
    unsigned int allocated;
+   unsigned char *changed;    //one flag per page written, counted down from top
+   unsigned int pages;
+   unsigned int savedSp;      //nothing below this made it into the last save
 
 };
 
@@ -0,0 +1,433 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: engine.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "cpu.h"
+#include "break.h"
+#include "engine.h"
+
+//instructions between looks at the clock during a run
+#define CLOCK_CHECK 4096
+
+struct EngineThread {
+#ifdef WIN32
+   HANDLE handle;
+   DWORD id;
+   CRITICAL_SECTION lock;
+   HANDLE wake;     //auto reset, set by post and by the destructor
+   HANDLE idle;     //manual reset, set while there is nothing to do
+#else
+   pthread_t handle;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   pthread_cond_t idle;
+   bool isIdle;
+#endif
+};
+
+#ifdef WIN32
+
+static DWORD WINAPI threadMain(LPVOID arg) {
+   Engine::work(arg);
+   return 0;
+}
+
+static bool createThread(EngineThread *t, void *engine) {
+   InitializeCriticalSection(&t->lock);
+   t->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+   t->idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+   if (t->wake && t->idle) {
+      t->handle = CreateThread(NULL, 0, threadMain, engine, 0, &t->id);
+   }
+   if (t->handle == NULL) {
+      if (t->wake) CloseHandle(t->wake);
+      if (t->idle) CloseHandle(t->idle);
+      DeleteCriticalSection(&t->lock);
+      return false;
+   }
+   return true;
+}
+
+static void joinThread(EngineThread *t) {
+   WaitForSingleObject(t->handle, INFINITE);
+   CloseHandle(t->handle);
+   CloseHandle(t->wake);
+   CloseHandle(t->idle);
+   DeleteCriticalSection(&t->lock);
+}
+
+static void lockEngine(EngineThread *t) {
+   EnterCriticalSection(&t->lock);
+}
+
+static void unlockEngine(EngineThread *t) {
+   LeaveCriticalSection(&t->lock);
+}
+
+//called with the lock held, returns with it held
+static void waitWork(EngineThread *t) {
+   LeaveCriticalSection(&t->lock);
+   WaitForSingleObject(t->wake, INFINITE);
+   EnterCriticalSection(&t->lock);
+}
+
+static void wakeWorker(EngineThread *t) {
+   SetEvent(t->wake);
+}
+
+//called with the lock held
+static void setIdle(EngineThread *t, bool idle) {
+   if (idle) SetEvent(t->idle);
+   else ResetEvent(t->idle);
+}
+
+static bool waitIdleFor(EngineThread *t, unsigned int ms) {
+   return WaitForSingleObject(t->idle, ms) == WAIT_OBJECT_0;
+}
+
+static bool isWorker(EngineThread *t) {
+   return GetCurrentThreadId() == t->id;
+}
+
+unsigned int Engine::now() {
+   return GetTickCount();
+}
+
+#else
+
+static void *threadMain(void *arg) {
+   Engine::work(arg);
+   return NULL;
+}
+
+static bool createThread(EngineThread *t, void *engine) {
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->wake, NULL);
+   pthread_cond_init(&t->idle, NULL);
+   t->isIdle = true;
+   if (pthread_create(&t->handle, NULL, threadMain, engine) != 0) {
+      pthread_cond_destroy(&t->idle);
+      pthread_cond_destroy(&t->wake);
+      pthread_mutex_destroy(&t->lock);
+      return false;
+   }
+   return true;
+}
+
+static void joinThread(EngineThread *t) {
+   pthread_join(t->handle, NULL);
+   pthread_cond_destroy(&t->idle);
+   pthread_cond_destroy(&t->wake);
+   pthread_mutex_destroy(&t->lock);
+}
+
+static void lockEngine(EngineThread *t) {
+   pthread_mutex_lock(&t->lock);
+}
+
+static void unlockEngine(EngineThread *t) {
+   pthread_mutex_unlock(&t->lock);
+}
+
+//called with the lock held, returns with it held
+static void waitWork(EngineThread *t) {
+   pthread_cond_wait(&t->wake, &t->lock);
+}
+
+static void wakeWorker(EngineThread *t) {
+   pthread_cond_signal(&t->wake);
+}
+
+//called with the lock held
+static void setIdle(EngineThread *t, bool idle) {
+   t->isIdle = idle;
+   if (idle) pthread_cond_broadcast(&t->idle);
+}
+
+static bool waitIdleFor(EngineThread *t, unsigned int ms) {
+   struct timespec until;
+   clock_gettime(CLOCK_REALTIME, &until);
+   until.tv_sec += ms / 1000;
+   until.tv_nsec += (ms % 1000) * 1000000;
+   if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+   }
+   pthread_mutex_lock(&t->lock);
+   while (!t->isIdle) {
+      if (pthread_cond_timedwait(&t->idle, &t->lock, &until) == ETIMEDOUT) break;
+   }
+   bool result = t->isIdle;
+   pthread_mutex_unlock(&t->lock);
+   return result;
+}
+
+static bool isWorker(EngineThread *t) {
+   return pthread_equal(pthread_self(), t->handle) != 0;
+}
+
+unsigned int Engine::now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#endif
+
+Engine::Engine(unsigned int publishMs) {
+   thread = NULL;
+   this->publishMs = publishMs;
+   head = count = 0;
+   active = quit = false;
+   stopRequest = STOP_NONE;
+   check = NULL;
+   checkUser = NULL;
+   progress = NULL;
+   progressUser = NULL;
+   memset(&status, 0, sizeof(status));
+   executed = lastExecuted = 0;
+   lastPublish = 0;
+}
+
+Engine::~Engine() {
+   if (thread) {
+      lockEngine(thread);
+      quit = true;
+      count = 0;
+      stopRequest = STOP_CANCELLED;
+      wakeWorker(thread);
+      unlockEngine(thread);
+      joinThread(thread);
+      delete thread;
+   }
+}
+
+bool Engine::start() {
+   if (thread) return true;
+   thread = new EngineThread;
+   memset(thread, 0, sizeof(EngineThread));
+   if (!createThread(thread, this)) {
+      delete thread;
+      thread = NULL;
+      return false;
+   }
+   return true;
+}
+
+bool Engine::post(int command, dword addr) {
+   if (thread == NULL) return runInline(command, addr);
+   bool result = true;
+   lockEngine(thread);
+   if (command == ENGINE_PAUSE) {
+      if (active) stopRequest = STOP_PAUSED;
+   }
+   else if (command == ENGINE_CANCEL) {
+      count = 0;
+      if (active) stopRequest = STOP_CANCELLED;
+   }
+   else if (count == ENGINE_QUEUE) {
+      result = false;
+   }
+   else {
+      unsigned int tail = (head + count) % ENGINE_QUEUE;
+      commands[tail] = command;
+      addrs[tail] = addr;
+      count++;
+      setIdle(thread, false);
+      wakeWorker(thread);
+   }
+   unlockEngine(thread);
+   return result;
+}
+
+bool Engine::busy() {
+   if (thread == NULL) return active;
+   lockEngine(thread);
+   bool result = active || count != 0;
+   unlockEngine(thread);
+   return result;
+}
+
+bool Engine::waitIdle(unsigned int ms) {
+   return thread == NULL || waitIdleFor(thread, ms);
+}
+
+void Engine::getStatus(EngineStatus *s) {
+   if (thread == NULL) {
+      *s = status;
+      return;
+   }
+   lockEngine(thread);
+   *s = status;
+   unlockEngine(thread);
+}
+
+void Engine::setStopCheck(EngineCheck check, void *user) {
+   this->check = check;
+   checkUser = user;
+}
+
+void Engine::setProgress(EngineProgress progress, void *user) {
+   this->progress = progress;
+   progressUser = user;
+}
+
+bool Engine::onWorker() {
+   return thread != NULL && isWorker(thread);
+}
+
+void Engine::work(void *engine) {
+   ((Engine*)engine)->runLoop();
+}
+
+void Engine::runLoop() {
+   lockEngine(thread);
+   while (!quit) {
+      if (count == 0) {
+         setIdle(thread, true);
+         waitWork(thread);
+         continue;
+      }
+      int command = commands[head];
+      dword addr = addrs[head];
+      head = (head + 1) % ENGINE_QUEUE;
+      count--;
+      active = true;
+      stopRequest = STOP_NONE;
+      unlockEngine(thread);
+
+      lastPublish = now();
+      lastExecuted = executed;
+      int reason = execute(command, addr);
+      publish(false, reason);
+
+      lockEngine(thread);
+      active = false;
+   }
+   unlockEngine(thread);
+}
+
+//no worker, the command runs on the caller's thread and nothing can be
+//queued behind it
+bool Engine::runInline(int command, dword addr) {
+   if (command == ENGINE_PAUSE) {
+      if (active) stopRequest = STOP_PAUSED;
+      return true;
+   }
+   if (command == ENGINE_CANCEL) {
+      if (active) stopRequest = STOP_CANCELLED;
+      return true;
+   }
+   if (active) return false;
+   active = true;
+   stopRequest = STOP_NONE;
+   lastPublish = now();
+   lastExecuted = executed;
+   int reason = execute(command, addr);
+   publish(false, reason);
+   active = false;
+   return true;
+}
+
+//stop a run when heap checking has reported an error
+static bool heapFault() {
+   return mm->shadow && mm->shadow->takeFault();
+}
+
+int Engine::execute(int command, dword addr) {
+   if (command == ENGINE_STEP) {
+      executeInstruction();
+      executed++;
+      return STOP_DONE;
+   }
+   //discard anything reported while stepping
+   heapFault();
+   unsigned int n = 0;
+   while (1) {
+      if (command == ENGINE_RUN_TO) {
+         if (eip == addr) return STOP_DONE;
+      }
+      else if (isBreakpoint(eip)) {
+         return STOP_BREAKPOINT;
+      }
+      if (check && (*check)(checkUser)) return STOP_CHECK;
+      executeInstruction();
+      executed++;
+      if (heapFault()) return STOP_HEAP;
+      if (++n == CLOCK_CHECK) {
+         //pause and cancel are looked at along with the clock
+         n = 0;
+         if (thread) lockEngine(thread);
+         int stop = stopRequest;
+         if (thread) unlockEngine(thread);
+         if (stop != STOP_NONE) return stop;
+         if (now() - lastPublish >= publishMs) {
+            publish(true, STOP_NONE);
+            if (progress) (*progress)(progressUser);
+         }
+      }
+   }
+}
+
+//called on the thread running the command, the only one touching the
+//cpu while it runs
+void Engine::publish(bool running, int reason) {
+   unsigned int t = now();
+   dword stack[ENGINE_STACK_DWORDS];
+   unsigned int n = 0;
+   //from the start of esp's 16 byte line, the way stacks are displayed
+   dword from = esp & ~15;
+   if (mm->stack && mm->stack->contains(from)) {
+      dword avail = (mm->stack->getStackTop() - from) / 4;
+      n = avail < ENGINE_STACK_DWORDS ? avail : ENGINE_STACK_DWORDS;
+      mm->stack->readBlock(from, (unsigned char*)stack, n * 4);
+   }
+
+   if (thread) lockEngine(thread);
+   status.serial++;
+   status.running = running;
+   if (!running) {
+      status.stops++;
+      status.stopReason = reason;
+   }
+   memcpy(status.general, general, sizeof(general));
+   status.eip = eip;
+   status.eflags = eflags;
+   status.instructions = executed;
+   if (t != lastPublish) {
+      status.rate = (executed - lastExecuted) * 1000 / (t - lastPublish);
+   }
+   status.stackAddr = from;
+   status.stackCount = n;
+   memcpy(status.stack, stack, n * 4);
+   if (thread) unlockEngine(thread);
+
+   lastPublish = t;
+   lastExecuted = executed;
+}
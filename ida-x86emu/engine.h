@@ -0,0 +1,135 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: engine.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include "x86defs.h"
+
+//commands
+#define ENGINE_STEP    0   //one instruction
+#define ENGINE_RUN     1   //until a breakpoint
+#define ENGINE_RUN_TO  2   //until eip reaches the command's address
+#define ENGINE_PAUSE   3   //stop the current command, the queue carries on
+#define ENGINE_CANCEL  4   //stop the current command and empty the queue
+
+//why the last command ended
+#define STOP_NONE       0
+#define STOP_DONE       1   //stepped, or reached the run to address
+#define STOP_BREAKPOINT 2
+#define STOP_HEAP       3   //heap checking reported an error
+#define STOP_CHECK      4   //the stop check said so
+#define STOP_PAUSED     5
+#define STOP_CANCELLED  6
+
+#define ENGINE_QUEUE 16
+//dwords from esp up in each published status
+#define ENGINE_STACK_DWORDS 64
+
+typedef struct _EngineStatus {
+   unsigned int serial;     //counts publications
+   unsigned int stops;      //counts finished commands
+   bool running;
+   int stopReason;          //for the last finished command
+   dword general[8];
+   dword eip;
+   dword eflags;
+   uquad instructions;      //executed by the engine so far
+   uquad rate;              //instructions per second lately
+   dword stackAddr;         //address of stack[0], esp rounded down to 16
+   unsigned int stackCount; //dwords of stack that are valid
+   dword stack[ENGINE_STACK_DWORDS];
+} EngineStatus;
+
+//called on the worker before each instruction of a run, true stops it
+typedef bool (*EngineCheck)(void *user);
+//called along with each publication during an inline run, where it is
+//the only chance to pause or cancel
+typedef void (*EngineProgress)(void *user);
+
+struct EngineThread;
+
+/*
+ * Runs the emulator on a worker thread so whoever drives it (the
+ * plugin dialog, the command line runner) stays free to watch, pause
+ * or cancel.  Commands are queued and run in order.  While a command
+ * runs the cpu, memory and hooks belong to the worker: others look at
+ * the registers and the top of the stack through the copy published
+ * with getStatus, at most once per publish interval and once more
+ * when each command ends, and only touch emulator state again once
+ * busy returns false.  Event handlers (see events.h) are called on the
+ * worker.
+ *
+ * Without start there is no worker and post runs each command inline,
+ * returning when it is done.  That is for hosts whose handlers call
+ * into something that must stay on one thread, like the IDA kernel in
+ * the plugin.  The progress callback can post pause or cancel.
+ */
+class Engine {
+public:
+   Engine(unsigned int publishMs = 100);
+   //cancels whatever is running and waits for the worker to finish
+   ~Engine();
+
+   bool start();
+   //false if the queue is full, pause and cancel are never queued
+   bool post(int command, dword addr = 0);
+   //a command is running or queued
+   bool busy();
+   //true once the engine is idle, false if ms ran out first
+   bool waitIdle(unsigned int ms);
+   void getStatus(EngineStatus *s);
+   //checked along with breakpoints, set while the engine is idle
+   void setStopCheck(EngineCheck check, void *user);
+   //for inline runs, set while the engine is idle
+   void setProgress(EngineProgress progress, void *user);
+   //true when called from the worker thread
+   bool onWorker();
+
+   static unsigned int now();  //milliseconds, for rates and timeouts
+   //thread entry
+   static void work(void *engine);
+
+private:
+   void runLoop();
+   bool runInline(int command, dword addr);
+   int execute(int command, dword addr);
+   void publish(bool running, int reason);
+
+   EngineThread *thread;
+   unsigned int publishMs;
+   int commands[ENGINE_QUEUE];
+   dword addrs[ENGINE_QUEUE];
+   unsigned int head;
+   unsigned int count;
+   bool active;          //a command is running
+   bool quit;
+   int stopRequest;      //STOP_PAUSED or STOP_CANCELLED
+   EngineCheck check;
+   void *checkUser;
+   EngineProgress progress;
+   void *progressUser;
+   EngineStatus status;
+   uquad executed;
+   uquad lastExecuted;
+   unsigned int lastPublish;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: events.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "memmgr.h"
+#include "events.h"
+
+typedef struct _Subscriber {
+   EventHandler handler;
+   void *user;
+   struct _Subscriber *next;
+} Subscriber;
+
+typedef struct _EventBatch {
+   EmuEvent events[EVENT_BATCH];
+   unsigned int count;
+} EventBatch;
+
+unsigned int eventMask = 0;
+
+static Subscriber *subscribers[EV_KINDS];
+
+//one batch each for reads and writes
+static EventBatch batches[2];
+//memory events raised by a handler while a batch is being handed out
+//are dropped rather than reported out of order
+static bool flushing = false;
+
+bool subscribe(int kind, EventHandler handler, void *user) {
+   if (kind < 0 || kind >= EV_KINDS) return false;
+   Subscriber *s;
+   for (s = subscribers[kind]; s; s = s->next) {
+      if (s->handler == handler && s->user == user) return false;
+   }
+   s = (Subscriber*) malloc(sizeof(Subscriber));
+   if (s == NULL) return false;
+   s->handler = handler;
+   s->user = user;
+   s->next = NULL;
+   //keep subscription order, the first to subscribe hears first
+   Subscriber **p = &subscribers[kind];
+   while (*p) p = &(*p)->next;
+   *p = s;
+   eventMask |= EVENT_BIT(kind);
+   return true;
+}
+
+void unsubscribe(int kind, EventHandler handler, void *user) {
+   if (kind < 0 || kind >= EV_KINDS) return;
+   for (Subscriber **p = &subscribers[kind]; *p; p = &(*p)->next) {
+      Subscriber *s = *p;
+      if (s->handler == handler && s->user == user) {
+         *p = s->next;
+         free(s);
+         break;
+      }
+   }
+   if (subscribers[kind] == NULL) {
+      //whatever is still batched for it has no one to go to
+      if (kind == EV_MEM_READ || kind == EV_MEM_WRITE) {
+         batches[kind - EV_MEM_READ].count = 0;
+      }
+      eventMask &= ~EVENT_BIT(kind);
+   }
+}
+
+static void deliver(int kind, const EmuEvent *events, unsigned int count) {
+   Subscriber *s = subscribers[kind];
+   while (s) {
+      //a handler may unsubscribe itself
+      Subscriber *next = s->next;
+      (*s->handler)(events, count, s->user);
+      s = next;
+   }
+}
+
+static void flushBatch(int kind) {
+   EventBatch *b = &batches[kind - EV_MEM_READ];
+   if (b->count == 0 || flushing) return;
+   flushing = true;
+   deliver(kind, b->events, b->count);
+   b->count = 0;
+   flushing = false;
+}
+
+void flushEvents() {
+   flushBatch(EV_MEM_READ);
+   flushBatch(EV_MEM_WRITE);
+}
+
+void raiseEvent(int kind, dword addr, dword size, dword value) {
+   EmuEvent e;
+   e.kind = kind;
+   e.eip = initial_eip;
+   e.addr = addr;
+   e.size = size;
+   e.value = value;
+   e.region = AS_UNMAPPED;
+   deliver(kind, &e, 1);
+}
+
+void raiseMemEvent(int kind, dword addr, dword size, dword value) {
+   void *owner;
+   raiseMemEvent(kind, addr, size, value, mm ? mm->region(addr, &owner) : AS_UNMAPPED);
+}
+
+void raiseMemEvent(int kind, dword addr, dword size, dword value, int region) {
+   if (flushing) return;
+   EventBatch *b = &batches[kind - EV_MEM_READ];
+   EmuEvent *e = &b->events[b->count++];
+   e->kind = kind;
+   e->eip = initial_eip;
+   e->addr = addr;
+   e->size = size;
+   e->value = value;
+   e->region = region;
+   if (b->count == EVENT_BATCH) flushBatch(kind);
+}
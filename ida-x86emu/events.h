@@ -0,0 +1,80 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: events.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __EVENTS_H
+#define __EVENTS_H
+
+#include "x86defs.h"
+
+//event kinds
+#define EV_INSTRUCTION 0   //about to execute the instruction at addr
+#define EV_MEM_READ    1   //data read by the program, batched
+#define EV_MEM_WRITE   2   //data written, batched
+#define EV_ALLOC       3   //emulated allocator returned addr, size bytes,
+                           //value is non zero for synthetic objects (frame.h)
+#define EV_FREE        4   //emulated free of the block at addr
+#define EV_CALL        5   //call to addr, value is the return address
+#define EV_RETURN      6   //return to addr
+#define EV_INTERRUPT   7   //interrupt size entered, handler at addr
+#define EV_BRANCH      8   //conditional branch went to addr, size is 1 if
+                           //taken, value is where it would have gone
+#define EV_KINDS       9
+
+#define EVENT_BIT(kind) (1 << (kind))
+
+#define EVENT_BATCH 256
+
+typedef struct _EmuEvent {
+   int kind;
+   dword eip;     //instruction that raised the event
+   dword addr;
+   dword size;
+   dword value;   //value read or written by 1, 2 and 4 byte accesses
+   int region;    //AS_ kind of addr for memory events
+} EmuEvent;
+
+//memory events arrive count at a time, everything else one at a time
+typedef void (*EventHandler)(const EmuEvent *events, unsigned int count, void *user);
+
+/*
+ * Anything that wants to watch the emulator (the plugin's stack view,
+ * idastruct, tracing tools) subscribes to the kinds it needs.  Raising
+ * an event is guarded by a test of eventMask, so a kind nobody listens
+ * to costs one test where it would be raised.  Memory events are kept
+ * until EVENT_BATCH of a kind have built up or flushEvents is called,
+ * so stop the emulator through flushEvents before looking at them.
+ */
+extern unsigned int eventMask;
+
+//returns false if the handler is already subscribed to kind
+bool subscribe(int kind, EventHandler handler, void *user = NULL);
+void unsubscribe(int kind, EventHandler handler, void *user = NULL);
+
+//hand out anything batched
+void flushEvents();
+
+//delivered at once, callers test eventMask first
+void raiseEvent(int kind, dword addr, dword size = 0, dword value = 0);
+//batched, region is looked up here
+void raiseMemEvent(int kind, dword addr, dword size, dword value);
+//batched, for callers that already know the region
+void raiseMemEvent(int kind, dword addr, dword size, dword value, int region);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: explore.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "memmgr.h"
+#include "events.h"
+#include "explore.h"
+
+#define TABLE_START 1024
+#define EMPTY_MEMBER 0xFFFFFFFF
+//instructions between looks at the clock
+#define CLOCK_CHECK 4096
+
+//BranchSlot flags, shifted left by the direction, 1 for taken
+#define BRANCH_SEEN   1
+#define BRANCH_QUEUED 4
+
+//priority points
+#define PRI_FRESH 4   //a new offset was found since the last branch
+#define PRI_NEAR  2   //a tracked block was accessed since the last branch
+
+static unsigned int hashDword(dword v) {
+   return v * 2654435761U;
+}
+
+Explorer::Explorer(uquad budget, unsigned int seconds, unsigned int pathLimit) {
+   this->budget = budget;
+   this->seconds = seconds;
+   this->pathLimit = pathLimit;
+   home = NULL;
+   numPending = order = 0;
+   branchMask = memberMask = siteMask = TABLE_START - 1;
+   branches = (BranchSlot*)calloc(TABLE_START, sizeof(BranchSlot));
+   members = (MemberSlot*)malloc(TABLE_START * sizeof(MemberSlot));
+   memset(members, 0xFF, TABLE_START * sizeof(MemberSlot));
+   sites = (SiteSlot*)calloc(TABLE_START, sizeof(SiteSlot));
+   numSites = numTracked = 0;
+   pathEnd = NULL;
+   pathUser = NULL;
+   pathSteps = 0;
+   started = 0;
+   done = quiet = false;
+   near = fresh = false;
+   pathNew = 0;
+   memset(&stats, 0, sizeof(stats));
+   subscribe(EV_BRANCH, branchEvent, this);
+   subscribe(EV_MEM_READ, accessEvent, this);
+   subscribe(EV_MEM_WRITE, accessEvent, this);
+   subscribe(EV_ALLOC, allocEvent, this);
+}
+
+Explorer::~Explorer() {
+   unsubscribe(EV_BRANCH, branchEvent, this);
+   unsubscribe(EV_MEM_READ, accessEvent, this);
+   unsubscribe(EV_MEM_WRITE, accessEvent, this);
+   unsubscribe(EV_ALLOC, allocEvent, this);
+   for (unsigned int i = 0; i < numPending; i++) {
+      delete pending[i].state;
+   }
+   delete home;
+   free(branches);
+   free(members);
+   free(sites);
+}
+
+void Explorer::trackSite(dword site) {
+   for (unsigned int i = 0; i < numTracked; i++) {
+      if (tracked[i] == site) return;
+   }
+   if (numTracked < EXPLORE_SITES) tracked[numTracked++] = site;
+}
+
+void Explorer::setPathEnd(EngineCheck pathEnd, void *user) {
+   this->pathEnd = pathEnd;
+   pathUser = user;
+}
+
+void Explorer::getStats(ExploreStats *s) {
+   *s = stats;
+   s->pending = numPending;
+}
+
+bool Explorer::check(void *explorer) {
+   return ((Explorer*)explorer)->step();
+}
+
+bool Explorer::step() {
+   if (done) return true;
+   bool end = pathEnd && (*pathEnd)(pathUser);
+   if (!end && (pathLimit == 0 || pathSteps < pathLimit)) {
+      pathSteps++;
+      if (home == NULL) return false;
+      stats.instructions++;
+      if (budget && stats.instructions >= budget) end = true;
+      else if (seconds && (stats.instructions % CLOCK_CHECK) == 0 &&
+               Engine::now() - started >= seconds * 1000) end = true;
+      if (!end) return false;
+      //out of budget, the rest stay unexplored
+      finish();
+      return true;
+   }
+   if (home == NULL) {
+      //the first path is over, it is where we come back to
+      quietly(true);
+      home = new PagedState(&store);
+      quietly(false);
+      started = Engine::now();
+   }
+   if (nextPath()) return false;
+   finish();
+   return true;
+}
+
+//restore the most promising saved state, false if there are none
+bool Explorer::nextPath() {
+   while (numPending) {
+      unsigned int best = 0;
+      for (unsigned int i = 1; i < numPending; i++) {
+         if (pending[i].priority > pending[best].priority ||
+             (pending[i].priority == pending[best].priority &&
+              pending[i].order < pending[best].order)) {
+            best = i;
+         }
+      }
+      Pending p = pending[best];
+      pending[best] = pending[--numPending];
+      BranchSlot *b = findBranch(p.branch);
+      b->flags &= ~(BRANCH_QUEUED << p.dir);
+      bool run = (b->flags & (BRANCH_SEEN << p.dir)) == 0;
+      if (run) {
+         quietly(true);
+         run = p.state->restore();
+         quietly(false);
+      }
+      delete p.state;
+      if (!run) continue;   //some other path got there first
+      eip = p.target;
+      //the other way was seen when the state was saved
+      b->flags |= BRANCH_SEEN << p.dir;
+      stats.bothWays++;
+      stats.paths++;
+      pathSteps = 0;
+      pathNew = 0;
+      near = fresh = false;
+      return true;
+   }
+   return false;
+}
+
+void Explorer::finish() {
+   done = true;
+   for (unsigned int i = 0; i < numPending; i++) {
+      delete pending[i].state;
+   }
+   numPending = 0;
+   if (home) {
+      quietly(true);
+      home->restore();
+      quietly(false);
+      delete home;
+      home = NULL;
+   }
+}
+
+//saving and restoring read and write guest memory, that isn't the
+//program's doing
+void Explorer::quietly(bool quiet) {
+   flushEvents();
+   this->quiet = quiet;
+}
+
+void Explorer::branch(dword addr, int dir, dword other) {
+   BranchSlot *b = findBranch(addr);
+   if ((b->flags & (BRANCH_SEEN << dir)) == 0) {
+      if (b->flags & (BRANCH_SEEN << (1 - dir))) stats.bothWays++;
+      b->flags |= BRANCH_SEEN << dir;
+   }
+   int priority = pathNew + (fresh ? PRI_FRESH : 0) + (near ? PRI_NEAR : 0);
+   near = fresh = false;
+   int odir = 1 - dir;
+   if (done || (b->flags & ((BRANCH_SEEN | BRANCH_QUEUED) << odir))) return;
+
+   Pending *p;
+   if (numPending < EXPLORE_PENDING) {
+      p = pending + numPending++;
+   }
+   else {
+      //make room by dropping the least promising, newest first
+      p = pending;
+      for (unsigned int i = 1; i < numPending; i++) {
+         if (pending[i].priority < p->priority ||
+             (pending[i].priority == p->priority && pending[i].order > p->order)) {
+            p = pending + i;
+         }
+      }
+      stats.dropped++;
+      if (p->priority >= priority) return;
+      findBranch(p->branch)->flags &= ~(BRANCH_QUEUED << p->dir);
+      delete p->state;
+   }
+   //the memory events the capture raises are not the program's
+   quietly(true);
+   p->state = new PagedState(&store);
+   quietly(false);
+   p->branch = addr;
+   p->target = other;
+   p->dir = odir;
+   p->priority = priority;
+   p->order = order++;
+   findBranch(addr)->flags |= BRANCH_QUEUED << odir;
+   stats.queued++;
+}
+
+void Explorer::access(dword addr) {
+   EmuHeap *h = mm->heap ? mm->heap->contains(addr) : NULL;
+   dword base, size;
+   if (h == NULL || !h->blockAt(addr, &base, &size)) return;
+   dword site = siteOf(base);
+   if (numTracked) {
+      unsigned int i;
+      for (i = 0; i < numTracked && tracked[i] != site; i++);
+      if (i == numTracked) return;
+   }
+   near = true;
+   if (addMember(site, addr - base)) {
+      fresh = true;
+      pathNew++;
+      if (home) stats.found++;
+   }
+}
+
+BranchSlot *Explorer::findBranch(dword addr) {
+   unsigned int h = hashDword(addr) & branchMask;
+   while (branches[h].flags) {
+      if (branches[h].addr == addr) return branches + h;
+      h = (h + 1) & branchMask;
+   }
+   //new, the caller sets a flag before anything else is added
+   if (2 * (stats.branches + 1) > branchMask) {
+      growBranches();
+      return findBranch(addr);
+   }
+   stats.branches++;
+   branches[h].addr = addr;
+   return branches + h;
+}
+
+void Explorer::growBranches() {
+   BranchSlot *old = branches;
+   unsigned int oldMask = branchMask;
+   branchMask = branchMask * 2 + 1;
+   branches = (BranchSlot*)calloc(branchMask + 1, sizeof(BranchSlot));
+   for (unsigned int i = 0; i <= oldMask; i++) {
+      if (old[i].flags == 0) continue;
+      unsigned int h = hashDword(old[i].addr) & branchMask;
+      while (branches[h].flags) h = (h + 1) & branchMask;
+      branches[h] = old[i];
+   }
+   free(old);
+}
+
+//true if the offset had not been seen before
+bool Explorer::addMember(dword site, dword offset) {
+   if (2 * (stats.members + 1) > memberMask) growMembers();
+   unsigned int h = (hashDword(site) ^ hashDword(offset + 0x9E3779B9)) & memberMask;
+   while (members[h].offset != EMPTY_MEMBER) {
+      if (members[h].site == site && members[h].offset == offset) return false;
+      h = (h + 1) & memberMask;
+   }
+   members[h].site = site;
+   members[h].offset = offset;
+   stats.members++;
+   return true;
+}
+
+void Explorer::growMembers() {
+   MemberSlot *old = members;
+   unsigned int oldMask = memberMask;
+   memberMask = memberMask * 2 + 1;
+   members = (MemberSlot*)malloc((memberMask + 1) * sizeof(MemberSlot));
+   memset(members, 0xFF, (memberMask + 1) * sizeof(MemberSlot));
+   for (unsigned int i = 0; i <= oldMask; i++) {
+      if (old[i].offset == EMPTY_MEMBER) continue;
+      unsigned int h = (hashDword(old[i].site) ^ hashDword(old[i].offset + 0x9E3779B9)) & memberMask;
+      while (members[h].offset != EMPTY_MEMBER) h = (h + 1) & memberMask;
+      members[h] = old[i];
+   }
+   free(old);
+}
+
+void Explorer::addSite(dword base, dword site) {
+   if (2 * (numSites + 1) > siteMask) growSites();
+   unsigned int h = hashDword(base) & siteMask;
+   while (sites[h].base && sites[h].base != base) h = (h + 1) & siteMask;
+   if (sites[h].base == 0) numSites++;
+   sites[h].base = base;
+   sites[h].site = site;
+}
+
+void Explorer::growSites() {
+   SiteSlot *old = sites;
+   unsigned int oldMask = siteMask;
+   siteMask = siteMask * 2 + 1;
+   sites = (SiteSlot*)calloc(siteMask + 1, sizeof(SiteSlot));
+   for (unsigned int i = 0; i <= oldMask; i++) {
+      if (old[i].base == 0) continue;
+      unsigned int h = hashDword(old[i].base) & siteMask;
+      while (sites[h].base) h = (h + 1) & siteMask;
+      sites[h] = old[i];
+   }
+   free(old);
+}
+
+//the allocation that last handed out base, 0 if we never saw it.  Paths
+//can reuse a base for other allocations, this is only a guide.
+dword Explorer::siteOf(dword base) {
+   unsigned int h = hashDword(base) & siteMask;
+   while (sites[h].base) {
+      if (sites[h].base == base) return sites[h].site;
+      h = (h + 1) & siteMask;
+   }
+   return 0;
+}
+
+void Explorer::branchEvent(const EmuEvent *events, unsigned int count, void *user) {
+   Explorer *x = (Explorer*)user;
+   //the accesses leading up to the branch count towards it
+   flushEvents();
+   for (unsigned int i = 0; i < count; i++) {
+      x->branch(events[i].eip, events[i].size, events[i].value);
+   }
+}
+
+void Explorer::accessEvent(const EmuEvent *events, unsigned int count, void *user) {
+   Explorer *x = (Explorer*)user;
+   if (x->quiet) return;
+   for (unsigned int i = 0; i < count; i++) {
+      if (events[i].region == AS_HEAP) x->access(events[i].addr);
+   }
+}
+
+void Explorer::allocEvent(const EmuEvent *events, unsigned int count, void *user) {
+   Explorer *x = (Explorer*)user;
+   for (unsigned int i = 0; i < count; i++) {
+      x->addSite(events[i].addr, events[i].eip);
+   }
+}
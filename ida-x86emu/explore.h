@@ -0,0 +1,158 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: explore.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __EXPLORE_H
+#define __EXPLORE_H
+
+#include "x86defs.h"
+#include "events.h"
+#include "engine.h"
+#include "pagestore.h"
+
+#define EXPLORE_PENDING 256   //saved states waiting for their turn
+#define EXPLORE_SITES   64    //allocation sites that can be tracked
+
+typedef struct _ExploreStats {
+   unsigned int paths;       //other directions run
+   unsigned int queued;      //states saved at branches
+   unsigned int dropped;     //states not saved, or pushed out, for want of room
+   unsigned int pending;     //states still waiting
+   unsigned int branches;    //conditional branches seen
+   unsigned int bothWays;    //of them, seen going both ways
+   unsigned int members;     //offsets seen accessed in tracked blocks
+   unsigned int found;       //of them, first seen on an explored path
+   uquad instructions;       //run on explored paths
+} ExploreStats;
+
+typedef struct _BranchSlot {
+   dword addr;
+   unsigned int flags;
+} BranchSlot;
+
+typedef struct _MemberSlot {
+   dword site;
+   dword offset;
+} MemberSlot;
+
+typedef struct _SiteSlot {
+   dword base;
+   dword site;
+} SiteSlot;
+
+typedef struct _Pending {
+   PagedState *state;
+   dword branch;
+   dword target;        //the direction not yet run
+   int dir;             //1 if that is the taken direction
+   int priority;
+   unsigned int order;
+} Pending;
+
+/*
+ * Follows more than one path through the program.  Each time a
+ * conditional branch goes a way it has not gone before, the state just
+ * after it is saved in a PageStore along with the direction it did not
+ * take.  Once the first path ends, check restores the saved states one
+ * at a time, moves eip to the other direction and lets the engine carry
+ * on from there, until nothing is left or the instruction or time
+ * budget runs out, then puts back the state the first path ended in.
+ *
+ * Paths are chosen by how promising the branch looked: whether the
+ * path it was on was still finding offsets of tracked heap blocks it
+ * had not accessed before, and whether such a block was accessed just
+ * before the branch.  Blocks are tracked by the instruction that
+ * allocated them (trackSite), or all of them if no sites are given.
+ * Branches inside memoised calls (see memo.h) are not seen.
+ *
+ * Use it as the engine's stop check, with the path end
+ * check deciding where a single path stops (returned, halted).  The
+ * engine still stops for breakpoints, pause and cancel, and finish puts
+ * the first path's state back whenever exploring stops early.
+ */
+class Explorer {
+public:
+   //budget instructions and seconds for the explored paths, 0 for no
+   //limit, and pathLimit instructions for each path
+   Explorer(uquad budget, unsigned int seconds, unsigned int pathLimit);
+   ~Explorer();
+
+   void trackSite(dword site);
+   void setPathEnd(EngineCheck pathEnd, void *user);
+
+   //the engine stop check, user is the Explorer
+   static bool check(void *explorer);
+   //back to where the first path ended, if exploring got that far
+   void finish();
+   bool exploring() {return home != NULL;};
+   void getStats(ExploreStats *s);
+
+   static void branchEvent(const EmuEvent *events, unsigned int count, void *user);
+   static void accessEvent(const EmuEvent *events, unsigned int count, void *user);
+   static void allocEvent(const EmuEvent *events, unsigned int count, void *user);
+
+private:
+   bool step();
+   bool nextPath();
+   void branch(dword addr, int dir, dword other);
+   void access(dword addr);
+   void quietly(bool quiet);
+   BranchSlot *findBranch(dword addr);
+   bool addMember(dword site, dword offset);
+   void addSite(dword base, dword site);
+   dword siteOf(dword base);
+   void growBranches();
+   void growMembers();
+   void growSites();
+
+   PageStore store;
+   PagedState *home;      //where the first path ended
+   Pending pending[EXPLORE_PENDING];
+   unsigned int numPending;
+   unsigned int order;
+
+   BranchSlot *branches;
+   unsigned int branchMask;
+   MemberSlot *members;
+   unsigned int memberMask;
+   SiteSlot *sites;       //where each block came from, by base
+   unsigned int siteMask;
+   unsigned int numSites;
+   dword tracked[EXPLORE_SITES];
+   unsigned int numTracked;
+
+   EngineCheck pathEnd;
+   void *pathUser;
+   uquad budget;
+   unsigned int seconds;
+   unsigned int pathLimit;
+   unsigned int pathSteps;
+   unsigned int started;  //Engine::now() when exploring began
+   bool done;
+   bool quiet;            //saving or restoring, events are ours
+
+   //since the last branch
+   bool near;             //a tracked block was accessed
+   bool fresh;            //a new offset was found
+   unsigned int pathNew;  //new offsets on this path
+
+   ExploreStats stats;
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: frame.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <string.h>
+
+#include "cpu.h"
+#include "memmgr.h"
+#include "events.h"
+#include "memo.h"
+#include "frame.h"
+
+int enterFunction(dword entry, unsigned int numArgs, dword objectSize, dword *objects) {
+   if (mm->heap == NULL) return -1;
+   if (numArgs > FRAME_MAX_ARGS) numArgs = FRAME_MAX_ARGS;
+   unsigned int numObjects = FRAME_ARG(numArgs);
+   for (unsigned int i = 0; i < numObjects; i++) {
+      objects[i] = mm->heap->calloc(1, objectSize);
+      if (objects[i] == HEAP_ERROR) {
+         while (i--) mm->heap->free(objects[i]);
+         return -1;
+      }
+   }
+
+   //whatever was being recorded is gone
+   abortCallMemo();
+   memset(general, 0, sizeof(general));
+   esp = mm->stack->getStackTop();
+   eflags = 2;
+   for (unsigned int n = numArgs; n; n--) {
+      push(objects[FRAME_ARG(n - 1)], SIZE_DWORD);
+   }
+   push(FRAME_RETURN, SIZE_DWORD);
+   ecx = objects[FRAME_THIS];
+   eip = entry;
+
+   //as though the function's first instruction had allocated them
+   initial_eip = entry;
+   if (eventMask & EVENT_BIT(EV_ALLOC)) {
+      for (unsigned int i = 0; i < numObjects; i++) {
+         raiseEvent(EV_ALLOC, objects[i], objectSize, i + 1);
+      }
+   }
+   return numObjects;
+}
+
+void leaveFunction(const dword *objects, int numObjects) {
+   if (mm->heap == NULL) return;
+   for (int i = 0; i < numObjects; i++) {
+      unsigned int base, size;
+      if (mm->heap->blockAt(objects[i], &base, &size) && base == objects[i]) {
+         mm->heap->free(objects[i]);
+         if (eventMask & EVENT_BIT(EV_FREE)) raiseEvent(EV_FREE, objects[i]);
+      }
+   }
+}
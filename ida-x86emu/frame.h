@@ -0,0 +1,57 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: frame.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+#ifndef __FRAME_H
+#define __FRAME_H
+
+#include "x86defs.h"
+
+//return address of a synthetic frame, eip reaches it when the function returns
+#define FRAME_RETURN      0xFFFFFFF0
+#define FRAME_OBJECT_SIZE 0x400   //default bytes in each synthetic object
+#define FRAME_MAX_ARGS    16
+
+//objects[FRAME_THIS] goes in ecx, stack argument n is objects[FRAME_ARG(n)]
+#define FRAME_THIS   0
+#define FRAME_ARG(n) ((n) + 1)
+
+/*
+ * Per-function emulation.  enterFunction sets the cpu up as if entry had
+ * just been called from nowhere: the general registers are cleared, esp
+ * starts over at the top of the stack, the return address is
+ * FRAME_RETURN and ecx and each of the numArgs stack arguments point to
+ * a zero filled heap block of objectSize bytes of their own.  Since it is
+ * not known which arguments are really pointers, every one gets a block,
+ * and the blocks are made generously large.
+ *
+ * Each block is announced with EV_ALLOC as if allocated by the
+ * instruction at entry, with the event's value 1 + its index in objects
+ * (so 1 for ecx) where an allocator leaves 0, so idastruct and the
+ * explorer trace the function's accesses to them like any other block.
+ * Returns the number of objects made, numArgs + 1, or -1 if there is no
+ * heap or it is full.
+ */
+int enterFunction(dword entry, unsigned int numArgs, dword objectSize, dword *objects);
+//free the objects an earlier enterFunction made, skipping any that are
+//no longer allocated blocks of their own (the heap was reset or reloaded)
+void leaveFunction(const dword *objects, int numObjects);
+
+#endif
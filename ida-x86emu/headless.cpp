@@ -0,0 +1,192 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: headless.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Host side of the emulator core when there is no IDA, see host.h.
+ * There are no host modules to call into and nothing to display, so
+ * most of these do nothing.  DLLs are only ever PE images loaded from
+ * the DLL path into emulated memory, see loadHeadlessImage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "stubs.h"
+#include "peloader.h"
+
+//no emulated API functions without the plugin
+HookEntry hookTable[] = {
+   {NULL, NULL}
+};
+
+bool msgQuiet = false;
+
+int msg(const char *format, ...) {
+   if (msgQuiet) return 0;
+   va_list va;
+   va_start(va, format);
+   int n = vfprintf(stderr, format, va);
+   va_end(va);
+   return n;
+}
+
+bool isModuleAddress(dword addr) {
+   return false;
+}
+
+char *reverseLookupExport(dword addr) {
+   return NULL;
+}
+
+static void unemulated(MemoryManager *mgr, dword addr) {
+   HookNode *n = find(addr);
+   stubCall(n ? n->getName() : NULL);
+}
+
+hookfunc checkForHook(char *funcName, dword funcAddr, dword moduleId) {
+   return addHook(funcName, funcAddr, unemulated, moduleId);
+}
+
+//no type libraries, signature files only
+bool hostSignature(const char *name, int *args, int *conv) {
+   return false;
+}
+
+typedef struct _HeadlessModule {
+   char *name;
+   dword id;
+   dword base;
+   PEImage *image;   //NULL if the DLL was not found
+   struct _HeadlessModule *next;
+} HeadlessModule;
+
+static HeadlessModule *modules = NULL;
+static dword moduleId = 1;
+
+//';' separated directories to load DLLs from
+static char *dllPath = NULL;
+
+void freeModuleList() {
+   while (modules) {
+      HeadlessModule *m = modules;
+      modules = m->next;
+      free(m->name);
+      delete m->image;
+      free(m);
+   }
+   moduleId = 1;
+}
+
+static HeadlessModule *newModule(const char *name, dword id, dword base) {
+   HeadlessModule *m = (HeadlessModule*)calloc(1, sizeof(HeadlessModule));
+   m->name = _strdup(name);
+   m->id = id;
+   m->base = base;
+   m->next = modules;
+   modules = m;
+   if (id >= moduleId) moduleId = id + 1;
+   return m;
+}
+
+void addHeadlessModule(const char *name, dword id, dword base) {
+   newModule(name, id, base);
+}
+
+void setHeadlessDllPath(const char *path) {
+   free(dllPath);
+   dllPath = (path && *path) ? _strdup(path) : NULL;
+}
+
+//PELookup over the module list, DLLs are loaded and bound the first time
+//they are named
+static PEImage *lookupImage(const char *dll, unsigned int *id, void *user) {
+   HeadlessModule *m;
+   for (m = modules; m; m = m->next) {
+      if (stricmp(dll, m->name) == 0) break;
+   }
+   if (m == NULL) {
+      PEImage *img = NULL;
+      char *path = PEImage::find(dllPath, dll);
+      if (path) {
+         img = PEImage::load(mm, path);
+         if (img) msg("x86emu: loaded %s at 0x%08X\n", path, img->getBase());
+         free(path);
+      }
+      if (img == NULL) msg("x86emu: %s is not in the DLL path, faking it\n", dll);
+      m = newModule(dll, moduleId, img ? img->getBase() : 0);
+      //in the list before binding so circular imports find it
+      m->image = img;
+      if (img) img->bindImports(lookupImage, NULL);
+   }
+   *id = m->id;
+   return m->image;
+}
+
+PEImage *loadHeadlessImage(const char *path) {
+   PEImage *img = PEImage::load(mm, path);
+   if (img) img->bindImports(lookupImage, NULL);
+   return img;
+}
+
+//same layout as the plugin's module list so blobs move between the two
+void saveModuleList(Buffer &b) {
+   int n = 0, len;
+   HeadlessModule *m;
+   for (m = modules; m; m = m->next) n++;
+   b.write((char*)&n, sizeof(n));
+   for (m = modules; m; m = m->next) {
+      b.write((char*)&m->id, sizeof(m->id));
+      len = strlen(m->name) + 1;
+      b.write((char*)&len, sizeof(len));
+      b.write(m->name, len);
+      b.write((char*)&m->base, sizeof(m->base));
+   }
+}
+
+void loadModuleList(Buffer &b) {
+   freeModuleList();
+   int n, len;
+   HeadlessModule **last = &modules;
+   b.read((char*)&n, sizeof(n));
+   for (int i = 0; i < n && !b.has_error(); i++) {
+      HeadlessModule *m = (HeadlessModule*)calloc(1, sizeof(HeadlessModule));
+      b.read((char*)&m->id, sizeof(m->id));
+      b.read((char*)&len, sizeof(len));
+      if (len <= 0 || b.has_error()) {
+         free(m);
+         break;
+      }
+      m->name = (char*)malloc(len);
+      b.read(m->name, len);
+      m->name[len - 1] = 0;
+      if (b.getVersion() >= 3) {
+         b.read((char*)&m->base, sizeof(m->base));
+      }
+      //images came back with the mapped files, just pick them up again
+      if (m->base && mm) m->image = PEImage::attach(mm, m->base);
+      if (m->id >= moduleId) moduleId = m->id + 1;
+      *last = m;
+      last = &m->next;
+   }
+}
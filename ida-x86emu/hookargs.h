@@ -0,0 +1,86 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: hookargs.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __HOOKARGS_H
+#define __HOOKARGS_H
+
+#include "cpu.h"
+#include "memmgr.h"
+
+#define HOOK_CDECL   0   //caller removes the arguments
+#define HOOK_STDCALL 1   //hook pops its arguments
+
+/*
+ * Adapters between the hookfunc interface and native emulations
+ * written with ordinary C signatures, for example
+ *
+ *    dword native_strlen(MemoryManager *mgr, dword str);
+ *    {"strlen", hook1<HOOK_CDECL, dword, native_strlen>},
+ *
+ * All of the arguments come off the stack with a single block read, the
+ * native's result goes in eax and stdcall hooks remove their arguments.
+ * Hooks are entered without a return address on the stack, so the first
+ * argument is at esp.  Natives for functions returning void should
+ * return eax to leave it untouched.
+ */
+
+inline void hookArgs(MemoryManager *mgr, dword *args, int n) {
+   mgr->readBlock(esp + ssBase, args, n * sizeof(dword));
+}
+
+inline void hookReturn(dword result, int conv, int n) {
+   eax = result;
+   if (conv == HOOK_STDCALL) esp += n * sizeof(dword);
+}
+
+template <int CONV, dword (*F)(MemoryManager*)>
+void hook0(MemoryManager *mgr, unsigned int addr) {
+   hookReturn(F(mgr), CONV, 0);
+}
+
+template <int CONV, class A1, dword (*F)(MemoryManager*, A1)>
+void hook1(MemoryManager *mgr, unsigned int addr) {
+   dword a[1];
+   hookArgs(mgr, a, 1);
+   hookReturn(F(mgr, (A1)a[0]), CONV, 1);
+}
+
+template <int CONV, class A1, class A2, dword (*F)(MemoryManager*, A1, A2)>
+void hook2(MemoryManager *mgr, unsigned int addr) {
+   dword a[2];
+   hookArgs(mgr, a, 2);
+   hookReturn(F(mgr, (A1)a[0], (A2)a[1]), CONV, 2);
+}
+
+template <int CONV, class A1, class A2, class A3, dword (*F)(MemoryManager*, A1, A2, A3)>
+void hook3(MemoryManager *mgr, unsigned int addr) {
+   dword a[3];
+   hookArgs(mgr, a, 3);
+   hookReturn(F(mgr, (A1)a[0], (A2)a[1], (A3)a[2]), CONV, 3);
+}
+
+template <int CONV, class A1, class A2, class A3, class A4, dword (*F)(MemoryManager*, A1, A2, A3, A4)>
+void hook4(MemoryManager *mgr, unsigned int addr) {
+   dword a[4];
+   hookArgs(mgr, a, 4);
+   hookReturn(F(mgr, (A1)a[0], (A2)a[1], (A3)a[2], (A4)a[3]), CONV, 4);
+}
+
+#endif
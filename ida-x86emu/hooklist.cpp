@@ -21,7 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "x86defs.h"
+#include "host.h"
 
 #include "hooklist.h"
 
@@ -31,17 +31,67 @@
 
 static HookNode *hookList = NULL; 
 
+//hooks are also chained into these by address and by name so that
+//doCall does not walk the whole list for every CALL
+static HookNode *addrHash[HOOK_HASH_SIZE];
+static HookNode *nameHash[HOOK_HASH_SIZE];
+
+//hookTable sorted by name, built on first use
+static HookEntry **sortedTable = NULL;
+static int sortedSize = 0;
+
+static unsigned int addrSlot(unsigned int addr) {
+   return (addr ^ (addr >> 10) ^ (addr >> 20)) & (HOOK_HASH_SIZE - 1);
+}
+
+static unsigned int nameSlot(const char *name) {
+   unsigned int h = 0;
+   while (*name) h = h * 31 + (unsigned char)*name++;
+   return h & (HOOK_HASH_SIZE - 1);
+}
+
 HookNode::HookNode(char *fName, unsigned int addr, hookfunc func, unsigned int id, HookNode *nxt) :
         funcAddr(addr), func(func), moduleId(id), next(nxt) {
    funcName = _strdup(fName);
+   addrNext = nameNext = NULL;
 }
 
 HookNode::~HookNode() {
    free(funcName);
 }
 
+void unlinkName(HookNode *n) {
+   for (HookNode **p = &nameHash[nameSlot(n->funcName)]; *p; p = &(*p)->nameNext) {
+      if (*p == n) {
+         *p = n->nameNext;
+         break;
+      }
+   }
+}
+
 hookfunc addHook(char *fName, unsigned int funcAddr, hookfunc func, unsigned int id) {
-   hookList = new HookNode(fName, funcAddr, func, id, hookList);
+   HookNode *n = find(funcAddr);
+   if (n) {
+      //already hooked, replace the hook rather than piling up duplicates
+      if (strcmp(n->funcName, fName)) {
+         unlinkName(n);
+         free(n->funcName);
+         n->funcName = _strdup(fName);
+         unsigned int slot = nameSlot(fName);
+         n->nameNext = nameHash[slot];
+         nameHash[slot] = n;
+      }
+      n->func = func;
+      n->moduleId = id;
+      return func;
+   }
+   hookList = n = new HookNode(fName, funcAddr, func, id, hookList);
+   unsigned int slot = addrSlot(funcAddr);
+   n->addrNext = addrHash[slot];
+   addrHash[slot] = n;
+   slot = nameSlot(fName);
+   n->nameNext = nameHash[slot];
+   nameHash[slot] = n;
    return func;
 //   msg("hooked %s at %X\n", fName, funcAddr);
 }
@@ -52,27 +102,42 @@ void freeHookList() {
       delete hookList;
    }
    hookList = NULL;
+   memset(addrHash, 0, sizeof(addrHash));
+   memset(nameHash, 0, sizeof(nameHash));
 }
 
 void loadHookList(Buffer &b) {
    int n;
    freeHookList();
    b.read((char*)&n, sizeof(n));
-   for (int i = 0; i < n; i++) {
-      unsigned int addr;
-      b.read((char*)&addr, sizeof(addr));
+   if (n <= 0) return;
+   //hooks are added at the head of the list, so add them last to first
+   //to get back the order they were saved in
+   unsigned int *addrs = (unsigned int*) calloc(n, sizeof(unsigned int));
+   char **names = (char**) calloc(n, sizeof(char*));
+   int i;
+   for (i = 0; i < n; i++) {
+      b.read((char*)&addrs[i], sizeof(addrs[i]));
       int len;
       b.read((char*)&len, sizeof(len));
-      char *name = (char*) malloc(len);
-      b.read(name, len);
-      hookfunc hf = findHook(name);
+      names[i] = (char*) malloc(len);
+      b.read(names[i], len);
+   }
+   for (i = n - 1; i >= 0; i--) {
+      hookfunc hf = findHook(names[i]);
       if (hf) {
          //need to find a way to pass valid id here
-         msg("Adding hook for %s at %X\n", name, addr);
-         addHook(name, addr, hf, 0);
+         msg("Adding hook for %s at %X\n", names[i], addrs[i]);
+         addHook(names[i], addrs[i], hf, 0);
       }
-      free(name);
+      else {
+         //no emulation, the host stubs it again (see stubs.h)
+         checkForHook(names[i], addrs[i], 0);
+      }
+      free(names[i]);
    }
+   free(names);
+   free(addrs);
 }
 
 Buffer *getHookListBlob(Buffer &b) {
@@ -109,25 +174,26 @@ void saveHookList(Buffer &b) {
 }
 
 void removeHook(unsigned int funcAddr) {
-   HookNode *prev = NULL, *curr = hookList;
-   while (curr) {
-      if (curr->funcAddr == funcAddr) {
-         if (prev) {
-            prev->next = curr->next;
-         }
-         else {
-            hookList = curr->next;
-         }
-         delete curr;
+   HookNode *curr;
+   HookNode **p;
+   for (p = &addrHash[addrSlot(funcAddr)]; *p; p = &(*p)->addrNext) {
+      if ((*p)->funcAddr == funcAddr) break;
+   }
+   if (*p == NULL) return;
+   curr = *p;
+   *p = curr->addrNext;
+   unlinkName(curr);
+   for (p = &hookList; *p; p = &(*p)->next) {
+      if (*p == curr) {
+         *p = curr->next;
          break;
       }
-      prev = curr;
-      curr = curr->next;
    }
+   delete curr;
 }
 
 hookfunc findHook(unsigned int funcAddr) {
-   for (HookNode *n = hookList; n; n = n->next) {
+   for (HookNode *n = addrHash[addrSlot(funcAddr)]; n; n = n->addrNext) {
       if (n->funcAddr == funcAddr) {
          return n->func;
       }
@@ -135,15 +201,35 @@ hookfunc findHook(unsigned int funcAddr) {
    return NULL;
 }
 
+static int compareEntries(const void *a, const void *b) {
+   return strcmp((*(HookEntry**)a)->fName, (*(HookEntry**)b)->fName);
+}
+
 hookfunc findHook(char *funcName) {
-   for (int i = 0; hookTable[i].fName; i++) {
-      if (!strcmp(hookTable[i].fName, funcName)) return hookTable[i].func;
+   if (sortedTable == NULL) {
+      int n;
+      for (n = 0; hookTable[n].fName; n++);
+      sortedTable = (HookEntry**) malloc(n * sizeof(HookEntry*));
+      if (sortedTable == NULL) return NULL;
+      for (int i = 0; i < n; i++) sortedTable[i] = &hookTable[i];
+      qsort(sortedTable, n, sizeof(HookEntry*), compareEntries);
+      sortedSize = n;
+   }
+   int lo = 0, hi = sortedSize - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int c = strcmp(funcName, sortedTable[mid]->fName);
+      if (c == 0) return sortedTable[mid]->func;
+      if (c < 0) hi = mid - 1;
+      else lo = mid + 1;
    }
+   //IDA names statically linked runtime functions _memcpy, _strlen etc.
+   if (funcName[0] == '_' && funcName[1] != '_') return findHook(funcName + 1);
    return NULL;
 }
 
 HookNode *find(unsigned int funcAddr) {
-   for (HookNode *n = hookList; n; n = n->next) {
+   for (HookNode *n = addrHash[addrSlot(funcAddr)]; n; n = n->addrNext) {
       if (n->funcAddr == funcAddr) {
          return n;
       }
@@ -152,7 +238,7 @@ HookNode *find(unsigned int funcAddr) {
 }
 
 HookNode *find(char *fName) {
-   for (HookNode *n = hookList; n; n = n->next) {
+   for (HookNode *n = nameHash[nameSlot(fName)]; n; n = n->nameNext) {
       if (!strcmp(n->funcName, fName)) {
          return n;
       }
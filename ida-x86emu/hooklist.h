@@ -28,6 +28,8 @@ class MemoryManager;
 
 typedef void (*hookfunc)(MemoryManager *mm, unsigned int addr);
 
+#define HOOK_HASH_SIZE 1024   //buckets in the address and name hashes, power of 2
+
 /*
  * These are used to setup hooking dialog menu entries
  */
@@ -50,6 +52,7 @@ class HookNode {
    friend HookNode *find(unsigned int addr);
    friend HookNode *find(char *fName);
    friend HookNode *getNext(HookNode *n);
+   friend void unlinkName(HookNode *n);
 
 public:
    HookNode(char *fName, unsigned int addr, hookfunc func, unsigned int id, HookNode *nxt);
@@ -63,7 +66,22 @@ private:
    hookfunc func;
    unsigned int moduleId;
    HookNode *next;
+   HookNode *addrNext;   //next in the same address bucket
+   HookNode *nameNext;   //next in the same name bucket
 };
 
+//friends above are not visible to callers without these
+hookfunc addHook(char *fName, unsigned int funcAddr, hookfunc func, unsigned int id);
+void removeHook(unsigned int funcAddr);
+void freeHookList();
+void loadHookList(Buffer &b);
+void saveHookList(Buffer &b);
+Buffer *getHookListBlob(Buffer &b);
+hookfunc findHook(unsigned int funcAddr);
+hookfunc findHook(char *funcName);
+HookNode *find(unsigned int addr);
+HookNode *find(char *fName);
+HookNode *getNext(HookNode *n);
+
 #endif
 
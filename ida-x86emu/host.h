@@ -0,0 +1,75 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: host.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __HOST_H
+#define __HOST_H
+
+#include "x86defs.h"
+#include "hooklist.h"
+
+/*
+ * Everything the emulator core (cpu, memory manager, heaps, SEH and
+ * hooks) calls back out to.  The IDA plugin provides these in
+ * x86emu.cpp and emufuncs.cpp, a headless build links headless.cpp
+ * instead.  Nothing else in the core may depend on IDA or Win32.
+ */
+
+#ifdef __IDP__
+#include <ida.hpp>
+#include <kernwin.hpp>
+#else
+//status and diagnostic output
+int msg(const char *format, ...);
+//headless.cpp drops msg output while this is set
+extern bool msgQuiet;
+//modules are only names and bases without the plugin, they are saved
+//and restored with the state but never called into
+void addHeadlessModule(const char *name, dword id, dword base);
+//';' separated directories loadHeadlessImage takes DLLs from
+void setHeadlessDllPath(const char *path);
+class PEImage;
+//load a PE file into mm and bind its imports, loading the DLLs it needs
+//from the DLL path; DLLs that are not there get hooks for every import.
+//NULL if path is not a loadable image
+PEImage *loadHeadlessImage(const char *path);
+#endif
+
+#if !defined(WIN32) && !defined(CYGWIN)
+#include <string.h>
+#include <strings.h>
+#define _strdup strdup
+#define stricmp strcasecmp
+#endif
+
+//true if addr lies in a module that the emulator cannot step into
+bool isModuleAddress(dword addr);
+//exported name for a module address, NULL if there is none
+char *reverseLookupExport(dword addr);
+//hook to run for a call to funcName at funcAddr, never NULL
+hookfunc checkForHook(char *funcName, dword funcAddr, dword moduleId);
+//argument count (-1 for varargs) and STUB_ convention from the host's
+//type information, false if it has none for name
+bool hostSignature(const char *name, int *args, int *conv);
+//the host's module list is part of the saved state
+void saveModuleList(Buffer &b);
+void loadModuleList(Buffer &b);
+void freeModuleList();
+
+#endif
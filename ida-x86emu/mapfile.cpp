@@ -0,0 +1,369 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: mapfile.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "host.h"
+#include "mapfile.h"
+
+//granularity of dirty page tracking
+#define MAP_PAGE_SIZE 0x1000
+#define MAP_PAGE_SHIFT 12
+
+#define PAGE_WRITTEN 1     //differs from the file
+#define PAGE_CHANGED 2     //written since the last save or load
+
+MappedFile::MappedFile(const char *fileName, unsigned int base, int mode,
+                       unsigned int offset, unsigned int len) {
+   this->fileName = strdup(fileName);
+   this->base = base;
+   this->mode = mode;
+   fileOffset = offset;
+   size = len;
+   view = mapping = NULL;
+   mappingSize = 0;
+   anonymous = false;
+   dirty = NULL;
+   saved = false;
+   handle = NULL;
+   next = NULL;
+   if (map()) {
+      dirty = (unsigned char*)calloc((size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT, 1);
+   }
+}
+
+MappedFile::MappedFile(unsigned int base, unsigned int len) {
+   fileName = strdup("");
+   this->base = base;
+   mode = MAP_COPY_ON_WRITE;
+   fileOffset = 0;
+   size = len;
+   mappingSize = 0;
+   saved = false;
+   handle = NULL;
+   next = NULL;
+   view = mapping = (unsigned char*)calloc(size, 1);
+   anonymous = view != NULL;
+   dirty = NULL;
+   if (view) {
+      dirty = (unsigned char*)calloc((size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT, 1);
+   }
+}
+
+//Reload a saved mapping.  The file is mapped again and any pages that
+//had been written are restored from the saved copy.  The mapping keeps
+//its saved size whatever has happened to the file since.
+MappedFile::MappedFile(Buffer &b) {
+   unsigned int len, pages, page, savedSize;
+   b.read((char*)&base, sizeof(base));
+   b.read((char*)&size, sizeof(size));
+   b.read((char*)&fileOffset, sizeof(fileOffset));
+   b.read((char*)&mode, sizeof(mode));
+   b.read((char*)&len, sizeof(len));
+   fileName = (char*)calloc(len + 1, 1);
+   if (fileName) {
+      b.read(fileName, len);
+   }
+   view = mapping = NULL;
+   mappingSize = 0;
+   anonymous = false;
+   saved = true;
+   handle = NULL;
+   next = NULL;
+   savedSize = size;
+   bool mapped = fileName && fileName[0] && map();
+   if (mapped && size < savedSize) {
+      //the file has shrunk, copy what is left and zero fill the rest
+      msg("x86emu: %s is shorter than when it was saved, zero filling the rest\n", fileName);
+      unsigned char *copy = (unsigned char*)calloc(savedSize, 1);
+      if (copy) {
+         memcpy(copy, view, size);
+      }
+      unmap();
+      view = mapping = copy;
+      anonymous = view != NULL;
+   }
+   else if (!mapped) {
+      //keep the address range alive even if the file has gone away
+      if (fileName && fileName[0]) {
+         msg("x86emu: unable to remap %s, using zero filled memory\n", fileName);
+      }
+      view = mapping = (unsigned char*)calloc(savedSize, 1);
+      anonymous = view != NULL;
+   }
+   //page lengths below follow from the size save() used
+   size = savedSize;
+   dirty = (unsigned char*)calloc((size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT, 1);
+   b.read((char*)&pages, sizeof(pages));
+   for (unsigned int i = 0; i < pages && !b.has_error(); i++) {
+      b.read((char*)&page, sizeof(page));
+      unsigned int offset = page << MAP_PAGE_SHIFT;
+      if (offset >= size) break;   //corrupt
+      len = size - offset;
+      if (len > MAP_PAGE_SIZE) len = MAP_PAGE_SIZE;
+      if (view && dirty) {
+         b.read((char*)view + offset, len);
+         dirty[page] = PAGE_WRITTEN;
+      }
+      else {
+         //nowhere to put it, skip over the saved page
+         unsigned char tmp[MAP_PAGE_SIZE];
+         b.read((char*)tmp, len);
+      }
+   }
+}
+
+MappedFile::~MappedFile() {
+   unmap();
+   free(dirty);
+   free(fileName);
+}
+
+//save the mapping description plus the contents of every page written
+//since the file was mapped, the rest comes back from the file on load
+void MappedFile::saveHeader(Buffer &b) {
+   unsigned int len = (unsigned int)strlen(fileName);
+   b.write((char*)&base, sizeof(base));
+   b.write((char*)&size, sizeof(size));
+   b.write((char*)&fileOffset, sizeof(fileOffset));
+   b.write((char*)&mode, sizeof(mode));
+   b.write((char*)&len, sizeof(len));
+   b.write(fileName, len);
+}
+
+void MappedFile::save(Buffer &b) {
+   unsigned int len;
+   unsigned int pages = 0, npages = (size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT;
+   unsigned int i;
+   saveHeader(b);
+   if (dirty) {
+      for (i = 0; i < npages; i++) {
+         if (dirty[i]) pages++;
+      }
+   }
+   b.write((char*)&pages, sizeof(pages));
+   for (i = 0; pages && i < npages; i++) {
+      if (dirty[i]) {
+         unsigned int offset = i << MAP_PAGE_SHIFT;
+         len = size - offset;
+         if (len > MAP_PAGE_SIZE) len = MAP_PAGE_SIZE;
+         b.write((char*)&i, sizeof(i));
+         b.write((char*)view + offset, len);
+      }
+   }
+}
+
+void MappedFile::saveDelta(Buffer &b) {
+   unsigned char full = !saved;
+   unsigned int pages = 0, npages = (size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT;
+   unsigned int i;
+   b.write((char*)&base, sizeof(base));
+   b.write(&full, sizeof(full));
+   if (full) {
+      save(b);
+      return;
+   }
+   if (dirty) {
+      for (i = 0; i < npages; i++) {
+         if (dirty[i] & PAGE_CHANGED) pages++;
+      }
+   }
+   b.write((char*)&pages, sizeof(pages));
+   for (i = 0; pages && i < npages; i++) {
+      if (dirty[i] & PAGE_CHANGED) {
+         unsigned int offset = i << MAP_PAGE_SHIFT;
+         unsigned int len = size - offset;
+         if (len > MAP_PAGE_SIZE) len = MAP_PAGE_SIZE;
+         b.write((char*)&i, sizeof(i));
+         b.write((char*)view + offset, len);
+      }
+   }
+}
+
+//apply the pages saved by saveDelta to a mapping that was already loaded
+bool MappedFile::loadPages(Buffer &b) {
+   unsigned int pages, page;
+   b.read((char*)&pages, sizeof(pages));
+   for (unsigned int i = 0; i < pages && !b.has_error(); i++) {
+      b.read((char*)&page, sizeof(page));
+      unsigned int offset = page << MAP_PAGE_SHIFT;
+      if (offset >= size) return false;
+      unsigned int len = size - offset;
+      if (len > MAP_PAGE_SIZE) len = MAP_PAGE_SIZE;
+      const unsigned char *data = b.read_view(len);
+      if (data && view && dirty) {
+         memcpy(view + offset, data, len);
+         dirty[page] = PAGE_WRITTEN;
+      }
+   }
+   return !b.has_error();
+}
+
+void MappedFile::saveLayout(Buffer &b) {
+   unsigned int pages = 0;
+   saveHeader(b);
+   b.write((char*)&pages, sizeof(pages));
+}
+
+void MappedFile::markClean() {
+   unsigned int npages = (size + MAP_PAGE_SIZE - 1) >> MAP_PAGE_SHIFT;
+   if (dirty) {
+      for (unsigned int i = 0; i < npages; i++) {
+         dirty[i] &= ~PAGE_CHANGED;
+      }
+   }
+   saved = true;
+}
+
+#ifdef WIN32
+
+bool MappedFile::map() {
+   SYSTEM_INFO si;
+   HANDLE f = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (f == INVALID_HANDLE_VALUE) return false;
+   DWORD fsize = GetFileSize(f, NULL);
+   if (fsize == INVALID_FILE_SIZE || fileOffset >= fsize) {
+      CloseHandle(f);
+      return false;
+   }
+   if (size == 0 || size > fsize - fileOffset) size = fsize - fileOffset;
+   handle = CreateFileMapping(f, NULL, mode == MAP_COPY_ON_WRITE ? PAGE_WRITECOPY : PAGE_READONLY,
+                              0, 0, NULL);
+   CloseHandle(f);   //the mapping holds its own reference
+   if (handle == NULL) return false;
+   //views must start on an allocation granularity boundary
+   GetSystemInfo(&si);
+   unsigned int start = fileOffset - (fileOffset % si.dwAllocationGranularity);
+   mappingSize = size + (fileOffset - start);
+   mapping = (unsigned char*)MapViewOfFile((HANDLE)handle,
+                          mode == MAP_COPY_ON_WRITE ? FILE_MAP_COPY : FILE_MAP_READ,
+                          0, start, mappingSize);
+   if (mapping == NULL) {
+      CloseHandle((HANDLE)handle);
+      handle = NULL;
+      return false;
+   }
+   view = mapping + (fileOffset - start);
+   return true;
+}
+
+void MappedFile::unmap() {
+   if (anonymous) {
+      free(mapping);
+   }
+   else if (mapping) {
+      UnmapViewOfFile(mapping);
+      CloseHandle((HANDLE)handle);
+   }
+   view = mapping = NULL;
+   handle = NULL;
+}
+
+#else
+
+bool MappedFile::map() {
+   struct stat st;
+   int fd = open(fileName, O_RDONLY);
+   if (fd == -1) return false;
+   if (fstat(fd, &st) == -1 || fileOffset >= (unsigned int)st.st_size) {
+      close(fd);
+      return false;
+   }
+   if (size == 0 || size > st.st_size - fileOffset) size = (unsigned int)(st.st_size - fileOffset);
+   //private mappings give us copy on write for free
+   unsigned int start = fileOffset & ~((unsigned int)sysconf(_SC_PAGESIZE) - 1);
+   mappingSize = size + (fileOffset - start);
+   void *p = mmap(NULL, mappingSize,
+                  mode == MAP_COPY_ON_WRITE ? PROT_READ | PROT_WRITE : PROT_READ,
+                  MAP_PRIVATE, fd, start);
+   close(fd);   //the mapping holds its own reference
+   if (p == MAP_FAILED) return false;
+   mapping = (unsigned char*)p;
+   view = mapping + (fileOffset - start);
+   return true;
+}
+
+void MappedFile::unmap() {
+   if (anonymous) {
+      free(mapping);
+   }
+   else if (mapping) {
+      munmap(mapping, mappingSize);
+   }
+   view = mapping = NULL;
+}
+
+#endif
+
+//Does this mapping or one chained after it contain addr?
+MappedFile *MappedFile::contains(unsigned int addr) {
+   for (MappedFile *m = this; m; m = m->next) {
+      if (m->view && (addr - m->base) < m->size) return m;
+   }
+   return NULL;
+}
+
+void MappedFile::markDirty(unsigned int addr, unsigned int len) {
+   unsigned int first = (addr - base) >> MAP_PAGE_SHIFT;
+   unsigned int last = (addr - base + len - 1) >> MAP_PAGE_SHIFT;
+   if (dirty) {
+      memset(dirty + first, PAGE_WRITTEN | PAGE_CHANGED, last - first + 1);
+   }
+}
+
+unsigned char MappedFile::readByte(unsigned int addr) {
+   return view[addr - base];
+}
+
+void MappedFile::writeByte(unsigned int addr, unsigned char val) {
+   if (mode == MAP_COPY_ON_WRITE) {
+      view[addr - base] = val;
+      markDirty(addr, 1);
+   }
+}
+
+void MappedFile::readBlock(unsigned int addr, unsigned char *buf, unsigned int len) {
+   memcpy(buf, view + (addr - base), len);
+}
+
+void MappedFile::writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len) {
+   if (mode == MAP_COPY_ON_WRITE && len) {
+      memcpy(view + (addr - base), buf, len);
+      markDirty(addr, len);
+   }
+}
+
+unsigned int MappedFile::findByte(unsigned int addr, unsigned char val, unsigned int len) {
+   unsigned char *p = view + (addr - base);
+   unsigned char *q = (unsigned char*)memchr(p, val, len);
+   return q ? (unsigned int)(q - p) : len;
+}
@@ -0,0 +1,93 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: mapfile.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __MAPFILE_H
+#define __MAPFILE_H
+
+#include <stdio.h>
+#include "buffer.h"
+
+#define MAP_READONLY 0
+#define MAP_COPY_ON_WRITE 1
+
+/*
+ * A host file mapped directly into the emulated address space.  Reads come
+ * straight out of the host mapping.  Copy-on-write mappings get a private
+ * copy of a page the first time it is written, the host OS takes care of
+ * that for us.  Writes to read only mappings are dropped.
+ */
+class MappedFile {
+   friend class MemoryManager;
+public:
+   MappedFile(const char *fileName, unsigned int base, int mode,
+              unsigned int offset = 0, unsigned int len = 0);
+   //len bytes of zero filled, writable memory with no file behind it
+   MappedFile(unsigned int base, unsigned int len);
+   MappedFile(Buffer &b);
+   ~MappedFile();
+
+   //false if the file could not be mapped
+   bool isMapped() {return view != NULL;};
+
+   MappedFile *contains(unsigned int addr);
+   unsigned char readByte(unsigned int addr);
+   void writeByte(unsigned int addr, unsigned char val);
+
+   //block access, [addr, addr + len) must lie within this mapping
+   void readBlock(unsigned int addr, unsigned char *buf, unsigned int len);
+   void writeBlock(unsigned int addr, const unsigned char *buf, unsigned int len);
+   unsigned int findByte(unsigned int addr, unsigned char val, unsigned int len);
+
+   unsigned int getBase() {return base;};
+   unsigned int getSize() {return size;};
+   const char *getFileName() {return fileName;};
+   MappedFile *getNext() {return next;};
+
+   void save(Buffer &b);
+   //the whole mapping if it is new since the last save or load, otherwise
+   //just the pages written since then
+   void saveDelta(Buffer &b);
+   bool loadPages(Buffer &b);
+   void markClean();
+   //as save() with none of the pages, loads as the unwritten mapping
+   void saveLayout(Buffer &b);
+
+private:
+   bool map();
+   void unmap();
+   void markDirty(unsigned int addr, unsigned int len);
+   void saveHeader(Buffer &b);
+
+   char *fileName;
+   unsigned int fileOffset;
+   unsigned int base;
+   unsigned int size;
+   int mode;
+   unsigned char *view;       //host address of guest address base
+   unsigned char *mapping;    //start of the host mapping, view may be offset
+   unsigned int mappingSize;
+   bool anonymous;            //file was unavailable, view is plain memory
+   unsigned char *dirty;      //PAGE_ flags for each page
+   bool saved;                //part of the last state saved or loaded
+   void *handle;              //host file mapping handle (Windows only)
+   MappedFile *next;
+};
+
+#endif
@@ -19,6 +19,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef __IDP__
 #include <ida.hpp>
@@ -27,9 +28,11 @@
 #endif
 
 #include "x86defs.h"
+#include "host.h"
 #include "seh.h"
 #include "memmgr.h"
 #include "emufuncs.h"
+#include "events.h"
 
 MemoryManager::MemoryManager(unsigned char *program, unsigned int minVaddr,
                              unsigned int maxVaddr) {
@@ -42,11 +45,22 @@ MemoryManager::MemoryManager(unsigned int minVaddr, unsigned int maxVaddr) {
    program = NULL;
 }
 
-MemoryManager::MemoryManager(Buffer &b) {
+MemoryManager::MemoryManager(Buffer &b, HeapImage *image) {
    b.read((char*)&minAddr, sizeof(minAddr));
    b.read((char*)&maxAddr, sizeof(maxAddr));
    stack = new EmuStack(b);
-   heap = new EmuHeap(b);
+   heap = new EmuHeap(b, image);
+   maps = NULL;
+   shadow = NULL;
+   program = NULL;
+   addressSpace.add(minAddr, maxAddr - minAddr, AS_PROGRAM, AS_RWX, this);
+   mapStack(true);
+   for (EmuHeap *h = heap; h; h = h->nextHeap) {
+      mapHeap(h, true);
+   }
+   if (b.getVersion() >= 2) {
+      loadMaps(b);
+   }
 }
 
 void MemoryManager::save(Buffer &b, unsigned int sp) {
@@ -54,24 +68,397 @@ void MemoryManager::save(Buffer &b, unsigned int sp) {
    b.write((char*)&maxAddr, sizeof(maxAddr));
    stack->save(b, sp);
    heap->save(b);
+   saveMaps(b);
+}
+
+//a single heap in the format EmuHeap(Buffer&) reads
+void MemoryManager::saveHeap(Buffer &b, EmuHeap *h) {
+   h->writeHeap(b);
+}
+
+void MemoryManager::saveMaps(Buffer &b) {
+   unsigned int count = 0;
+   MappedFile *m;
+   for (m = maps; m; m = m->next) count++;
+   b.write((char*)&count, sizeof(count));
+   for (m = maps; m; m = m->next) {
+      m->save(b);
+   }
+}
+
+void MemoryManager::loadStack(Buffer &b) {
+   mapStack(false);
+   delete stack;
+   stack = new EmuStack(b);
+   mapStack(true);
+}
+
+void MemoryManager::loadHeap(Buffer &b) {
+   EmuHeap **last = &heap;
+   while (*last) last = &(*last)->nextHeap;
+   *last = new EmuHeap(b);
+   mapHeap(*last, true);
+}
+
+//saved mappings go after any we already have, in the order they were saved
+void MemoryManager::loadMaps(Buffer &b) {
+   unsigned int count;
+   MappedFile **last = &maps;
+   while (*last) last = &(*last)->next;
+   b.read((char*)&count, sizeof(count));
+   for (unsigned int i = 0; i < count && !b.has_error(); i++) {
+      MappedFile *m = new MappedFile(b);
+      *last = m;
+      last = &m->next;
+      addressSpace.add(m->base, m->size, AS_MAPPED, m->mode == MAP_COPY_ON_WRITE ? AS_RWX : AS_READ | AS_EXEC, m);
+   }
+}
+
+void MemoryManager::saveDelta(Buffer &b, unsigned int sp) {
+   unsigned int count = 0;
+   MappedFile *m;
+   b.write((char*)&minAddr, sizeof(minAddr));
+   b.write((char*)&maxAddr, sizeof(maxAddr));
+   stack->saveDelta(b, sp);
+   if (heap) {
+      heap->saveDelta(b);
+   }
+   else {
+      b.write((char*)&count, sizeof(count));
+   }
+   for (m = maps; m; m = m->next) count++;
+   b.write((char*)&count, sizeof(count));
+   for (m = maps; m; m = m->next) {
+      m->saveDelta(b);
+   }
+}
+
+bool MemoryManager::loadDelta(Buffer &b) {
+   unsigned int min, max, count, i;
+   EmuHeap *h, *old, **lastHeap = &heap;
+   MappedFile *m, *oldMaps, **lastMap = &maps;
+   bool ok;
+   b.read((char*)&min, sizeof(min));
+   b.read((char*)&max, sizeof(max));
+   if (min != minAddr || max != maxAddr) {
+      addressSpace.remove(minAddr, maxAddr - minAddr, this);
+      minAddr = min;
+      maxAddr = max;
+      addressSpace.add(minAddr, maxAddr - minAddr, AS_PROGRAM, AS_RWX, this);
+   }
+   //the address map only changes for regions that moved
+   unsigned int top = stack->getStackTop(), size = stack->getStackSize();
+   ok = stack->loadDelta(b);
+   if (top != stack->getStackTop() || size != stack->getStackSize()) {
+      addressSpace.remove(top - size, size, stack);
+      mapStack(true);
+   }
+
+   //heaps are matched up with the old ones by base address
+   old = heap;
+   heap = NULL;
+   b.read((char*)&count, sizeof(count));
+   for (i = 0; ok && i < count && !b.has_error(); i++) {
+      unsigned int n, base, limit;
+      b.read((char*)&n, sizeof(n));
+      b.read((char*)&base, sizeof(base));
+      b.read((char*)&limit, sizeof(limit));
+      EmuHeap **p = &old;
+      while (*p && (*p)->base != base) p = &(*p)->nextHeap;
+      if (*p) {
+         h = *p;
+         *p = h->nextHeap;
+         h->nextHeap = NULL;
+         if (h->max != limit) {
+            mapHeap(h, false);
+            h->max = limit;
+            mapHeap(h, true);
+         }
+      }
+      else {
+         h = new EmuHeap(base, limit - base);
+         mapHeap(h, true);
+      }
+      *lastHeap = h;
+      lastHeap = &h->nextHeap;
+      ok = h->loadDelta(b, n);
+   }
+   for (h = old; h; h = h->nextHeap) {
+      mapHeap(h, false);
+   }
+   delete old;
+
+   //mappings left out of the delta have been unmapped
+   oldMaps = maps;
+   maps = NULL;
+   b.read((char*)&count, sizeof(count));
+   for (i = 0; ok && i < count && !b.has_error(); i++) {
+      unsigned int base = 0;
+      unsigned char full = 0;
+      b.read((char*)&base, sizeof(base));
+      b.read(&full, sizeof(full));
+      MappedFile **p = &oldMaps;
+      while (*p && (*p)->base != base) p = &(*p)->next;
+      m = *p;
+      if (m) {
+         *p = m->next;
+         m->next = NULL;
+      }
+      if (full) {
+         if (m) {
+            addressSpace.remove(m->base, m->size, m);
+            delete m;
+         }
+         m = new MappedFile(b);
+         addressSpace.add(m->base, m->size, AS_MAPPED, m->mode == MAP_COPY_ON_WRITE ? AS_RWX : AS_READ | AS_EXEC, m);
+      }
+      else if (m == NULL) {
+         ok = false;
+         break;
+      }
+      else {
+         ok = m->loadPages(b);
+      }
+      *lastMap = m;
+      lastMap = &m->next;
+   }
+   while (oldMaps) {
+      m = oldMaps;
+      oldMaps = m->next;
+      addressSpace.remove(m->base, m->size, m);
+      delete m;
+   }
+   return ok && !b.has_error();
+}
+
+void MemoryManager::saveLayout(Buffer &b) {
+   unsigned int top = stack->getStackTop(), size = stack->getStackSize();
+   unsigned int count = 0;
+   MappedFile *m;
+   b.write((char*)&minAddr, sizeof(minAddr));
+   b.write((char*)&maxAddr, sizeof(maxAddr));
+   b.write((char*)&top, sizeof(top));
+   b.write((char*)&size, sizeof(size));
+   if (heap) {
+      heap->saveLayout(b);
+   }
+   else {
+      b.write((char*)&count, sizeof(count));
+   }
+   for (m = maps; m; m = m->next) count++;
+   b.write((char*)&count, sizeof(count));
+   for (m = maps; m; m = m->next) {
+      m->saveLayout(b);
+   }
+}
+
+bool MemoryManager::loadLayout(Buffer &b) {
+   unsigned int min = 0, max = 0, top = 0, size = 0;
+   EmuHeap *h;
+   b.read((char*)&min, sizeof(min));
+   b.read((char*)&max, sizeof(max));
+   b.read((char*)&top, sizeof(top));
+   b.read((char*)&size, sizeof(size));
+   if (b.has_error() || min != minAddr || max != maxAddr) {
+      //a layout from some other program
+      return false;
+   }
+   mapStack(false);
+   delete stack;
+   stack = new EmuStack(top, size);
+   mapStack(true);
+
+   for (h = heap; h; h = h->nextHeap) {
+      mapHeap(h, false);
+   }
+   delete heap;
+   heap = EmuHeap::loadLayout(b);
+   for (h = heap; h; h = h->nextHeap) {
+      mapHeap(h, true);
+   }
+   if (shadow) {
+      //start checking the new heaps with the same settings
+      unsigned int redzone = shadow->getRedzone();
+      delete shadow;
+      shadow = NULL;
+      enableShadow(redzone);
+   }
+
+   while (maps) {
+      MappedFile *m = maps;
+      maps = m->next;
+      addressSpace.remove(m->base, m->size, m);
+      delete m;
+   }
+   loadMaps(b);
+   return !b.has_error();
+}
+
+static int comparePages(const void *a, const void *b) {
+   unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+   return x < y ? -1 : x > y;
+}
+
+//pages covering [base, base + len) from n on, returns the new count
+static unsigned int rangePages(unsigned int base, unsigned int len, unsigned int shift,
+                               unsigned int *pages, unsigned int n) {
+   if (len) {
+      unsigned int last = (base + len - 1) >> shift;
+      for (unsigned int p = base >> shift; p <= last; p++) {
+         if (pages) pages[n] = p << shift;
+         n++;
+      }
+   }
+   return n;
+}
+
+unsigned int MemoryManager::statePages(unsigned int sp, unsigned int shift, unsigned int **pages) {
+   unsigned int *list = NULL;
+   unsigned int top = stack->getStackTop(), size = stack->getStackSize();
+   unsigned int n = 0, i, j;
+#ifdef __IDP__
+   bool withProgram = maxAddr - minAddr <= MAX_STATE_PROGRAM;
+#else
+   //headless program space is only there with an image behind it
+   bool withProgram = program != NULL && maxAddr - minAddr <= MAX_STATE_PROGRAM;
+#endif
+   if (sp < top - size || sp > top) sp = top - size;
+   //count them all, then fill them in
+   for (int pass = 0; pass < 2; pass++) {
+      n = 0;
+      if (withProgram) {
+         n = rangePages(minAddr, maxAddr - minAddr, shift, list, n);
+      }
+      n = rangePages(sp, top - sp, shift, list, n);
+      for (EmuHeap *h = heap; h; h = h->nextHeap) {
+         n += h->blockPages(shift, list ? list + n : NULL);
+      }
+      for (MappedFile *m = maps; m; m = m->next) {
+         n = rangePages(m->base, m->size, shift, list, n);
+      }
+      if (list == NULL) {
+         list = (unsigned int*)malloc((n ? n : 1) * sizeof(unsigned int));
+         if (list == NULL) break;
+      }
+   }
+   if (list == NULL) {
+      *pages = NULL;
+      return 0;
+   }
+   qsort(list, n, sizeof(unsigned int), comparePages);
+   for (i = j = 0; i < n; i++) {
+      if (j == 0 || list[i] != list[j - 1]) list[j++] = list[i];
+   }
+   *pages = list;
+   return j;
+}
+
+void MemoryManager::markClean(unsigned int sp) {
+   stack->markClean(sp);
+   if (heap) {
+      heap->markClean();
+   }
+   for (MappedFile *m = maps; m; m = m->next) {
+      m->markClean();
+   }
 }
 
 MemoryManager::~MemoryManager() {
+   mapRegions(false);
    delete stack;
    delete heap;
+   delete shadow;
+   while (maps) {
+      MappedFile *m = maps;
+      maps = m->next;
+      delete m;
+   }
+}
+
+void MemoryManager::mapRegions(bool add) {
+   if (add) {
+      addressSpace.add(minAddr, maxAddr - minAddr, AS_PROGRAM, AS_RWX, this);
+   }
+   else {
+      addressSpace.remove(minAddr, maxAddr - minAddr, this);
+   }
+   mapStack(add);
+   for (EmuHeap *h = heap; h; h = h->nextHeap) {
+      mapHeap(h, add);
+   }
+   for (MappedFile *m = maps; m; m = m->next) {
+      if (add) {
+         addressSpace.add(m->base, m->size, AS_MAPPED, m->mode == MAP_COPY_ON_WRITE ? AS_RWX : AS_READ | AS_EXEC, m);
+      }
+      else {
+         addressSpace.remove(m->base, m->size, m);
+      }
+   }
+}
+
+//add or remove the stack from the address map
+void MemoryManager::mapStack(bool add) {
+   if (stack) {
+      unsigned int size = stack->getStackSize();
+      unsigned int bottom = stack->getStackTop() - size;
+      if (add) {
+         addressSpace.add(bottom, size, AS_STACK, AS_RWX, stack);
+      }
+      else {
+         addressSpace.remove(bottom, size, stack);
+      }
+   }
+}
+
+void MemoryManager::mapHeap(EmuHeap *h, bool add) {
+   if (add) {
+      addressSpace.add(h->base, h->max - h->base, AS_HEAP, AS_RWX, h);
+   }
+   else {
+      addressSpace.remove(h->base, h->max - h->base, h);
+   }
 }
 
 void MemoryManager::initStack(unsigned int stackTop, unsigned int maxSize) {
    if (stack) {
+      mapStack(false);
       stack->rebase(stackTop, maxSize);
    }
    else {
       stack = new EmuStack(stackTop, maxSize);
    }
+   mapStack(true);
 }
 
 void MemoryManager::initHeap(unsigned int heapBase, unsigned int maxSize) {
+   for (EmuHeap *h = heap; h; h = h->nextHeap) {
+      mapHeap(h, false);
+   }
+   delete heap;
    heap = new EmuHeap(heapBase, maxSize);
+   mapHeap(heap, true);
+   if (shadow) {
+      //start checking the new heap with the same settings
+      unsigned int redzone = shadow->getRedzone();
+      delete shadow;
+      shadow = NULL;
+      enableShadow(redzone);
+   }
+}
+
+void MemoryManager::enableShadow(unsigned int redzone) {
+   if (shadow == NULL && heap) {
+      shadow = new ShadowMemory(heap, redzone);
+      heap->setShadow(shadow);
+   }
+}
+
+void MemoryManager::disableShadow() {
+   if (heap) {
+      heap->setShadow(NULL);
+   }
+   delete shadow;
+   shadow = NULL;
 }
 
 unsigned int MemoryManager::addHeap(unsigned int maxSize) {
@@ -82,6 +469,8 @@ unsigned int MemoryManager::addHeap(unsigned int maxSize) {
    if (p) {
       //really need to check maxSize + max here against 0xFFFFFFFF
       p->nextHeap = new EmuHeap(p->max, maxSize);
+      p->nextHeap->setShadow(shadow);
+      mapHeap(p->nextHeap, true);
    }
    return p ? p->base : 0;
 }
@@ -93,6 +482,7 @@ unsigned int MemoryManager::destroyHeap(unsigned int handle) {
       p = h;
    }
    if (p && h) {
+      mapHeap(h, false);
       p->nextHeap = h->nextHeap;
       h->nextHeap = NULL;
       delete h;
@@ -109,59 +499,324 @@ EmuHeap *MemoryManager::findHeap(unsigned int handle) {
    return NULL;
 }
 
+//does [start, start + len) overlap [base, base + size)
+static bool overlaps(unsigned int start, unsigned int len, unsigned int base, unsigned int size) {
+   return (start - base) < size || (base - start) < len;
+}
+
+bool MemoryManager::mapFile(const char *fileName, unsigned int base, bool copyOnWrite,
+                            unsigned int offset, unsigned int len) {
+   return addMapping(new MappedFile(fileName, base, copyOnWrite ? MAP_COPY_ON_WRITE : MAP_READONLY,
+                                    offset, len));
+}
+
+bool MemoryManager::mapZero(unsigned int base, unsigned int len) {
+   return addMapping(new MappedFile(base, len));
+}
+
+//takes ownership of f, which is deleted if it can't be added
+bool MemoryManager::addMapping(MappedFile *f) {
+   unsigned int base = f->getBase();
+   unsigned int size = f->getSize();
+   bool ok = f->isMapped() && size && (base + size - 1) >= base;
+   if (ok && overlaps(base, size, minAddr, maxAddr - minAddr)) ok = false;
+   if (ok && stack) {
+      unsigned int bottom = stack->getStackTop() - stack->getStackSize();
+      if (overlaps(base, size, bottom, stack->getStackSize())) ok = false;
+   }
+   for (EmuHeap *h = heap; ok && h; h = h->nextHeap) {
+      if (overlaps(base, size, h->base, h->max - h->base)) ok = false;
+   }
+   for (MappedFile *m = maps; ok && m; m = m->next) {
+      if (overlaps(base, size, m->base, m->size)) ok = false;
+   }
+   if (!ok) {
+      delete f;
+      return false;
+   }
+   f->next = maps;
+   maps = f;
+   addressSpace.add(base, size, AS_MAPPED, f->mode == MAP_COPY_ON_WRITE ? AS_RWX : AS_READ | AS_EXEC, f);
+   return true;
+}
+
+bool MemoryManager::unmapFile(unsigned int base) {
+   for (MappedFile **p = &maps; *p; p = &(*p)->next) {
+      if ((*p)->base == base) {
+         MappedFile *m = *p;
+         *p = m->next;
+         addressSpace.remove(m->base, m->size, m);
+         delete m;
+         return true;
+      }
+   }
+   return false;
+}
+
 unsigned char MemoryManager::readByte(unsigned int addr) {
-   EmuHeap *h;
-   if (contains(addr)) {
+   void *owner = NULL;
+   switch (region(addr, &owner)) {
+      case AS_MAPPED:
+         return ((MappedFile*)owner)->readByte(addr);
+      case AS_PROGRAM:
 #ifdef __IDP__
-      //interface to IDA to read a byte
-      //from virtual program space
-      return get_byte(addr);
+         //interface to IDA to read a byte
+         //from virtual program space
+         return get_byte(addr);
 #else
-      //assume user provided program space
-      return program[addr - minAddr];
+         //assume user provided program space
+         return program[addr - minAddr];
+#endif
+      case AS_STACK:
+         return stack->readByte(addr);
+      case AS_HEAP:
+         if (shadow) shadow->checkRead(addr);
+         return ((EmuHeap*)owner)->readByte(addr);
+#ifdef __IDP__
+      //host modules are only there in the plugin, loaded in our own process
+      case AS_MODULE:
+         return *(unsigned char*)addr;
 #endif
    }
+   //else out of bounds memory access
+//   memoryAccessException();
+   return 0;
+}
+
+void MemoryManager::writeByte(unsigned int addr, unsigned char val) {
+   void *owner = NULL;
+   switch (region(addr, &owner)) {
+      case AS_MAPPED:
+         ((MappedFile*)owner)->writeByte(addr, val);
+         break;
+      case AS_PROGRAM:
+#ifdef __IDP__
+         //interface to IDA to write a byte
+         //to virtual program space
+      //   put_byte(addr, val);
+         if (val == 0xFF) { //new version of ida (4.9) sees 0xFF as undefined?
+            patch_byte(addr, 0);
+         }
+         patch_byte(addr, val);
+#else
+         //no IDA so assume user supplied program space
+         program[addr - minAddr] = val;
+#endif
+         break;
+      case AS_STACK:
+         stack->writeByte(addr, val);
+         break;
+      case AS_HEAP:
+         if (shadow) shadow->checkWrite(addr);
+         ((EmuHeap*)owner)->writeByte(addr, val);
+         break;
+   }
+   //else out of bounds memory access
+//   memoryAccessException();
+}
+
+//Slow path for pages that the address map could not settle, check each
+//region in order of precedence
+int MemoryManager::classify(unsigned int addr, void **owner) {
+   EmuHeap *h;
+   MappedFile *m;
+   *owner = NULL;
+   if (maps && (m = maps->contains(addr))) {
+      *owner = m;
+      return AS_MAPPED;
+   }
+   else if (contains(addr)) {
+      return AS_PROGRAM;
+   }
    else if (stack && stack->contains(addr)) {
-      return stack->readByte(addr);
+      *owner = stack;
+      return AS_STACK;
    }
    else if (heap && (h = heap->contains(addr))) {
-      return h->readByte(addr);
+      *owner = h;
+      return AS_HEAP;
    }
    else if (isModuleAddress(addr)) {
-      return *(unsigned char*)addr;
+      return AS_MODULE;
    }
-   //else out of bounds memory access
-//   memoryAccessException();
-   return 0;
+   return AS_UNMAPPED;
 }
 
-void MemoryManager::writeByte(unsigned int addr, unsigned char val) {
-   EmuHeap *h;
-   if (contains(addr)) {
+//Classify addr and clip *len so that [addr, addr + *len) stays within a
+//single region and a single page.  The page split lets module space,
+//whose extent we don't know, be rechecked at each page boundary.
+int MemoryManager::span(unsigned int addr, unsigned int *len, void **owner) {
+   unsigned int n = MM_PAGE_SIZE - (addr & MM_PAGE_MASK);
+   unsigned int limit = n;
+   int kind = region(addr, owner);
+   switch (kind) {
+      case AS_MAPPED: {
+            MappedFile *m = (MappedFile*)*owner;
+            limit = m->base + m->size - addr;
+         }
+         break;
+      case AS_PROGRAM:
+         limit = maxAddr - addr;
+         break;
+      case AS_STACK:
+         limit = stack->getStackTop() - addr;
+         break;
+      case AS_HEAP:
+         limit = ((EmuHeap*)*owner)->max - addr;
+         break;
+      case AS_UNMAPPED:
+         if (addressSpace.kind(addr) == AS_SHARED) {
+            //unmapped part of a shared page, run up to the next region
+            if (minAddr > addr && minAddr - addr < limit) limit = minAddr - addr;
+            if (stack) {
+               unsigned int bottom = stack->getStackTop() - stack->getStackSize();
+               if (bottom > addr && bottom - addr < limit) limit = bottom - addr;
+            }
+            for (EmuHeap *p = heap; p; p = p->nextHeap) {
+               if (p->base > addr && p->base - addr < limit) limit = p->base - addr;
+            }
+            for (MappedFile *f = maps; f; f = f->next) {
+               if (f->base > addr && f->base - addr < limit) limit = f->base - addr;
+            }
+         }
+         break;
+   }
+   if (limit < n) n = limit;
+   if (n < *len) *len = n;
+   return kind;
+}
+
+void MemoryManager::readBlock(unsigned int addr, void *buf, unsigned int len) {
+   unsigned char *p = (unsigned char*)buf;
+   while (len) {
+      void *owner = NULL;
+      unsigned int n = len;
+      int kind = span(addr, &n, &owner);
+      switch (kind) {
+         case AS_PROGRAM:
 #ifdef __IDP__
-      //interface to IDA to write a byte
-      //to virtual program space
-   //   put_byte(addr, val);
-      if (val == 0xFF) { //new version of ida (4.9) sees 0xFF as undefined?
-         patch_byte(addr, 0);
-      }
-      patch_byte(addr, val);
+            if (!get_many_bytes(addr, p, n)) {
+               //some bytes have no value, get what we can
+               for (unsigned int i = 0; i < n; i++) {
+                  p[i] = get_byte(addr + i);
+               }
+            }
 #else
-      //no IDA so assume user supplied program space
-      program[addr - minAaddr] = val;
+            memcpy(p, program + (addr - minAddr), n);
+#endif
+            break;
+         case AS_STACK:
+            stack->readBlock(addr, p, n);
+            break;
+         case AS_HEAP:
+            if (shadow) shadow->checkRead(addr, n);
+            ((EmuHeap*)owner)->readBlock(addr, p, n);
+            break;
+#ifdef __IDP__
+         case AS_MODULE:
+            memcpy(p, (void*)addr, n);
+            break;
 #endif
+         case AS_MAPPED:
+            ((MappedFile*)owner)->readBlock(addr, p, n);
+            break;
+         default:
+            memset(p, 0, n);
+            break;
+      }
+      if (eventMask & EVENT_BIT(EV_MEM_READ)) {
+         raiseMemEvent(EV_MEM_READ, addr, n, 0, kind);
+      }
+      addr += n;
+      p += n;
+      len -= n;
    }
-   else if (stack && stack->contains(addr)) {
-      stack->writeByte(addr, val);
+}
+
+void MemoryManager::writeBlock(unsigned int addr, const void *buf, unsigned int len) {
+   const unsigned char *p = (const unsigned char*)buf;
+   while (len) {
+      void *owner = NULL;
+      unsigned int n = len;
+      int kind = span(addr, &n, &owner);
+      switch (kind) {
+         case AS_PROGRAM:
 #ifdef __IDP__
-      updateStack(addr);
+            for (unsigned int i = 0; i < n; i++) {
+               if (p[i] == 0xFF) { //see writeByte
+                  patch_byte(addr + i, 0);
+               }
+               patch_byte(addr + i, p[i]);
+            }
+#else
+            memcpy(program + (addr - minAddr), p, n);
 #endif
+            break;
+         case AS_STACK:
+            stack->writeBlock(addr, p, n);
+            break;
+         case AS_HEAP:
+            if (shadow) shadow->checkWrite(addr, n);
+            ((EmuHeap*)owner)->writeBlock(addr, p, n);
+            break;
+         case AS_MAPPED:
+            ((MappedFile*)owner)->writeBlock(addr, p, n);
+            break;
+         default:
+            //out of bounds memory access
+            break;
+      }
+      if (eventMask & EVENT_BIT(EV_MEM_WRITE)) {
+         raiseMemEvent(EV_MEM_WRITE, addr, n, 0, kind);
+      }
+      addr += n;
+      p += n;
+      len -= n;
    }
-   else if (heap && (h = heap->contains(addr))) {
-      h->writeByte(addr, val);
+}
+
+unsigned int MemoryManager::findByte(unsigned int addr, unsigned char val, unsigned int max) {
+   unsigned int offset = 0;
+   while (offset < max) {
+      void *owner = NULL;
+      unsigned int n = max - offset;
+      unsigned int r = n;
+      unsigned char *q;
+      switch (span(addr, &n, &owner)) {
+         case AS_PROGRAM:
+#ifdef __IDP__
+            for (r = 0; r < n; r++) {
+               if (get_byte(addr + r) == val) break;
+            }
+#else
+            q = (unsigned char*)memchr(program + (addr - minAddr), val, n);
+            r = q ? (unsigned int)(q - (program + (addr - minAddr))) : n;
+#endif
+            break;
+         case AS_STACK:
+            r = stack->findByte(addr, val, n);
+            break;
+         case AS_HEAP:
+            r = ((EmuHeap*)owner)->findByte(addr, val, n);
+            break;
+#ifdef __IDP__
+         case AS_MODULE:
+            q = (unsigned char*)memchr((void*)addr, val, n);
+            r = q ? (unsigned int)(q - (unsigned char*)addr) : n;
+            break;
+#endif
+         case AS_MAPPED:
+            r = ((MappedFile*)owner)->findByte(addr, val, n);
+            break;
+         default:
+            r = val ? n : 0;
+            break;
+      }
+      if (r < n) return offset + r;
+      addr += n;
+      offset += n;
    }
-   //else out of bounds memory access
-//   memoryAccessException();
+   return max;
 }
 
 bool MemoryManager::contains(unsigned int addr) {
@@ -173,6 +828,9 @@ void MemoryManager::initCommon(unsigned int minVaddr, unsigned int maxVaddr) {
    maxAddr = maxVaddr;
    heap = NULL;
    stack = NULL;
+   maps = NULL;
+   shadow = NULL;
+   addressSpace.add(minAddr, maxAddr - minAddr, AS_PROGRAM, AS_RWX, this);
 }
 
 
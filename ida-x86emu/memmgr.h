@@ -25,16 +25,37 @@
 #include "buffer.h"
 #include "emustack.h"
 #include "emuheap.h"
+#include "mapfile.h"
+#include "addrmap.h"
+
+//granularity at which block requests are split
+#define MM_PAGE_SIZE 0x1000
+#define MM_PAGE_MASK (MM_PAGE_SIZE - 1)
+
+//statePages leaves out a program space larger than this
+#define MAX_STATE_PROGRAM 0x10000000
 
 class MemoryManager {
 public:
    MemoryManager(unsigned char *program, unsigned int minVaddr,
                  unsigned int maxVaddr);
    MemoryManager(unsigned int minVaddr, unsigned int maxVaddr);
-   MemoryManager(Buffer &b);
+   //heap blocks are left in image, if given, until written (see EmuHeap)
+   MemoryManager(Buffer &b, HeapImage *image = NULL);
    ~MemoryManager();
 
    bool contains(unsigned int addr);
+
+   //which region addr falls in (an AS_ kind) and the object that owns it
+   int region(unsigned int addr, void **owner) {
+      PageInfo *p = addressSpace.find(addr);
+      if (p == NULL) return AS_UNMAPPED;
+      if (p->kind != AS_SHARED) {
+         *owner = p->owner;
+         return p->kind;
+      }
+      return classify(addr, owner);
+   };
    
    void initStack(unsigned int stackTop, unsigned int maxSize);
    void initHeap(unsigned int heapBase, unsigned int maxSize);
@@ -44,16 +65,70 @@ public:
    unsigned int destroyHeap(unsigned int handle);
    EmuHeap *findHeap(unsigned int handle);
 
+   //map a host file, or len bytes of it starting at offset, at base
+   //fails if the range overlaps any other region
+   bool mapFile(const char *fileName, unsigned int base, bool copyOnWrite,
+                unsigned int offset = 0, unsigned int len = 0);
+   //zero filled memory that is saved and restored like a mapping
+   bool mapZero(unsigned int base, unsigned int len);
+   bool unmapFile(unsigned int base);
+
+   //opt-in heap checking, redzone bytes are kept around every new block
+   void enableShadow(unsigned int redzone = SHADOW_DEFAULT_REDZONE);
+   void disableShadow();
+
    unsigned char readByte(unsigned int addr);
    void writeByte(unsigned int addr, unsigned char val);
 
+   //bulk access, unmapped bytes read as zero and writes to them are dropped
+   void readBlock(unsigned int addr, void *buf, unsigned int len);
+   void writeBlock(unsigned int addr, const void *buf, unsigned int len);
+   //offset of the first val in [addr, addr + max), max if there is none
+   unsigned int findByte(unsigned int addr, unsigned char val, unsigned int max);
+
    void save(Buffer &b, unsigned int sp);
+   //only what was written since the last save or load, loadDelta applies
+   //it over that same state and fails if the delta doesn't fit it
+   void saveDelta(Buffer &b, unsigned int sp);
+   bool loadDelta(Buffer &b);
+   //the state was just saved or loaded, start tracking changes afresh
+   void markClean(unsigned int sp);
+   //the stack, heap blocks and mappings without their contents.  Loading
+   //replaces them with zero filled (or freshly mapped) ones to be written
+   //into, program space is left alone.
+   void saveLayout(Buffer &b);
+   bool loadLayout(Buffer &b);
+   //address of every page (of 1 << shift bytes) holding program space,
+   //the stack from sp up, heap blocks or mappings, sorted and without
+   //repeats.  *pages is malloc'ed, returns the count.
+   unsigned int statePages(unsigned int sp, unsigned int shift, unsigned int **pages);
+
+   //the parts of save() one at a time for snapshot files, loading starts
+   //from MemoryManager(program, minVaddr, maxVaddr)
+   unsigned int getMinAddr() {return minAddr;};
+   unsigned int getMaxAddr() {return maxAddr;};
+   void saveHeap(Buffer &b, EmuHeap *h);
+   void saveMaps(Buffer &b);
+   void loadStack(Buffer &b);
+   //each heap is added after those already loaded
+   void loadHeap(Buffer &b);
+   void loadMaps(Buffer &b);
+   //add or remove every region from the address map, a manager taken out
+   //of it can be kept aside while another one is built
+   void mapRegions(bool add);
 
    EmuStack *stack;
    EmuHeap *heap;
+   MappedFile *maps;
+   ShadowMemory *shadow;   //NULL unless heap checking is on
 
 private:
    void initCommon(unsigned int minVaddr, unsigned int maxVaddr);
+   int classify(unsigned int addr, void **owner);
+   int span(unsigned int addr, unsigned int *len, void **owner);
+   void mapStack(bool add);
+   void mapHeap(EmuHeap *h, bool add);
+   bool addMapping(MappedFile *f);
 
    unsigned char *program;
    unsigned int minAddr;
@@ -0,0 +1,521 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: memo.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "memmgr.h"
+#include "events.h"
+#include "memo.h"
+
+#define MEMO_BUCKETS 1024
+#define SLOT_BITS 13
+#define SLOTS (1 << SLOT_BITS)   //twice MEMO_MAX_BYTES
+#define MAX_INSN 15              //longest instruction
+
+//flags a call can see
+#define MEMO_FLAGS (CF | PF | AF | ZF | SF | DF | OF)
+
+//MemoByte flags
+#define BYTE_IN  1   //read before the call wrote it
+#define BYTE_OUT 2   //written by the call
+
+typedef struct _MemoByte {
+   dword addr;
+   byte in;      //value first read
+   byte out;     //value last written
+   byte flags;
+} MemoByte;
+
+//a run of footprint bytes, data for all the runs follows them
+typedef struct _MemoRun {
+   dword addr;
+   word len;
+   word stack;   //the run is on the stack
+} MemoRun;
+
+typedef struct _MemoEntry {
+   struct _MemoEntry *next;
+   dword regs[8];      //at the call
+   dword flags;
+   dword out[8];       //after the return
+   dword changed;      //registers the call changed
+   dword eflags;       //after the return
+   dword espDelta;     //esp after the return less esp at the call
+   dword entrySp;      //esp at the call, must match if stack is set
+   bool stack;         //the footprint has stack bytes
+   dword steps;
+   unsigned int inRuns;
+   unsigned int outRuns;
+   unsigned int size;  //bytes of runs and data
+   bool confirmed;
+   MemoRun *runs;      //inputs then outputs
+   byte *data;
+} MemoEntry;
+
+typedef struct _MemoFunc {
+   struct _MemoFunc *next;
+   dword addr;
+   MemoEntry *entries;   //most recently used first
+   unsigned int count;
+   unsigned int recorded;
+   unsigned int aborts;
+   bool banned;
+   dword codeLow;        //code run by its summaries
+   dword codeHigh;
+} MemoFunc;
+
+//the call being recorded
+typedef struct _Recording {
+   MemoFunc *func;
+   MemoEntry *check;     //summary being confirmed
+   dword retAddr;
+   dword entrySp;        //esp at the call
+   dword entryEsp;       //and as a linear address
+   dword regs[8];
+   dword flags;
+   dword steps;
+   dword codeLow;
+   dword codeHigh;
+   bool dirty;           //its code was written
+   unsigned int used;
+   unsigned int slots[MEMO_MAX_BYTES];
+   MemoByte table[SLOTS];
+} Recording;
+
+bool memoOn = false;
+bool memoRecording = false;
+
+static dword regMask = 0xFF & ~(1 << ESP);
+static MemoFunc *funcs[MEMO_BUCKETS];
+static Recording rec;
+static MemoStats stats;
+
+//every function's code range, for a quick look at writes
+static dword allLow = 0xFFFFFFFF;
+static dword allHigh = 0;
+
+static unsigned int hashAddr(dword addr, int bits) {
+   return (addr * 2654435761U) >> (32 - bits);
+}
+
+static MemoFunc *findFunc(dword addr) {
+   unsigned int h = hashAddr(addr, 10);
+   MemoFunc *f;
+   for (f = funcs[h]; f; f = f->next) {
+      if (f->addr == addr) return f;
+   }
+   f = (MemoFunc*)calloc(1, sizeof(MemoFunc));
+   f->addr = addr;
+   f->codeLow = 0xFFFFFFFF;
+   f->next = funcs[h];
+   funcs[h] = f;
+   return f;
+}
+
+static void dropEntries(MemoFunc *f) {
+   while (f->entries) {
+      MemoEntry *e = f->entries;
+      f->entries = e->next;
+      free(e);
+   }
+   f->count = 0;
+}
+
+static void ban(MemoFunc *f) {
+   dropEntries(f);
+   f->banned = true;
+   stats.functions++;
+}
+
+static void stopRecording() {
+   for (unsigned int i = 0; i < rec.used; i++) {
+      rec.table[rec.slots[i]].flags = 0;
+   }
+   rec.used = 0;
+   memoRecording = false;
+}
+
+static void startRecording(MemoFunc *f, MemoEntry *check, dword retAddr) {
+   rec.func = f;
+   rec.check = check;
+   rec.retAddr = retAddr;
+   rec.entrySp = esp;
+   rec.entryEsp = ssBase + esp;
+   memcpy(rec.regs, general, sizeof(rec.regs));
+   rec.flags = eflags & MEMO_FLAGS;
+   rec.steps = 0;
+   rec.codeLow = 0xFFFFFFFF;
+   rec.codeHigh = 0;
+   rec.dirty = false;
+   memoRecording = true;
+}
+
+//the slot for addr, NULL once the footprint is full
+static MemoByte *slot(dword addr) {
+   unsigned int h = hashAddr(addr, SLOT_BITS);
+   while (rec.table[h].flags) {
+      if (rec.table[h].addr == addr) return rec.table + h;
+      h = (h + 1) & (SLOTS - 1);
+   }
+   if (rec.used == MEMO_MAX_BYTES) return NULL;
+   rec.slots[rec.used++] = h;
+   rec.table[h].addr = addr;
+   return rec.table + h;
+}
+
+void memoRead(dword addr, const void *data, dword len) {
+   const byte *p = (const byte*)data;
+   for (dword i = 0; i < len; i++) {
+      //the return address is checked when the call returns
+      if (addr + i - rec.entryEsp < 4) continue;
+      MemoByte *b = slot(addr + i);
+      if (b == NULL) {
+         memoAbort();
+         return;
+      }
+      if (b->flags == 0) {
+         b->flags = BYTE_IN;
+         b->in = p[i];
+      }
+   }
+}
+
+void memoWrite(dword addr, const void *data, dword len) {
+   const byte *p = (const byte*)data;
+   for (dword i = 0; i < len; i++) {
+      if (addr + i - rec.entryEsp < 4) continue;
+      MemoByte *b = slot(addr + i);
+      if (b == NULL) {
+         memoAbort();
+         return;
+      }
+      b->flags |= BYTE_OUT;
+      b->out = p[i];
+   }
+}
+
+//footprint bytes in run order, stack bytes after the rest
+typedef struct _SortByte {
+   dword key;
+   word stack;
+   byte value;
+} SortByte;
+
+static int compareBytes(const void *a, const void *b) {
+   const SortByte *x = (const SortByte*)a;
+   const SortByte *y = (const SortByte*)b;
+   if (x->stack != y->stack) return x->stack - y->stack;
+   return x->key < y->key ? -1 : x->key > y->key;
+}
+
+//sorts and packs n bytes into runs and data, returns the run count
+static unsigned int makeRuns(SortByte *bytes, unsigned int n, MemoRun *runs, byte *data) {
+   unsigned int count = 0;
+   qsort(bytes, n, sizeof(SortByte), compareBytes);
+   for (unsigned int i = 0; i < n; i++) {
+      MemoRun *last = runs + count - 1;
+      if (count == 0 || bytes[i].stack != last->stack || last->len == 0xFFFF ||
+          bytes[i].key != last->addr + last->len) {
+         last = runs + count++;
+         last->addr = bytes[i].key;
+         last->len = 0;
+         last->stack = bytes[i].stack;
+      }
+      last->len++;
+      data[i] = bytes[i].value;
+   }
+   return count;
+}
+
+//the recorded call as a summary
+static MemoEntry *summarise() {
+   SortByte *in = (SortByte*)malloc(rec.used * sizeof(SortByte) + 1);
+   SortByte *out = (SortByte*)malloc(rec.used * sizeof(SortByte) + 1);
+   MemoRun *runs = (MemoRun*)malloc(2 * rec.used * sizeof(MemoRun) + 1);
+   byte *data = (byte*)malloc(2 * rec.used + 1);
+   unsigned int nIn = 0, nOut = 0;
+   bool onStack = false;
+   dword espDelta = esp - rec.entrySp;
+   for (unsigned int i = 0; i < rec.used; i++) {
+      MemoByte *b = rec.table + rec.slots[i];
+      //stack bytes stay absolute, a pointer into a caller's frame looks the
+      //same from any depth, so the summary is tied to esp instead
+      word stack = mm->stack->contains(b->addr) ? 1 : 0;
+      if (b->flags & BYTE_IN) {
+         in[nIn].key = b->addr;
+         in[nIn].stack = stack;
+         in[nIn++].value = b->in;
+         if (stack) onStack = true;
+      }
+      //stack below the final esp is free once the call returns
+      if ((b->flags & BYTE_OUT) && !(stack && (int)(b->addr - rec.entryEsp) < (int)espDelta)) {
+         out[nOut].key = b->addr;
+         out[nOut].stack = stack;
+         out[nOut++].value = b->out;
+         if (stack) onStack = true;
+      }
+   }
+   unsigned int inRuns = makeRuns(in, nIn, runs, data);
+   unsigned int outRuns = makeRuns(out, nOut, runs + inRuns, data + nIn);
+   unsigned int runBytes = (inRuns + outRuns) * sizeof(MemoRun);
+
+   MemoEntry *e = (MemoEntry*)malloc(sizeof(MemoEntry) + runBytes + nIn + nOut);
+   memcpy(e->regs, rec.regs, sizeof(e->regs));
+   e->flags = rec.flags;
+   memset(e->out, 0, sizeof(e->out));
+   e->changed = 0;
+   for (int r = 0; r < 8; r++) {
+      if (r != ESP && general[r] != rec.regs[r]) {
+         e->out[r] = general[r];
+         e->changed |= 1 << r;
+      }
+   }
+   e->eflags = eflags;
+   e->espDelta = espDelta;
+   e->entrySp = rec.entrySp;
+   e->stack = onStack;
+   e->steps = rec.steps;
+   e->inRuns = inRuns;
+   e->outRuns = outRuns;
+   e->size = runBytes + nIn + nOut;
+   e->confirmed = false;
+   e->next = NULL;
+   e->runs = (MemoRun*)(e + 1);
+   e->data = (byte*)e->runs + runBytes;
+   memcpy(e->runs, runs, runBytes);
+   memcpy(e->data, data, nIn + nOut);
+   free(in);
+   free(out);
+   free(runs);
+   free(data);
+   return e;
+}
+
+static bool sameSummary(MemoEntry *a, MemoEntry *b) {
+   return a->changed == b->changed && a->eflags == b->eflags &&
+          a->espDelta == b->espDelta && a->stack == b->stack && a->steps == b->steps &&
+          a->inRuns == b->inRuns && a->outRuns == b->outRuns &&
+          a->size == b->size &&
+          memcmp(a->out, b->out, sizeof(a->out)) == 0 &&
+          memcmp(a->runs, b->runs, a->size) == 0;
+}
+
+static void finishRecording() {
+   //writes to the code may still be queued
+   flushEvents();
+   MemoFunc *f = rec.func;
+   if (rec.dirty) {
+      stopRecording();
+      return;
+   }
+   MemoEntry *e = summarise();
+   if (rec.check) {
+      if (sameSummary(e, rec.check)) {
+         rec.check->confirmed = true;
+         stats.verified++;
+      }
+      else {
+         //same inputs, different results, something isn't in the footprint
+         ban(f);
+      }
+      free(e);
+   }
+   else {
+      e->next = f->entries;
+      f->entries = e;
+      f->recorded++;
+      stats.recorded++;
+      if (++f->count > MEMO_ENTRIES) {
+         MemoEntry *p = f->entries;
+         while (p->next->next) p = p->next;
+         free(p->next);
+         p->next = NULL;
+         f->count--;
+      }
+      if (rec.codeLow < f->codeLow) f->codeLow = rec.codeLow;
+      if (rec.codeHigh > f->codeHigh) f->codeHigh = rec.codeHigh;
+      if (f->codeLow < allLow) allLow = f->codeLow;
+      if (f->codeHigh > allHigh) allHigh = f->codeHigh;
+   }
+   stopRecording();
+}
+
+static bool matches(MemoEntry *e) {
+   for (int r = 0; r < 8; r++) {
+      if ((regMask & (1 << r)) && general[r] != e->regs[r]) return false;
+   }
+   if ((eflags & MEMO_FLAGS) != e->flags) return false;
+   if (e->stack && esp != e->entrySp) return false;
+   const byte *d = e->data;
+   for (unsigned int i = 0; i < e->inRuns; i++) {
+      const MemoRun *run = e->runs + i;
+      for (dword j = 0; j < run->len; j++) {
+         if (mm->readByte(run->addr + j) != *d++) return false;
+      }
+   }
+   return true;
+}
+
+static void replay(MemoEntry *e, dword retAddr) {
+   const byte *d = e->data;
+   for (unsigned int i = 0; i < e->inRuns + e->outRuns; i++) {
+      const MemoRun *run = e->runs + i;
+      dword addr = run->addr;
+      if (i >= e->inRuns) {
+         mm->writeBlock(addr, d, run->len);
+         if (memoRecording) memoWrite(addr, d, run->len);
+      }
+      else if (memoRecording) {
+         //the call being recorded depends on these as well
+         memoRead(addr, d, run->len);
+      }
+      d += run->len;
+   }
+   for (int r = 0; r < 8; r++) {
+      if (e->changed & (1 << r)) general[r] = e->out[r];
+   }
+   esp += e->espDelta;
+   eflags = e->eflags;
+   eip = retAddr;
+   if (memoRecording) rec.steps += e->steps;
+   stats.replayed++;
+   stats.saved += e->steps;
+   if (eventMask & EVENT_BIT(EV_RETURN)) raiseEvent(EV_RETURN, eip);
+}
+
+dword memoCall(dword retAddr) {
+   //heap checking has to see every access
+   if (mm->shadow) return 0;
+   MemoFunc *f = findFunc(eip);
+   if (f->banned) return 0;
+   stats.calls++;
+   flushEvents();
+   MemoEntry *prev = NULL;
+   for (MemoEntry *e = f->entries; e; prev = e, e = e->next) {
+      if (!matches(e)) continue;
+      if (e->confirmed) {
+         if (prev) {
+            prev->next = e->next;
+            e->next = f->entries;
+            f->entries = e;
+         }
+         replay(e, retAddr);
+         return e->steps;
+      }
+      if (!memoRecording) startRecording(f, e, retAddr);
+      return 0;
+   }
+   //calls made while recording are part of the recording
+   if (!memoRecording) startRecording(f, NULL, retAddr);
+   return 0;
+}
+
+void memoStep() {
+   if (++rec.steps > MEMO_MAX_STEPS || esp > rec.entrySp) {
+      //too long, or the frame went away without a return
+      memoAbort();
+      return;
+   }
+   dword addr = csBase + initial_eip;
+   if (addr < rec.codeLow) rec.codeLow = addr;
+   if (addr + MAX_INSN > rec.codeHigh) rec.codeHigh = addr + MAX_INSN;
+}
+
+void memoReturn() {
+   if (esp <= rec.entrySp) return;  //a call inside the recorded one
+   if (eip == rec.retAddr) {
+      finishRecording();
+   }
+   else {
+      memoAbort();
+   }
+}
+
+void memoAbort() {
+   if (!memoRecording) return;
+   MemoFunc *f = rec.func;
+   stats.aborted++;
+   if (++f->aborts >= MEMO_MAX_ABORTS && f->aborts > f->recorded && !f->banned) {
+      ban(f);
+   }
+   stopRecording();
+}
+
+void abortCallMemo() {
+   if (memoRecording) stopRecording();
+}
+
+//drop the summaries of any function whose code was written
+static void codeWrites(const EmuEvent *events, unsigned int count, void *user) {
+   for (unsigned int i = 0; i < count; i++) {
+      const EmuEvent *ev = events + i;
+      dword end = ev->addr + ev->size;
+      if (memoRecording && ev->addr < rec.codeHigh && end > rec.codeLow) {
+         rec.dirty = true;
+      }
+      if (ev->addr >= allHigh || end <= allLow) continue;
+      for (int h = 0; h < MEMO_BUCKETS; h++) {
+         for (MemoFunc *f = funcs[h]; f; f = f->next) {
+            if (f->entries && ev->addr < f->codeHigh && end > f->codeLow) {
+               stats.invalidated += f->count;
+               dropEntries(f);
+            }
+         }
+      }
+   }
+}
+
+void enableCallMemo(bool enable) {
+   if (enable == memoOn) return;
+   if (enable) {
+      subscribe(EV_MEM_WRITE, codeWrites);
+   }
+   else {
+      unsubscribe(EV_MEM_WRITE, codeWrites);
+      clearCallMemo();
+   }
+   memoOn = enable;
+}
+
+void setMemoRegisters(dword mask) {
+   regMask = mask & 0xFF & ~(1 << ESP);
+   clearCallMemo();
+}
+
+void clearCallMemo() {
+   abortCallMemo();
+   for (int h = 0; h < MEMO_BUCKETS; h++) {
+      while (funcs[h]) {
+         MemoFunc *f = funcs[h];
+         funcs[h] = f->next;
+         dropEntries(f);
+         free(f);
+      }
+   }
+   allLow = 0xFFFFFFFF;
+   allHigh = 0;
+   memset(&stats, 0, sizeof(stats));
+}
+
+void getMemoStats(MemoStats *s) {
+   *s = stats;
+}
@@ -0,0 +1,91 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: memo.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __MEMO_H
+#define __MEMO_H
+
+#include "x86defs.h"
+
+//limits on a single recorded call
+#define MEMO_MAX_BYTES  4096     //distinct bytes read or written
+#define MEMO_MAX_STEPS  1000000  //instructions
+#define MEMO_ENTRIES    16       //summaries kept per function
+#define MEMO_MAX_ABORTS 4        //failed recordings before a function is left alone
+
+typedef struct _MemoStats {
+   unsigned int calls;        //calls looked up
+   unsigned int replayed;     //calls answered from a summary
+   unsigned int recorded;     //summaries stored
+   unsigned int verified;     //summaries confirmed by running the call again
+   unsigned int aborted;      //recordings given up
+   unsigned int invalidated;  //summaries dropped because their code was written
+   unsigned int functions;    //functions no longer memoised
+   uquad saved;               //instructions not executed thanks to replays
+} MemoStats;
+
+/*
+ * Call memoisation.  With it enabled, a call to ordinary guest code is
+ * recorded: the registers and flags at the call, every memory byte it reads
+ * before writing it (its input footprint) and everything it leaves
+ * behind, registers and memory bytes written (its effects).  A summary
+ * with bytes on the stack only matches a call made with the same esp,
+ * and stack writes below the final esp are dropped.
+ *
+ * A later call to the same function whose registers and input bytes all
+ * match a summary is first run again and compared; once a summary has
+ * been confirmed that way, matching calls are replayed: the effects are
+ * written, the registers set and eip moved to the return address without
+ * executing the call.  Replayed calls raise no instruction events and no
+ * events for the memory they read.
+ *
+ * A recording is given up on calls to hooks or loaded modules,
+ * interrupts and exceptions, RDTSC, leaving the frame without a return
+ * and calls that get too big.  A function whose recordings keep failing,
+ * or that gives different results for the same inputs, is left alone
+ * from then on.  Writes to the code a summary covers drop the summaries.
+ * Nothing is memoised while heap checking is on.
+ */
+
+extern bool memoOn;         //enabled
+extern bool memoRecording;  //a call is being recorded
+
+//clears summaries when turned off
+void enableCallMemo(bool enable);
+//registers (1 << EAX etc.) that must match, default all but esp
+void setMemoRegisters(dword mask);
+//drop every summary and recording and reset the statistics
+void clearCallMemo();
+//the state changed under the recording, forget it without holding
+//it against the function
+void abortCallMemo();
+void getMemoStats(MemoStats *stats);
+
+//cpu hooks
+//just pushed retAddr and jumped to eip, returns the instructions a
+//replay stood in for
+dword memoCall(dword retAddr);
+void memoStep();
+void memoReturn();
+//the recorded call did something that can't be summarised
+void memoAbort();
+void memoRead(dword addr, const void *data, dword len);
+void memoWrite(dword addr, const void *data, dword len);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: pack.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <string.h>
+
+#include "pack.h"
+
+#define TAG_LITERAL 0x00
+#define TAG_ZERO    0x40
+#define TAG_MATCH   0x80
+#define TAG_MASK    0xC0
+#define COUNT_MASK  0x3F
+
+#define LITERAL_MAX 63    //longest literal run with a one byte tag
+#define HASH_BITS   14
+#define WINDOW      0x10000
+
+//each tag, its count and distance add at most this much
+#define TAG_OVERHEAD 11
+
+unsigned int packBound(unsigned int len) {
+   //an incompressible stream is one literal tag per LITERAL_MAX bytes,
+   //runs and matches are only taken when they pay for themselves
+   return len + len / 32 + 2 * TAG_OVERHEAD;
+}
+
+static unsigned int varintSize(unsigned int n) {
+   unsigned int size = 1;
+   while (n >= 0x80) {
+      n >>= 7;
+      size++;
+   }
+   return size;
+}
+
+static unsigned char *putCount(unsigned char *p, unsigned int tag, unsigned int n) {
+   if (n < COUNT_MASK) {
+      *p++ = (unsigned char)(tag | n);
+      return p;
+   }
+   *p++ = (unsigned char)(tag | COUNT_MASK);
+   n -= COUNT_MASK;
+   while (n >= 0x80) {
+      *p++ = (unsigned char)(n | 0x80);
+      n >>= 7;
+   }
+   *p++ = (unsigned char)n;
+   return p;
+}
+
+static unsigned char *putLiterals(unsigned char *p, const unsigned char *src, unsigned int n) {
+   if (n) {
+      p = putCount(p, TAG_LITERAL, n - 1);
+      memcpy(p, src, n);
+      p += n;
+   }
+   return p;
+}
+
+static unsigned int hash4(const unsigned char *p, unsigned int bits) {
+   unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+   return (v * 2654435761U) >> (32 - bits);
+}
+
+unsigned int pack(const unsigned char *src, unsigned int len, unsigned char *dest) {
+   unsigned int table[1 << HASH_BITS];   //last position + 1 of each hash
+   unsigned char *p = dest;
+   unsigned int lit = 0;    //start of pending literals
+   unsigned int i = 0;
+   //small sections don't need (or want to clear) the whole table
+   unsigned int bits = 8;
+   while (bits < HASH_BITS && (1U << bits) < len) bits++;
+   memset(table, 0, sizeof(unsigned int) << bits);
+   while (i + PACK_MIN_RUN <= len) {
+      //zero runs first, they are the bulk of most heaps
+      if (src[i] == 0 && src[i + 1] == 0 && src[i + 2] == 0 && src[i + 3] == 0) {
+         unsigned int j = i + PACK_MIN_RUN;
+         while (j < len && src[j] == 0) j++;
+         p = putLiterals(p, src + lit, i - lit);
+         p = putCount(p, TAG_ZERO, j - i - PACK_MIN_RUN);
+         i = lit = j;
+         continue;
+      }
+      unsigned int h = hash4(src + i, bits);
+      unsigned int cand = table[h];
+      table[h] = i + 1;
+      if (cand && i - (cand - 1) < WINDOW &&
+          memcmp(src + cand - 1, src + i, PACK_MIN_RUN) == 0) {
+         unsigned int from = cand - 1;
+         unsigned int j = i + PACK_MIN_RUN;
+         while (j < len && src[j] == src[from + j - i]) j++;
+         unsigned int n = j - i - PACK_MIN_RUN;
+         unsigned int cost = (n < COUNT_MASK ? 1 : 1 + varintSize(n - COUNT_MASK)) +
+                             varintSize(i - from) + (i > lit ? 1 : 0);
+         if (cost > j - i) {
+            //cheaper left as literals
+            i++;
+            if (i - lit == LITERAL_MAX) {
+               p = putLiterals(p, src + lit, i - lit);
+               lit = i;
+            }
+            continue;
+         }
+         p = putLiterals(p, src + lit, i - lit);
+         p = putCount(p, TAG_MATCH, n);
+         unsigned int dist = i - from;
+         while (dist >= 0x80) {
+            *p++ = (unsigned char)(dist | 0x80);
+            dist >>= 7;
+         }
+         *p++ = (unsigned char)dist;
+         i = lit = j;
+         continue;
+      }
+      i++;
+      //keep literal runs short enough that packBound holds
+      if (i - lit == LITERAL_MAX) {
+         p = putLiterals(p, src + lit, i - lit);
+         lit = i;
+      }
+   }
+   p = putLiterals(p, src + lit, len - lit);
+   return (unsigned int)(p - dest);
+}
+
+//a 7 bit varint, false if it runs off the end or overflows
+static bool getVarint(const unsigned char **pp, const unsigned char *end, unsigned int *val) {
+   const unsigned char *p = *pp;
+   unsigned int v = 0;
+   for (int shift = 0; shift < 32; shift += 7) {
+      if (p == end) return false;
+      unsigned char c = *p++;
+      v |= (unsigned int)(c & 0x7F) << shift;
+      if ((c & 0x80) == 0) {
+         *pp = p;
+         *val = v;
+         return true;
+      }
+   }
+   return false;
+}
+
+bool unpack(const unsigned char *src, unsigned int srcLen, unsigned char *dest, unsigned int len) {
+   const unsigned char *p = src;
+   const unsigned char *end = src + srcLen;
+   unsigned int out = 0;
+   while (p < end) {
+      unsigned int tag = *p & TAG_MASK;
+      unsigned int n = *p++ & COUNT_MASK;
+      if (n == COUNT_MASK) {
+         unsigned int more;
+         if (!getVarint(&p, end, &more) || more > len) return false;
+         n += more;
+      }
+      if (tag == TAG_LITERAL) {
+         n += 1;
+         if (n > len - out || n > (unsigned int)(end - p)) return false;
+         memcpy(dest + out, p, n);
+         p += n;
+      }
+      else if (tag == TAG_ZERO) {
+         n += PACK_MIN_RUN;
+         if (n > len - out) return false;
+         memset(dest + out, 0, n);
+      }
+      else if (tag == TAG_MATCH) {
+         unsigned int dist;
+         n += PACK_MIN_RUN;
+         if (!getVarint(&p, end, &dist) || dist == 0 || dist > out || n > len - out) {
+            return false;
+         }
+         //may overlap itself, copy forward a byte at a time
+         unsigned char *d = dest + out;
+         const unsigned char *s = d - dist;
+         for (unsigned int k = 0; k < n; k++) {
+            d[k] = s[k];
+         }
+      }
+      else {
+         return false;
+      }
+      out += n;
+   }
+   return out == len;
+}
@@ -0,0 +1,50 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: pack.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __PACK_H
+#define __PACK_H
+
+/*
+ * Byte codec for saved state sections.  Heaps and stacks are mostly
+ * zeros and repeated structures, so the stream is a run of literals,
+ * zero runs and LZ matches (within a 64K window), each introduced by a
+ * tag byte:
+ *
+ *    00nnnnnn  n + 1 literal bytes follow
+ *    01nnnnnn  n + PACK_MIN_RUN zero bytes
+ *    10nnnnnn  n + PACK_MIN_RUN bytes copied from a distance that follows
+ *
+ * A 6 bit count of 63 is followed by the rest of the count, and the
+ * match distance is always written, 7 bits at a time low bits first.
+ */
+
+#define PACK_MIN_RUN 4
+
+//largest packed size for len input bytes
+unsigned int packBound(unsigned int len);
+
+//pack len bytes from src into dest, which must hold packBound(len)
+//bytes, returns the packed length
+unsigned int pack(const unsigned char *src, unsigned int len, unsigned char *dest);
+
+//false unless src unpacks to exactly len bytes
+bool unpack(const unsigned char *src, unsigned int srcLen, unsigned char *dest, unsigned int len);
+
+#endif
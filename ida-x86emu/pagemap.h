@@ -0,0 +1,78 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: pagemap.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __PAGEMAP_H
+#define __PAGEMAP_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEAF_SHIFT 10
+#define PAGEMAP_LEAF_SIZE (1 << PAGEMAP_LEAF_SHIFT)
+#define PAGEMAP_DIR_SIZE (1 << (32 - PAGEMAP_PAGE_SHIFT - PAGEMAP_LEAF_SHIFT))
+
+/*
+ * Sparse table holding one T for every 4K page of the 32 bit guest
+ * address space.  Two levels, a 1024 entry directory of 1024 entry
+ * leaves, so any lookup is two loads.  Leaves are allocated on first
+ * use and zero filled, T must be something for which all zero bits
+ * is a sensible empty value (pointers, small structs of integers).
+ */
+template <class T>
+class PageMap {
+public:
+   PageMap() {memset(dir, 0, sizeof(dir));};
+   ~PageMap() {clear();};
+
+   //entry for the page containing addr, NULL if it was never set
+   T *find(unsigned int addr) {
+      T *leaf = dir[addr >> (PAGEMAP_PAGE_SHIFT + PAGEMAP_LEAF_SHIFT)];
+      return leaf ? leaf + ((addr >> PAGEMAP_PAGE_SHIFT) & (PAGEMAP_LEAF_SIZE - 1)) : NULL;
+   };
+
+   //entry for the page containing addr, created if necessary
+   //returns NULL only if we are out of memory
+   T *get(unsigned int addr) {
+      T **leaf = dir + (addr >> (PAGEMAP_PAGE_SHIFT + PAGEMAP_LEAF_SHIFT));
+      if (*leaf == NULL) {
+         *leaf = (T*)calloc(PAGEMAP_LEAF_SIZE, sizeof(T));
+         if (*leaf == NULL) return NULL;
+      }
+      return *leaf + ((addr >> PAGEMAP_PAGE_SHIFT) & (PAGEMAP_LEAF_SIZE - 1));
+   };
+
+   //visit every page in the directory slot i, used to release leaves
+   T *leaf(unsigned int i) {return dir[i];};
+
+   void clear() {
+      for (unsigned int i = 0; i < PAGEMAP_DIR_SIZE; i++) {
+         free(dir[i]);
+         dir[i] = NULL;
+      }
+   };
+
+private:
+   PageMap(const PageMap &m) {};
+
+   T *dir[PAGEMAP_DIR_SIZE];
+};
+
+#endif
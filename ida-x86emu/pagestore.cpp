@@ -0,0 +1,311 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: pagestore.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "hooklist.h"
+#include "seh.h"
+#include "pagestore.h"
+
+#define MIN_BUCKETS 1024
+//pages read or written at a time, walking a heap's block list once a
+//run rather than once a page
+#define RUN_PAGES 256
+
+static unsigned int hashPage(const unsigned char *data) {
+   const unsigned int *w = (const unsigned int*)data;
+   unsigned int h = 0x811C9DC5;
+   for (unsigned int i = 0; i < STORE_PAGE_SIZE / sizeof(unsigned int); i++) {
+      h = (h ^ w[i]) * 0x01000193;
+      h ^= h >> 15;
+   }
+   return h;
+}
+
+PageStore::PageStore() {
+   buckets = (StoredPage**)calloc(MIN_BUCKETS, sizeof(StoredPage*));
+   mask = MIN_BUCKETS - 1;
+   count = 0;
+}
+
+PageStore::~PageStore() {
+   for (unsigned int i = 0; i <= mask; i++) {
+      while (buckets[i]) {
+         StoredPage *p = buckets[i];
+         buckets[i] = p->next;
+         free(p);
+      }
+   }
+   free(buckets);
+}
+
+StoredPage *PageStore::intern(const unsigned char *data) {
+   unsigned int h = hashPage(data);
+   StoredPage *p;
+   for (p = buckets[h & mask]; p; p = p->next) {
+      if (p->hash == h && memcmp(p->data, data, STORE_PAGE_SIZE) == 0) {
+         p->refs++;
+         return p;
+      }
+   }
+   p = (StoredPage*)malloc(sizeof(StoredPage));
+   if (p == NULL) return NULL;
+   memcpy(p->data, data, STORE_PAGE_SIZE);
+   p->hash = h;
+   p->refs = 1;
+   p->next = buckets[h & mask];
+   buckets[h & mask] = p;
+   if (++count > mask) grow();
+   return p;
+}
+
+void PageStore::release(StoredPage *p) {
+   if (p == NULL || --p->refs) return;
+   StoredPage **q = &buckets[p->hash & mask];
+   while (*q != p) q = &(*q)->next;
+   *q = p->next;
+   free(p);
+   count--;
+}
+
+//double the buckets to keep the chains short
+void PageStore::grow() {
+   unsigned int size = (mask + 1) * 2;
+   StoredPage **table = (StoredPage**)calloc(size, sizeof(StoredPage*));
+   if (table == NULL) return;   //longer chains, still correct
+   for (unsigned int i = 0; i <= mask; i++) {
+      while (buckets[i]) {
+         StoredPage *p = buckets[i];
+         buckets[i] = p->next;
+         p->next = table[p->hash & (size - 1)];
+         table[p->hash & (size - 1)] = p;
+      }
+   }
+   free(buckets);
+   buckets = table;
+   mask = size - 1;
+}
+
+static const char *regNames[STATE_REGS] = {
+   "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "eip", "eflags",
+   "cs", "ss", "ds", "es", "fs", "gs",
+   "cs base", "ss base", "ds base", "es base", "fs base", "gs base",
+   "cr0", "cr1", "cr2", "cr3", "cr4",
+   "dr0", "dr1", "dr2", "dr3", "dr4", "dr5", "dr6", "dr7",
+   "gdtr", "idtr"
+};
+
+//in the order of regNames
+static void captureRegisters(dword *regs) {
+   int i, n = 0;
+   for (i = 0; i < 8; i++) regs[n++] = general[i];
+   regs[n++] = eip;
+   regs[n++] = eflags;
+   for (i = 0; i < 6; i++) regs[n++] = segReg[i];
+   for (i = 0; i < 6; i++) regs[n++] = segBase[i];
+   for (i = 0; i < 5; i++) regs[n++] = control[i];
+   for (i = 0; i < 8; i++) regs[n++] = debug_regs[i];
+   regs[n++] = gdtr.base;
+   regs[n++] = idtr.base;
+}
+
+//consecutive pages from i on, at most RUN_PAGES of them
+static unsigned int runLength(const unsigned int *addrs, unsigned int i, unsigned int n) {
+   unsigned int len = 1;
+   while (len < RUN_PAGES && i + len < n &&
+          addrs[i + len] == addrs[i] + (len << STORE_PAGE_SHIFT)) {
+      len++;
+   }
+   return len;
+}
+
+PagedState::PagedState(PageStore *store) {
+   unsigned char *buf = (unsigned char*)malloc(RUN_PAGES * STORE_PAGE_SIZE);
+   unsigned int *addrs = NULL;
+   this->store = store;
+   cpu = new Buffer(CPU_VERSION);
+   saveRegisters(*cpu);
+   layout = new Buffer(CPU_VERSION);
+   mm->saveLayout(*layout);
+   rest = new Buffer(CPU_VERSION);
+   saveHookList(*rest);
+   saveModuleList(*rest);
+   saveSEHState(*rest);
+   captureRegisters(regs);
+
+   numPages = mm->statePages(esp, STORE_PAGE_SHIFT, &addrs);
+   pages = (StatePage*)malloc((numPages ? numPages : 1) * sizeof(StatePage));
+   if (pages == NULL || buf == NULL) numPages = 0;
+   //reading the pages is not the program's doing, keep heap checking out of it
+   ShadowMemory *shadow = mm->shadow;
+   mm->shadow = NULL;
+   for (unsigned int i = 0; i < numPages; ) {
+      unsigned int len = runLength(addrs, i, numPages);
+      mm->readBlock(addrs[i], buf, len << STORE_PAGE_SHIFT);
+      for (unsigned int j = 0; j < len; j++, i++) {
+         pages[i].addr = addrs[i];
+         pages[i].page = store->intern(buf + (j << STORE_PAGE_SHIFT));
+      }
+   }
+   mm->shadow = shadow;
+   free(addrs);
+   free(buf);
+}
+
+PagedState::~PagedState() {
+   for (unsigned int i = 0; i < numPages; i++) {
+      store->release(pages[i].page);
+   }
+   free(pages);
+   delete cpu;
+   delete layout;
+   delete rest;
+}
+
+bool PagedState::restore() {
+   unsigned char *buf = (unsigned char*)malloc(RUN_PAGES * STORE_PAGE_SIZE);
+   unsigned int *addrs = (unsigned int*)malloc((numPages ? numPages : 1) * sizeof(unsigned int));
+   unsigned int i;
+   if (buf == NULL || addrs == NULL) {
+      free(buf);
+      free(addrs);
+      return false;
+   }
+   for (i = 0; i < numPages; i++) {
+      addrs[i] = pages[i].addr;
+   }
+   Buffer l(layout->get_buf(), layout->get_wlen(), false);
+   if (!mm->loadLayout(l)) {
+      free(buf);
+      free(addrs);
+      return false;
+   }
+   ShadowMemory *shadow = mm->shadow;
+   mm->shadow = NULL;
+   //only runs of pages that differ are written, so untouched mappings stay
+   //clean and program space in the database is only patched where it changed
+   for (i = 0; i < numPages; ) {
+      unsigned int len = runLength(addrs, i, numPages);
+      unsigned int first = 0, count = 0;
+      mm->readBlock(addrs[i], buf, len << STORE_PAGE_SHIFT);
+      for (unsigned int j = 0; j <= len; j++) {
+         unsigned char *p = buf + (j << STORE_PAGE_SHIFT);
+         StoredPage *sp = j < len ? pages[i + j].page : NULL;
+         if (sp && memcmp(p, sp->data, STORE_PAGE_SIZE)) {
+            memcpy(p, sp->data, STORE_PAGE_SIZE);
+            if (count++ == 0) first = j;
+         }
+         else if (count) {
+            mm->writeBlock(addrs[i + first], buf + (first << STORE_PAGE_SHIFT), count << STORE_PAGE_SHIFT);
+            count = 0;
+         }
+      }
+      i += len;
+   }
+   mm->shadow = shadow;
+   free(buf);
+   free(addrs);
+   Buffer c(cpu->get_buf(), cpu->get_wlen(), false);
+   loadRegisters(c);
+   Buffer r(rest->get_buf(), rest->get_wlen(), false);
+   loadHookList(r);
+   loadModuleList(r);
+   loadSEHState(r);
+   stateLoaded();
+   return true;
+}
+
+//add [addr, addr + len) to the list, merging it with the last range
+static void addRange(StateRange **ranges, unsigned int *n, unsigned int *size,
+                     dword addr, dword len) {
+   StateRange *last = *n ? *ranges + *n - 1 : NULL;
+   if (last && last->addr + last->len == addr) {
+      last->len += len;
+      return;
+   }
+   if (*n == *size) {
+      unsigned int grown = *size ? *size * 2 : 64;
+      StateRange *r = (StateRange*)realloc(*ranges, grown * sizeof(StateRange));
+      if (r == NULL) return;
+      *ranges = r;
+      *size = grown;
+   }
+   (*ranges)[*n].addr = addr;
+   (*ranges)[*n].len = len;
+   (*n)++;
+}
+
+//the runs of differing bytes between two pages at addr
+static void diffPage(dword addr, const unsigned char *a, const unsigned char *b,
+                     StateRange **ranges, unsigned int *n, unsigned int *size) {
+   unsigned int i = 0;
+   while (i < STORE_PAGE_SIZE) {
+      if (a[i] == b[i]) {
+         i++;
+         continue;
+      }
+      unsigned int start = i;
+      while (i < STORE_PAGE_SIZE && a[i] != b[i]) i++;
+      addRange(ranges, n, size, addr + start, i - start);
+   }
+}
+
+unsigned int PagedState::diffMemory(PagedState *other, StateRange **ranges) {
+   static const unsigned char zero[STORE_PAGE_SIZE] = {0};
+   unsigned int n = 0, size = 0, i = 0, j = 0;
+   *ranges = NULL;
+   while (i < numPages || j < other->numPages) {
+      StatePage *a = i < numPages ? pages + i : NULL;
+      StatePage *b = j < other->numPages ? other->pages + j : NULL;
+      const unsigned char *x = zero, *y = zero;
+      dword addr;
+      if (a && (b == NULL || a->addr <= b->addr)) {
+         addr = a->addr;
+         if (a->page) x = a->page->data;
+         i++;
+      }
+      else {
+         addr = b->addr;
+      }
+      if (b && b->addr == addr) {
+         if (b->page) y = b->page->data;
+         j++;
+      }
+      if (x != y) {
+         diffPage(addr, x, y, ranges, &n, &size);
+      }
+   }
+   return n;
+}
+
+unsigned int PagedState::diffRegisters(PagedState *other, int *which) {
+   unsigned int n = 0;
+   for (int r = 0; r < STATE_REGS; r++) {
+      if (regs[r] != other->regs[r]) which[n++] = r;
+   }
+   return n;
+}
+
+const char *PagedState::registerName(int r) {
+   return r >= 0 && r < STATE_REGS ? regNames[r] : NULL;
+}
@@ -0,0 +1,114 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: pagestore.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __PAGESTORE_H
+#define __PAGESTORE_H
+
+#include "x86defs.h"
+#include "buffer.h"
+
+#define STORE_PAGE_SHIFT 12
+#define STORE_PAGE_SIZE (1 << STORE_PAGE_SHIFT)
+
+//registers a PagedState compares, see PagedState::registerName
+#define STATE_REGS 37
+
+typedef struct _StoredPage {
+   unsigned int hash;
+   unsigned int refs;
+   struct _StoredPage *next;   //hash chain
+   unsigned char data[STORE_PAGE_SIZE];
+} StoredPage;
+
+/*
+ * Guest pages kept once per distinct content.  States taken a little
+ * apart share nearly all of their pages, so a store holding many of
+ * them costs about one state plus what changed between them, and two
+ * states compare equal on a page exactly when they hold the same
+ * StoredPage.
+ */
+class PageStore {
+public:
+   PageStore();
+   ~PageStore();
+
+   //the page holding these contents, added if there isn't one yet,
+   //with a reference for the caller
+   StoredPage *intern(const unsigned char *data);
+   void release(StoredPage *p);
+
+   unsigned int getPageCount() {return count;};
+
+private:
+   void grow();
+
+   StoredPage **buckets;
+   unsigned int mask;
+   unsigned int count;
+};
+
+typedef struct _StatePage {
+   dword addr;
+   StoredPage *page;
+} StatePage;
+
+//guest bytes [addr, addr + len)
+typedef struct _StateRange {
+   dword addr;
+   dword len;
+} StateRange;
+
+/*
+ * An emulator state held in a PageStore: the registers, the hook,
+ * module and SEH state as saved, the layout of the stack, heaps and
+ * mappings, and every guest page of program space, the live stack,
+ * allocated heap blocks and mappings.  Taking one needs mm in place.
+ */
+class PagedState {
+public:
+   PagedState(PageStore *store);
+   ~PagedState();
+
+   //make this the current emulator state, false if it was taken with
+   //some other program space
+   bool restore();
+
+   //guest ranges whose bytes differ between the two states, sorted and
+   //merged.  A page one of them lacks reads as zero.  Only pages held
+   //as different StoredPages are compared byte by byte.  *ranges is
+   //malloc'ed, returns the count.
+   unsigned int diffMemory(PagedState *other, StateRange **ranges);
+   //indices of the registers that differ, which needs STATE_REGS slots
+   unsigned int diffRegisters(PagedState *other, int *which);
+   static const char *registerName(int r);
+
+   unsigned int getPageCount() {return numPages;};
+
+private:
+   PageStore *store;
+   Buffer *cpu;         //saveRegisters
+   Buffer *layout;      //MemoryManager::saveLayout
+   Buffer *rest;        //hooks, modules and SEH
+   dword regs[STATE_REGS];
+   StatePage *pages;    //sorted by address
+   unsigned int numPages;
+};
+
+#endif
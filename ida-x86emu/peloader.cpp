@@ -0,0 +1,516 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: peloader.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "memmgr.h"
+#include "peloader.h"
+#include "host.h"
+
+//PE header fields, as offsets from the PE signature
+#define PE_MACHINE           4
+#define PE_NUM_SECTIONS      6
+#define PE_OPT_SIZE         20
+#define PE_CHARACTERISTICS  22
+#define PE_OPT_HEADER       24
+#define PE_MAGIC            24
+#define PE_ENTRY            40
+#define PE_IMAGE_BASE       52
+#define PE_SECTION_ALIGN    56
+#define PE_IMAGE_SIZE       80
+#define PE_HEADERS_SIZE     84
+#define PE_NUM_DIRS        116
+#define PE_DIRS            120
+#define PE_HEADER_SIZE     248   //through the last data directory
+
+#define DIR_EXPORT 0
+#define DIR_IMPORT 1
+#define DIR_RELOC  5
+
+//section header fields
+#define SEC_SIZE    40
+#define SEC_VSIZE    8
+#define SEC_VADDR   12
+#define SEC_RAWSIZE 16
+#define SEC_RAWPTR  20
+
+#define DOS_SIGNATURE      0x5A4D
+#define PE_SIGNATURE       0x4550
+#define PE_I386            0x14C
+#define PE_MAGIC32         0x10B
+#define PE_RELOCS_STRIPPED 0x0001
+#define REL_ABSOLUTE       0
+#define REL_HIGHLOW        3
+
+#define PE_PAGE_SIZE 0x1000
+//where to look for room when the preferred base is taken
+#define PE_REBASE_MIN  0x10000000
+#define PE_REBASE_MAX  0x80000000
+#define PE_REBASE_STEP 0x10000
+
+#define PE_MAX_EXPORTS 0x10000
+#define PE_MAX_NAME    0x1000
+#define PE_ORDINAL_FLAG 0x80000000
+//forwarder chains longer than this are assumed to be loops
+#define PE_MAX_FORWARDS 8
+
+//addresses handed out for functions we could not resolve
+static unsigned int nextUnresolved = 0xFFFFFFFF;
+
+static unsigned int get16(const unsigned char *p) {
+   return p[0] | (p[1] << 8);
+}
+
+static unsigned int get32(const unsigned char *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+//true if no region uses any page of [base, base + size), which must
+//be in user space
+static bool isFree(unsigned int base, unsigned int size) {
+   if (size == 0 || base >= PE_REBASE_MAX || size > PE_REBASE_MAX - base) return false;
+   for (unsigned int offset = 0; offset < size; offset += PE_PAGE_SIZE) {
+      if (addressSpace.kind(base + offset) != AS_UNMAPPED) return false;
+   }
+   return true;
+}
+
+static int compareNames(const void *a, const void *b) {
+   return strcmp((*(PEExport**)a)->name, (*(PEExport**)b)->name);
+}
+
+static int compareAddrs(const void *a, const void *b) {
+   PEExport *ea = *(PEExport**)a;
+   PEExport *eb = *(PEExport**)b;
+   if (ea->addr != eb->addr) return ea->addr < eb->addr ? -1 : 1;
+   return ea->ordinal < eb->ordinal ? -1 : (ea->ordinal > eb->ordinal ? 1 : 0);
+}
+
+PEImage::PEImage(MemoryManager *mgr, unsigned int base) {
+   this->mgr = mgr;
+   this->base = base;
+   size = entry = importDir = 0;
+   ordinalBase = numExports = numNames = 0;
+   exports = NULL;
+   byName = byAddr = NULL;
+}
+
+PEImage::~PEImage() {
+   for (unsigned int i = 0; i < numExports; i++) {
+      free(exports[i].name);
+      free(exports[i].forward);
+   }
+   free(exports);
+   free(byName);
+   free(byAddr);
+}
+
+PEImage *PEImage::load(MemoryManager *mgr, const char *path) {
+   unsigned char dos[64], hdr[PE_HEADER_SIZE];
+   unsigned char *sections = NULL;
+   unsigned int pe = 0, nsec = 0, fileSize = 0;
+   FILE *f = fopen(path, "rb");
+   if (f == NULL) return NULL;
+   bool ok = fread(dos, sizeof(dos), 1, f) == 1 && get16(dos) == DOS_SIGNATURE;
+   if (ok) {
+      pe = get32(dos + 60);
+      ok = fseek(f, pe, SEEK_SET) == 0 && fread(hdr, sizeof(hdr), 1, f) == 1 &&
+           get32(hdr) == PE_SIGNATURE && get16(hdr + PE_MACHINE) == PE_I386 &&
+           get16(hdr + PE_MAGIC) == PE_MAGIC32;
+   }
+   if (ok) {
+      nsec = get16(hdr + PE_NUM_SECTIONS);
+      sections = (unsigned char*)malloc(nsec * SEC_SIZE + 1);
+      ok = sections != NULL &&
+           fseek(f, pe + PE_OPT_HEADER + get16(hdr + PE_OPT_SIZE), SEEK_SET) == 0 &&
+           fread(sections, SEC_SIZE, nsec, f) == nsec;
+   }
+   if (ok && fseek(f, 0, SEEK_END) == 0) {
+      fileSize = (unsigned int)ftell(f);
+   }
+   fclose(f);
+   if (!ok) {
+      free(sections);
+      return NULL;
+   }
+
+   unsigned int preferred = get32(hdr + PE_IMAGE_BASE);
+   unsigned int size = (get32(hdr + PE_IMAGE_SIZE) + PE_PAGE_SIZE - 1) & ~(PE_PAGE_SIZE - 1);
+   unsigned int align = get32(hdr + PE_SECTION_ALIGN);
+   if (align == 0) align = 1;
+   unsigned int base = preferred;
+   if (!isFree(base, size)) {
+      base = 0;
+      if ((get16(hdr + PE_CHARACTERISTICS) & PE_RELOCS_STRIPPED) == 0) {
+         unsigned int b;
+         for (b = PE_REBASE_MIN; b < PE_REBASE_MAX; b += PE_REBASE_STEP) {
+            if (isFree(b, size)) {
+               base = b;
+               break;
+            }
+         }
+      }
+      if (base == 0) {
+         free(sections);
+         return NULL;
+      }
+   }
+
+   //map the headers then each section, remembering what we mapped in
+   //case we have to back out
+   unsigned int *mapped = (unsigned int*)malloc((2 * nsec + 1) * sizeof(unsigned int));
+   unsigned int nmapped = 0;
+   unsigned int hsize = get32(hdr + PE_HEADERS_SIZE);
+   unsigned int i;
+   for (i = 0; i < nsec; i++) {
+      //headers may not run into the first section
+      unsigned int va = get32(sections + i * SEC_SIZE + SEC_VADDR);
+      if (va < hsize) hsize = va;
+   }
+   if (hsize > fileSize) hsize = fileSize;
+   ok = mapped != NULL && hsize && mgr->mapFile(path, base, true, 0, hsize);
+   if (ok) mapped[nmapped++] = base;
+   for (i = 0; ok && i < nsec; i++) {
+      unsigned char *s = sections + i * SEC_SIZE;
+      unsigned int va = get32(s + SEC_VADDR);
+      unsigned int vsize = get32(s + SEC_VSIZE);
+      unsigned int raw = get32(s + SEC_RAWSIZE);
+      unsigned int ptr = get32(s + SEC_RAWPTR);
+      if (vsize == 0) vsize = raw;
+      unsigned int end = ((vsize + align - 1) / align) * align;
+      if (va >= size) continue;
+      if (end > size - va) end = size - va;
+      unsigned int len = raw < end ? raw : end;
+      if (ptr >= fileSize) len = 0;
+      else if (len > fileSize - ptr) len = fileSize - ptr;
+      if (len) {
+         ok = mgr->mapFile(path, base + va, true, ptr, len);
+         if (ok) mapped[nmapped++] = base + va;
+      }
+      if (ok && end > len) {
+         //uninitialized data and padding up to the section alignment
+         ok = mgr->mapZero(base + va + len, end - len);
+         if (ok) mapped[nmapped++] = base + va + len;
+      }
+   }
+   free(sections);
+
+   PEImage *img = NULL;
+   if (ok) {
+      img = new PEImage(mgr, base);
+      if (base != preferred) {
+         unsigned int rva = get32(hdr + PE_NUM_DIRS) > DIR_RELOC ? get32(hdr + PE_DIRS + DIR_RELOC * 8) : 0;
+         ok = rva && img->relocate(base + rva, get32(hdr + PE_DIRS + DIR_RELOC * 8 + 4), base - preferred);
+         //the loader records where the image actually went
+         mgr->writeBlock(base + pe + PE_IMAGE_BASE, &base, sizeof(base));
+      }
+      ok = ok && img->parse();
+   }
+   if (!ok) {
+      delete img;
+      img = NULL;
+      for (i = 0; i < nmapped; i++) {
+         mgr->unmapFile(mapped[i]);
+      }
+   }
+   free(mapped);
+   return img;
+}
+
+PEImage *PEImage::attach(MemoryManager *mgr, unsigned int base) {
+   PEImage *img = new PEImage(mgr, base);
+   if (!img->parse()) {
+      delete img;
+      img = NULL;
+   }
+   return img;
+}
+
+char *PEImage::find(const char *searchPath, const char *name) {
+   //only the file part of name is used
+   const char *file = name;
+   for (const char *p = name; *p; p++) {
+      if (*p == '/' || *p == '\\' || *p == ':') file = p + 1;
+   }
+   const char *ext = strchr(file, '.') ? "" : ".dll";
+   const char *dir = searchPath;
+   while (dir && *dir) {
+      const char *end = strchr(dir, ';');
+      unsigned int len = end ? (unsigned int)(end - dir) : (unsigned int)strlen(dir);
+      if (len) {
+         char *path = (char*)malloc(len + strlen(file) + strlen(ext) + 2);
+         //try the name as given, then in lower case for case sensitive hosts
+         for (int lower = 0; path && lower < 2; lower++) {
+            sprintf(path, "%.*s/%s%s", len, dir, file, ext);
+            if (lower) {
+               for (char *p = path + len + 1; *p; p++) *p = tolower(*p);
+            }
+            FILE *f = fopen(path, "rb");
+            if (f) {
+               fclose(f);
+               return path;
+            }
+         }
+         free(path);
+      }
+      dir = end ? end + 1 : NULL;
+   }
+   return NULL;
+}
+
+char *PEImage::readString(unsigned int addr) {
+   unsigned int len = mgr->findByte(addr, 0, PE_MAX_NAME);
+   char *s = (char*)malloc(len + 1);
+   if (s) {
+      mgr->readBlock(addr, s, len);
+      s[len] = 0;
+   }
+   return s;
+}
+
+bool PEImage::parse() {
+   unsigned char dos[64], hdr[PE_HEADER_SIZE];
+   mgr->readBlock(base, dos, sizeof(dos));
+   if (get16(dos) != DOS_SIGNATURE) return false;
+   mgr->readBlock(base + get32(dos + 60), hdr, sizeof(hdr));
+   if (get32(hdr) != PE_SIGNATURE) return false;
+   size = get32(hdr + PE_IMAGE_SIZE);
+   entry = get32(hdr + PE_ENTRY);
+   if (entry) entry += base;
+   unsigned int ndirs = get32(hdr + PE_NUM_DIRS);
+   unsigned int rva = ndirs > DIR_IMPORT ? get32(hdr + PE_DIRS + DIR_IMPORT * 8) : 0;
+   importDir = rva ? base + rva : 0;
+   rva = ndirs > DIR_EXPORT ? get32(hdr + PE_DIRS + DIR_EXPORT * 8) : 0;
+   return rva == 0 || parseExports(base + rva, get32(hdr + PE_DIRS + DIR_EXPORT * 8 + 4));
+}
+
+bool PEImage::parseExports(unsigned int dir, unsigned int dirSize) {
+   unsigned char ed[40];
+   unsigned int i;
+   mgr->readBlock(dir, ed, sizeof(ed));
+   ordinalBase = get32(ed + 16);
+   unsigned int nfuncs = get32(ed + 20);
+   unsigned int nnames = get32(ed + 24);
+   if (nfuncs > PE_MAX_EXPORTS || nnames > PE_MAX_EXPORTS) return false;
+   if (nfuncs == 0) return true;
+   exports = (PEExport*)calloc(nfuncs, sizeof(PEExport));
+   unsigned int *rvas = (unsigned int*)malloc(nfuncs * sizeof(unsigned int));
+   unsigned int *names = (unsigned int*)malloc(nnames * sizeof(unsigned int) + 1);
+   unsigned short *ords = (unsigned short*)malloc(nnames * sizeof(unsigned short) + 1);
+   byName = (PEExport**)malloc(nnames * sizeof(PEExport*) + 1);
+   byAddr = (PEExport**)malloc(nnames * sizeof(PEExport*) + 1);
+   bool ok = exports && rvas && names && ords && byName && byAddr;
+   if (ok) {
+      numExports = nfuncs;
+      mgr->readBlock(base + get32(ed + 28), rvas, nfuncs * sizeof(unsigned int));
+      mgr->readBlock(base + get32(ed + 32), names, nnames * sizeof(unsigned int));
+      mgr->readBlock(base + get32(ed + 36), ords, nnames * sizeof(unsigned short));
+      for (i = 0; i < nfuncs; i++) {
+         PEExport *e = exports + i;
+         e->ordinal = ordinalBase + i;
+         if (rvas[i] == 0) continue;   //unused slot
+         if (rvas[i] - (dir - base) < dirSize) {
+            //points back into the export directory, a forwarder string
+            e->forward = readString(base + rvas[i]);
+         }
+         else {
+            e->addr = base + rvas[i];
+         }
+      }
+      for (i = 0; i < nnames; i++) {
+         if (ords[i] >= nfuncs) continue;
+         PEExport *e = exports + ords[i];
+         if (e->name) continue;   //only the first name for a slot is kept
+         e->name = readString(base + names[i]);
+         if (e->name) {
+            byName[numNames] = byAddr[numNames] = e;
+            numNames++;
+         }
+      }
+      qsort(byName, numNames, sizeof(PEExport*), compareNames);
+      qsort(byAddr, numNames, sizeof(PEExport*), compareAddrs);
+   }
+   free(rvas);
+   free(names);
+   free(ords);
+   return ok;
+}
+
+bool PEImage::relocate(unsigned int dir, unsigned int dirSize, unsigned int delta) {
+   unsigned int offset = 0;
+   while (offset + 8 <= dirSize) {
+      unsigned char block[8];
+      mgr->readBlock(dir + offset, block, sizeof(block));
+      unsigned int page = base + get32(block);
+      unsigned int blockSize = get32(block + 4);
+      if (blockSize < 8 || blockSize > dirSize - offset) return false;
+      unsigned int count = (blockSize - 8) / 2;
+      unsigned char *entries = (unsigned char*)malloc(count * 2 + 1);
+      if (entries == NULL) return false;
+      mgr->readBlock(dir + offset + 8, entries, count * 2);
+      for (unsigned int i = 0; i < count; i++) {
+         unsigned int e = get16(entries + i * 2);
+         switch (e >> 12) {
+            case REL_ABSOLUTE:   //padding
+               break;
+            case REL_HIGHLOW: {
+               unsigned char v[4];
+               unsigned int addr = page + (e & 0xFFF);
+               mgr->readBlock(addr, v, sizeof(v));
+               unsigned int val = get32(v) + delta;
+               v[0] = (unsigned char)val;
+               v[1] = (unsigned char)(val >> 8);
+               v[2] = (unsigned char)(val >> 16);
+               v[3] = (unsigned char)(val >> 24);
+               mgr->writeBlock(addr, v, sizeof(v));
+               break;
+            }
+            default:   //nothing else is used by 32 bit images
+               break;
+         }
+      }
+      free(entries);
+      offset += blockSize;
+   }
+   return true;
+}
+
+PEExport *PEImage::findExport(const char *name) {
+   int lo = 0, hi = (int)numNames - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int c = strcmp(name, byName[mid]->name);
+      if (c == 0) return byName[mid];
+      if (c < 0) hi = mid - 1;
+      else lo = mid + 1;
+   }
+   return NULL;
+}
+
+PEExport *PEImage::findExport(unsigned int ordinal) {
+   unsigned int i = ordinal - ordinalBase;
+   if (i < numExports && (exports[i].addr || exports[i].forward)) return exports + i;
+   return NULL;
+}
+
+const char *PEImage::exportName(unsigned int addr) {
+   //first entry for addr, the sort puts the lowest ordinal there
+   unsigned int lo = 0, hi = numNames;
+   while (lo < hi) {
+      unsigned int mid = (lo + hi) / 2;
+      if (byAddr[mid]->addr < addr) lo = mid + 1;
+      else hi = mid;
+   }
+   if (lo < numNames && byAddr[lo]->addr == addr) return byAddr[lo]->name;
+   return NULL;
+}
+
+unsigned int PEImage::unresolved() {
+   return nextUnresolved--;
+}
+
+void PEImage::bindImports(PELookup lookup, void *user) {
+   unsigned int desc = importDir;
+   if (desc == 0) return;
+   while (1) {
+      unsigned int d[5];  //OriginalFirstThunk, TimeDateStamp, ForwarderChain, Name, FirstThunk
+      mgr->readBlock(desc, d, sizeof(d));
+      if (d[3] == 0 || d[4] == 0) break;
+      char *dllName = readString(d[3] + base);
+      if (dllName == NULL) break;
+      unsigned int id = 0;
+      PEImage *dll = (*lookup)(dllName, &id, user);
+      //bound images overwrite FirstThunk, the names are in OriginalFirstThunk
+      unsigned int lookupTable = (d[0] ? d[0] : d[4]) + base;
+      unsigned int iat = d[4] + base;
+      while (1) {
+         unsigned int thunk;
+         mgr->readBlock(lookupTable, &thunk, sizeof(thunk));
+         if (thunk == 0) break;
+         char *funcName;
+         unsigned int ord = 0;
+         if (thunk & PE_ORDINAL_FLAG) {
+            ord = thunk & 0xFFFF;
+            funcName = (char*)malloc(strlen(dllName) + 16);
+            sprintf(funcName, "%s_0x%4.4X", dllName, ord);
+         }
+         else {
+            funcName = readString(thunk + base + 2);   //skip the Hint
+         }
+         unsigned int f = resolve(dll, id, funcName, ord, lookup, user, 0);
+         mgr->writeBlock(iat, &f, sizeof(f));
+         free(funcName);
+         lookupTable += 4;
+         iat += 4;
+      }
+      free(dllName);
+      desc += 20;
+   }
+}
+
+unsigned int PEImage::resolveImport(PEImage *img, unsigned int id, char *name,
+                                    unsigned int ord, PELookup lookup, void *user) {
+   return resolve(img, id, name, ord, lookup, user, 0);
+}
+
+unsigned int PEImage::resolve(PEImage *img, unsigned int id, char *name, unsigned int ord,
+                              PELookup lookup, void *user, int depth) {
+   PEExport *e = NULL;
+   if (img) e = ord ? img->findExport(ord) : img->findExport(name);
+   if (e && e->forward && depth < PE_MAX_FORWARDS) {
+      return resolveForward(e->forward, lookup, user, depth + 1);
+   }
+   if (e && e->addr) {
+      hookfunc h = ord ? NULL : findHook(name);
+      if (h) addHook(name, e->addr, h, id);
+      return e->addr;
+   }
+   unsigned int f = unresolved();
+   checkForHook(name, f, id);
+   return f;
+}
+
+//"DLL.Name" or "DLL.#ord"
+unsigned int PEImage::resolveForward(const char *forward, PELookup lookup, void *user, int depth) {
+   const char *dot = strrchr(forward, '.');
+   if (dot == NULL) return 0;
+   char *dllName = (char*)malloc(dot - forward + 5);
+   sprintf(dllName, "%.*s.dll", (int)(dot - forward), forward);
+   unsigned int id = 0;
+   PEImage *img = (*lookup)(dllName, &id, user);
+   free(dllName);
+   unsigned int f;
+   if (dot[1] == '#') {
+      unsigned int ord = strtoul(dot + 2, NULL, 10);
+      char *label = (char*)malloc(strlen(forward) + 16);
+      sprintf(label, "%.*s_0x%4.4X", (int)(dot - forward), forward, ord);
+      f = resolve(img, id, label, ord, lookup, user, depth);
+      free(label);
+   }
+   else {
+      char *name = _strdup(dot + 1);
+      f = resolve(img, id, name, 0, lookup, user, depth);
+      free(name);
+   }
+   return f;
+}
@@ -0,0 +1,113 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: peloader.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __PELOADER_H
+#define __PELOADER_H
+
+class MemoryManager;
+class PEImage;
+
+//one exported function
+typedef struct _PEExport {
+   unsigned int addr;      //absolute address, 0 for a forwarder
+   unsigned int ordinal;   //biased by the export directory Base
+   char *name;             //NULL if only exported by ordinal
+   char *forward;          //"DLL.Name" or "DLL.#ord" for forwarders
+} PEExport;
+
+//finds the image for a DLL named by an import, loading it if need be,
+//NULL if there is none.  *id gets the module id that hooks on the
+//DLL's functions are tagged with.
+typedef PEImage *(*PELookup)(const char *dll, unsigned int *id, void *user);
+
+/*
+ * A 32 bit PE image loaded straight from its file into the emulated
+ * address space, no host loader involved.  Headers and each section's
+ * raw data are copy-on-write file mappings, the rest of each section is
+ * zero filled.  If the preferred base is taken the image is rebased and
+ * its relocations applied.  Exports are parsed out of emulated memory so
+ * an image can be picked up again after a saved state is restored.
+ *
+ * Imports are bound against whatever images the host's PELookup finds.
+ * Exported code is emulated unless the host has an emulation for it
+ * (findHook), anything that does not resolve to code in an image gets an
+ * address of its own from the top of memory and is hooked (checkForHook).
+ *
+ * Nothing in here uses the Windows headers, so it works the same on any
+ * host.
+ */
+class PEImage {
+public:
+   //NULL if path is not a loadable PE image or there was no room for it
+   static PEImage *load(MemoryManager *mgr, const char *path);
+   //an image already in emulated memory at base, as after a restore
+   static PEImage *attach(MemoryManager *mgr, unsigned int base);
+   //search a ';' separated list of directories for a DLL, the result
+   //must be free'd
+   static char *find(const char *searchPath, const char *name);
+   ~PEImage();
+
+   unsigned int getBase() {return base;};
+   unsigned int getSize() {return size;};
+   unsigned int getEntry() {return entry;};
+   //absolute address of the import descriptors, 0 if there are none
+   unsigned int getImportDirectory() {return importDir;};
+
+   //NULL if there is no such export
+   PEExport *findExport(const char *name);
+   PEExport *findExport(unsigned int ordinal);
+   //name of the export at addr, NULL if it has none
+   const char *exportName(unsigned int addr);
+
+   //fill in the IAT, the DLLs come from lookup
+   void bindImports(PELookup lookup, void *user);
+   //address a function exported from img (NULL if its DLL was not found)
+   //resolves to, hooking it as necessary.  ord is 0 for imports by name,
+   //otherwise name is just a label for the hook.
+   static unsigned int resolveImport(PEImage *img, unsigned int id, char *name,
+                                     unsigned int ord, PELookup lookup, void *user);
+   //a new address for a function that did not resolve, counting down
+   //from the top of memory
+   static unsigned int unresolved();
+
+private:
+   PEImage(MemoryManager *mgr, unsigned int base);
+   bool parse();
+   bool parseExports(unsigned int dir, unsigned int dirSize);
+   bool relocate(unsigned int dir, unsigned int dirSize, unsigned int delta);
+   char *readString(unsigned int addr);
+   static unsigned int resolve(PEImage *img, unsigned int id, char *name, unsigned int ord,
+                               PELookup lookup, void *user, int depth);
+   static unsigned int resolveForward(const char *forward, PELookup lookup, void *user, int depth);
+
+   MemoryManager *mgr;
+   unsigned int base;
+   unsigned int size;
+   unsigned int entry;
+   unsigned int importDir;
+   unsigned int ordinalBase;
+   unsigned int numExports;    //one per export address table slot
+   PEExport *exports;
+   unsigned int numNames;
+   PEExport **byName;          //named exports sorted by name
+   PEExport **byAddr;          //named exports sorted by address
+};
+
+#endif
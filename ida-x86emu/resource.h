@@ -62,6 +62,7 @@
 #define IDC_MEM_ASCIIZ                  1043
 #define IDC_SET_MEMORY                  1044
 #define IDC_MEM_LOADFILE                1044
+#define IDC_MEM_MAPFILE                 1045
 #define IDC_RESET                       40002
 #define IDC_EDITSTACK                   40003
 #define IDC_SETTINGS                    40005
@@ -83,14 +84,25 @@
 #define IDC_CLEARBREAK                  40026
 #define IDC_PATCHHOOK                   40027
 #define IDC_EXPORT                      40028
+#define IDC_HEAPCHECK                   40029
+#define IDC_DLLDIR                      40030
+#define IDC_COMPRESS                    40031
+#define IDC_SNAPSHOT_SAVE               40032
+#define IDC_SNAPSHOT_LOAD               40033
+#define IDC_MEMOIZE                     40034
+#define IDC_EXPLORE                     40035
+#define IDC_FUNCTION                    40036
+#define IDC_STUB_RETURN                 40037
+#define IDC_STUB_SIGS                   40038
+#define IDC_STUB_SUMMARY                40039
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        108
-#define _APS_NEXT_COMMAND_VALUE         40029
-#define _APS_NEXT_CONTROL_VALUE         1044
+#define _APS_NEXT_COMMAND_VALUE         40040
+#define _APS_NEXT_CONTROL_VALUE         1046
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
@@ -0,0 +1,397 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: runner.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Command line runner for the headless emulator core.  Loads a raw
+ * image at a given address and runs it from an entry point until it
+ * returns, halts, hits a stop address or uses up its instruction
+ * budget, then dumps the cpu state.  It can instead pick up where a
+ * snapshot file (see snapshot.h) left off, and can write one when it
+ * stops.  A PE program can be loaded as Windows would, with the DLLs it
+ * imports taken from a search path (see peloader.h).
+ *
+ *    x86emu-run [options] image
+ *    x86emu-run [options] -s snapshot
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "seh.h"
+#include "break.h"
+#include "snapshot.h"
+#include "engine.h"
+#include "memo.h"
+#include "explore.h"
+#include "frame.h"
+#include "stubs.h"
+#include "host.h"
+#include "peloader.h"
+
+//return address pushed for the entry point, returning to it ends the run
+#define RUN_EXIT FRAME_RETURN
+
+#define DEFAULT_BASE  0x400000
+//the main thread's stack sits below PE images, as on Windows
+#define PE_STACK_TOP  0x130000
+#define PE_STACK_SIZE 0x100000
+#define DEFAULT_LIMIT 10000000
+#define MAX_DUMPS 16
+#define MAX_ARGS  16
+
+static void usage() {
+   fprintf(stderr,
+      "usage: x86emu-run [options] image\n"
+      "       x86emu-run [options] -s snapshot\n"
+      "   -b addr       load address of the image (default 0x%X)\n"
+      "   -e addr       entry point (default the load address)\n"
+      "   -n count      instruction limit (default %u)\n"
+      "   -x addr       stop when eip reaches addr, may be repeated\n"
+      "   -a value      push a dword argument for the entry point, first\n"
+      "                 argument first, may be repeated\n"
+      "   -m addr:len   dump memory after the run, may be repeated\n"
+      "   -w            Windows layout: stack, segment registers and SEH\n"
+      "                 as the plugin sets them up for PE files\n"
+      "   -P            image is a PE file: map it at its preferred base,\n"
+      "                 load the DLLs it imports from -d and start at its\n"
+      "                 entry point, implies -w and ignores -b\n"
+      "   -d dirs       ';' separated directories to load DLLs from for -P\n"
+      "   -h            check heap accesses\n"
+      "   -s file       resume from a snapshot instead of loading an image,\n"
+      "                 -e moves eip and -a and -w are ignored\n"
+      "   -f count      run the entry point as a function on its own: ecx\n"
+      "                 and count stack arguments (decimal) point to fresh\n"
+      "                 heap objects, -a is ignored\n"
+      "   -z size       bytes in each -f object (default 0x%X)\n"
+      "   -r value      eax for calls to functions without an emulation\n"
+      "                 (default 0)\n"
+      "   -g file       argument counts and conventions for functions without\n"
+      "                 an emulation, lines of: name args convention (cdecl,\n"
+      "                 stdcall, fastcall or thiscall)\n"
+      "   -o file       write a snapshot when the run stops\n"
+      "   -p            report progress on stderr every second\n"
+      "   -c            memoise calls and report how it went\n"
+      "   -k mask       registers a memoised call must match, bit 0 eax to\n"
+      "                 bit 7 edi in x86 order (default FF, all but esp)\n"
+      "   -X count      once the run ends, go back and take the other way at\n"
+      "                 conditional branches for up to count instructions in\n"
+      "                 all (decimal, 0 for no limit), each path limited by -n\n"
+      "   -t secs       stop exploring after secs seconds (decimal)\n"
+      "   -S addr       explore for heap blocks allocated at addr, may be\n"
+      "                 repeated (default all blocks)\n"
+      "numbers are hex\n", DEFAULT_BASE, DEFAULT_LIMIT, FRAME_OBJECT_SIZE);
+   exit(1);
+}
+
+static unsigned int hexArg(const char *s) {
+   char *end;
+   unsigned int v = strtoul(s, &end, 16);
+   if (*s == 0 || *end != 0) usage();
+   return v;
+}
+
+//the whole image, padded with zeros to a page multiple
+static unsigned char *loadImage(const char *name, unsigned int *size) {
+   FILE *f = fopen(name, "rb");
+   if (f == NULL) return NULL;
+   fseek(f, 0, SEEK_END);
+   long len = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   if (len <= 0) {
+      fclose(f);
+      return NULL;
+   }
+   *size = (unsigned int)((len + 0xFFF) & ~0xFFF);
+   unsigned char *image = (unsigned char*)calloc(*size, 1);
+   if (image && fread(image, len, 1, f) != 1) {
+      free(image);
+      image = NULL;
+   }
+   fclose(f);
+   return image;
+}
+
+static unsigned int limit = DEFAULT_LIMIT;
+static unsigned int count = 0;
+static const char *reason = "limit";
+
+//the engine stops at breakpoints and heap errors, the rest is up to us
+static bool runnerCheck(void *user) {
+   if (eip == RUN_EXIT) reason = "exit";
+   else if (mm->readByte(csBase + eip) == 0xF4) reason = "hlt";
+   else if (count == limit) reason = "limit";
+   else {
+      count++;
+      return false;
+   }
+   return true;
+}
+
+//where each explored path ends, the explorer keeps count
+static bool pathEnd(void *user) {
+   return eip == RUN_EXIT || mm->readByte(csBase + eip) == 0xF4;
+}
+
+static void dumpMemory(unsigned int addr, unsigned int len) {
+   for (unsigned int i = 0; i < len; i += 16) {
+      unsigned char line[16];
+      unsigned int n = len - i < 16 ? len - i : 16;
+      mm->readBlock(addr + i, line, n);
+      printf("%08X:", addr + i);
+      for (unsigned int j = 0; j < n; j++) {
+         printf(" %02X", line[j]);
+      }
+      printf("\n");
+   }
+}
+
+int main(int argc, char **argv) {
+   unsigned int base = DEFAULT_BASE;
+   unsigned int entry = 0;
+   bool haveEntry = false;
+   unsigned int dumps[MAX_DUMPS][2];
+   unsigned int numDumps = 0;
+   unsigned int args[MAX_ARGS];
+   unsigned int numArgs = 0;
+   bool function = false;
+   unsigned int funcArgs = 0;
+   unsigned int objectSize = FRAME_OBJECT_SIZE;
+   dword objects[FRAME_ARG(FRAME_MAX_ARGS)];
+   int numObjects = 0;
+   bool windows = false;
+   bool pe = false;
+   bool heapCheck = false;
+   bool progress = false;
+   bool memo = false;
+   bool explore = false;
+   uquad budget = 0;
+   unsigned int seconds = 0;
+   unsigned int sites[EXPLORE_SITES];
+   unsigned int numSites = 0;
+   const char *snapshot = NULL;
+   const char *output = NULL;
+   unsigned char *image = NULL;
+   int i;
+
+   for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+      char opt = argv[i][1];
+      if (opt == 'w') windows = true;
+      else if (opt == 'P') pe = windows = true;
+      else if (opt == 'h') heapCheck = true;
+      else if (opt == 'p') progress = true;
+      else if (opt == 'c') memo = true;
+      else if (i + 1 == argc) usage();
+      else if (opt == 'b') base = hexArg(argv[++i]);
+      else if (opt == 'e') {
+         entry = hexArg(argv[++i]);
+         haveEntry = true;
+      }
+      else if (opt == 'n') limit = strtoul(argv[++i], NULL, 10);
+      else if (opt == 's') snapshot = argv[++i];
+      else if (opt == 'o') output = argv[++i];
+      else if (opt == 'd') setHeadlessDllPath(argv[++i]);
+      else if (opt == 'k') setMemoRegisters(hexArg(argv[++i]));
+      else if (opt == 'X') {
+         explore = true;
+         budget = strtoull(argv[++i], NULL, 10);
+      }
+      else if (opt == 'f') {
+         function = true;
+         funcArgs = strtoul(argv[++i], NULL, 10);
+      }
+      else if (opt == 'z') objectSize = hexArg(argv[++i]);
+      else if (opt == 'r') setStubReturn(hexArg(argv[++i]));
+      else if (opt == 'g') {
+         if (loadStubSignatures(argv[++i]) < 0) {
+            fprintf(stderr, "x86emu-run: unable to read signatures from %s\n", argv[i]);
+            return 1;
+         }
+      }
+      else if (opt == 't') seconds = strtoul(argv[++i], NULL, 10);
+      else if (opt == 'S' && numSites < EXPLORE_SITES) sites[numSites++] = hexArg(argv[++i]);
+      else if (opt == 'x') addBreakpoint(hexArg(argv[++i]));
+      else if (opt == 'a' && numArgs < MAX_ARGS) args[numArgs++] = hexArg(argv[++i]);
+      else if (opt == 'm' && numDumps < MAX_DUMPS) {
+         char *colon = strchr(argv[++i], ':');
+         if (colon == NULL) usage();
+         *colon = 0;
+         dumps[numDumps][0] = hexArg(argv[i]);
+         dumps[numDumps][1] = hexArg(colon + 1);
+         numDumps++;
+      }
+      else usage();
+   }
+   if (i + (snapshot ? 0 : 1) != argc) usage();
+
+   if (snapshot) {
+      resetCpu();
+      int status = loadSnapshot(snapshot);
+      if (status != X86EMULOAD_OK) {
+         fprintf(stderr, "x86emu-run: unable to load snapshot %s (%d)\n", snapshot, status);
+         return 1;
+      }
+      if (haveEntry) eip = entry;
+      if (heapCheck) mm->enableShadow();
+   }
+   else {
+      unsigned int size;
+      if (!pe) {
+         image = loadImage(argv[i], &size);
+         if (image == NULL) {
+            fprintf(stderr, "x86emu-run: unable to load %s\n", argv[i]);
+            return 1;
+         }
+         if (!haveEntry) entry = base;
+      }
+
+      //same layouts the plugin uses
+      resetCpu();
+      MemoryManager *mgr;
+      if (pe) {
+         //no program space, everything comes from the files
+         mgr = new MemoryManager(0, 0);
+         mgr->initStack(PE_STACK_TOP, PE_STACK_SIZE);
+      }
+      else {
+         mgr = new MemoryManager(image, base, base + size);
+         if (windows) {
+            mgr->initStack(0x01300000, 0x01300000);
+         }
+         else {
+            mgr->initStack(0xC0000000, 0x01000000);
+         }
+      }
+      if (windows) {
+         enableSEH();
+         es = ss = ds = 0x23;
+         cs = 0x1b;
+         fs = 0x38;
+      }
+      mgr->initHeap(0xA0000000, 0x01000000);
+      if (pe) {
+         //after the stack and heap, so the images find room around them
+         mm = mgr;
+         PEImage *img = loadHeadlessImage(argv[i]);
+         if (img == NULL) {
+            fprintf(stderr, "x86emu-run: unable to load %s as a PE image\n", argv[i]);
+            return 1;
+         }
+         if (!haveEntry) entry = img->getEntry();
+         delete img;
+      }
+      initProgram(entry, mgr);
+      if (heapCheck) mgr->enableShadow();
+
+      while (numArgs && !function) {
+         push(args[--numArgs], SIZE_DWORD);
+      }
+      push(RUN_EXIT, SIZE_DWORD);
+   }
+
+   enableCallMemo(memo);
+
+   Explorer *explorer = NULL;
+   Engine engine(1000);
+   if (explore) {
+      explorer = new Explorer(budget, seconds, limit);
+      explorer->setPathEnd(pathEnd, NULL);
+      for (unsigned int s = 0; s < numSites; s++) {
+         explorer->trackSite(sites[s]);
+      }
+   }
+   if (function) {
+      //after the explorer, so it sees the objects handed out
+      numObjects = enterFunction(eip, funcArgs, objectSize, objects);
+      if (numObjects < 0) {
+         fprintf(stderr, "x86emu-run: no room in the heap for the function's objects\n");
+         return 1;
+      }
+   }
+   if (explorer) {
+      engine.setStopCheck(Explorer::check, explorer);
+   }
+   else {
+      engine.setStopCheck(runnerCheck, NULL);
+   }
+   if (!engine.start() || !engine.post(ENGINE_RUN)) {
+      fprintf(stderr, "x86emu-run: unable to start the engine\n");
+      return 1;
+   }
+   EngineStatus status;
+   while (!engine.waitIdle(1000)) {
+      if (progress) {
+         engine.getStatus(&status);
+         fprintf(stderr, "%llu instructions, %llu/sec, eip=%08X\n",
+                 (unsigned long long)status.instructions,
+                 (unsigned long long)status.rate, status.eip);
+      }
+   }
+   engine.getStatus(&status);
+   if (explorer) {
+      //back where the first path ended, the count covers every path
+      explorer->finish();
+      if (eip == RUN_EXIT) reason = "exit";
+      else if (mm->readByte(csBase + eip) == 0xF4) reason = "hlt";
+      count = (unsigned int)status.instructions;
+   }
+   if (status.stopReason == STOP_BREAKPOINT) reason = "breakpoint";
+   else if (status.stopReason == STOP_HEAP) reason = "heap";
+
+   printf("stop: %s after %u instructions\n", reason, count);
+   printf("eax=%08X ebx=%08X ecx=%08X edx=%08X\n", eax, ebx, ecx, edx);
+   printf("esi=%08X edi=%08X ebp=%08X esp=%08X\n", esi, edi, ebp, esp);
+   printf("eip=%08X eflags=%08X\n", eip, eflags);
+   if (memo) {
+      MemoStats ms;
+      getMemoStats(&ms);
+      printf("memo: %u calls, %u replayed, %llu instructions saved\n",
+             ms.calls, ms.replayed, (unsigned long long)ms.saved);
+      printf("memo: %u recorded, %u confirmed, %u aborted, %u invalidated, %u functions dropped\n",
+             ms.recorded, ms.verified, ms.aborted, ms.invalidated, ms.functions);
+   }
+   if (explorer) {
+      ExploreStats xs;
+      explorer->getStats(&xs);
+      printf("explore: %u paths, %llu instructions, %u states saved, %u dropped, %u left\n",
+             xs.paths, (unsigned long long)xs.instructions, xs.queued, xs.dropped, xs.pending);
+      printf("explore: %u branches, %u both ways, %u block offsets, %u of them on explored paths\n",
+             xs.branches, xs.bothWays, xs.members, xs.found);
+      delete explorer;
+   }
+   if (getStubSummary()) {
+      printStubSummary();
+   }
+   for (int o = 0; o < numObjects; o++) {
+      if (o == FRAME_THIS) printf("object ecx=%08X\n", objects[o]);
+      else printf("object arg%d=%08X\n", o - FRAME_ARG(0), objects[o]);
+   }
+   for (unsigned int d = 0; d < numDumps; d++) {
+      dumpMemory(dumps[d][0], dumps[d][1]);
+   }
+   if (output && saveSnapshot(output) != X86EMUSAVE_OK) {
+      fprintf(stderr, "x86emu-run: unable to write snapshot %s\n", output);
+   }
+
+   delete mm;
+   free(image);
+   return strcmp(reason, "limit") ? 0 : 2;
+}
@@ -1,4 +1,5 @@
 
+#include "host.h"
 #include "cpu.h"
 #include "seh.h"
 
@@ -89,48 +90,30 @@ void initContext() {
 }
 
 void popContext() {
-   byte *ptr = (byte*) &ctx;
-   dword addr, i;
    dword ctx_size = (sizeof(CONTEXT) + 3) & ~3;  //round up to next dword
-   addr = esp;
-   for (i = 0; i < sizeof(CONTEXT); i++) {
-      *ptr++ = (byte) readMem(addr++, SIZE_BYTE);
-   }
+   readBlock(esp, &ctx, sizeof(CONTEXT));
    esp += ctx_size;
    contextToCpu();
 }
 
 dword pushContext() {
-   byte *ptr = (byte*) &ctx;
-   dword addr, i;
    dword ctx_size = (sizeof(CONTEXT) + 3) & ~3;  //round up to next dword
    cpuToContext();
-   addr = esp -= ctx_size;
-   for (i = 0; i < sizeof(CONTEXT); i++) {
-      writeMem(addr++, *ptr++, SIZE_BYTE);
-   }
+   esp -= ctx_size;
+   writeBlock(esp, &ctx, sizeof(CONTEXT));
    return esp;
 }
 
 void popExceptionRecord(EXCEPTION_RECORD *rec) {
-   byte *ptr = (byte*) &rec;
-   dword addr, i;
    dword rec_size = (sizeof(EXCEPTION_RECORD) + 3) & ~3;  //round up to next dword
-   addr = esp;
-   for (i = 0; i < sizeof(EXCEPTION_RECORD); i++) {
-      *ptr++ = (byte) readMem(addr++, SIZE_BYTE);
-   }
+   readBlock(esp, rec, sizeof(EXCEPTION_RECORD));
    esp += rec_size;
 }
 
 dword pushExceptionRecord(EXCEPTION_RECORD *rec) {
-   byte *ptr = (byte*) rec;
-   dword addr, i;
    dword rec_size = (sizeof(EXCEPTION_RECORD) + 3) & ~3;  //round up to next dword
-   addr = esp -= rec_size;
-   for (i = 0; i < sizeof(EXCEPTION_RECORD); i++) {
-      writeMem(addr++, *ptr++, SIZE_BYTE);
-   }
+   esp -= rec_size;
+   writeBlock(esp, rec, sizeof(EXCEPTION_RECORD));
    return esp;
 }
 
@@ -0,0 +1,191 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: shadow.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "shadow.h"
+#include "emuheap.h"
+
+unsigned char ShadowMemory::unallocated = SHADOW_UNALLOCATED;
+
+ShadowMemory::ShadowMemory(EmuHeap *heaps, unsigned int redzone) {
+   this->heaps = heaps;
+   this->redzone = (redzone + 3) & ~3;   //keep blocks dword aligned
+   if (this->redzone < 4) this->redzone = 4;
+   errors = 0;
+   lastEip = 0xFFFFFFFF;
+   fault = false;
+   next = 0;
+   memset(history, 0, sizeof(history));
+}
+
+ShadowMemory::~ShadowMemory() {
+   for (unsigned int i = 0; i < PAGEMAP_DIR_SIZE; i++) {
+      unsigned char **leaf = pages.leaf(i);
+      if (leaf) {
+         for (unsigned int j = 0; j < PAGEMAP_LEAF_SIZE; j++) {
+            free(leaf[j]);
+         }
+      }
+   }
+}
+
+//shadow bytes for the page containing addr, created on demand
+unsigned char *ShadowMemory::shadowPage(unsigned int addr) {
+   unsigned char **page = pages.get(addr);
+   if (page == NULL) return NULL;
+   if (*page == NULL) {
+      *page = (unsigned char*)calloc(1 << PAGEMAP_PAGE_SHIFT, 1);   //SHADOW_UNALLOCATED
+   }
+   return *page;
+}
+
+void ShadowMemory::mark(unsigned int addr, unsigned int len, unsigned char state) {
+   while (len) {
+      unsigned int n = (1 << PAGEMAP_PAGE_SHIFT) - (addr & 0xFFF);
+      if (n > len) n = len;
+      unsigned char *page = shadowPage(addr);
+      if (page) {
+         memset(page + (addr & 0xFFF), state, n);
+      }
+      addr += n;
+      len -= n;
+   }
+}
+
+//the redzone in front of the block doubles as the one behind the
+//previous block, EmuHeap spaces blocks at least one redzone apart
+void ShadowMemory::allocate(unsigned int base, unsigned int req, unsigned int size, bool zeroed) {
+   mark(base - redzone, redzone, SHADOW_REDZONE);
+   mark(base, req, zeroed ? SHADOW_VALID : SHADOW_UNINIT);
+   //rounding slack counts as redzone, overflows are caught at the exact size
+   mark(base + req, size - req + redzone, SHADOW_REDZONE);
+}
+
+void ShadowMemory::release(unsigned int base, unsigned int size, unsigned int allocSite) {
+   FreedBlock *f = history + next;
+   mark(base, size, SHADOW_FREED);
+   f->base = base;
+   f->size = size;
+   f->allocSite = allocSite;
+   f->freeSite = initial_eip;
+   next = (next + 1) % SHADOW_HISTORY;
+}
+
+void ShadowMemory::badFree(unsigned int addr) {
+   errors++;
+   fault = true;
+   msg("x86emu: %s of 0x%08X by instruction at 0x%08X\n",
+       *lookup(addr) == SHADOW_FREED ? "double free" : "invalid free", addr, initial_eip);
+}
+
+unsigned int ShadowMemory::currentSite() {
+   return initial_eip;
+}
+
+void ShadowMemory::resize(unsigned int base, unsigned int req, unsigned int oldSize) {
+   for (unsigned int i = 0; i < req; i++) {
+      unsigned char *s = lookup(base + i);
+      if (*s == SHADOW_REDZONE) *s = SHADOW_UNINIT;   //old rounding slack
+   }
+   if (req < oldSize) {
+      mark(base + req, oldSize - req, SHADOW_REDZONE);
+   }
+}
+
+void ShadowMemory::copy(unsigned int dest, unsigned int src, unsigned int len) {
+   for (unsigned int i = 0; i < len; i++) {
+      if (*lookup(src + i) == SHADOW_VALID) {
+         unsigned char *d = lookup(dest + i);
+         if (*d == SHADOW_UNINIT) *d = SHADOW_VALID;
+      }
+   }
+}
+
+void ShadowMemory::checkRead(unsigned int addr, unsigned int len) {
+   for (unsigned int i = 0; i < len; i++) {
+      if (*lookup(addr + i) != SHADOW_VALID) {
+         report(addr + i, len - i, false);
+         break;
+      }
+   }
+}
+
+void ShadowMemory::checkWrite(unsigned int addr, unsigned int len) {
+   for (unsigned int i = 0; i < len; i++) {
+      unsigned char *s = lookup(addr + i);
+      if (*s == SHADOW_UNINIT) {
+         *s = SHADOW_VALID;
+      }
+      else if (*s != SHADOW_VALID) {
+         report(addr + i, len - i, true);
+         break;
+      }
+   }
+}
+
+//slow path, describe a bad access and the block it hit
+void ShadowMemory::report(unsigned int addr, unsigned int len, bool write) {
+   unsigned char state = *lookup(addr);
+   unsigned int base, size, site;
+   const char *what;
+   fault = true;
+   if (initial_eip == lastEip) return;
+   lastEip = initial_eip;
+   errors++;
+   switch (state) {
+      case SHADOW_REDZONE: what = "heap overflow"; break;
+      case SHADOW_FREED: what = "use after free"; break;
+      case SHADOW_UNINIT: what = "uninitialized heap read"; break;
+      default: what = "access to unallocated heap memory"; break;
+   }
+   msg("x86emu: %s, %d byte %s at 0x%08X by instruction at 0x%08X\n", what, len,
+       write ? "write" : "read", addr, initial_eip);
+   if (state == SHADOW_FREED) {
+      //most recent free first
+      for (unsigned int i = 1; i <= SHADOW_HISTORY; i++) {
+         FreedBlock *f = history + (next + SHADOW_HISTORY - i) % SHADOW_HISTORY;
+         if (f->size && (addr - f->base) < f->size) {
+            msg("   inside %d byte block at 0x%08X allocated at 0x%08X, freed at 0x%08X\n",
+                f->size, f->base, f->allocSite, f->freeSite);
+            break;
+         }
+      }
+      return;
+   }
+   EmuHeap *h = heaps ? heaps->contains(addr) : NULL;
+   if (h && h->nearestBlock(addr, &base, &size, &site)) {
+      if (addr < base) {
+         msg("   %d bytes before %d byte block at 0x%08X allocated at 0x%08X\n",
+             base - addr, size, base, site);
+      }
+      else if (addr - base >= size) {
+         msg("   %d bytes after %d byte block at 0x%08X allocated at 0x%08X\n",
+             addr - (base + size), size, base, site);
+      }
+      else {
+         msg("   offset %d in %d byte block at 0x%08X allocated at 0x%08X\n",
+             addr - base, size, base, site);
+      }
+   }
+}
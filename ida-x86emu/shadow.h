@@ -0,0 +1,107 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: shadow.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __SHADOW_H
+#define __SHADOW_H
+
+#include "pagemap.h"
+
+//shadow byte values, one per byte of heap memory
+#define SHADOW_UNALLOCATED 0  //heap memory outside of any block
+#define SHADOW_REDZONE     1  //guard bytes around a block
+#define SHADOW_FREED       2  //block has been freed
+#define SHADOW_UNINIT      3  //allocated but never written
+#define SHADOW_VALID       4  //allocated and written
+
+#define SHADOW_DEFAULT_REDZONE 16
+#define SHADOW_HISTORY 256    //freed blocks remembered for reporting
+
+class EmuHeap;
+
+typedef struct _FreedBlock {
+   unsigned int base;
+   unsigned int size;
+   unsigned int allocSite;
+   unsigned int freeSite;
+} FreedBlock;
+
+/*
+ * Opt-in heap checker.  Every heap byte has a shadow byte giving its
+ * state and the MemoryManager heap path checks it on each access.  The
+ * check is a page table lookup and a compare, the list walks only happen
+ * when something is wrong and we need to describe it.
+ */
+class ShadowMemory {
+public:
+   ShadowMemory(EmuHeap *heaps, unsigned int redzone = SHADOW_DEFAULT_REDZONE);
+   ~ShadowMemory();
+
+   unsigned int getRedzone() {return redzone;};
+   unsigned int getErrorCount() {return errors;};
+   //true once after any error has been reported, lets run loops stop
+   bool takeFault() {bool f = fault; fault = false; return f;};
+
+   //new block of req bytes at base, size is the rounded allocation size
+   void allocate(unsigned int base, unsigned int req, unsigned int size, bool zeroed);
+   void release(unsigned int base, unsigned int size, unsigned int allocSite);
+   //in place realloc of a block from oldSize bytes to req bytes
+   void resize(unsigned int base, unsigned int req, unsigned int oldSize);
+   //carry initialized state across a realloc copy
+   void copy(unsigned int dest, unsigned int src, unsigned int len);
+   //mark a range with state, existing blocks are VALID when checking starts
+   void mark(unsigned int addr, unsigned int len, unsigned char state);
+   //free of something that is not a live block
+   void badFree(unsigned int addr);
+   //allocation site recorded for new blocks
+   unsigned int currentSite();
+
+   void checkRead(unsigned int addr) {
+      if (*lookup(addr) != SHADOW_VALID) report(addr, 1, false);
+   };
+   void checkWrite(unsigned int addr) {
+      unsigned char *s = lookup(addr);
+      if (*s != SHADOW_VALID) {
+         if (*s == SHADOW_UNINIT) *s = SHADOW_VALID;
+         else report(addr, 1, true);
+      }
+   };
+   void checkRead(unsigned int addr, unsigned int len);
+   void checkWrite(unsigned int addr, unsigned int len);
+
+private:
+   unsigned char *lookup(unsigned int addr) {
+      unsigned char **page = pages.find(addr);
+      return (page && *page) ? *page + (addr & 0xFFF) : &unallocated;
+   };
+   unsigned char *shadowPage(unsigned int addr);
+   void report(unsigned int addr, unsigned int len, bool write);
+
+   PageMap<unsigned char*> pages;
+   EmuHeap *heaps;
+   unsigned int redzone;
+   unsigned int errors;
+   unsigned int lastEip;   //one report per instruction
+   bool fault;
+   FreedBlock history[SHADOW_HISTORY];
+   unsigned int next;
+   static unsigned char unallocated;
+};
+
+#endif
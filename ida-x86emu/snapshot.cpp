@@ -0,0 +1,351 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: snapshot.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "host.h"
+#include "cpu.h"
+#include "hooklist.h"
+#include "seh.h"
+#include "snapshot.h"
+
+//leave the program image out of snapshots of a larger program space
+#define MAX_PROGRAM_SIZE 0x10000000
+
+/*
+ * The host mapping of a snapshot file.  A headless state keeps running
+ * out of the program image of the last snapshot loaded, so its mapping
+ * stays until the next one replaces it.
+ */
+typedef struct _SnapshotMap {
+   unsigned char *view;
+   unsigned int size;
+   void *handle;     //host file mapping handle (Windows only)
+} SnapshotMap;
+
+static SnapshotMap current;
+
+#ifdef WIN32
+
+static bool mapSnapshot(const char *fileName, SnapshotMap *m) {
+   HANDLE f = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (f == INVALID_HANDLE_VALUE) return false;
+   DWORD fsize = GetFileSize(f, NULL);
+   if (fsize == INVALID_FILE_SIZE || fsize == 0) {
+      CloseHandle(f);
+      return false;
+   }
+   m->handle = CreateFileMapping(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+   CloseHandle(f);
+   if (m->handle == NULL) return false;
+   m->view = (unsigned char*)MapViewOfFile((HANDLE)m->handle, FILE_MAP_COPY, 0, 0, fsize);
+   if (m->view == NULL) {
+      CloseHandle((HANDLE)m->handle);
+      m->handle = NULL;
+      return false;
+   }
+   m->size = fsize;
+   return true;
+}
+
+static void unmapSnapshot(SnapshotMap *m) {
+   if (m->view) {
+      UnmapViewOfFile(m->view);
+      CloseHandle((HANDLE)m->handle);
+   }
+   m->view = NULL;
+   m->handle = NULL;
+   m->size = 0;
+}
+
+#else
+
+static bool mapSnapshot(const char *fileName, SnapshotMap *m) {
+   struct stat st;
+   int fd = open(fileName, O_RDONLY);
+   if (fd == -1) return false;
+   if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > 0xFFFFFFFFll) {
+      close(fd);
+      return false;
+   }
+   //private, writes to the program image stay in this process
+   void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) return false;
+   m->view = (unsigned char*)p;
+   m->size = (unsigned int)st.st_size;
+   m->handle = NULL;
+   return true;
+}
+
+static void unmapSnapshot(SnapshotMap *m) {
+   if (m->view) {
+      munmap(m->view, m->size);
+   }
+   m->view = NULL;
+   m->size = 0;
+}
+
+#endif
+
+static dword roundPage(dword n) {
+   return (n + SNAPSHOT_PAGE - 1) & ~(SNAPSHOT_PAGE - 1);
+}
+
+int saveSnapshot(const char *fileName) {
+   unsigned int numHeaps = 0, count, i;
+   EmuHeap *h;
+   if (mm == NULL) return X86EMUSAVE_FAILED;
+   for (h = mm->heap; h; h = h->getNextHeap()) numHeaps++;
+   count = 7 + numHeaps;
+
+   Buffer **parts = (Buffer**)calloc(count, sizeof(Buffer*));
+   SnapshotSection *table = (SnapshotSection*)calloc(count, sizeof(SnapshotSection));
+   if (parts == NULL || table == NULL) {
+      free(parts);
+      free(table);
+      return X86EMUSAVE_FAILED;
+   }
+   unsigned int n = 0;
+   table[n].type = SNAP_CPU;
+   parts[n] = new Buffer(CPU_VERSION);
+   saveRegisters(*parts[n++]);
+   dword minAddr = mm->getMinAddr(), maxAddr = mm->getMaxAddr();
+   if (maxAddr - minAddr <= MAX_PROGRAM_SIZE) {
+      table[n].type = SNAP_PROGRAM;
+      parts[n] = new Buffer();
+      unsigned char *image = parts[n++]->write_view(maxAddr - minAddr);
+      if (image) {
+         mm->readBlock(minAddr, image, maxAddr - minAddr);
+      }
+   }
+   else {
+      msg("x86emu: program space too large, leaving it out of the snapshot\n");
+   }
+   table[n].type = SNAP_STACK;
+   parts[n] = new Buffer(CPU_VERSION);
+   mm->stack->save(*parts[n++], esp);
+   for (i = 0, h = mm->heap; h; h = h->getNextHeap(), i++) {
+      table[n].type = SNAP_HEAP;
+      table[n].index = i;
+      parts[n] = new Buffer(CPU_VERSION);
+      mm->saveHeap(*parts[n++], h);
+   }
+   table[n].type = SNAP_MAPS;
+   parts[n] = new Buffer(CPU_VERSION);
+   mm->saveMaps(*parts[n++]);
+   table[n].type = SNAP_HOOKS;
+   parts[n] = new Buffer(CPU_VERSION);
+   saveHookList(*parts[n++]);
+   table[n].type = SNAP_MODULES;
+   parts[n] = new Buffer(CPU_VERSION);
+   saveModuleList(*parts[n++]);
+   table[n].type = SNAP_SEH;
+   parts[n] = new Buffer(CPU_VERSION);
+   saveSEHState(*parts[n++]);
+
+   SnapshotHeader header;
+   memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+   header.version = SNAPSHOT_VERSION;
+   header.stateVersion = CPU_VERSION;
+   header.pageSize = SNAPSHOT_PAGE;
+   header.minAddr = minAddr;
+   header.maxAddr = maxAddr;
+   header.count = n;
+
+   bool ok = true;
+   dword offset = roundPage(sizeof(header) + n * sizeof(SnapshotSection));
+   for (i = 0; i < n; i++) {
+      if (parts[i]->has_error()) ok = false;
+      table[i].offset = offset;
+      table[i].length = parts[i]->get_wlen();
+      offset += roundPage(table[i].length);
+   }
+
+   FILE *f = ok ? fopen(fileName, "wb") : NULL;
+   if (f) {
+      static const unsigned char zero[SNAPSHOT_PAGE] = {0};
+      dword pos = sizeof(header) + n * sizeof(SnapshotSection);
+      ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+           fwrite(table, sizeof(SnapshotSection), n, f) == n;
+      for (i = 0; ok && i < n; i++) {
+         //pad out to the start of the section
+         ok = fwrite(zero, 1, table[i].offset - pos, f) == table[i].offset - pos;
+         if (ok && table[i].length) {
+            ok = fwrite(parts[i]->get_buf(), table[i].length, 1, f) == 1;
+         }
+         pos = table[i].offset + table[i].length;
+      }
+      if (fclose(f) != 0) ok = false;
+   }
+   else {
+      ok = false;
+   }
+   for (i = 0; i < n; i++) {
+      delete parts[i];
+   }
+   free(parts);
+   free(table);
+   return ok ? X86EMUSAVE_OK : X86EMUSAVE_FAILED;
+}
+
+//the first section of the given type and index, NULL if there is none
+static SnapshotSection *findSection(SnapshotHeader *header, dword type, dword index) {
+   SnapshotSection *table = (SnapshotSection*)(header + 1);
+   for (dword i = 0; i < header->count; i++) {
+      if (table[i].type == type && table[i].index == index) return table + i;
+   }
+   return NULL;
+}
+
+//check the header and that every section lies within the file
+static int checkSnapshot(SnapshotMap *m) {
+   SnapshotHeader *header = (SnapshotHeader*)m->view;
+   if (m->size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))) {
+      return X86EMULOAD_CORRUPT;
+   }
+   if (header->version != SNAPSHOT_VERSION || header->pageSize != SNAPSHOT_PAGE ||
+       header->stateVersion > CPU_VERSION) {
+      return X86EMULOAD_VERSION_INCOMPATIBLE;
+   }
+   if (header->count > (m->size - sizeof(SnapshotHeader)) / sizeof(SnapshotSection)) {
+      return X86EMULOAD_CORRUPT;
+   }
+   SnapshotSection *table = (SnapshotSection*)(header + 1);
+   for (dword i = 0; i < header->count; i++) {
+      if (table[i].offset > m->size || table[i].length > m->size - table[i].offset ||
+          table[i].offset & (SNAPSHOT_PAGE - 1)) {
+         return X86EMULOAD_CORRUPT;
+      }
+   }
+   if (findSection(header, SNAP_CPU, 0) == NULL || findSection(header, SNAP_STACK, 0) == NULL) {
+      return X86EMULOAD_CORRUPT;
+   }
+#ifndef __IDP__
+   SnapshotSection *program = findSection(header, SNAP_PROGRAM, 0);
+   if (program == NULL || program->length != header->maxAddr - header->minAddr) {
+      //nothing to run without the program
+      return X86EMULOAD_CORRUPT;
+   }
+#endif
+   return X86EMULOAD_OK;
+}
+
+//parse a section in place, false if it was damaged, a missing section
+//counts as empty
+static bool loadSection(SnapshotMap *m, SnapshotSection *s, void (*load)(Buffer &b)) {
+   if (s == NULL) return true;
+   Buffer b(m->view + s->offset, s->length, false);
+   load(b);
+   return !b.has_error();
+}
+
+//everything loadSnapshot replaces other than memory
+static void saveGlobals(Buffer &b) {
+   saveRegisters(b);
+   saveHookList(b);
+   saveModuleList(b);
+   saveSEHState(b);
+}
+
+static void loadGlobals(Buffer &b) {
+   loadRegisters(b);
+   loadHookList(b);
+   loadModuleList(b);
+   loadSEHState(b);
+}
+
+int loadSnapshot(const char *fileName) {
+   SnapshotMap snap;
+   if (!mapSnapshot(fileName, &snap)) return X86EMULOAD_NO_NETNODE;
+   int result = checkSnapshot(&snap);
+   if (result != X86EMULOAD_OK) {
+      unmapSnapshot(&snap);
+      return result;
+   }
+   SnapshotHeader *header = (SnapshotHeader*)snap.view;
+
+   //the file looks sound, but a section may still be damaged.  The old
+   //memory is kept out of the address map and the rest of the state is
+   //saved, so either can be put back if the new one doesn't load.
+   MemoryManager *old = mm;
+   if (old) old->mapRegions(false);
+   Buffer saved(CPU_VERSION);
+   saveGlobals(saved);
+
+   unsigned char *program = NULL;
+#ifndef __IDP__
+   program = snap.view + findSection(header, SNAP_PROGRAM, 0)->offset;
+#endif
+   MemoryManager *mgr = new MemoryManager(program, header->minAddr, header->maxAddr);
+   SnapshotSection *s = findSection(header, SNAP_STACK, 0);
+   Buffer stack(snap.view + s->offset, s->length, false);
+   mgr->loadStack(stack);
+   bool ok = !stack.has_error();
+   for (dword i = 0; ok && (s = findSection(header, SNAP_HEAP, i)) != NULL; i++) {
+      Buffer heap(snap.view + s->offset, s->length, false);
+      mgr->loadHeap(heap);
+      ok = !heap.has_error();
+   }
+   if (ok && (s = findSection(header, SNAP_MAPS, 0)) != NULL) {
+      Buffer maps(snap.view + s->offset, s->length, false);
+      mgr->loadMaps(maps);
+      ok = !maps.has_error();
+   }
+   mm = mgr;
+   ok = ok && loadSection(&snap, findSection(header, SNAP_CPU, 0), loadRegisters);
+   ok = ok && loadSection(&snap, findSection(header, SNAP_HOOKS, 0), loadHookList);
+   ok = ok && loadSection(&snap, findSection(header, SNAP_MODULES, 0), loadModuleList);
+   ok = ok && loadSection(&snap, findSection(header, SNAP_SEH, 0), loadSEHState);
+   if (!ok) {
+      delete mgr;
+      mm = old;
+      if (old) old->mapRegions(true);
+      Buffer b(saved.get_buf(), saved.get_wlen(), false);
+      loadGlobals(b);
+      unmapSnapshot(&snap);
+      return X86EMULOAD_CORRUPT;
+   }
+   delete old;
+   stateLoaded();
+
+#ifdef __IDP__
+   //everything has been copied out
+   unmapSnapshot(&snap);
+#else
+   //the old program space was in the old snapshot
+   unmapSnapshot(&current);
+   current = snap;
+#endif
+   return X86EMULOAD_OK;
+}
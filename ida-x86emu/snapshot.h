@@ -0,0 +1,82 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: snapshot.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "x86defs.h"
+
+/*
+ * Snapshot files hold a complete emulator state outside of the IDA
+ * database so that it can be captured once and then run from by any
+ * number of headless workers.  The file is a header page followed by
+ * page aligned sections:
+ *
+ *    SnapshotHeader, then count SnapshotSection entries
+ *    section data, each starting at a multiple of pageSize
+ *
+ * Every section other than the program image is an unpacked Buffer in
+ * the saved state format (see cpu.h), a loader maps the file and parses
+ * the sections where they lie.  The program image is the raw bytes of
+ * [minAddr, maxAddr), a headless loader uses them in place as program
+ * space through a private (copy on write) mapping.  The plugin takes
+ * program space from the database and ignores it.
+ */
+
+#define SNAPSHOT_MAGIC   "x86emuSS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE    0x1000
+
+//section types
+#define SNAP_CPU      1   //registers
+#define SNAP_PROGRAM  2
+#define SNAP_STACK    3
+#define SNAP_HEAP     4   //one per heap, index is its place in the heap list
+#define SNAP_MAPS     5   //all mapped files
+#define SNAP_HOOKS    6
+#define SNAP_MODULES  7
+#define SNAP_SEH      8
+
+typedef struct _SnapshotHeader {
+   char magic[8];
+   dword version;
+   dword stateVersion;  //CPU_VERSION of the Buffer sections
+   dword pageSize;
+   dword minAddr;       //program space
+   dword maxAddr;
+   dword count;         //sections in the table that follows
+} SnapshotHeader;
+
+typedef struct _SnapshotSection {
+   dword type;
+   dword index;
+   dword offset;        //from the start of the file
+   dword length;
+} SnapshotSection;
+
+//write the state to fileName, returns X86EMUSAVE_OK or X86EMUSAVE_FAILED
+int saveSnapshot(const char *fileName);
+
+//replace the state with the one in fileName, mm is rebuilt and the hook,
+//module and SEH state reloaded.  The current state is untouched if the
+//file can't be used, returns one of the X86EMULOAD_ codes
+int loadSnapshot(const char *fileName);
+
+#endif
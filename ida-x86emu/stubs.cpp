@@ -0,0 +1,239 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: stubs.cpp
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "host.h"
+#include "cpu.h"
+#include "memmgr.h"
+#include "stubs.h"
+
+#define STUB_NAME_LEN 256
+
+//signatures loaded from a file, these win over the host's
+typedef struct _FileSig {
+   struct _FileSig *next;
+   char *name;
+   int args;
+   int conv;
+} FileSig;
+
+static const char *convNames[] = {"cdecl", "stdcall", "fastcall", "thiscall"};
+static const char *sourceNames[] = {"file", "types", "name", "caller", "unknown"};
+
+static dword stubReturn = 0;
+static FileSig *fileSigs = NULL;
+static StubRecord *records = NULL;
+static StubRecord *lastRecord = NULL;
+
+static void resolve(StubRecord *r);
+
+void setStubReturn(dword value) {
+   stubReturn = value;
+}
+
+dword getStubReturn() {
+   return stubReturn;
+}
+
+int loadStubSignatures(const char *file) {
+   FILE *f = fopen(file, "r");
+   if (f == NULL) return -1;
+   char line[STUB_NAME_LEN + 64];
+   char name[STUB_NAME_LEN];
+   char conv[16];
+   int args;
+   int n = 0;
+   while (fgets(line, sizeof(line), f)) {
+      char *hash = strchr(line, '#');
+      if (hash) *hash = 0;
+      if (sscanf(line, "%255s %d %15s", name, &args, conv) != 3) continue;
+      int c;
+      for (c = STUB_THISCALL; c > STUB_CDECL; c--) {
+         if (stricmp(conv, convNames[c]) == 0) break;
+      }
+      if (c == STUB_CDECL && stricmp(conv, convNames[c]) != 0) {
+         msg("x86emu: unknown calling convention %s for %s\n", conv, name);
+         continue;
+      }
+      FileSig *s = (FileSig*)malloc(sizeof(FileSig));
+      s->name = _strdup(name);
+      s->args = args;
+      s->conv = c;
+      s->next = fileSigs;
+      fileSigs = s;
+      n++;
+   }
+   fclose(f);
+   //functions already called go by the new signatures from now on
+   for (StubRecord *r = records; r; r = r->next) {
+      resolve(r);
+   }
+   return n;
+}
+
+static bool findSig(const char *name, int *args, int *conv, int *source) {
+   for (FileSig *s = fileSigs; s; s = s->next) {
+      if (strcmp(s->name, name) == 0) {
+         *args = s->args;
+         *conv = s->conv;
+         *source = STUB_FROM_FILE;
+         return true;
+      }
+   }
+   if (hostSignature(name, args, conv)) {
+      *source = STUB_FROM_TYPES;
+      return true;
+   }
+   return false;
+}
+
+//_name@12 is stdcall and @name@8 fastcall, the number is argument bytes
+static bool decoratedSig(const char *name, int *args, int *conv) {
+   const char *at = strrchr(name, '@');
+   if (at == NULL || at == name || !isdigit((unsigned char)at[1])) return false;
+   for (const char *p = at + 1; *p; p++) {
+      if (!isdigit((unsigned char)*p)) return false;
+   }
+   *args = atoi(at + 1) / 4;
+   *conv = name[0] == '@' ? STUB_FASTCALL : STUB_STDCALL;
+   return true;
+}
+
+static void resolve(StubRecord *r) {
+   r->args = -1;
+   r->conv = STUB_CDECL;
+   r->source = STUB_FROM_NONE;
+   if (findSig(r->name, &r->args, &r->conv, &r->source)) return;
+   //the A and W versions of an API take the same arguments
+   unsigned int len = strlen(r->name);
+   char last = len ? r->name[len - 1] : 0;
+   if (len > 1 && len < STUB_NAME_LEN && (last == 'A' || last == 'W')) {
+      char twin[STUB_NAME_LEN];
+      strcpy(twin, r->name);
+      twin[len - 1] = last == 'A' ? 'W' : 'A';
+      if (findSig(twin, &r->args, &r->conv, &r->source)) return;
+   }
+   if (decoratedSig(r->name, &r->args, &r->conv)) {
+      r->source = STUB_FROM_NAME;
+   }
+}
+
+//add esp, n straight after the call, the caller removes the arguments
+static int callerCleans() {
+   byte op = mm->readByte(csBase + eip);
+   byte modrm = mm->readByte(csBase + eip + 1);
+   if ((op != 0x83 && op != 0x81) || modrm != 0xC4) return -1;
+   dword n = mm->readByte(csBase + eip + 2);
+   if (op == 0x81) {
+      for (int i = 3; i < 6; i++) {
+         n |= mm->readByte(csBase + eip + i) << ((i - 2) * 8);
+      }
+   }
+   return (int)(n / 4);
+}
+
+static StubRecord *findRecord(const char *name) {
+   for (StubRecord *r = records; r; r = r->next) {
+      if (strcmp(r->name, name) == 0) return r;
+   }
+   StubRecord *r = (StubRecord*)calloc(1, sizeof(StubRecord));
+   r->name = _strdup(name);
+   resolve(r);
+   if (lastRecord) lastRecord->next = r;
+   else records = r;
+   lastRecord = r;
+   return r;
+}
+
+//buf needs room for the longest, 64 is plenty
+static const char *describe(StubRecord *r, char *buf) {
+   if (r->source == STUB_FROM_NONE) {
+      return "arguments unknown";
+   }
+   if (r->args < 0) {
+      sprintf(buf, "%s with variable arguments (%s)",
+              convNames[r->conv], sourceNames[r->source]);
+   }
+   else {
+      sprintf(buf, "%s with %d arguments (%s)",
+              convNames[r->conv], r->args, sourceNames[r->source]);
+   }
+   return buf;
+}
+
+void stubCall(const char *name) {
+   StubRecord *r = findRecord(name ? name : "?");
+   bool log = r->calls++ == 0;
+   if (r->source == STUB_FROM_NONE) {
+      int n = callerCleans();
+      if (n >= 0) {
+         r->args = n;
+         r->conv = STUB_CDECL;
+         r->source = STUB_FROM_CALLER;
+         log = true;
+      }
+   }
+   if (log) {
+      char buf[64];
+      msg("x86emu: %s has no emulation, %s, returning 0x%X\n",
+          r->name, describe(r, buf), stubReturn);
+   }
+   eax = stubReturn;
+   if (r->args > 0) {
+      if (r->conv == STUB_STDCALL) esp += r->args * 4;
+      else if (r->conv == STUB_FASTCALL && r->args > 2) esp += (r->args - 2) * 4;
+      else if (r->conv == STUB_THISCALL) esp += (r->args - 1) * 4;
+   }
+}
+
+StubRecord *getStubSummary() {
+   return records;
+}
+
+void printStubSummary() {
+   unsigned int calls = 0, functions = 0, unknown = 0;
+   StubRecord *r;
+   for (r = records; r; r = r->next) {
+      calls += r->calls;
+      functions++;
+      if (r->source == STUB_FROM_NONE) unknown++;
+   }
+   msg("unemulated: %u calls to %u functions, %u with unknown arguments\n",
+       calls, functions, unknown);
+   for (r = records; r; r = r->next) {
+      char buf[64];
+      msg("   %-32s %8u calls  %s\n", r->name, r->calls, describe(r, buf));
+   }
+}
+
+void clearStubSummary() {
+   while (records) {
+      StubRecord *r = records;
+      records = r->next;
+      free(r->name);
+      free(r);
+   }
+   lastRecord = NULL;
+}
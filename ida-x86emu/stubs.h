@@ -0,0 +1,85 @@
+/*
+   Source for x86 emulator IdaPro plugin
+   File: stubs.h
+   Copyright (c) 2004, Chris Eagle
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+
+#ifndef __STUBS_H
+#define __STUBS_H
+
+#include "x86defs.h"
+
+//calling conventions
+#define STUB_CDECL    0   //caller removes the arguments
+#define STUB_STDCALL  1   //callee removes them
+#define STUB_FASTCALL 2   //callee removes all but the two in ecx and edx
+#define STUB_THISCALL 3   //callee removes all but this in ecx
+
+//where a function's convention was found
+#define STUB_FROM_FILE   0   //loadStubSignatures
+#define STUB_FROM_TYPES  1   //the host's type information (hostSignature)
+#define STUB_FROM_NAME   2   //decorated name, _name@12 or @name@8
+#define STUB_FROM_CALLER 3   //a caller removed arguments after the call
+#define STUB_FROM_NONE   4   //nothing known, the stack is left alone
+
+typedef struct _StubRecord {
+   struct _StubRecord *next;
+   char *name;
+   unsigned int calls;
+   int args;      //-1 if not known
+   int conv;
+   int source;
+} StubRecord;
+
+/*
+ * What happens to calls to functions that have no emulation.  Rather
+ * than stopping for the user, each call returns the stub return value
+ * in eax and, for functions that remove their own arguments, pops them
+ * off the stack, so an unattended run carries on with a balanced stack.
+ *
+ * The argument count and convention come from a signature file if one
+ * was loaded, otherwise from the host's type information (the type
+ * libraries loaded in IDA for the plugin, nothing headless), trying the
+ * A/W twin of a name neither knows, otherwise from a decorated name.
+ * Failing all that, a caller that removes the arguments itself (add esp,
+ * n just after the call) shows the function is cdecl; if even that is
+ * missing the stack is left as it is and the function counts as unknown
+ * in the summary.
+ *
+ * Each function is logged once, on its first call, and counted in a
+ * summary after that.
+ */
+
+void setStubReturn(dword value);
+dword getStubReturn();
+//lines of "name args convention" (cdecl, stdcall, fastcall or
+//thiscall), # starts a comment, returns the number of signatures
+//read or -1 if the file can't be opened
+int loadStubSignatures(const char *file);
+
+//stand in for a call to name (NULL if it has none), entered as a hook,
+//without a return address on the stack
+void stubCall(const char *name);
+
+//one record per function called, in order of first call
+StubRecord *getStubSummary();
+//totals and a line per function through msg
+void printStubSummary();
+void clearStubSummary();
+
+#endif
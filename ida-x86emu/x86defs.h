@@ -258,8 +258,6 @@ extern DescriptorTableReg idtr;
 #define SIZE_WORD 2
 #define SIZE_DWORD 4
 
-void updateStack(dword addr);
-
 /*
 //masks to clear out bytes appropriate to the sizes above
 extern dword SIZE_MASKS[5];
@@ -43,6 +43,7 @@
 #include <auto.hpp>
 #include <loader.hpp>
 #include <kernwin.hpp>
+#include <funcs.hpp>
 
 #include "resource.h"
 #include "cpu.h"
@@ -50,6 +51,13 @@
 #include "emufuncs.h"
 #include "hooklist.h"
 #include "break.h"
+#include "snapshot.h"
+#include "events.h"
+#include "engine.h"
+#include "memo.h"
+#include "explore.h"
+#include "frame.h"
+#include "stubs.h"
 
 //#include <allins.hpp>
 #include "../idastruct/idastruct.h"
@@ -63,7 +71,6 @@ void memoryAccessException();
 HWND mainWindow;
 HFONT fixed;
 HWND x86Dlg;
-HCURSOR waitCursor;
 HMODULE hModule;
 
 // The magic number for verifying the database blob
@@ -115,6 +122,26 @@ dword listTop;
 //set to true is saved emulator state is found
 bool cpuInit = false;
 
+//everything that executes instructions goes through the engine.  It
+//runs commands inline on the UI thread, hooks and event handlers call
+//into the IDA kernel which is not thread safe, and pumps the dialog
+//while a run goes on
+Engine *engine;
+#define ENGINE_TIMER    1
+#define ENGINE_TIMER_MS 100
+//finished commands the dialog has caught up with
+static unsigned int engineStops = 0;
+//Explore paths, from eip until the function it is in returns
+static Explorer *explorer = NULL;
+static dword exploreEsp;
+#define EXPLORE_SECONDS 30
+#define EXPLORE_PATH    1000000
+//Emulate function, from a synthetic frame until it returns
+static bool functionRun = false;
+//the last run's argument objects, freed by the next one
+static dword frameObjects[FRAME_ARG(FRAME_MAX_ARGS)];
+static int numFrameObjects = 0;
+
 //callback for events in the emulator window
 BOOL CALLBACK DlgProc(HWND, UINT, WPARAM, LPARAM);
 
@@ -149,6 +176,8 @@ unsigned int *toReg(int controlID) {
 //i.e. synchronize the display to the actual cpu/memory values
 void syncDisplay() {
    char buf[16];
+   //stack writes still batched have not reached the stack view
+   flushEvents();
    for (int i = IDC_EAX; i <= IDC_EFLAGS; i++) {
       unsigned int *reg = toReg(i);
       sprintf(buf, "0x%08X", *reg);
@@ -228,22 +257,30 @@ void doubleClick(HWND edit) {
       dword newVal;
       sscanf(value, "%X", &newVal);
       updateRegister(ctl, newVal);
+      abortCallMemo();
    }
 }
 
-//build the string representaion of a given memory line
-//addr should have been 16 byte aligned
-char *memoryLine(dword addr) {
+//the string representation of the 16 bytes at line
+static char *formatLine(dword addr, const unsigned char *line) {
    static char buf[80];
    char *temp = buf + 10;
    sprintf(buf, "%08X: ", addr);
    for (int i = 0; i < 16; i++) {
-      sprintf(temp, "%02X ", mgr->readByte(addr++));
+      sprintf(temp, "%02X ", line[i]);
       temp += 3;
    }
    return buf;
 }
 
+//build the string representaion of a given memory line
+//addr should have been 16 byte aligned
+char *memoryLine(dword addr) {
+   unsigned char line[16];
+   mgr->readBlock(addr, line, sizeof(line));
+   return formatLine(addr, line);
+}
+
 //update the memory display at the given address
 //first ensure we are displaying this address, and if so
 //delete the old values and insert the new ones
@@ -256,6 +293,19 @@ void updateStack(dword addr) {
                       index, (LPARAM) memoryLine(addr));
 }
 
+//EV_MEM_WRITE handler, one update per stack line written
+static void stackWrites(const EmuEvent *events, unsigned int count, void *user) {
+   dword last = 1;  //never a line address
+   for (unsigned int i = 0; i < count; i++) {
+      const EmuEvent *e = events + i;
+      if (e->region != AS_STACK) continue;
+      for (dword line = e->addr & ~15; line < e->addr + e->size; line += 16) {
+         if (line != last) updateStack(line);
+         last = line;
+      }
+   }
+}
+
 //addr should be 16 byte aligned.  Mapping from x86 addresses
 //to internal stack address is squirelly due to internal stack
 //implementation
@@ -342,12 +392,18 @@ void dumpRange() {
          ofn.nMaxFileTitle = 0;
          ofn.lpstrInitialDir = NULL;
          ofn.Flags = OFN_SHOWHELP | OFN_OVERWRITEPROMPT;         
-         unsigned char val;
-         if (GetSaveFileName(&ofn)) {
+         unsigned char buf[0x1000];
+         if (start <= finish && GetSaveFileName(&ofn)) {
             FILE *f = fopen(szFile, "wb");
-            for (; start <= finish; start++) {
-               val = get_byte(start);           //change this to read out of any location (stack, heap, etc...)
-               fwrite(&val, 1, 1, f);
+            //reads from any location (ida, stack, heap, etc...)
+            dword remaining = finish - start;   //one less than the byte count
+            while (1) {
+               dword len = remaining < sizeof(buf) ? remaining + 1 : sizeof(buf);
+               mgr->readBlock(start, buf, len);
+               fwrite(buf, 1, len, f);
+               if (remaining < len) break;
+               remaining -= len;
+               start += len;
             }
             fclose(f);
          }
@@ -355,6 +411,86 @@ void dumpRange() {
    }
 }
 
+//ask for a file name and write the whole emulator state to it
+void exportSnapshot() {
+   OPENFILENAME ofn;
+   char szFile[260];       // buffer for file name
+   memset(&ofn, 0, sizeof(ofn));
+
+   ofn.lStructSize = sizeof(ofn);
+   ofn.hwndOwner = x86Dlg;
+   ofn.lpstrFile = szFile;
+   *szFile = '\0';
+   ofn.nMaxFile = sizeof(szFile);
+   ofn.lpstrFilter = "Snapshot\0*.x86snap\0All\0*.*\0";
+   ofn.nFilterIndex = 1;
+   ofn.Flags = OFN_OVERWRITEPROMPT;
+   if (GetSaveFileName(&ofn)) {
+      if (saveSnapshot(szFile) != X86EMUSAVE_OK) {
+         MessageBox(x86Dlg, "Unable to write the snapshot", "Export Snapshot", MB_OK);
+      }
+   }
+}
+
+//ask for a snapshot file and replace the emulator state with it
+void importSnapshot() {
+   OPENFILENAME ofn;
+   char szFile[260];       // buffer for file name
+   memset(&ofn, 0, sizeof(ofn));
+
+   ofn.lStructSize = sizeof(ofn);
+   ofn.hwndOwner = x86Dlg;
+   ofn.lpstrFile = szFile;
+   *szFile = '\0';
+   ofn.nMaxFile = sizeof(szFile);
+   ofn.lpstrFilter = "Snapshot\0*.x86snap\0All\0*.*\0";
+   ofn.nFilterIndex = 1;
+   ofn.Flags = OFN_FILEMUSTEXIST;
+   if (GetOpenFileName(&ofn)) {
+      int status = loadSnapshot(szFile);
+      if (mm) {
+         mgr = mm;
+      }
+      else {
+         //nothing left of the old state, start over with an empty one
+         mgr = new MemoryManager(nextaddr(0), prevaddr(0xFFFFFFFF));
+         mgr->initStack(0xC0000000, 0x01000000);
+         mgr->initHeap(0xA0000000, 0x01000000);
+         initProgram(get_screen_ea(), mgr);
+      }
+      if (status != X86EMULOAD_OK) {
+         msg("x86emu: error loading snapshot %s: %d\n", szFile, status);
+         MessageBox(x86Dlg, "Unable to load the snapshot", "Import Snapshot", MB_OK);
+      }
+      syncDisplay();
+   }
+}
+
+//ask for a signature file for functions without an emulation, see stubs.h
+void loadSignatures() {
+   OPENFILENAME ofn;
+   char szFile[260];       // buffer for file name
+   memset(&ofn, 0, sizeof(ofn));
+
+   ofn.lStructSize = sizeof(ofn);
+   ofn.hwndOwner = x86Dlg;
+   ofn.lpstrFile = szFile;
+   *szFile = '\0';
+   ofn.nMaxFile = sizeof(szFile);
+   ofn.lpstrFilter = "Signatures\0*.sig;*.txt\0All\0*.*\0";
+   ofn.nFilterIndex = 1;
+   ofn.Flags = OFN_FILEMUSTEXIST;
+   if (GetOpenFileName(&ofn)) {
+      int n = loadStubSignatures(szFile);
+      if (n < 0) {
+         MessageBox(x86Dlg, "Unable to read the signature file", "Load Signatures", MB_OK);
+      }
+      else {
+         msg("x86emu: %d signatures loaded from %s\n", n, szFile);
+      }
+   }
+}
+
 BOOL CALLBACK SegmentDlgProc(HWND hwndDlg, UINT message, 
                              WPARAM wParam, LPARAM lParam) { 
    char buf[16];
@@ -449,7 +585,7 @@ BOOL CALLBACK MemoryDlgProc(HWND hwndDlg, UINT message,
 void memLoadFile(dword start) {
    OPENFILENAME ofn;
    char szFile[260];       // buffer for file name
-   unsigned char buf[512], *ptr;
+   unsigned char buf[0x10000];
    int readBytes;
    memset(&ofn, 0, sizeof(ofn));
 
@@ -473,15 +609,35 @@ void memLoadFile(dword start) {
    if (GetOpenFileName(&ofn)) {
       FILE *f = fopen(szFile, "rb");
       while ((readBytes = fread(buf, 1, sizeof(buf), f)) > 0) {
-         ptr = buf;
-         for (; readBytes > 0; readBytes--) {
-            writeMem(start++, *ptr++, SIZE_BYTE);
-         }
+         writeBlock(start, buf, readBytes);
+         start += readBytes;
       }
       fclose(f);
    }
 }
 
+//ask user for a file name and map the file into the address
+//space at the specified address, writes are private to the emulator
+void memMapFile(dword start) {
+   OPENFILENAME ofn;
+   char szFile[260];       // buffer for file name
+   memset(&ofn, 0, sizeof(ofn));
+
+   ofn.lStructSize = sizeof(ofn);
+   ofn.hwndOwner = x86Dlg;
+   ofn.lpstrFile = szFile;
+   *szFile = '\0';
+   ofn.nMaxFile = sizeof(szFile);
+   ofn.lpstrFilter = "All\0*.*\0";
+   ofn.nFilterIndex = 1;
+   ofn.Flags = OFN_FILEMUSTEXIST;
+   if (GetOpenFileName(&ofn)) {
+      if (!mgr->mapFile(szFile, start, true)) {
+         MessageBox(x86Dlg, "Unable to map file, the address range may already be in use", "Map File", MB_OK);
+      }
+   }
+}
+
 BOOL CALLBACK SetMemoryDlgProc(HWND hwndDlg, UINT message, 
                                WPARAM wParam, LPARAM lParam) { 
    switch (message) { 
@@ -492,7 +648,7 @@ BOOL CALLBACK SetMemoryDlgProc(HWND hwndDlg, UINT message,
          SendDlgItemMessage(hwndDlg, IDC_MEM_VALUES, WM_SETFONT, (WPARAM)fixed, FALSE);
          SetDlgItemText(hwndDlg, IDC_MEM_ADDR, buf);
          SetDlgItemText(hwndDlg, IDC_MEM_VALUES, "");
-         CheckRadioButton(hwndDlg, IDC_HEX_BYTES, IDC_MEM_LOADFILE, IDC_HEX_DWORDS); 
+         CheckRadioButton(hwndDlg, IDC_HEX_BYTES, IDC_MEM_MAPFILE, IDC_HEX_DWORDS); 
          return TRUE; 
       }
       case WM_COMMAND: 
@@ -505,16 +661,19 @@ BOOL CALLBACK SetMemoryDlgProc(HWND hwndDlg, UINT message,
                char *v = vals;
                GetDlgItemText(hwndDlg, IDC_MEM_VALUES, vals, len + 1);
                vals[len] = 0;
-               for (btn = IDC_HEX_BYTES; btn <= IDC_MEM_LOADFILE; btn++) {
+               for (btn = IDC_HEX_BYTES; btn <= IDC_MEM_MAPFILE; btn++) {
                   if (IsDlgButtonChecked(hwndDlg, btn) == BST_CHECKED) break;
                }
                switch (btn) {
                case IDC_MEM_LOADFILE:
                   memLoadFile(addr);
                   break;
+               case IDC_MEM_MAPFILE:
+                  memMapFile(addr);
+                  break;
                case IDC_MEM_ASCII: case IDC_MEM_ASCIIZ:
-                  while (*v) writeMem(addr++, *v++, SIZE_BYTE);
-                  if (btn == IDC_MEM_ASCIIZ) writeMem(addr, 0, SIZE_BYTE);
+                  //include the terminating null for ASCIIZ
+                  writeBlock(addr, v, strlen(v) + (btn == IDC_MEM_ASCIIZ));
                   break;
                case IDC_HEX_BYTES: case IDC_HEX_WORDS: case IDC_HEX_DWORDS: {
                      dword sz = btn - IDC_HEX_BYTES + 1;
@@ -592,6 +751,112 @@ void skip() {
    jumpto(eip, 0);
 }
 
+//registers, stack and instruction rate from the engine's last
+//publication
+static void showProgress(const EngineStatus *s) {
+   char buf[80];
+   for (int i = IDC_EAX; i <= IDC_EFLAGS; i++) {
+      unsigned int *reg = toReg(i);
+      dword val;
+      if (reg == &eip) val = s->eip;
+      else if (reg == &eflags) val = s->eflags;
+      else val = s->general[reg - general];
+      sprintf(buf, "0x%08X", val);
+      SetDlgItemText(x86Dlg, i, buf);
+   }
+   //only lines already in the list, adding lines reads the stack
+   for (unsigned int i = 0; i + 4 <= s->stackCount; i += 4) {
+      dword addr = s->stackAddr + i * 4;
+      if (addr < listTop) continue;
+      dword index = (addr - listTop) / 16;
+      SendDlgItemMessage(x86Dlg, IDC_MEMORY, LB_DELETESTRING, index, 0);
+      SendDlgItemMessage(x86Dlg, IDC_MEMORY, LB_INSERTSTRING, index,
+                         (LPARAM) formatLine(addr, (unsigned char*)(s->stack + i)));
+   }
+   qsnprintf(buf, sizeof(buf), "x86 Emulator - %u instructions/sec, eip 0x%08X",
+             (unsigned int)s->rate, s->eip);
+   SetWindowText(x86Dlg, buf);
+}
+
+//a path ends when the function exploring started in returns
+static bool exploreEnd(void *user) {
+   return esp > exploreEsp;
+}
+
+static bool functionEnd(void *user) {
+   return eip == FRAME_RETURN;
+}
+
+//the engine finished a command, the state is ours again
+static void engineStopped(int reason) {
+   if (explorer) {
+      ExploreStats s;
+      //breakpoints and Stop end exploring too
+      explorer->finish();
+      explorer->getStats(&s);
+      //a function run carries on to its own end
+      if (functionRun) engine->setStopCheck(functionEnd, NULL);
+      else engine->setStopCheck(NULL, NULL);
+      delete explorer;
+      explorer = NULL;
+      msg("x86emu: explored %u paths, %u instructions, %u left unexplored\n",
+          s.paths, (unsigned int)s.instructions, s.pending + s.dropped);
+      msg("x86emu: %u of %u branches went both ways, %u of %u members found on explored paths\n",
+          s.bothWays, s.branches, s.found, s.members);
+   }
+   //a breakpoint or pause inside the function leaves it to be continued
+   if (functionRun && (eip == FRAME_RETURN || reason == STOP_CANCELLED)) {
+      engine->setStopCheck(NULL, NULL);
+      functionRun = false;
+      if (eip == FRAME_RETURN) msg("x86emu: the function returned, eax 0x%08X\n", eax);
+   }
+   syncDisplay();
+   codeCheck();
+   jumpto(eip, 0);
+   SetDlgItemText(x86Dlg, IDC_RUN, "Run");
+   SetWindowText(x86Dlg, "x86 Emulator");
+   if (reason == STOP_PAUSED || reason == STOP_CANCELLED) {
+      msg("x86emu: stopped at 0x%08X\n", eip);
+   }
+}
+
+//timer tick, keep the dialog up with the engine
+static void engineTick() {
+   EngineStatus s;
+   engine->getStatus(&s);
+   if (s.stops != engineStops) {
+      //finished, but the state isn't ours until the engine lets go
+      if (engine->busy()) return;
+      engineStops = s.stops;
+      engineStopped(s.stopReason);
+   }
+   else if (s.running) {
+      showProgress(&s);
+   }
+}
+
+//hand a command to the engine, Run becomes Stop until it is done
+static void startEngine(int command, dword addr = 0) {
+   if (command != ENGINE_STEP) {
+      SetDlgItemText(x86Dlg, IDC_RUN, "Stop");
+   }
+   //returns once the command has run
+   engine->post(command, addr);
+   engineTick();
+}
+
+//the engine's progress callback, handles the dialog's messages during
+//a run so its display keeps up and Stop can cancel
+static void pumpDialog(void *user) {
+   MSG m;
+   while (PeekMessage(&m, x86Dlg, 0, 0, PM_REMOVE)) {
+      if (!IsDialogMessage(x86Dlg, &m)) {
+         TranslateMessage(&m);
+         DispatchMessage(&m);
+      }
+   }
+}
+
 //This is the main callback function for the emulator interface
 BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message, 
                       WPARAM wParam, LPARAM lParam) { 
@@ -602,7 +867,6 @@ BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message,
          if (!cpuInit) {
             eip = get_screen_ea();
          }
-         waitCursor = LoadCursor(NULL, IDC_WAIT); 
          for (int i = IDC_EAX; i <= IDC_EFLAGS; i++) {
             HWND ctl = GetDlgItem(hwndDlg, i);
             editBoxes[i - IDC_EAX] = ctl;
@@ -612,51 +876,116 @@ BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message,
          SendDlgItemMessage(hwndDlg, IDC_MEMORY, WM_SETFONT, (WPARAM)fixed, FALSE);
          addListEntry(mgr->stack->getStackTop() - 16);
          syncDisplay();
+         SetTimer(hwndDlg, ENGINE_TIMER, ENGINE_TIMER_MS, NULL);
          return TRUE; 
       }
+      case WM_TIMER:
+         if (wParam == ENGINE_TIMER) {
+            engineTick();
+            return TRUE;
+         }
+         break;
       case WM_COMMAND: 
+         if (engine->busy()) {
+            //the emulator is the engine's until it stops, Run and Run
+            //To Cursor stop it
+            switch (LOWORD(wParam)) {
+               case IDC_RUN: case IDC_RUN_TO_CURSOR:
+                  engine->post(ENGINE_CANCEL);
+                  break;
+               case IDC_HIDE:
+                  ShowWindow(hwndDlg, SW_HIDE);
+                  break;
+               default:
+                  MessageBeep(MB_OK);
+                  break;
+            }
+            return TRUE;
+         }
+         //catch up with a command that ended since the last tick
+         engineTick();
+         switch (LOWORD(wParam)) {
+            case IDC_STEP: case IDC_RUN: case IDC_RUN_TO_CURSOR: case IDC_HIDE:
+            case IDC_EXPLORE: case IDC_FUNCTION:
+               break;
+            default:
+               //anything else may change the state under a recorded call
+               abortCallMemo();
+               break;
+         }
          switch (LOWORD(wParam)) { 
             case IDC_RESET: //reset the display/emulator
                resetCpu();
+               clearStubSummary();
+               if (functionRun) {
+                  engine->setStopCheck(NULL, NULL);
+                  functionRun = false;
+               }
                eip = get_screen_ea();
                syncDisplay();
                return TRUE;
             case IDC_STEP: //STEP 
 			   codeCheck();			  
-               executeInstruction();
-               syncDisplay();
-               codeCheck();
-               jumpto(eip, 0);
+               startEngine(ENGINE_STEP);
                return TRUE; 
             case IDC_JUMP_CURSOR: //Reset eip.cursor
                eip = get_screen_ea();
                syncDisplay();
                jumpto(eip, 0);
                return TRUE;
-            case IDC_RUN: {//Run
+            case IDC_RUN: //Run
                codeCheck();
-               HCURSOR old = SetCursor(waitCursor);
-               while (!isBreakpoint(eip)) {
-                  executeInstruction();
-               }
-               syncDisplay();
-               SetCursor(old);
-               jumpto(eip, 0);
+               startEngine(ENGINE_RUN);
                return TRUE;
-            }
             case IDC_SKIP: //Skip the next instruction
                skip();
                return TRUE;
-            case IDC_RUN_TO_CURSOR: {//Run to cursor
+            case IDC_RUN_TO_CURSOR: //Run to cursor
                codeCheck();
-               HCURSOR old = SetCursor(waitCursor);
-               dword endAddr = get_screen_ea();
-               while (eip != endAddr) {
-                  executeInstruction();
-               }
-               syncDisplay();
-               SetCursor(old);
+               startEngine(ENGINE_RUN_TO, get_screen_ea());
                return TRUE; 
+            case IDC_EXPLORE: { //Run the other ways branches could go
+               codeCheck();
+               explorer = new Explorer(0, EXPLORE_SECONDS, EXPLORE_PATH);
+               exploreEsp = esp;
+               explorer->setPathEnd(exploreEnd, NULL);
+               //the allocations idastruct is tracing, or all of them
+               for (strace_t *st = strace; st; st = st->next) {
+                  explorer->trackSite(st->addr);
+               }
+               engine->setStopCheck(Explorer::check, explorer);
+               startEngine(ENGINE_RUN);
+               return TRUE;
+            }
+            case IDC_FUNCTION: { //Run the function at the cursor on its own
+               func_t *pfn = get_func(get_screen_ea());
+               char count[16];
+               unsigned int args = 0;
+               if (pfn == NULL) {
+                  msg("x86emu: the cursor is not in a function\n");
+                  return TRUE;
+               }
+               //what the function pops, if it says
+               qsnprintf(count, 16, "%u", (unsigned int)(pfn->argsize / 4));
+               if (!inputBox("Emulate Function", "Number of stack arguments", count)) {
+                  return TRUE;
+               }
+               sscanf(value, "%u", &args);
+               leaveFunction(frameObjects, numFrameObjects);
+               numFrameObjects = enterFunction(pfn->startEA, args, FRAME_OBJECT_SIZE, frameObjects);
+               if (numFrameObjects < 0) {
+                  numFrameObjects = 0;
+                  msg("x86emu: no room for the arguments, set up the heap in Emulate/Settings\n");
+                  return TRUE;
+               }
+               msg("x86emu: ecx 0x%08X, %u stack arguments, %u bytes each\n",
+                   frameObjects[FRAME_THIS], args < FRAME_MAX_ARGS ? args : FRAME_MAX_ARGS,
+                   FRAME_OBJECT_SIZE);
+               codeCheck();
+               functionRun = true;
+               engine->setStopCheck(functionEnd, NULL);
+               startEngine(ENGINE_RUN);
+               return TRUE;
             }
             case IDC_HIDE: 
                ShowWindow(hwndDlg, SW_HIDE);    
@@ -676,6 +1005,28 @@ BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message,
             case IDC_DUMP: 
                dumpRange();
                return TRUE;
+            case IDC_SNAPSHOT_SAVE:
+               exportSnapshot();
+               return TRUE;
+            case IDC_SNAPSHOT_LOAD:
+               importSnapshot();
+               return TRUE;
+            case IDC_STUB_RETURN: {
+               char val[16];
+               qsnprintf(val, 16, "0x%08X", getStubReturn());
+               if (inputBox("Unemulated Calls", "Return value for functions without an emulation", val)) {
+                  dword ret = 0;
+                  sscanf(value, "%X", &ret);
+                  setStubReturn(ret);
+               }
+               return TRUE;
+            }
+            case IDC_STUB_SIGS:
+               loadSignatures();
+               return TRUE;
+            case IDC_STUB_SUMMARY:
+               printStubSummary();
+               return TRUE;
             case IDC_SEGMENTS: 
                DialogBox(hModule, MAKEINTRESOURCE(IDD_SEGMENTDIALOG),
                          x86Dlg, SegmentDlgProc);
@@ -746,6 +1097,26 @@ BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message,
                }
                return TRUE;
             }
+            case IDC_HEAPCHECK:
+               if (mgr->shadow) {
+                  mgr->disableShadow();
+               }
+               else {
+                  mgr->enableShadow();
+               }
+               CheckMenuItem(GetMenu(hwndDlg), IDC_HEAPCHECK, 
+                             mgr->shadow ? MF_CHECKED : MF_UNCHECKED);
+               return TRUE;
+            case IDC_COMPRESS:
+               compressState = !compressState;
+               CheckMenuItem(GetMenu(hwndDlg), IDC_COMPRESS, 
+                             compressState ? MF_CHECKED : MF_UNCHECKED);
+               return TRUE;
+            case IDC_MEMOIZE:
+               enableCallMemo(!memoOn);
+               CheckMenuItem(GetMenu(hwndDlg), IDC_MEMOIZE, 
+                             memoOn ? MF_CHECKED : MF_UNCHECKED);
+               return TRUE;
             case IDC_MEMEX:
                initial_eip = eip;  //since we are not going through executeInstruction
                memoryAccessException();
@@ -774,6 +1145,13 @@ BOOL CALLBACK DlgProc(HWND hwndDlg, UINT message,
                }
                return TRUE;
             }
+            case IDC_DLLDIR:
+               //blank to go back to the host loader
+               if (inputBox("DLL Directory", "Load DLLs from (; separated)",
+                            emu_dllPath ? emu_dllPath : (char*)"")) {
+                  setDllPath(value);
+               }
+               return TRUE;
          } 
    } 
    return FALSE; 
@@ -786,7 +1164,8 @@ LRESULT EditSubclassProc(HWND hwndCtl, UINT message,
                          WPARAM wParam, LPARAM lParam) {
    switch (message) {
       case WM_LBUTTONDBLCLK:
-         doubleClick(hwndCtl);
+         //registers can't change under a running engine
+         if (!engine->busy()) doubleClick(hwndCtl);
          return TRUE;
    }
    return CallWindowProc((WNDPROC) oldProc, hwndCtl, message, wParam, lParam);
@@ -831,6 +1210,14 @@ static int idaapi uiCallback(void *cookie, int code, va_list va) {
       // The user is saving the database.  Save the plug-in
       // state with it.
       //
+      if (engine->busy()) {
+         //the state can only be saved between commands
+         engine->post(ENGINE_CANCEL);
+         if (!engine->waitIdle(5000)) {
+            msg("Emulator state was not saved, the emulator is still running.\n");
+            break;
+         }
+      }
       x86emu_node.create(x86emu_node_name);
       if (saveState(x86emu_node) == X86EMUSAVE_OK) {
          msg("Emulator state was saved.\n");
@@ -913,6 +1300,12 @@ int init(void) {
 
    hModule = GetModuleHandle("x86emu.plw");
 
+   //no worker thread, see engine
+   engine = new Engine(ENGINE_TIMER_MS);
+   engine->setProgress(pumpDialog, NULL);
+
+   subscribe(EV_MEM_WRITE, stackWrites);
+   subscribe(EV_MEM_WRITE, importLabels);
    idastruct_init();
 
    return PLUGIN_KEEP;
@@ -927,8 +1320,15 @@ int init(void) {
 void term(void)
 {
    unhook_from_notification_point(HT_UI, uiCallback, NULL);
+   unsubscribe(EV_MEM_WRITE, stackWrites);
+   unsubscribe(EV_MEM_WRITE, importLabels);
    DestroyWindow(x86Dlg); 
    x86Dlg = NULL; 
+   //cancels anything still running
+   delete engine;
+   delete explorer;
+   explorer = NULL;
+   enableCallMemo(false);
    delete mgr;
 }
 
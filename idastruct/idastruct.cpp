@@ -11,6 +11,9 @@
 #include "idastruct.h"
 #include "../ida-x86emu/cpu.h"
 #include "../ida-x86emu/x86defs.h"
+#include "../ida-x86emu/addrmap.h"
+#include "../ida-x86emu/events.h"
+#include "../ida-x86emu/frame.h"
 
 struct _options options;
 strace_t *strace = NULL;
@@ -150,7 +153,10 @@ void struct_trace(ea_t addr)
 			break;
 		}
 
-		for(trace = strace; trace; trace = trace->next)
+		// every traced structure tags its dwords in the address map,
+		// the most recently created one wins where they overlap
+		trace = (strace_t *)addressSpace.getTag(val);
+		if(trace)
 		{
 			if(val >= trace->base && val <= trace->base + trace->size)
 			{
@@ -185,10 +191,7 @@ void struct_trace(ea_t addr)
 					//msg("%s\n", name);
 					//qsnprintf(name, 256, "offset_%d", val - trace->base);
 					if(struct_member_add(sptr, name, val - trace->base, 0, NULL, get_dtyp_size(op->dtyp)) < 0)
-					{
-						trace = trace->next;
 						continue;
-					}
 					mptr = get_member(sptr, val - trace->base);
 
 				}
@@ -300,6 +303,14 @@ int get_disasm(ea_t addr, char *buf, int bufsz)
 }
 
 
+// instruction hook, only subscribed once a structure is traced
+static void insn_event(const EmuEvent *events, unsigned int count, void *user)
+{
+	for(unsigned int i = 0; i < count; i++)
+		struct_trace(events[i].addr);
+}
+
+
 int struct_init(ea_t addr, ea_t base, size_t size)
 {
 	char buf[1024];
@@ -308,7 +319,7 @@ int struct_init(ea_t addr, ea_t base, size_t size)
 	// skip if this alloc has already been identified
 	while(st)
 	{
-		if(st->addr == addr)
+		if(st->addr == addr && st->arg < 0)
 			return 0;
 		st = st->next;
 	}
@@ -373,6 +384,7 @@ int struct_init(ea_t addr, ea_t base, size_t size)
 	}
 
 	st->addr = addr;
+	st->arg  = -1;
 	st->size = size;
 	st->base = base;
 	st->sptr = struct_create(st->size);
@@ -391,15 +403,95 @@ int struct_init(ea_t addr, ea_t base, size_t size)
 	st->next = strace; 
 	strace = st; 	
 
+	// base + size is still treated as part of the structure
+	addressSpace.setTag(st->base, st->size + 1, st);
+
+	// start tracing instructions now there is something to trace
+	subscribe(EV_INSTRUCTION, insn_event);
+
+	return 0;
+}
+
+
+// object given to argument arg of the function at addr when it is
+// emulated on its own, traced without asking since the user chose to
+// run the function; each run adds to the same structure
+int struct_arg(ea_t addr, int arg, ea_t base, size_t size)
+{
+	strace_t *st = strace;
+
+	while(st)
+	{
+		if(st->addr == addr && st->arg == arg)
+			break;
+		st = st->next;
+	}
+
+	if(!st)
+	{
+		st = (strace_t *)qcalloc(1, sizeof(strace_t));
+		if(!st)
+		{
+			msg("[idastruct] error: could not allocate memory\n");
+			return -1;
+		}
+		st->addr = addr;
+		st->arg  = arg;
+		st->sptr = struct_create(size);
+		if(!st->sptr)
+		{
+			qfree(st);
+			return -1;
+		}
+		st->next = strace;
+		strace = st;
+	}
+
+	// every run hands out a new block, tags left on the old one fail
+	// the range check in struct_trace
+	st->base = base;
+	st->size = size;
+
+	if(options.verbose)
+	{
+		msg("[idastruct] argument structure initialized\n");
+		msg("            function:       0x%08x\n", addr);
+		if(arg == FRAME_THIS)
+			msg("            argument:       ecx\n");
+		else
+			msg("            argument:       stack %d\n", arg - FRAME_ARG(0));
+		msg("            structure base: 0x%08x\n", st->base);
+		msg("            structure size: %d bytes\n", st->size);
+	}
+
+	addressSpace.setTag(st->base, st->size + 1, st);
+	subscribe(EV_INSTRUCTION, insn_event);
+
 	return 0;
 }
 
 
+// emulated allocators report each block they hand out, synthetic
+// argument objects carry their index + 1 in value
+static void alloc_event(const EmuEvent *events, unsigned int count, void *user)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(events[i].value)
+			struct_arg(events[i].eip, events[i].value - 1, events[i].addr, events[i].size);
+		else
+			struct_init(events[i].eip, events[i].addr, events[i].size);
+	}
+}
+
+
 void idastruct_init(void)
 {
 	options.verbose       = true;
 	options.detect_struct = true;
 	options.detect_size   = false;
 
+	subscribe(EV_ALLOC, alloc_event);
+
 	return;
 }
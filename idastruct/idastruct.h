@@ -18,6 +18,8 @@ typedef struct _strace {
 	ea_t     base;			// identified base_addr ptr (return from call)
 	size_t   size;			// struct size
 	struct _itrace *itrace; // instruction trace
+	int      arg;			// object index for a function argument at addr
+							// (see frame.h), -1 for allocations
 } strace_t;
 extern strace_t *strace;
 
@@ -46,6 +48,7 @@ struct _alloc_function {
 
 
 extern int struct_init(ea_t addr, ea_t base, size_t size);
+extern int struct_arg(ea_t addr, int arg, ea_t base, size_t size);
 extern void struct_trace(ea_t addr);
 extern void idastruct_init();
 